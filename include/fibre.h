@@ -2,6 +2,9 @@
 #define HEADER_FIBRE_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* Reference-counted opaque data-structure */
 struct fibre;
@@ -12,6 +15,25 @@ int fibre_init(void);
  * fibre prior to termination. */
 void fibre_finish(void);
 
+/* Context-switching backends ("x86", "ucfast", "setjmp", "ucontext"). A
+ * library built with FIBRE_ARCH=multi has all of those that the platform
+ * supports, and the first fibre_init() in the process picks one for good: the
+ * one named by fibre_backend_select() if that was called beforehand, otherwise
+ * the one named by the FIBRE_BACKEND environment variable (fibre_init()
+ * fails with -ENOENT if there's no such backend), otherwise whichever is
+ * fastest on a quick calibration run. (It isn't FIBRE_ARCH, as that's the
+ * build's, and make exports it.) A library built with any other FIBRE_ARCH
+ * just has that one.
+ *
+ * fibre_backend_select() returns -ENOENT if the library doesn't have the named
+ * backend, or -EBUSY if a different one has already been picked.
+ * fibre_backend_name() returns NULL if none has been picked yet.
+ * fibre_backend_list() fills in up to 'max' names, and returns the number of
+ * backends there are. */
+int fibre_backend_select(const char *name);
+const char *fibre_backend_name(void);
+unsigned int fibre_backend_list(const char **names, unsigned int max);
+
 /* Create a fibre (and prepare it to run the given function with the given
  * argument).
  *
@@ -30,9 +52,108 @@ void fibre_finish(void);
  * treat a zero return value as a bug.
  */
 int fibre_create(struct fibre **, void (*fn)(void *), void *);
+
+/* Per-fibre creation attributes, for use with fibre_create_ex(). Always call
+ * fibre_attr_init() first, to pick up the defaults (which are what
+ * fibre_create() uses), then override what you need.
+ *  stack_size: the stack's memory footprint in bytes, of which the library
+ *              uses a few dozen at the top. Zero means the default. Stacks are
+ *              pooled in power-of-two size classes, so this is rounded up to
+ *              the next class.
+ *  stack: caller-provided stack memory of 'stack_size' bytes, or NULL to have
+ *         the library allocate it. The library never frees it, and it must
+ *         remain valid until the fibre has been destroyed (or recreated).
+ *  flags: FIBRE_ATTR_* bitmask.
+ *  pool: FIBRE_ATTR_POOL_* hint as to where the stack should come from.
+ */
+struct fibre_attr {
+	size_t stack_size;
+	void *stack;
+	unsigned int flags;
+	unsigned int pool;
+};
+/* Put a PROT_NONE guard page below the stack, so that overflow faults rather
+ * than silently corrupting memory. Ignored for caller-provided stacks. */
+#define FIBRE_ATTR_GUARD     0x1
+/* Carve the fibre's own bookkeeping from the top of its stack, so that the
+ * fibre costs a single allocation and its switch-critical state sits next to
+ * its stack. The stack is then held until fibre_destroy(), rather than going
+ * back to the pool as soon as the fibre completes. */
+#define FIBRE_ATTR_INLINE    0x2
+/* Run on the thread's shared stack, rather than a stack of the fibre's own.
+ * While switched out, the fibre only holds a copy of the part of the stack it
+ * was actually using, so this is for large numbers of mostly-idle fibres. The
+ * price is copying that part out and back in when another shared fibre has
+ * been running in between. 'stack_size' is ignored, the fibre gets however
+ * much of the shared stack it uses. Can't be combined with FIBRE_ATTR_INLINE
+ * or a caller-provided stack, and once it has run, the fibre must only be
+ * resumed on the same thread. */
+#define FIBRE_ATTR_SHARED    0x4
+/* Take the stack from (and return it to) the thread's pool for its size
+ * class. */
+#define FIBRE_ATTR_POOL_DEFAULT 0
+/* Map a stack of exactly the requested size, and unmap it when released.
+ * Useful for one-off odd-sized stacks that would only pollute the pool. */
+#define FIBRE_ATTR_POOL_NONE    1
+/* Carve the stack out of a 2MiB arena backed by huge pages (explicit ones if
+ * the system has them reserved, otherwise transparent ones, otherwise falling
+ * back to normal pages), so that many fibres' stacks share a TLB entry. Such
+ * stacks have no guard page, whatever FIBRE_ATTR_GUARD says. Stacks bigger
+ * than the arena are mapped as for FIBRE_ATTR_POOL_NONE. */
+#define FIBRE_ATTR_POOL_HUGE    2
+
+void fibre_attr_init(struct fibre_attr *);
+int fibre_create_ex(struct fibre **, const struct fibre_attr *,
+		    void (*fn)(void *), void *);
+/* Stack usage statistics. These are per-thread and off by default.
+ *
+ * FIBRE_STACK_STATS_MEASURE "paints" fibre stacks as they're handed out, and
+ * records each fibre's peak stack usage when it completes (or, if its stack is
+ * FIBRE_ATTR_INLINE, when it's destroyed or recreated). The results are also
+ * accumulated per fibre entry function. The cost is a scan of the untouched
+ * part of the stack per fibre, and clearing the touched part before reuse.
+ *
+ * FIBRE_STACK_STATS_ADAPTIVE measures too, and once enough fibres with a
+ * given entry function have been measured, fibre_create() (but not
+ * fibre_create_ex()) gives new fibres with that entry function a stack of
+ * their peak usage plus 'margin' bytes (zero for the default margin), rounded
+ * up to the stack size-class. You'll want guard pages enabled if you use this.
+ */
+#define FIBRE_STACK_STATS_OFF      0
+#define FIBRE_STACK_STATS_MEASURE  1
+#define FIBRE_STACK_STATS_ADAPTIVE 2
+void fibre_stack_stats_mode(unsigned int mode, size_t margin);
+
+/* Peak stack usage of the fibre in bytes. If the fibre still has its stack,
+ * this is measured there and then, otherwise it's what was recorded when the
+ * fibre completed. Zero if the fibre's stack wasn't being measured. For a
+ * FIBRE_ATTR_SHARED fibre it's the largest copy of its stack saved so far,
+ * whether or not measurement is on. */
+size_t fibre_stack_usage(struct fibre *);
+
+/* Per entry-function statistics;
+ *  count: number of fibres measured.
+ *  peak: the largest peak usage of any of them.
+ *  total: sum of their peak usages (so total/count is the mean).
+ *  suggested: the stack size adaptive mode would use, or zero if it would use
+ *             the default.
+ */
+struct fibre_stack_stat {
+	void (*fn)(void *);
+	unsigned long count;
+	size_t peak;
+	size_t total;
+	size_t suggested;
+};
+/* Returns -ENOENT if no fibre with that entry function has been measured */
+int fibre_stack_stats(void (*fn)(void *), struct fibre_stack_stat *);
+/* Fills in up to 'max' entries, returns the number there are */
+unsigned int fibre_stack_stats_all(struct fibre_stack_stat *,
+				   unsigned int max);
+
 /* If a fibre has completed, it can be reinitialised for reuse (equivalent to
  * calling fibre_destroy() and then fibre_create(), but saves on memory
- * (re)allocation). */
+ * (re)allocation). The stack attributes given at creation are retained. */
 int fibre_recreate(struct fibre *, void (*fn)(void *), void *);
 /* Destroy a fibre, should only occur on a fibre that was never invoked or
  * that has completed. */
@@ -50,6 +171,29 @@ void fibre_destroy(struct fibre *);
 void fibre_set_userdata(struct fibre *, void *);
 void *fibre_get_userdata(struct fibre *);
 
+/* Fibre-local storage, for when several libraries want per-fibre data of
+ * their own. fibre_key_create() hands out a key (like pthread_key_create()),
+ * and every fibre has a value for every key, NULL until it's set. The values
+ * for the first FIBRE_KEYS_INLINE keys are kept in the fibre itself, and for
+ * any others in a table that's allocated the first time the fibre sets one
+ * (which is the only way fibre_key_set() can fail, with -ENOMEM), so getting
+ * or setting a value is just an index either way. fibre_inline.h has inline
+ * versions of them.
+ *
+ * A key can have a destructor, which is called for each fibre that has a
+ * non-NULL value for the key when it completes (on the fibre, before it
+ * completes), or when it's destroyed or recreated with one. The value is set
+ * back to NULL first, and if destructors set values again, they're called
+ * again, up to FIBRE_KEYS_ROUNDS times. Keys are never deleted, and once
+ * there are FIBRE_KEYS_MAX of them, fibre_key_create() returns -EAGAIN. It
+ * can be called from any thread. */
+#define FIBRE_KEYS_INLINE 4
+#define FIBRE_KEYS_MAX 128
+#define FIBRE_KEYS_ROUNDS 4
+int fibre_key_create(unsigned int *key, void (*destructor)(void *));
+int fibre_key_set(struct fibre *, unsigned int key, void *);
+void *fibre_key_get(struct fibre *, unsigned int key);
+
 /* Return a handle to the currently-scheduled fibre. This will return NULL
  * iff the currently-executing fibre is the "origin" of the top-most selector
  * in the selector stack. */
@@ -67,7 +211,8 @@ int fibre_completed(struct fibre *);
  * stack. */
 struct fibre_selector;
 
-/* Push/pop selectors to/from the thread-local selector stack. */
+/* Push/pop selectors to/from the thread-local selector stack. A
+ * FIBRE_ATTR_SHARED fibre can't push one (-EINVAL). */
 int fibre_push(struct fibre_selector *);
 int fibre_pop(struct fibre_selector **);
 
@@ -85,6 +230,15 @@ int fibre_can_switch_implicit(void);
 void fibre_schedule_to(struct fibre *);
 void fibre_schedule(void);
 
+/* Symmetric transfer with a pointer-sized payload. This is fibre_schedule_to()
+ * (or, if the fibre is NULL, fibre_schedule()) that hands 'msg' to the fibre
+ * switched to, as the return value of the fibre_transfer() it's resuming
+ * from. In turn, it returns the 'msg' of the fibre_transfer() that switches
+ * back to the caller, or NULL if the caller gets resumed any other way
+ * (including by a fibre completing). A fibre that hasn't started yet has
+ * nothing to return the message from, so it's dropped. */
+void *fibre_transfer(struct fibre *, void *msg);
+
 /*
  * Different selector types.
  */
@@ -107,6 +261,286 @@ int fibre_selector_scheduler(struct fibre_selector **,
 			     void *cb_arg,
 			     int allow_explicit);
 
+/* A "run-queue" selector. Once pushed, and so long as this selector is
+ * top-most in the selector stack, fibre_ready() puts fibres on its run queue,
+ * and implicit scheduling via fibre_schedule() switches to the fibre at the
+ * head of the queue, or to the 'origin' if the queue is empty (and from the
+ * origin, with nothing queued, it returns straight away). A fibre that wants
+ * to yield to the others calls fibre_ready() on itself before
+ * fibre_schedule(). Explicit scheduling is allowed, but not to a fibre that's
+ * on the queue. The queue is FIFO, except for a "run next" slot that
+ * fibre_ready_next() puts the fibre in (moving whatever was there to the end
+ * of the queue), eg. for a fibre that's just been woken by the current one.
+ * Queueing never allocates, and the selector can't be popped while anything
+ * is queued. */
+int fibre_selector_runq(struct fibre_selector **);
+
+/* Queue a fibre on the top-most selector's run queue, if it has one
+ * (-EOPNOTSUPP otherwise). Queueing a fibre that's already queued does
+ * nothing. The fibre mustn't have completed. */
+int fibre_ready(struct fibre *);
+int fibre_ready_next(struct fibre *);
+
+/* A "priority" selector. As for the run-queue selector, except that there's a
+ * FIFO queue for each priority level, and fibre_schedule() switches to the
+ * fibre at the head of the highest-priority non-empty one. fibre_ready_next()
+ * puts the fibre at the head of its level. If 'aging' is non-zero, then every
+ * 'aging' fibres it switches to from the queue, the fibre at the head of each
+ * non-empty level below the highest moves up a level, so that low-priority
+ * fibres aren't starved. That's just while it's queued, it goes back to its own
+ * priority the next time it's queued. */
+int fibre_selector_prio(struct fibre_selector **, unsigned int aging);
+
+/* Priority levels for the priority selector, zero being the highest. A fibre's
+ * priority is FIBRE_PRIO_DEFAULT until set otherwise, and is kept across
+ * fibre_recreate(). Setting it for a queued fibre only takes effect the next
+ * time the fibre is queued. Returns -EINVAL if it's out of range. */
+#define FIBRE_PRIO_LEVELS  32
+#define FIBRE_PRIO_DEFAULT 16
+int fibre_set_priority(struct fibre *, unsigned int prio);
+unsigned int fibre_get_priority(struct fibre *);
+
+/* An M:N runtime: 'num' worker threads, each with one of these selectors
+ * pushed, running fibres handed to it by fibre_mn_submit() (from any thread)
+ * or fibre_ready() (from a fibre that's running in it). Each worker has a
+ * work-stealing deque of ready fibres that fibre_ready() pushes on to, and
+ * that it takes the most recently readied fibre from, idle workers steal from
+ * the other ends of the others' deques, and there's a FIFO queue for
+ * fibre_mn_submit() and for fibres that ready themselves (ie. yield). So a
+ * fibre can be resumed on a different thread from the one it suspended on.
+ * The rules for fibres running in it;
+ *  - fibre_get_current() is per-thread, as ever, so always gets the right
+ *    answer, but neither it nor the address of any thread-local variable can
+ *    be held on to across anything that might switch;
+ *  - the async atomicity count is per-thread too, so it must be zero whenever
+ *    the fibre switches (which is already the rule for async suspension);
+ *  - FIBRE_ATTR_SHARED fibres are tied to their thread's shared stack, so
+ *    fibre_ready() and fibre_mn_submit() refuse them (-EINVAL);
+ *  - fibre_ready() on a fibre that's running queues it to run again after it
+ *    next switches away, and it can't be resumed elsewhere until it has, so a
+ *    fibre that readies itself should switch straight away;
+ *  - fibre_ready_next() is the same as fibre_ready().
+ * fibre_mn_wait() returns once every worker is idle with nothing queued, so
+ * fibres that are suspended but not readied don't count. The fibres are the
+ * caller's to destroy, from any thread that has called fibre_init(). */
+struct fibre_mn;
+int fibre_mn_create(struct fibre_mn **, unsigned int num);
+int fibre_mn_submit(struct fibre_mn *, struct fibre *);
+void fibre_mn_wait(struct fibre_mn *);
+/* Call fibre_mn_wait() first */
+void fibre_mn_destroy(struct fibre_mn *);
+
+/* An "epoll" selector, ie. a built-in dispatcher for the async methods that
+ * need an event loop. It has a run queue like fibre_selector_runq()'s, and
+ * when pushed it sets the async mask to FIBRE_ASYNC_POLL |
+ * FIBRE_ASYNC_FD_READABLE | FIBRE_ASYNC_TIMER | FIBRE_ASYNC_CHECK_CB |
+ * FIBRE_ASYNC_WAKE (see below). A FIBRE_ASYNC_POLL fibre is just queued
+ * again. One that suspends any of the other ways is held until its fd is
+ * readable (by way of epoll), its deadline has passed, it's woken, or its
+ * callback returns non-zero (by way of a struct fibre_pollset, below, which
+ * is checked every time it checks for events, so while any such fibre is
+ * held it never waits in epoll_wait()), and then queued. One that suspends
+ * with a deadline (the _timeout suspends, below) and is still held when it
+ * passes is queued anyway, timed out.
+ * Whenever nothing is queued it waits in epoll_wait(), so fibre_schedule()
+ * from the origin returns once nothing is queued *or* held. While things are
+ * queued, it checks for events (without waiting) every so often. Several
+ * fibres can wait on the same fd, and all of them are resumed. An fd that
+ * epoll can't watch (eg. a regular file, which is always readable) resumes
+ * its fibre straight away. fibre_ready() on a held fibre stops it waiting,
+ * eg. after fibre_async_abort() (for FIBRE_ASYNC_IO, below, it tries to
+ * cancel the operation, and the fibre is queued once the operation is done
+ * with). The selector can't be popped while anything is queued or held.
+ *
+ * An fd is added to the epoll set (edge-triggered) the first time a fibre
+ * waits on it, and left there, so waiting again makes no epoll_ctl() call.
+ * A fibre needn't read until EAGAIN before waiting again, as it's resumed
+ * straight away if there's still something to read.
+ * So before an fd that fibres have waited on (or that's registered with
+ * io_uring, below) is closed, or to stop watching it, call
+ * fibre_epoll_forget(). That returns -EBUSY if a fibre is waiting on
+ * the fd, and -EINVAL if the selector isn't an epoll one. */
+int fibre_selector_epoll(struct fibre_selector **);
+int fibre_epoll_forget(struct fibre_selector *, int fd);
+/* fibre_pollset_batch() for the epoll selector's poll set, or -EINVAL if
+ * the selector isn't an epoll one */
+int fibre_epoll_batch(struct fibre_selector *, int (*cb)(void *),
+		      unsigned int (*batch)(void *const *args,
+					    unsigned int num,
+					    unsigned char *ready));
+
+/* The epoll selector also does FIBRE_ASYNC_WAKE (and includes it in the
+ * mask). fibre_wake_remote() can be called from any thread, and queues the
+ * fibre on the epoll selector that last ran it (so it must be one that's run
+ * by an epoll selector directly, not a proxy's, and the selector must outlive
+ * the wake), much as fibre_ready() would, stopping it waiting if it's held.
+ * It's lock-free: the fibre is pushed on to the selector's wake queue, and
+ * that's taken in one go each time the selector checks for events. Only the
+ * wake that finds the queue empty writes to an eventfd (in the epoll set) to
+ * wake the selector, and waking a fibre that's already on the queue does
+ * nothing, so a burst of wakes costs one system call between them. The fibre
+ * mustn't be destroyed while a wake for it may not have been taken yet (the
+ * wake of a completed fibre is ignored). Returns -EOPNOTSUPP if no epoll
+ * selector has run the fibre. */
+int fibre_wake_remote(struct fibre *);
+
+/* Where the kernel has io_uring, the epoll selector also does FIBRE_ASYNC_IO
+ * (and includes it in the mask), otherwise those operations fall back to
+ * waiting for readability. The SQEs of all the fibres that suspend between
+ * two of its checks for events are submitted together, with one
+ * io_uring_enter(), and the completions are reaped without a system call.
+ * Files and buffers can be registered with io_uring, replacing whatever was
+ * registered before (none, if 'num' is zero), and from then on operations on
+ * those fds, or within those buffers, make use of that. Registered files are
+ * matched by fd number, so before a registered fd is closed, call
+ * fibre_epoll_forget() on it (which stops operations using the registered
+ * file), or register the files again without it; otherwise operations on a
+ * new fd that gets the same number would go to the old file. These return
+ * -EOPNOTSUPP without io_uring, -EBUSY if any operations are in flight, and
+ * -EINVAL if the selector isn't an epoll one. */
+struct iovec;
+int fibre_epoll_register_files(struct fibre_selector *, const int *fds,
+			       unsigned int num);
+int fibre_epoll_register_buffers(struct fibre_selector *,
+				 const struct iovec *, unsigned int num);
+
+/* Synchronisation between the fibres of one thread: a mutex, a condition
+ * variable, a counting semaphore and a reader-writer lock. They can be
+ * embedded anywhere, and are initialised by the _init()s (there's nothing to
+ * destroy). Waiting fibres are kept in a FIFO queue linked through the fibres
+ * themselves, so waiting never allocates. A fibre that has to wait suspends
+ * with fibre_schedule(), so the top-most selector must allow implicit
+ * switching and have a run queue (the run-queue, priority and epoll
+ * selectors), and it's a bug for a non-fibre (eg. the origin) to have to
+ * wait. It holds on to whatever it's waiting for while suspended, so unlike
+ * a pthread mutex, a fibre mutex can be held across a suspension.
+ *
+ * A release with waiters doesn't release at all, but hands what's released
+ * straight to the waiter at the head of the queue and fibre_ready()s it, so
+ * there's no thundering herd and no barging. With FIBRE_SYNC_SWITCH, it's put
+ * at the head of the run queue (fibre_ready_next()), and a fibre that
+ * releases yields to it straight away. fibre_cond_signal() and _broadcast()
+ * move their waiters on to the mutex's queue if it's held (as it normally
+ * is), so that they're handed it one by one. A reader-writer lock's waiters
+ * are served in order, runs of readers together, and a reader doesn't get in
+ * ahead of a writer that's already waiting. The _try versions return -EBUSY
+ * rather than wait.
+ *
+ * The uncontended cases don't do much more than test and set a field, and
+ * fibre_inline.h has inline versions of fibre_mutex_lock() and _unlock(). */
+#define FIBRE_SYNC_SWITCH 0x1
+struct fibre_waitq {
+	struct fibre *head;
+	struct fibre *tail;
+};
+struct fibre_mutex {
+	int locked;
+	unsigned int flags;
+	struct fibre_waitq waiters;
+};
+struct fibre_cond {
+	struct fibre_waitq waiters;
+};
+struct fibre_sem {
+	unsigned long count;
+	unsigned int flags;
+	struct fibre_waitq waiters;
+};
+struct fibre_rwlock {
+	/* The number of readers, or -1 for a writer */
+	long state;
+	unsigned int flags;
+	struct fibre_waitq waiters;
+};
+void fibre_mutex_init(struct fibre_mutex *, unsigned int flags);
+void fibre_mutex_lock(struct fibre_mutex *);
+int fibre_mutex_trylock(struct fibre_mutex *);
+void fibre_mutex_unlock(struct fibre_mutex *);
+/* The mutex's flags go for the fibres it moves */
+void fibre_cond_init(struct fibre_cond *);
+void fibre_cond_wait(struct fibre_cond *, struct fibre_mutex *);
+void fibre_cond_signal(struct fibre_cond *);
+void fibre_cond_broadcast(struct fibre_cond *);
+void fibre_sem_init(struct fibre_sem *, unsigned long count,
+		    unsigned int flags);
+void fibre_sem_wait(struct fibre_sem *);
+int fibre_sem_trywait(struct fibre_sem *);
+void fibre_sem_post(struct fibre_sem *);
+void fibre_rwlock_init(struct fibre_rwlock *, unsigned int flags);
+void fibre_rwlock_rdlock(struct fibre_rwlock *);
+void fibre_rwlock_wrlock(struct fibre_rwlock *);
+int fibre_rwlock_tryrdlock(struct fibre_rwlock *);
+int fibre_rwlock_trywrlock(struct fibre_rwlock *);
+void fibre_rwlock_unlock(struct fibre_rwlock *);
+
+/* Bounded channels, for passing fixed-size messages between fibres on the
+ * same thread. fibre_chan_init() sets the size of a message and the number
+ * of them the channel buffers ('cap'), 0 making it unbuffered, so that each
+ * send waits for (or finds) a receive to pair with. A sender that finds a
+ * receiver waiting copies the message straight into the receiver's buffer
+ * (normally in the receiver's stack frame) and fibre_ready()s it, and
+ * likewise a receiver that finds a sender waiting (with an empty buffer)
+ * copies straight out of the sender's, so a message is only ever copied via
+ * the channel's buffer when neither side is waiting. FIBRE_SYNC_SWITCH goes
+ * as for the synchronisation primitives above: a fibre that hands a message
+ * over (or makes room for one) switches to its peer straight away, which is
+ * what a pipeline of fibres wants.
+ *
+ * Sends and receives return 0, or -EPIPE once the channel has been closed
+ * (for a receive, only once what's buffered has been received), and the
+ * _try versions return -EBUSY rather than wait. Closing resumes whatever's
+ * waiting on the channel (with -EPIPE), and it's a bug to close a channel
+ * twice, or to destroy one that fibres are waiting on.
+ *
+ * fibre_chan_select() waits for the first of several sends and receives
+ * (each of which can be on any channel) to be done, does just that one, and
+ * returns its index, with its result in its 'ret'. If several could be done
+ * straight away, it's the first in the array. fibre_chan_try_select()
+ * returns -EBUSY rather than wait. The waiting is done in the
+ * fibre_chan_op structures themselves, so a select never allocates. That
+ * also means a FIBRE_ATTR_SHARED fibre can't wait on a channel (its ops are on
+ * a stack that's copied out while it's away), so a send, receive or select
+ * that would wait returns -EINVAL for one instead; the _try versions are
+ * fine. */
+struct fibre_chan_op;
+struct fibre_chanq {
+	struct fibre_chan_op *head;
+	struct fibre_chan_op *tail;
+};
+struct fibre_chan {
+	size_t size;
+	unsigned long cap;
+	/* The buffered messages, 'num' of them from slot 'head' */
+	unsigned long num;
+	unsigned long head;
+	void *buf;
+	unsigned int flags;
+	int closed;
+	struct fibre_chanq senders;
+	struct fibre_chanq receivers;
+};
+struct fibre_chan_op {
+	struct fibre_chan *chan;
+	/* Non-zero to send 'msg', otherwise to receive into it */
+	int send;
+	void *msg;
+	int ret;
+	/* The library's, for while it waits */
+	struct fibre_chan_op *prev;
+	struct fibre_chan_op *next;
+	struct fibre *fibre;
+};
+int fibre_chan_init(struct fibre_chan *, size_t size, unsigned long cap,
+		    unsigned int flags);
+void fibre_chan_destroy(struct fibre_chan *);
+int fibre_chan_send(struct fibre_chan *, const void *msg);
+int fibre_chan_recv(struct fibre_chan *, void *msg);
+int fibre_chan_try_send(struct fibre_chan *, const void *msg);
+int fibre_chan_try_recv(struct fibre_chan *, void *msg);
+void fibre_chan_close(struct fibre_chan *);
+int fibre_chan_select(struct fibre_chan_op *, unsigned int num);
+int fibre_chan_try_select(struct fibre_chan_op *, unsigned int num);
+
 /*
  * Fibre "async" support
  *
@@ -125,6 +559,9 @@ int fibre_selector_scheduler(struct fibre_selector **,
 #define FIBRE_ASYNC_POLL        0x01
 #define FIBRE_ASYNC_FD_READABLE 0x02
 #define FIBRE_ASYNC_CHECK_CB    0x04
+#define FIBRE_ASYNC_TIMER       0x08
+#define FIBRE_ASYNC_IO          0x10
+#define FIBRE_ASYNC_WAKE        0x20
 
 void fibre_async_set_mask(uint32_t mask);
 
@@ -145,8 +582,24 @@ void fibre_async_set_mask(uint32_t mask);
  *     the fibre. (See following section.)
  * Async support is scoped to the top-most selector in the selector stack. If
  * you locally push a new selector, but want to benefit from the async support
- * of the parent selector in the stack, you should support "proxying". */
+ * of the parent selector in the stack, call fibre_async_set_transparent() with
+ * the methods to pass through (after pushing it, as for the mask). A
+ * suspension with one of those methods then goes down the stack, through any
+ * other selectors that are transparent for it, to the first selector that has
+ * it in its mask, and the fibre that's current in that selector (the "proxy",
+ * ie. the one that pushed the selector above it, or its ancestor) is
+ * suspended there in its place. When the proxy is resumed, so is the fibre
+ * that suspended, and everything in between carries on as it was. While
+ * that's suspended, so is everything under the selectors in between, and the
+ * higher API level sees the proxy (fibre_async_abort() and
+ * fibre_async_timeout() on the fibre that suspended are passed on to the
+ * proxy, but it's the proxy that has to be resumed). It can't be done if the
+ * proxy is an origin, in which case fibre_async_can_suspend() says no. (Nor
+ * can the proxy or any fibre current in between be on the shared stack, as
+ * a FIBRE_ATTR_SHARED fibre can't push a selector.) Nor can the top-most
+ * selector's origin suspend, having no fibre to suspend. */
 
+void fibre_async_set_transparent(uint32_t mask);
 int fibre_async_can_suspend(uint32_t method);
 
 /* To avoid deadlocks, any thread-locking strategy (that synchronises multiple
@@ -190,6 +643,52 @@ int fibre_async_suspend_fd_readable(int fd);
  * non-zero once. Return value zero or -EINTR as with _poll(). */
 int fibre_async_suspend_use_cb(void *arg, int (*cb)(void *));
 
+/* The same, but if the fibre hasn't been resumed normally by 'deadline' (in
+ * nanoseconds, as returned by fibre_time_ns(), below), the higher API level
+ * should call fibre_async_timeout() on it and resume it, and it then returns
+ * -ETIMEDOUT. (If it's aborted as well, it returns whichever came first.)
+ * FIBRE_NO_DEADLINE means no deadline, as for the ones above. */
+#define FIBRE_NO_DEADLINE UINT64_MAX
+int fibre_async_suspend_poll_timeout(uint64_t deadline);
+int fibre_async_suspend_fd_readable_timeout(int fd, uint64_t deadline);
+int fibre_async_suspend_use_cb_timeout(void *arg, int (*cb)(void *),
+				       uint64_t deadline);
+
+/* FIBRE_ASYNC_WAKE: the higher API level should resume this fibre normally
+ * only once it has been woken, by fibre_wake_remote() (from any thread, see
+ * the epoll selector above) or fibre_ready(). A wake that arrives while the
+ * fibre is running, or that was meant for an earlier suspension, can resume
+ * it too, so (as with a condition variable) the caller should check what
+ * it's waiting for again. Return value zero, -EINTR or -ETIMEDOUT as with
+ * the _timeout suspends above. */
+int fibre_async_suspend_wake(void);
+int fibre_async_suspend_wake_timeout(uint64_t deadline);
+
+/* FIBRE_ASYNC_TIMER: the higher API level should resume this fibre normally
+ * only once CLOCK_MONOTONIC reaches 'deadline' (in nanoseconds, as returned by
+ * fibre_time_ns()), eg. by way of a struct fibre_timers. Unlike the others,
+ * these can be called when fibre_async_can_suspend() says no, in which case
+ * they sleep the whole thread (and return zero). Otherwise, return value zero
+ * or -EINTR as with _poll(). */
+uint64_t fibre_time_ns(void);
+int fibre_sleep_until(uint64_t deadline);
+int fibre_sleep_for(uint64_t ns);
+
+/* FIBRE_ASYNC_IO: the higher API level should carry out the operation (eg. by
+ * way of io_uring), and resume this fibre normally once it has completed,
+ * with the result. These are equivalents of the system calls, but return the
+ * result or a negative errno. Like the _TIMER ones, they can be called when
+ * fibre_async_can_suspend() says no, in which case they make the system call,
+ * and if a read or accept would block (the fd being non-blocking) they wait
+ * with fibre_async_suspend_fd_readable() (if that can suspend) and try again.
+ * The same goes for a read or accept that completes with -EAGAIN. If the
+ * fibre was aborted and the operation didn't complete, -EINTR. */
+ssize_t fibre_io_read(int fd, void *buf, size_t len);
+ssize_t fibre_io_write(int fd, const void *buf, size_t len);
+int fibre_io_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+		    int flags);
+int fibre_io_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
 /* For a fibre that has been suspended due to a fibre_async_suspend_*() API,
  * this obtains the completion method that was used. */
 uint32_t fibre_async_type(struct fibre *);
@@ -198,13 +697,92 @@ uint32_t fibre_async_type(struct fibre *);
  * details. */
 void fibre_async_get_fd_readable(struct fibre *, int *fd);
 void fibre_async_get_use_cb(struct fibre *, void **arg, int (**cb)(void *));
+void fibre_async_get_timer(struct fibre *, uint64_t *deadline);
+/* The deadline of a _timeout suspension, or FIBRE_NO_DEADLINE. While the
+ * fibre is suspended (any way besides FIBRE_ASYNC_TIMER), its timer linkage
+ * is free, so the higher API level can keep it in a struct fibre_timers
+ * (below) to find the suspensions that have expired. */
+uint64_t fibre_async_get_deadline(struct fibre *);
+
+/* The operation of a FIBRE_ASYNC_IO fibre. The higher API level puts the
+ * result (or negative errno) in 'res' before resuming the fibre. */
+#define FIBRE_IO_READ    1 /* 'len' bytes into 'buf' */
+#define FIBRE_IO_WRITE   2 /* 'len' bytes from 'buf' */
+#define FIBRE_IO_ACCEPT  3 /* 'buf', 'addrlen' and 'flags' as for accept4() */
+#define FIBRE_IO_CONNECT 4 /* 'buf' is the address, and 'len' its length */
+struct fibre_io {
+	unsigned int op;
+	int fd;
+	void *buf;
+	size_t len;
+	socklen_t *addrlen;
+	int flags;
+	long res;
+};
+void fibre_async_get_io(struct fibre *, struct fibre_io **io);
 
 /* Prior to an "async" fibre being resumed, the 'abort' API can set an attribute
- * such that the fibre will see a +1 return value from its 'suspend' call. The
- * purpose of this feature is to provide cancellability of async operations. If
- * the suspending code sees this and the operation it is waiting on is not
- * complete, then it should assume an underlying failure rather than suspending
- * again for the same reason. */
+ * such that the fibre will see a -EINTR return value from its 'suspend' call.
+ * The purpose of this feature is to provide cancellability of async
+ * operations. If the suspending code sees this and the operation it is
+ * waiting on is not complete, then it should assume an underlying failure
+ * rather than suspending again for the same reason. The 'timeout' API is the
+ * same, but with -ETIMEDOUT, for a suspension whose deadline has passed. */
 void fibre_async_abort(struct fibre *);
+void fibre_async_timeout(struct fibre *);
+
+/* A timer wheel, for the higher API level to keep FIBRE_ASYNC_TIMER fibres (or
+ * any other fibres it wants to wake at a given time) in. Times are in
+ * nanoseconds on the fibre_time_ns() clock, and deadlines are rounded up to
+ * the next multiple of 'granularity' (zero for the default of a millisecond),
+ * so timers that are due close together fire together. 'now' is where the
+ * wheel starts from. Each fibre can be in one wheel at a time; adding one
+ * that's already there moves it. Adding and cancelling are O(1).
+ *
+ * fibre_timers_next() returns the time of the next expiry (which can be a
+ * little early, never late), or UINT64_MAX if the wheel is empty, eg. to
+ * compute the timeout for epoll_wait(). fibre_timers_expire() takes out up to
+ * 'max' fibres whose deadlines are at or before 'now', in order of expiry,
+ * and returns how many; any more are left for the next call. A wheel must be
+ * empty to be destroyed. */
+struct fibre_timers;
+int fibre_timers_create(struct fibre_timers **, uint64_t now,
+			uint64_t granularity);
+void fibre_timers_destroy(struct fibre_timers *);
+void fibre_timers_add(struct fibre_timers *, struct fibre *, uint64_t deadline);
+void fibre_timers_cancel(struct fibre_timers *, struct fibre *);
+uint64_t fibre_timers_next(struct fibre_timers *);
+unsigned int fibre_timers_expire(struct fibre_timers *, uint64_t now,
+				 struct fibre **, unsigned int max);
+
+/* A poll set, for the higher API level to keep FIBRE_ASYNC_CHECK_CB fibres
+ * in. The fibres are grouped by callback, each group's args being kept in
+ * one array, so a check calls each callback over its args in a tight loop.
+ * Or a callback can have a batch form, which is given a group's args in one
+ * call, sets 'ready[i]' non-zero for each of them that the callback would
+ * have returned non-zero for, and returns how many it set; a callback has to
+ * be registered with fibre_pollset_batch() for that (it can be before any
+ * fibre has used it). Each fibre can be in one poll set at a time, and
+ * adding one that isn't suspended with FIBRE_ASYNC_CHECK_CB is a bug.
+ * fibre_pollset_add() returns -ENOMEM if it runs out of memory, and
+ * fibre_pollset_count() is how many fibres are in the set.
+ *
+ * fibre_pollset_check() takes out up to 'max' fibres whose callbacks have
+ * returned non-zero, in the order they were added, and returns how many. It
+ * only calls callbacks when it has nothing left over from the last time, so
+ * no callback is called again once it has returned non-zero. A poll set must
+ * be empty to be destroyed. */
+struct fibre_pollset;
+int fibre_pollset_create(struct fibre_pollset **);
+void fibre_pollset_destroy(struct fibre_pollset *);
+int fibre_pollset_batch(struct fibre_pollset *, int (*cb)(void *),
+			unsigned int (*batch)(void *const *args,
+					      unsigned int num,
+					      unsigned char *ready));
+int fibre_pollset_add(struct fibre_pollset *, struct fibre *);
+void fibre_pollset_remove(struct fibre_pollset *, struct fibre *);
+unsigned int fibre_pollset_count(struct fibre_pollset *);
+unsigned int fibre_pollset_check(struct fibre_pollset *, struct fibre **,
+				 unsigned int max);
 
 #endif
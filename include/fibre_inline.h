@@ -0,0 +1,118 @@
+#ifndef HEADER_FIBRE_INLINE_H
+#define HEADER_FIBRE_INLINE_H
+
+#include <fibre.h>
+
+/* Inline fast paths for fibre_schedule_to() and fibre_transfer(), for tight
+ * loops of explicit switching (eg. producer/consumer ping-pong), for
+ * fibre_mutex_lock() and _unlock(), which only make the call if the mutex is
+ * contended, and for fibre_key_get() and _set(), which only make the call
+ * for keys whose values aren't kept in the fibre itself.
+ *
+ * When the top-most selector is an "origin" selector (fibre_selector_origin()),
+ * these update that selector's notion of the current fibre themselves and go
+ * straight to the arch-level switch, without the indirect calls through the
+ * selector. In any other case (a different kind of selector on top, or either
+ * side of the switch being a FIBRE_ATTR_SHARED fibre), they are just the
+ * out-of-line versions. The two can be mixed freely. Unlike fibre_transfer(),
+ * fibre_transfer_inline() needs a non-NULL fibre.
+ *
+ * What follows is the library's side of the deal, which is only
+ * here so that it can be inlined. Don't use it directly.
+ */
+static inline void fibre_schedule_to_inline(struct fibre *);
+static inline void *fibre_transfer_inline(struct fibre *, void *msg);
+static inline void fibre_mutex_lock_inline(struct fibre_mutex *);
+static inline void fibre_mutex_unlock_inline(struct fibre_mutex *);
+static inline void *fibre_key_get_inline(struct fibre *, unsigned int key);
+static inline int fibre_key_set_inline(struct fibre *, unsigned int key,
+				       void *);
+
+struct fibre_arch;
+
+/* The leading fields of struct fibre */
+struct fibre_inline_fibre {
+	struct fibre_arch *arch;
+	unsigned int flags;
+	void *keys[FIBRE_KEYS_INLINE];
+};
+/* Flags that take a fibre off the fast path */
+#define FIBRE_INLINE_FLAGS_SLOW 0x6 /* COMPLETED | SHARED */
+
+/* The origin selector's state */
+struct fibre_inline_origin {
+	struct fibre_arch *origin;
+	struct fibre *current;
+};
+
+struct fibre_inline_tls {
+	/* The top-most selector's state, iff it's an origin selector */
+	struct fibre_inline_origin *origin;
+	/* A completed fibre whose stack is yet to go back to the pool */
+	struct fibre *reap;
+};
+extern __thread struct fibre_inline_tls fibre_inline_tls;
+
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg);
+void fibre_inline_reap(void);
+
+static inline void *fibre_transfer_inline(struct fibre *f, void *msg)
+{
+	struct fibre_inline_origin *o = fibre_inline_tls.origin;
+	struct fibre_inline_fibre *d = (struct fibre_inline_fibre *)f;
+	struct fibre_inline_fibre *s;
+	if (__builtin_expect(!o, 0))
+		goto slow;
+	s = (struct fibre_inline_fibre *)o->current;
+	if (__builtin_expect((d->flags | (s ? s->flags : 0)) &
+			     FIBRE_INLINE_FLAGS_SLOW, 0))
+		goto slow;
+	o->current = f;
+	msg = fibre_arch_switch(d->arch, s ? s->arch : o->origin, msg);
+	if (__builtin_expect(!!fibre_inline_tls.reap, 0))
+		fibre_inline_reap();
+	return msg;
+slow:
+	return fibre_transfer(f, msg);
+}
+
+static inline void fibre_schedule_to_inline(struct fibre *f)
+{
+	fibre_transfer_inline(f, NULL);
+}
+
+static inline void fibre_mutex_lock_inline(struct fibre_mutex *m)
+{
+	if (__builtin_expect(!m->locked, 1))
+		m->locked = 1;
+	else
+		fibre_mutex_lock(m);
+}
+
+static inline void fibre_mutex_unlock_inline(struct fibre_mutex *m)
+{
+	if (__builtin_expect(!m->waiters.head, 1))
+		m->locked = 0;
+	else
+		fibre_mutex_unlock(m);
+}
+
+static inline void *fibre_key_get_inline(struct fibre *f, unsigned int key)
+{
+	if (__builtin_expect(key < FIBRE_KEYS_INLINE, 1))
+		return ((struct fibre_inline_fibre *)f)->keys[key];
+	return fibre_key_get(f, key);
+}
+
+static inline int fibre_key_set_inline(struct fibre *f, unsigned int key,
+				       void *val)
+{
+	if (__builtin_expect(key < FIBRE_KEYS_INLINE, 1)) {
+		((struct fibre_inline_fibre *)f)->keys[key] = val;
+		return 0;
+	}
+	return fibre_key_set(f, key, val);
+}
+
+#endif
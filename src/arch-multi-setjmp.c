@@ -0,0 +1,4 @@
+/* setjmp, as one of the backends of a FIBRE_ARCH=multi build */
+#define FIBRE_ARCH_PREFIX setjmp
+#include "arch-setjmp.c"
+FIBRE_ARCH_OPS(setjmp);
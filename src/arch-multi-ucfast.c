@@ -0,0 +1,4 @@
+/* ucfast, as one of the backends of a FIBRE_ARCH=multi build */
+#define FIBRE_ARCH_PREFIX ucfast
+#include "arch-ucfast.c"
+FIBRE_ARCH_OPS(ucfast);
@@ -0,0 +1,4 @@
+/* ucontext, as one of the backends of a FIBRE_ARCH=multi build */
+#define FIBRE_ARCH_PREFIX ucontext
+#include "arch-ucontext.c"
+FIBRE_ARCH_OPS(ucontext);
@@ -0,0 +1,6 @@
+/* x86, as one of the backends of a FIBRE_ARCH=multi build */
+#if defined(__x86_64__) || defined(__i386__)
+#define FIBRE_ARCH_PREFIX x86
+#include "arch-x86.c"
+FIBRE_ARCH_OPS(x86);
+#endif
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "private.h"
+
+/* FIBRE_ARCH=multi: every arch implementation that the platform supports is
+ * built in (each via its arch-multi-<name>.c wrapper, which gives its hooks
+ * prefixed names), and the hooks here pass through to whichever was chosen.
+ *
+ * The choice is made once for the whole process, by the first fibre_init(),
+ * as contexts and stacks can outlive the thread that made them. It's the
+ * backend named by fibre_backend_select() if that was called first, otherwise
+ * by the FIBRE_ARCH environment variable if that's set, otherwise whichever
+ * does a ping-pong of switches fastest on a quick calibration run.
+ *
+ * The cost of this is an indirect jump on every hook, including the switch.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+extern const struct fibre_arch_ops fibre_arch_x86_ops;
+#endif
+extern const struct fibre_arch_ops fibre_arch_ucfast_ops;
+extern const struct fibre_arch_ops fibre_arch_setjmp_ops;
+extern const struct fibre_arch_ops fibre_arch_ucontext_ops;
+
+/* In order of preference, should calibration find them equal */
+static const struct fibre_arch_ops *const backends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	&fibre_arch_x86_ops,
+#endif
+	&fibre_arch_ucfast_ops,
+	&fibre_arch_setjmp_ops,
+	&fibre_arch_ucontext_ops
+};
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+#ifndef FIBRE_ARCH_CALIBRATE_LOOPS
+#define FIBRE_ARCH_CALIBRATE_LOOPS 1000
+#endif
+#ifndef FIBRE_ARCH_CALIBRATE_RUNS
+#define FIBRE_ARCH_CALIBRATE_RUNS 3
+#endif
+#define CALIBRATE_STACK (64*1024)
+
+static struct multi_state {
+	/* Serialises the choice, and calibration */
+	pthread_mutex_t lock;
+	/* Set by fibre_backend_select() until the first fibre_init() */
+	const struct fibre_arch_ops *selected;
+	/* The choice, once made. 'swtch' is copied out of it. */
+	const struct fibre_arch_ops *ops;
+	void *(*swtch)(struct fibre_arch *, struct fibre_arch *, void *);
+	/* The backend being calibrated, its context, and its origin */
+	const struct fibre_arch_ops *cal_ops;
+	struct fibre_arch *cal_ctx;
+	struct fibre_arch *cal_origin;
+} multi = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static const struct fibre_arch_ops *find(const char *name)
+{
+	unsigned int loop;
+	for (loop = 0; loop < NUM_BACKENDS; loop++)
+		if (!strcmp(backends[loop]->name, name))
+			return backends[loop];
+	return NULL;
+}
+
+static void calibrate_fn(void)
+{
+	while (1)
+		multi.cal_ops->swtch(multi.cal_origin, multi.cal_ctx, NULL);
+}
+
+/* Returns the best time (in ns) for a run of switches, or ~0 on failure */
+static unsigned long calibrate(const struct fibre_arch_ops *o)
+{
+	unsigned long best = ~0UL, ns;
+	struct timespec start, end;
+	unsigned int run, loop;
+	void *stack = NULL;
+	int ret;
+	if (o->init())
+		return best;
+	multi.cal_ops = o;
+	multi.cal_origin = NULL;
+	multi.cal_ctx = aligned_alloc(64, (o->size() + 63) & ~(size_t)63);
+	stack = aligned_alloc(64, CALIBRATE_STACK);
+	if (!multi.cal_ctx || !stack || o->origin(&multi.cal_origin))
+		goto out;
+	if (o->create(multi.cal_ctx, stack, CALIBRATE_STACK, calibrate_fn))
+		goto out;
+	for (run = 0; run < FIBRE_ARCH_CALIBRATE_RUNS; run++) {
+		ret = clock_gettime(CLOCK_MONOTONIC, &start);
+		for (loop = 0; loop < FIBRE_ARCH_CALIBRATE_LOOPS; loop++)
+			o->swtch(multi.cal_ctx, multi.cal_origin, NULL);
+		ret |= clock_gettime(CLOCK_MONOTONIC, &end);
+		if (ret)
+			break;
+		ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+		     end.tv_nsec - start.tv_nsec;
+		if (ns < best)
+			best = ns;
+	}
+	/* It's left suspended, which is fine as it owns nothing */
+	o->destroy(multi.cal_ctx);
+out:
+	if (multi.cal_origin)
+		o->origin_free(multi.cal_origin);
+	free(multi.cal_ctx);
+	free(stack);
+	o->finish();
+	return best;
+}
+
+static int choose(void)
+{
+	const struct fibre_arch_ops *o = multi.selected;
+	unsigned long best = ~0UL, ns;
+	const char *env;
+	unsigned int loop;
+	if (!o && (env = getenv("FIBRE_BACKEND")) && *env) {
+		o = find(env);
+		if (!o)
+			return -ENOENT;
+	}
+	if (!o) {
+		for (loop = 0; loop < NUM_BACKENDS; loop++) {
+			ns = calibrate(backends[loop]);
+			if (ns < best) {
+				best = ns;
+				o = backends[loop];
+			}
+		}
+	}
+	if (!o)
+		return -ENOSYS;
+	multi.selected = NULL;
+	multi.swtch = o->swtch;
+	multi.ops = o;
+	return 0;
+}
+
+int fibre_backend_select(const char *name)
+{
+	const struct fibre_arch_ops *o = find(name);
+	int ret = 0;
+	if (!o)
+		return -ENOENT;
+	pthread_mutex_lock(&multi.lock);
+	if (multi.ops)
+		ret = (multi.ops == o) ? 0 : -EBUSY;
+	else
+		multi.selected = o;
+	pthread_mutex_unlock(&multi.lock);
+	return ret;
+}
+
+const char *fibre_backend_name(void)
+{
+	const struct fibre_arch_ops *o = multi.ops;
+	return o ? o->name : NULL;
+}
+
+unsigned int fibre_backend_list(const char **names, unsigned int max)
+{
+	unsigned int loop;
+	for (loop = 0; loop < NUM_BACKENDS && loop < max; loop++)
+		names[loop] = backends[loop]->name;
+	return NUM_BACKENDS;
+}
+
+int fibre_arch_init(void)
+{
+	int ret = 0;
+	pthread_mutex_lock(&multi.lock);
+	if (!multi.ops)
+		ret = choose();
+	pthread_mutex_unlock(&multi.lock);
+	return ret ? ret : multi.ops->init();
+}
+
+void fibre_arch_finish(void)
+{
+	multi.ops->finish();
+}
+
+size_t fibre_arch_sizeof(void)
+{
+	return multi.ops->size();
+}
+
+int fibre_arch_origin(struct fibre_arch **aa)
+{
+	return multi.ops->origin(aa);
+}
+
+void fibre_arch_origin_free(struct fibre_arch *a)
+{
+	multi.ops->origin_free(a);
+}
+
+int fibre_arch_create(struct fibre_arch *a, void *stack, size_t stack_size,
+		      void (*fn)(void))
+{
+	return multi.ops->create(a, stack, stack_size, fn);
+}
+
+int fibre_arch_reset(struct fibre_arch *a, void *stack, size_t stack_size,
+		     void (*fn)(void))
+{
+	return multi.ops->reset(a, stack, stack_size, fn);
+}
+
+void fibre_arch_destroy(struct fibre_arch *a)
+{
+	multi.ops->destroy(a);
+}
+
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg)
+{
+	return multi.swtch(dest, src, msg);
+}
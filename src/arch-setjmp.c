@@ -2,75 +2,142 @@
 #include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
-#include <semaphore.h>
+#include <string.h>
 #include "private.h"
 
-#ifndef FIBRE_STACK_SIZE
-#define FIBRE_STACK_SIZE SIGSTKSZ
-#endif
-
+/* A fresh context is made by running a signal handler on the new stack (via
+ * sigaltstack() and raise()), and capturing a jmp_buf from within it. That's
+ * several syscalls, so once a stack has been bootstrapped like that, we keep
+ * a "pristine" copy of the result: the jmp_buf, and the stack from just below
+ * the trampoline's frame up to the top. Writing those back gets any context
+ * back to the just-bootstrapped state on that stack, so long as it's at the
+ * same address (the jmp_buf holds absolute stack addresses, and they can't be
+ * portably relocated). As stacks come from a pool and get reused, most
+ * fibre_arch_create() and fibre_arch_reset() calls are just a copy.
+ *
+ * The copies are cached per-thread, by stack address and size, and as the
+ * copy is only a function of the address, a cache entry stays valid even if
+ * the stack is unmapped and something else is later mapped there.
+ *
+ * Nothing in a bootstrapped frame refers to the fibre_arch it was made for,
+ * or to the thread it was made on: when a context first runs, the function
+ * to call is picked up from thread-local state set by fibre_arch_switch(). So
+ * the copy can be given to any fibre.
+ *
+ * The SIGUSR1 handler is installed once, when the first thread calls
+ * fibre_arch_init(), and it passes on any SIGUSR1 that isn't one of our
+ * own to whatever handler was there before. If the application has since
+ * replaced our handler, we put it back before bootstrapping.
+ */
 struct fibre_arch {
 	jmp_buf jbuf;
 	void (*fn)(void);
-	stack_t stack;
 	int is_origin;
 };
 
+/* Enough to cover the trampoline's locals, which sit below its frame
+ * address. */
+#define FRAME_SLACK 256
+
+#ifndef FIBRE_SETJMP_CACHE
+#define FIBRE_SETJMP_CACHE 256
+#endif
+
+struct pristine {
+	void *stack;
+	size_t size;
+	jmp_buf jbuf;
+	void *frame;
+	size_t frame_len;
+	void *frame_copy;
+};
+
+static __thread struct setjmp_state {
+	/* The context being bootstrapped, and where its trampoline's frame is */
+	struct fibre_arch *boot;
+	void *frame;
+	/* Set by the signal handler, so we know it was our handler that ran */
+	int booted;
+	/* To get back out of the trampoline once it has made the context */
+	jmp_buf callerctx;
+	/* The function a fresh context calls, set when switching to it */
+	void (*launch)(void);
+	/* Direct-mapped, by stack address */
+	struct pristine *cache;
+	/* The message being handed over by a switch, which is always between
+	 * two contexts on this thread */
+	void *msg;
+} tls_setjmp;
+
 static struct global_state {
-	/* We lazy initialise the semaphore when thread_count goes non-zero,
-	 * and destroy it when it goes to zero. The mutex synchronizes the
-	 * per-thread init/finish calls through this logic. */
+	/* Serialises the per-thread init/finish calls, which install the
+	 * handler when thread_count goes non-zero, and restore the previous one
+	 * when it goes back to zero. */
 	pthread_mutex_t lock;
 	unsigned int thread_count;
-	/* The semaphore used to serialize fibre creation, because it relies on
-	 * global signal-handling tricks. */
-	sem_t sem;
-	/* And the per-fibre details (e.g. function to call) used when the
-	 * signal-handler is creating the fibre. NB: the signal handler has to
-	 * copy this to a local stack variable during initialization, because
-	 * when it is later resumed this global data will be different. */
-	struct fibre_arch *fibre;
-	/* In order to get a clean stack frame despite the signal handler
-	 * returning (which invalidates the stack frame), we longjmp() back
-	 * into the trampoline post-signal and it calls a subroutine to create
-	 * the required stack frame. This jmp_buf is used in that second step,
-	 * to get back to the caller context from the parameter-less trampoline
-	 * sub-routine. */
-	jmp_buf callerctx;
+	struct sigaction prev;
 } global_state = {
 	.lock = PTHREAD_MUTEX_INITIALIZER,
 	.thread_count = 0
 };
 
+/* Kept out of line, so that nothing thread-local is looked up before the
+ * setjmp() that a context resumes from (it may not be the same thread). */
+static __attribute__((noinline)) void local_trampoline_launch(void)
+{
+	tls_setjmp.launch();
+}
+
 static void local_trampoline_clean_stack_frame(void)
 {
-	struct fibre_arch *fibre = global_state.fibre;
-	if (setjmp(fibre->jbuf)) {
-		fibre->fn();
+	tls_setjmp.frame = (char *)__builtin_frame_address(0) - FRAME_SLACK;
+	if (setjmp(tls_setjmp.boot->jbuf)) {
+		local_trampoline_launch();
 		fprintf(stderr, "Critical: shouldn't get this far!!\n");
+		abort();
 	}
-	longjmp(global_state.callerctx, 1);
+	longjmp(tls_setjmp.callerctx, 1);
 }
 
-static void local_trampoline(int arg)
+static void local_trampoline(int sig, siginfo_t *info, void *uc)
 {
-	struct fibre_arch *fibre = global_state.fibre;
-	FCHECK(arg == SIGUSR1);
-	if (!fibre) {
-		fprintf(stderr, "Warning: spurious SIGUSR1 in libfibre\n");
+	struct fibre_arch *fibre = tls_setjmp.boot;
+	if (!fibre || tls_setjmp.booted) {
+		/* Not ours */
+		const struct sigaction *prev = &global_state.prev;
+		if (prev->sa_flags & SA_SIGINFO)
+			prev->sa_sigaction(sig, info, uc);
+		else if (prev->sa_handler == SIG_DFL) {
+			signal(sig, SIG_DFL);
+			raise(sig);
+		} else if (prev->sa_handler != SIG_IGN)
+			prev->sa_handler(sig);
 		return;
 	}
+	tls_setjmp.booted = 1;
 	if (setjmp(fibre->jbuf))
 		local_trampoline_clean_stack_frame();
 }
 
+static int install_handler(void)
+{
+	struct sigaction sa;
+	sa.sa_sigaction = local_trampoline;
+	sa.sa_flags = SA_ONSTACK | SA_SIGINFO |
+		      (global_state.prev.sa_flags & SA_RESTART);
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGUSR1, &sa, NULL) ? -errno : 0;
+}
+
 int fibre_arch_init(void)
 {
 	int ret = pthread_mutex_lock(&global_state.lock);
 	if (ret)
 		return ret;
 	if (++global_state.thread_count == 1) {
-		ret = sem_init(&global_state.sem, 0, 1);
+		ret = sigaction(SIGUSR1, NULL, &global_state.prev) ? -errno : 0;
+		if (!ret)
+			ret = install_handler();
 		if (ret)
 			global_state.thread_count--;
 	}
@@ -80,15 +147,33 @@ int fibre_arch_init(void)
 
 void fibre_arch_finish(void)
 {
-	FUNUSED int ret = pthread_mutex_lock(&global_state.lock);
+	struct pristine *cache = tls_setjmp.cache;
+	struct sigaction cur;
+	FUNUSED int ret;
+	unsigned int loop;
+	if (cache) {
+		for (loop = 0; loop < FIBRE_SETJMP_CACHE; loop++)
+			free(cache[loop].frame_copy);
+		free(cache);
+		tls_setjmp.cache = NULL;
+	}
+	ret = pthread_mutex_lock(&global_state.lock);
 	FCHECK(!ret);
 	if (--global_state.thread_count == 0) {
-		ret = sem_destroy(&global_state.sem);
-		FCHECK(!ret);
+		/* Unless the application has put its own in since */
+		ret = sigaction(SIGUSR1, NULL, &cur);
+		if (!ret && (cur.sa_flags & SA_SIGINFO) &&
+				cur.sa_sigaction == local_trampoline)
+			sigaction(SIGUSR1, &global_state.prev, NULL);
 	}
 	pthread_mutex_unlock(&global_state.lock);
 }
 
+size_t fibre_arch_sizeof(void)
+{
+	return sizeof(struct fibre_arch);
+}
+
 int fibre_arch_origin(struct fibre_arch **aa)
 {
 	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
@@ -99,79 +184,140 @@ int fibre_arch_origin(struct fibre_arch **aa)
 	return 0;
 }
 
-int fibre_arch_create(struct fibre_arch **aa, void (*fn)(void))
+void fibre_arch_origin_free(struct fibre_arch *a)
 {
-	struct sigaction sa, osa;
-	stack_t ostack;
-	int ret;
-	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
-	if (!a)
-		return -ENOMEM;
-	FCHECK(global_state.thread_count > 0);
-	a->is_origin = 0;
-	a->fn = fn;
-	a->stack.ss_flags = 0;
-	a->stack.ss_size = FIBRE_STACK_SIZE;
-	a->stack.ss_sp = malloc(FIBRE_STACK_SIZE);
-	if (!a->stack.ss_sp)
-		return -ENOMEM;
-	ret = sem_wait(&global_state.sem);
-	if (ret) {
-		free(a->stack.ss_sp);
-		return ret;
-	}
-	global_state.fibre = a;
-	ret = sigaltstack(&a->stack, &ostack);
-	if (ret) {
-		global_state.fibre = NULL;
-		sem_post(&global_state.sem);
-		free(a->stack.ss_sp);
-		return ret;
-	}
-	sa.sa_handler = local_trampoline;
-	sa.sa_flags = SA_ONSTACK;
-	sigemptyset(&sa.sa_mask);
-	ret = sigaction(SIGUSR1, &sa, &osa);
-	if (ret) {
-		sigaltstack(&ostack, NULL);
-		global_state.fibre = NULL;
-		sem_post(&global_state.sem);
-		free(a->stack.ss_sp);
-		return ret;
+	FCHECK(a->is_origin);
+	free(a);
+}
+
+/* Runs the signal trampoline to get a fresh context on the given stack */
+static int bootstrap(struct fibre_arch *a, void *stack, size_t stack_size)
+{
+	stack_t ss, ostack;
+	int ret, tries;
+	/* sigaltstack() won't take anything smaller */
+	if (stack_size < MINSIGSTKSZ)
+		return -EINVAL;
+	ss.ss_flags = 0;
+	ss.ss_size = stack_size;
+	ss.ss_sp = stack;
+	if (sigaltstack(&ss, &ostack))
+		return -errno;
+	tls_setjmp.boot = a;
+	tls_setjmp.booted = 0;
+	ret = 0;
+	/* Raise the signal, which is delivered to this thread before raise()
+	 * returns. If it wasn't our handler that ran, have another go with it
+	 * put back. */
+	for (tries = 0; !ret && !tls_setjmp.booted && tries < 2; tries++) {
+		if (tries) {
+			ret = pthread_mutex_lock(&global_state.lock);
+			if (ret)
+				break;
+			ret = install_handler();
+			pthread_mutex_unlock(&global_state.lock);
+			if (ret)
+				break;
+		}
+		if (raise(SIGUSR1))
+			ret = -errno;
 	}
-	/* Raise the signal and wait for the handler to finish. This triggers
-	 * the trampoline sequence that creates the fibre. */
-	ret = raise(SIGUSR1);
-	sigaction(SIGUSR1, &osa, NULL);
 	sigaltstack(&ostack, NULL);
+	if (!ret && !tls_setjmp.booted)
+		ret = -EAGAIN;
 	if (ret) {
-		global_state.fibre = NULL;
-		sem_post(&global_state.sem);
-		free(a->stack.ss_sp);
+		tls_setjmp.boot = NULL;
 		return ret;
 	}
 	/* The trampoline sequence through the signal handler has created a
 	 * fibre context. But for weird "clean stack frame" reasons we now need
 	 * to resume the fibre and have it caller a subroutine with no
 	 * arguments, before it's bootstrapped and ready to be resumed at a
-	 * later date (with no more global state and semaphoring required). */
-	if (!setjmp(global_state.callerctx))
+	 * later date. */
+	if (!setjmp(tls_setjmp.callerctx))
 		longjmp(a->jbuf, 1);
-	global_state.fibre = NULL;
-	sem_post(&global_state.sem);
-	*aa = a;
+	tls_setjmp.boot = NULL;
+	return 0;
+}
+
+static struct pristine *cache_slot(void *stack)
+{
+	uintptr_t h = (uintptr_t)stack >> 12;
+	h ^= h >> 9;
+	if (!tls_setjmp.cache) {
+		tls_setjmp.cache = calloc(FIBRE_SETJMP_CACHE,
+					  sizeof(struct pristine));
+		if (!tls_setjmp.cache)
+			return NULL;
+	}
+	return &tls_setjmp.cache[h % FIBRE_SETJMP_CACHE];
+}
+
+/* Puts a pristine context on the stack, bootstrapping it if need be */
+static int pristine(struct fibre_arch *a, void *stack, size_t stack_size)
+{
+	struct pristine *p = cache_slot(stack);
+	char *top = (char *)stack + stack_size;
+	size_t len;
+	int ret;
+	if (p && p->stack == stack && p->size == stack_size) {
+		memcpy(p->frame, p->frame_copy, p->frame_len);
+		memcpy(a->jbuf, p->jbuf, sizeof(jmp_buf));
+		return 0;
+	}
+	ret = bootstrap(a, stack, stack_size);
+	if (ret || !p)
+		return ret;
+	/* Snapshot it. If that fails, we just won't have it next time. */
+	if ((char *)tls_setjmp.frame < (char *)stack)
+		tls_setjmp.frame = stack;
+	len = top - (char *)tls_setjmp.frame;
+	if (len > p->frame_len || !p->frame_copy) {
+		void *copy = realloc(p->frame_copy, len);
+		if (!copy) {
+			p->stack = NULL;
+			return 0;
+		}
+		p->frame_copy = copy;
+	}
+	p->stack = stack;
+	p->size = stack_size;
+	p->frame = tls_setjmp.frame;
+	p->frame_len = len;
+	memcpy(p->frame_copy, p->frame, len);
+	memcpy(p->jbuf, a->jbuf, sizeof(jmp_buf));
 	return 0;
 }
 
+int fibre_arch_create(struct fibre_arch *a, void *stack, size_t stack_size,
+		      void (*fn)(void))
+{
+	FCHECK(global_state.thread_count > 0);
+	a->is_origin = 0;
+	a->fn = fn;
+	return pristine(a, stack, stack_size);
+}
+
+int fibre_arch_reset(struct fibre_arch *a, void *stack, size_t stack_size,
+		     void (*fn)(void))
+{
+	FCHECK(!a->is_origin);
+	a->fn = fn;
+	return pristine(a, stack, stack_size);
+}
+
 void fibre_arch_destroy(struct fibre_arch *a)
 {
-	if (!a->is_origin)
-		free(a->stack.ss_sp);
-	free(a);
+	FCHECK(!a->is_origin);
 }
 
-void fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src)
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg)
 {
-	if (!setjmp(src->jbuf))
+	if (!setjmp(src->jbuf)) {
+		tls_setjmp.launch = dest->fn;
+		tls_setjmp.msg = msg;
 		longjmp(dest->jbuf, 1);
+	}
+	return tls_setjmp.msg;
 }
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE /* For the REG_* indices */
+#include <ucontext.h>
+#include <stddef.h>
+#include <errno.h>
+#include "private.h"
+
+/* A variant of arch-ucontext.c that sets contexts up the same way, with
+ * getcontext() and makecontext(), but switches between them without
+ * swapcontext(). On glibc, swapcontext() saves and restores the signal mask,
+ * which is an rt_sigprocmask() syscall on every switch. Here the signal mask
+ * is left alone, ie. it belongs to the thread rather than to each fibre.
+ *
+ * The switch saves and restores just what the calling convention says a
+ * function call preserves: the callee-saved registers, the stack and
+ * instruction pointers, and the x87/SSE control words. It does so in the
+ * ucontext_t's own slots for them, so it resumes contexts prepared by
+ * makecontext() just as setcontext() would.
+ *
+ * That needs to know the ucontext_t layout, so it's only done for x86-64
+ * Linux. Anywhere else this is the same as arch-ucontext.c.
+ */
+
+struct fibre_arch {
+	ucontext_t ctx;
+	int is_origin;
+};
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#define UC_RBX  "128"
+#define UC_RBP  "120"
+#define UC_R12  "72"
+#define UC_R13  "80"
+#define UC_R14  "88"
+#define UC_R15  "96"
+#define UC_RSP  "160"
+#define UC_RIP  "168"
+#define UC_CWD  "424"
+#define UC_MXCSR "448"
+
+#define UC_CHECK(field, off) \
+	_Static_assert(offsetof(ucontext_t, field) == off, \
+		       "ucontext_t layout mismatch: " #field)
+UC_CHECK(uc_mcontext.gregs[REG_RBX], 128);
+UC_CHECK(uc_mcontext.gregs[REG_RBP], 120);
+UC_CHECK(uc_mcontext.gregs[REG_R12], 72);
+UC_CHECK(uc_mcontext.gregs[REG_R13], 80);
+UC_CHECK(uc_mcontext.gregs[REG_R14], 88);
+UC_CHECK(uc_mcontext.gregs[REG_R15], 96);
+UC_CHECK(uc_mcontext.gregs[REG_RSP], 160);
+UC_CHECK(uc_mcontext.gregs[REG_RIP], 168);
+UC_CHECK(__fpregs_mem.cwd, 424);
+UC_CHECK(__fpregs_mem.mxcsr, 448);
+
+/* ucfast_switch(ucontext_t *dest, ucontext_t *src, void *msg), arguments in
+ * rdi, rsi, rdx. The saved context resumes as though ucfast_switch() had
+ * returned, with 'msg' as the return value. Local to this object, hence no
+ * .globl. */
+void *ucfast_switch(ucontext_t *dest, ucontext_t *src, void *msg);
+asm(".text\n"
+".type ucfast_switch, @function\n"
+"ucfast_switch:\n"
+"\tfnstcw " UC_CWD "(%rsi)\n"
+"\tstmxcsr " UC_MXCSR "(%rsi)\n"
+"\tmovq (%rsp), %rax\n"
+"\tleaq 8(%rsp), %rcx\n"
+"\tmovq %rbx, " UC_RBX "(%rsi)\n"
+"\tmovq %rbp, " UC_RBP "(%rsi)\n"
+"\tmovq %r12, " UC_R12 "(%rsi)\n"
+"\tmovq %r13, " UC_R13 "(%rsi)\n"
+"\tmovq %r14, " UC_R14 "(%rsi)\n"
+"\tmovq %r15, " UC_R15 "(%rsi)\n"
+"\tmovq %rcx, " UC_RSP "(%rsi)\n"
+"\tmovq %rax, " UC_RIP "(%rsi)\n"
+
+/* Loading the control words is slow, and they hardly ever differ */
+"\tmovl " UC_MXCSR "(%rdi), %eax\n"
+"\tcmpl " UC_MXCSR "(%rsi), %eax\n"
+"\tjne 1f\n"
+"\tmovzwl " UC_CWD "(%rdi), %eax\n"
+"\tmovzwl " UC_CWD "(%rsi), %ecx\n"
+"\tcmpl %ecx, %eax\n"
+"\tjne 1f\n"
+"2:\n"
+"\tmovq " UC_RBX "(%rdi), %rbx\n"
+"\tmovq " UC_RBP "(%rdi), %rbp\n"
+"\tmovq " UC_R12 "(%rdi), %r12\n"
+"\tmovq " UC_R13 "(%rdi), %r13\n"
+"\tmovq " UC_R14 "(%rdi), %r14\n"
+"\tmovq " UC_R15 "(%rdi), %r15\n"
+"\tmovq " UC_RSP "(%rdi), %rsp\n"
+/* Return (rather than jump) into it, to keep the CPU's return-address
+ * prediction in step with the call that got us here */
+"\tmovq %rdx, %rax\n"
+"\tpushq " UC_RIP "(%rdi)\n"
+"\tret\n"
+"1:\n"
+"\tfldcw " UC_CWD "(%rdi)\n"
+"\tldmxcsr " UC_MXCSR "(%rdi)\n"
+"\tjmp 2b\n"
+".size ucfast_switch, .-ucfast_switch\n");
+
+#define UC_SWITCH(dest, src, msg) ucfast_switch(dest, src, msg)
+
+#else
+
+/* As for arch-ucontext.c */
+static __thread void *tls_msg;
+
+static void *uc_switch(ucontext_t *dest, ucontext_t *src, void *msg)
+{
+	tls_msg = msg;
+	swapcontext(src, dest);
+	return tls_msg;
+}
+
+#define UC_SWITCH(dest, src, msg) uc_switch(dest, src, msg)
+
+#endif
+
+int fibre_arch_init(void)
+{
+	return 0;
+}
+
+void fibre_arch_finish(void)
+{
+}
+
+size_t fibre_arch_sizeof(void)
+{
+	return sizeof(struct fibre_arch);
+}
+
+int fibre_arch_origin(struct fibre_arch **aa)
+{
+	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
+	if (!a)
+		return -ENOMEM;
+	a->is_origin = 1;
+	*aa = a;
+	return 0;
+}
+
+void fibre_arch_origin_free(struct fibre_arch *a)
+{
+	FCHECK(a->is_origin);
+	free(a);
+}
+
+int fibre_arch_create(struct fibre_arch *a, void *stack, size_t stack_size,
+		      void (*fn)(void))
+{
+	int ret = getcontext(&a->ctx);
+	if (ret)
+		return ret;
+	a->is_origin = 0;
+	a->ctx.uc_stack.ss_sp = stack;
+	a->ctx.uc_stack.ss_size = stack_size;
+	a->ctx.uc_link = NULL;
+	makecontext(&a->ctx, fn, 0);
+	return 0;
+}
+
+/* As for arch-ucontext.c. The control words that getcontext() saved are
+ * still in place, as the switch only ever writes back what it loaded. */
+int fibre_arch_reset(struct fibre_arch *a, void *stack, size_t stack_size,
+		     void (*fn)(void))
+{
+	FCHECK(!a->is_origin);
+	a->ctx.uc_stack.ss_sp = stack;
+	a->ctx.uc_stack.ss_size = stack_size;
+	a->ctx.uc_link = NULL;
+	makecontext(&a->ctx, fn, 0);
+	return 0;
+}
+
+void fibre_arch_destroy(struct fibre_arch *a)
+{
+	FCHECK(!a->is_origin);
+}
+
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg)
+{
+	return UC_SWITCH(&dest->ctx, &src->ctx, msg);
+}
@@ -2,15 +2,15 @@
 #include <errno.h>
 #include "private.h"
 
-#ifndef FIBRE_STACK_SIZE
-#define FIBRE_STACK_SIZE (64*1024)
-#endif
-
 struct fibre_arch {
 	ucontext_t ctx;
 	int is_origin;
 };
 
+/* The message being handed over by a switch. The switch is always between two
+ * contexts on the same thread, so it can be left here for the other side. */
+static __thread void *tls_msg;
+
 int fibre_arch_init(void)
 {
 	return 0;
@@ -20,6 +20,11 @@ void fibre_arch_finish(void)
 {
 }
 
+size_t fibre_arch_sizeof(void)
+{
+	return sizeof(struct fibre_arch);
+}
+
 int fibre_arch_origin(struct fibre_arch **aa)
 {
 	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
@@ -30,41 +35,50 @@ int fibre_arch_origin(struct fibre_arch **aa)
 	return 0;
 }
 
-int fibre_arch_create(struct fibre_arch **aa, void (*fn)(void))
+void fibre_arch_origin_free(struct fibre_arch *a)
 {
-	void *stackspace;
-	int ret;
-	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
-	if (!a)
-		return -ENOMEM;
-	ret = getcontext(&a->ctx);
-	if (ret) {
-		free(a);
+	FCHECK(a->is_origin);
+	free(a);
+}
+
+int fibre_arch_create(struct fibre_arch *a, void *stack, size_t stack_size,
+		      void (*fn)(void))
+{
+	int ret = getcontext(&a->ctx);
+	if (ret)
 		return ret;
-	}
 	a->is_origin = 0;
-	stackspace = malloc(FIBRE_STACK_SIZE);
-	if (!stackspace) {
-		free(a);
-		return -ENOMEM;
-	}
-	a->ctx.uc_stack.ss_sp = stackspace;
-	a->ctx.uc_stack.ss_size = FIBRE_STACK_SIZE;
+	a->ctx.uc_stack.ss_sp = stack;
+	a->ctx.uc_stack.ss_size = stack_size;
+	a->ctx.uc_link = NULL;
+	makecontext(&a->ctx, fn, 0);
+	return 0;
+}
+
+/* The context was initialised by getcontext() when it was created, and
+ * makecontext() only needs to re-seed the registers and the stack. */
+int fibre_arch_reset(struct fibre_arch *a, void *stack, size_t stack_size,
+		     void (*fn)(void))
+{
+	FCHECK(!a->is_origin);
+	a->ctx.uc_stack.ss_sp = stack;
+	a->ctx.uc_stack.ss_size = stack_size;
 	a->ctx.uc_link = NULL;
 	makecontext(&a->ctx, fn, 0);
-	*aa = a;
 	return 0;
 }
 
 void fibre_arch_destroy(struct fibre_arch *a)
 {
-	if (!a->is_origin)
-		free(a->ctx.uc_stack.ss_sp);
-	free(a);
+	FCHECK(!a->is_origin);
 }
 
-void fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src)
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg)
 {
-	FUNUSED int ret = swapcontext(&src->ctx, &dest->ctx);
+	FUNUSED int ret;
+	tls_msg = msg;
+	ret = swapcontext(&src->ctx, &dest->ctx);
 	FCHECK(!ret);
+	return tls_msg;
 }
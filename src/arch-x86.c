@@ -17,7 +17,10 @@
  *
  * Actually, the excerpt is not quite verbatim. To avoid;
  * "warning: declaration of ‘fiber’ shadows a global declaration [-Wshadow]"
- * I changed the typedef from 'fiber' to '_fiber'.
+ * I changed the typedef from 'fiber' to '_fiber'. Also, create_stack() no
+ * longer malloc()s the stack, it is handed the stack memory to use (which
+ * comes from the libfibre stack pool), and asm_switch()'s "return_value" is a
+ * pointer rather than an int (which the asm already handled).
  */
 
 /*****************/
@@ -30,13 +33,14 @@
 typedef struct
 {
 	void** stack; /* The stack pointer */
-	void* stack_bottom; /* The original returned from malloc. */
+	void* stack_bottom; /* The lowest address of the stack memory. */
 	int active;
 } _fiber;
 
 /* Prototype for the assembly function to switch processes. */
-extern int asm_switch(_fiber* next, _fiber* current, int return_value);
-static void create_stack(_fiber* fiber, int stack_size, void (*fptr)(void));
+extern void *asm_switch(_fiber* next, _fiber* current, void *return_value);
+static void create_stack(_fiber* fiber, void* stack_bottom, int stack_size,
+			 void (*fptr)(void));
 extern void* asm_call_fiber_exit;
 
 #ifdef __APPLE__
@@ -55,7 +59,8 @@ ASM_PREFIX "asm_call_fiber_exit:\n"
 /*"\t.type asm_call_fiber_exit, @function\n"*/
 "\tcall " ASM_PREFIX "fiber_exit\n");
 
-static void create_stack(_fiber* fiber, int stack_size, void (*fptr)(void)) {
+static void create_stack(_fiber* fiber, void* stack_bottom, int stack_size,
+			 void (*fptr)(void)) {
 	int i;
 #ifdef __x86_64
 	/* x86-64: rbx, rbp, r12, r13, r14, r15 */
@@ -68,9 +73,8 @@ static void create_stack(_fiber* fiber, int stack_size, void (*fptr)(void)) {
 	assert(fptr != NULL);
 
 	/* Create a 16-byte aligned stack which will work on Mac OS X. */
-	assert(stack_size % 16 == 0);
-	fiber->stack_bottom = malloc(stack_size);
-	if (fiber->stack_bottom == 0) return;
+	assert(((uintptr_t)stack_bottom + stack_size) % 16 == 0);
+	fiber->stack_bottom = stack_bottom;
 	fiber->stack = (void**)((char*) fiber->stack_bottom + stack_size);
 #ifdef __APPLE__
 	assert((uintptr_t) fiber->stack % 16 == 0);
@@ -118,7 +122,7 @@ ASM_PREFIX "asm_switch:\n"
 /* return to the "next" fiber with eax set to return_value */
 "\tret\n");
 #else
-/* static int asm_switch(fiber* next, fiber* current, int return_value); */
+/* static void *asm_switch(fiber* next, fiber* current, void *return_value); */
 asm(".globl " ASM_PREFIX "asm_switch\n"
 ASM_PREFIX "asm_switch:\n"
 #ifndef __APPLE__
@@ -151,10 +155,6 @@ ASM_PREFIX "asm_switch:\n"
 /* END EXCERPT */
 /***************/
 
-#ifndef FIBRE_STACK_SIZE
-#define FIBRE_STACK_SIZE (64*1024)
-#endif
-
 /* This hook is needed from the above code, but it should never be executed in
  * our model, so we craft it appropriately. */
 void fiber_exit(void)
@@ -177,6 +177,11 @@ void fibre_arch_finish(void)
 {
 }
 
+size_t fibre_arch_sizeof(void)
+{
+	return sizeof(struct fibre_arch);
+}
+
 int fibre_arch_origin(struct fibre_arch **aa)
 {
 	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
@@ -187,29 +192,44 @@ int fibre_arch_origin(struct fibre_arch **aa)
 	return 0;
 }
 
-int fibre_arch_create(struct fibre_arch **aa, void (*fn)(void))
+void fibre_arch_origin_free(struct fibre_arch *a)
+{
+	FCHECK(a->is_origin);
+	free(a);
+}
+
+/* The size up to the 16-byte aligned top of the stack, where create_stack()
+ * starts, as a caller-provided stack may not be aligned */
+static inline size_t stack_aligned_size(void *stack, size_t stack_size)
+{
+	return (((uintptr_t)stack + stack_size) & ~(uintptr_t)15) -
+	       (uintptr_t)stack;
+}
+
+int fibre_arch_create(struct fibre_arch *a, void *stack, size_t stack_size,
+		      void (*fn)(void))
 {
-	struct fibre_arch *a = malloc(sizeof(struct fibre_arch));
-	if (!a)
-		return -ENOMEM;
 	a->is_origin = 0;
-	create_stack(&a->ctx, FIBRE_STACK_SIZE, fn);
-	if (!a->ctx.stack_bottom) {
-		free(a);
-		return -ENOMEM;
-	}
-	*aa = a;
+	create_stack(&a->ctx, stack, stack_aligned_size(stack, stack_size), fn);
+	return 0;
+}
+
+int fibre_arch_reset(struct fibre_arch *a, void *stack, size_t stack_size,
+		     void (*fn)(void))
+{
+	FCHECK(!a->is_origin);
+	create_stack(&a->ctx, stack, stack_aligned_size(stack, stack_size), fn);
 	return 0;
 }
 
 void fibre_arch_destroy(struct fibre_arch *a)
 {
-	if (!a->is_origin)
-		free(a->ctx.stack_bottom);
-	free(a);
+	FCHECK(!a->is_origin);
 }
 
-void fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src)
+/* asm_switch() carries the message across in a register */
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg)
 {
-	asm_switch(&dest->ctx, &src->ctx, 0);
+	return asm_switch(&dest->ctx, &src->ctx, msg);
 }
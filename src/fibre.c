@@ -1,6 +1,11 @@
+#define _GNU_SOURCE /* For accept4() */
 #include "private.h"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 static __thread struct tls_fibre {
 	int inited;
@@ -8,6 +13,11 @@ static __thread struct tls_fibre {
 	unsigned int async_atomic;
 } tls_fibre;
 
+/* Shared with fibre_inline.h. 'reap' is a fibre that has completed and
+ * switched away, whose stack is to be returned to the pool by whichever
+ * context runs next. */
+__thread struct fibre_inline_tls fibre_inline_tls;
+
 struct fibre_selector {
 	/* NULL when this selector is the bottom of the stack */
 	struct fibre_selector *parent;
@@ -16,6 +26,8 @@ struct fibre_selector {
 	/* The implementation's per-selector state goes here */
 	void *vtable_data;
 	uint32_t async_mask;
+	/* Methods it passes through to its parent (see fibre_async_owner()) */
+	uint32_t async_transparent;
 };
 
 int fibre_init(void)
@@ -27,9 +39,16 @@ int fibre_init(void)
 	ret = fibre_arch_init();
 	if (ret)
 		return ret;
+	ret = fibre_stack_init();
+	if (ret) {
+		fibre_arch_finish();
+		return ret;
+	}
 	tls_fibre.inited = 1;
 	tls_fibre.sstack = NULL;
 	tls_fibre.async_atomic = 0;
+	fibre_inline_tls.origin = NULL;
+	fibre_inline_tls.reap = NULL;
 	return 0;
 }
 
@@ -38,34 +57,229 @@ void fibre_finish(void)
 	FCHECK(tls_fibre.inited);
 	FCHECK(!tls_fibre.sstack);
 	FCHECK(!tls_fibre.async_atomic);
+	FCHECK(!fibre_inline_tls.reap);
+	fibre_stack_stats_finish();
+	fibre_shared_finish();
+	fibre_stack_finish();
 	fibre_arch_finish();
 	tls_fibre.inited = 0;
 }
 
-static void fibre_bootstrap(void)
+#ifndef FIBRE_ARCH_MULTI
+/* Just the one backend. (With FIBRE_ARCH=multi, these are in arch-multi.c.) */
+int fibre_backend_select(const char *name)
 {
-	struct fibre *f = fibre_get_current();
+	return strcmp(name, FIBRE_ARCH_NAME) ? -ENOENT : 0;
+}
+
+const char *fibre_backend_name(void)
+{
+	return FIBRE_ARCH_NAME;
+}
+
+unsigned int fibre_backend_list(const char **names, unsigned int max)
+{
+	if (max)
+		names[0] = FIBRE_ARCH_NAME;
+	return 1;
+}
+#endif
+
+/* A completed fibre can't give its stack back while it is still running on it,
+ * so it leaves itself in fibre_inline_tls.reap and the next context to run
+ * (which will be on a different stack) does it. */
+static void fibre_stack_account(struct fibre *f);
+
+static inline void fibre_reap(void)
+{
+	struct fibre *f = fibre_inline_tls.reap;
+	if (f) {
+		fibre_inline_tls.reap = NULL;
+		if (f->stack->flags & FIBRE_STACK_PAINTED)
+			fibre_stack_account(f);
+		fibre_stack_put(f->stack);
+		f->stack = NULL;
+	}
+}
+
+void fibre_inline_reap(void)
+{
+	fibre_reap();
+}
+
+void fibre_bootstrap(void)
+{
+	struct fibre_selector *s = tls_fibre.sstack;
+	struct fibre *f;
+	if (s->vtable->started)
+		s->vtable->started(s->vtable_data);
+	fibre_reap();
+	f = fibre_get_current();
 	FCHECK(f);
 	FCHECK(!(f->flags & FIBRE_FLAGS_STARTED));
 	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
-	f->flags |= FIBRE_FLAGS_STARTED;
+	/* Atomically, as with the M:N runtime, FIBRE_FLAGS_READY can be set
+	 * from another thread while we're running */
+	__atomic_or_fetch(&f->flags, FIBRE_FLAGS_STARTED, __ATOMIC_RELAXED);
 	f->fn(f->fn_arg);
-	f->flags |= FIBRE_FLAGS_COMPLETED;
+	fibre_keys_clear(f);
+	__atomic_or_fetch(&f->flags, FIBRE_FLAGS_COMPLETED, __ATOMIC_RELAXED);
+	/* An inline fibre lives on its stack, so keeps it until destroyed, and
+	 * a shared one doesn't have one of its own */
+	if (f->flags & FIBRE_FLAGS_SHARED)
+		fibre_shared_done(f);
+	else if (!(f->attr.flags & FIBRE_ATTR_INLINE)) {
+		FCHECK(!fibre_inline_tls.reap);
+		fibre_inline_tls.reap = f;
+	}
 	fibre_schedule();
 	FCHECK(NULL == "Should never reach here!");
 }
 
+void fibre_attr_init(struct fibre_attr *attr)
+{
+	attr->stack_size = FIBRE_STACK_SIZE;
+	attr->stack = NULL;
+	attr->flags = FIBRE_STACK_GUARD_PAGES ? FIBRE_ATTR_GUARD : 0;
+	attr->pool = FIBRE_ATTR_POOL_DEFAULT;
+}
+
+/* The layout of a fibre's block (see private.h) */
+#define FIBRE_BLOCK_ALIGN 64
+
+static inline size_t fibre_block_arch(void)
+{
+	return (fibre_arch_sizeof() + 15) & ~(size_t)15;
+}
+
+static inline size_t fibre_block_size(void)
+{
+	return (fibre_block_arch() + sizeof(struct fibre) +
+		FIBRE_BLOCK_ALIGN - 1) & ~(size_t)(FIBRE_BLOCK_ALIGN - 1);
+}
+
+/* The part of the fibre's stack that's left for the arch code to use */
+static inline size_t fibre_stack_usable(struct fibre *f)
+{
+	if (f->attr.flags & FIBRE_ATTR_INLINE)
+		return (char *)f->arch - (char *)f->stack->sp_lo;
+	return f->stack->size;
+}
+
+static inline void *fibre_stack_top(struct fibre *f)
+{
+	return (char *)f->stack->sp_lo + fibre_stack_usable(f);
+}
+
+/* Called with the stack that a fibre is about to (re)start on */
+static inline void fibre_stack_prepare(struct fibre_stack *st, void *top)
+{
+	if (fibre_stack_stats_on)
+		fibre_stack_paint(st, top);
+	else
+		st->flags &= ~FIBRE_STACK_PAINTED;
+}
+
+/* Called once a fibre is done with its stack (if it was painted) */
+static void fibre_stack_account(struct fibre *f)
+{
+	if (!(f->flags & FIBRE_FLAGS_STARTED))
+		return;
+	f->stack_peak = fibre_stack_peak(f->stack, fibre_stack_top(f));
+	fibre_stack_stats_record(f->fn, f->stack_peak);
+}
+
+static int fibre_get_stack(struct fibre *f)
+{
+	f->stack = fibre_stack_get(&f->attr);
+	if (!f->stack)
+		return f->attr.stack ? -EINVAL : -ENOMEM;
+	fibre_stack_prepare(f->stack, fibre_stack_top(f));
+	return 0;
+}
+
 int fibre_create(struct fibre **foo, void (*fn)(void *), void *d)
 {
+	return fibre_create_ex(foo, NULL, fn, d);
+}
+
+int fibre_create_ex(struct fibre **foo, const struct fibre_attr *attr,
+		    void (*fn)(void *), void *d)
+{
+	struct fibre_attr defattr;
+	struct fibre_stack *st;
 	struct fibre *f;
+	void *block;
 	int ret;
-	f = malloc(sizeof(*f));
-	if (!f)
-		return -ENOMEM;
+	if (!attr) {
+		fibre_attr_init(&defattr);
+		if (fibre_stack_stats_on == FIBRE_STACK_STATS_ADAPTIVE) {
+			size_t sz = fibre_stack_stats_suggest(fn);
+			if (sz)
+				defattr.stack_size = sz;
+		}
+		attr = &defattr;
+	}
+	if (attr->flags & FIBRE_ATTR_SHARED) {
+		if (attr->stack || (attr->flags & FIBRE_ATTR_INLINE))
+			return -EINVAL;
+		ret = fibre_shared_init();
+		if (ret)
+			return ret;
+		st = NULL;
+	} else {
+		st = fibre_stack_get(attr);
+		if (!st)
+			return attr->stack ? -EINVAL : -ENOMEM;
+		fibre_stack_prepare(st, (char *)st->sp_lo + st->size);
+	}
+	if (attr->flags & FIBRE_ATTR_INLINE) {
+		uintptr_t top = (uintptr_t)st->sp_lo + st->size;
+		if (top - (uintptr_t)st->sp_lo < 2 * fibre_block_size()) {
+			fibre_stack_put(st);
+			return -EINVAL;
+		}
+		block = (void *)((top - fibre_block_size()) &
+				 ~(uintptr_t)(FIBRE_BLOCK_ALIGN - 1));
+	} else {
+		block = aligned_alloc(FIBRE_BLOCK_ALIGN, fibre_block_size());
+		if (!block) {
+			if (st)
+				fibre_stack_put(st);
+			return -ENOMEM;
+		}
+	}
+	f = (struct fibre *)((char *)block + fibre_block_arch());
+	f->arch = block;
 	f->flags = 0;
-	ret = fibre_arch_create(&f->arch, fibre_bootstrap);
+	f->async = 0;
+	f->prio = FIBRE_PRIO_DEFAULT;
+	f->oncpu = 0;
+	f->timer.link.next = NULL;
+	f->poll.set = NULL;
+	f->wakeq = NULL;
+	f->wake_pending = 0;
+	f->wait.kind = 0;
+	memset(f->keys, 0, sizeof(f->keys));
+	f->keys_spill = NULL;
+	f->keys_spill_num = 0;
+	f->stack = st;
+	f->attr = *attr;
+	f->stack_peak = 0;
+	f->shared.buf = NULL;
+	f->shared.len = f->shared.cap = 0;
+	f->shared.arch = 0;
+	if (!st) {
+		/* The arch context is created when it first gets the stack */
+		f->flags = FIBRE_FLAGS_SHARED;
+		ret = 0;
+	} else
+		ret = fibre_arch_create(f->arch, st->sp_lo,
+					fibre_stack_usable(f), fibre_bootstrap);
 	if (ret) {
-		free(f);
+		if (!(attr->flags & FIBRE_ATTR_INLINE))
+			free(block);
+		fibre_stack_put(st);
 		return ret;
 	}
 	f->fn = fn;
@@ -82,11 +296,41 @@ int fibre_recreate(struct fibre *f, void (*fn)(void *), void *d)
 {
 	int ret;
 	FCHECK(f->flags & FIBRE_FLAGS_COMPLETED);
-	fibre_arch_destroy(f->arch);
-	f->flags = 0;
-	ret = fibre_arch_create(&f->arch, fibre_bootstrap);
-	if (ret)
+	/* In case any have been set since it completed */
+	fibre_keys_clear(f);
+	if (f->flags & FIBRE_FLAGS_SHARED) {
+		/* The arch context is reset when it next gets the stack */
+		f->flags = FIBRE_FLAGS_SHARED;
+		f->shared.len = 0;
+		f->stack_peak = 0;
+		f->fn = fn;
+		f->fn_arg = d;
+		return 0;
+	}
+	if (f->attr.flags & FIBRE_ATTR_INLINE) {
+		if (f->stack->flags & FIBRE_STACK_PAINTED)
+			fibre_stack_account(f);
+		fibre_stack_prepare(f->stack, fibre_stack_top(f));
+		f->flags = 0;
+	} else {
+		FCHECK(!f->stack);
+		f->flags = 0;
+		/* The pool is LIFO, so this is normally the stack we just
+		 * released */
+		ret = fibre_get_stack(f);
+		if (ret)
+			return ret;
+	}
+	f->stack_peak = 0;
+	ret = fibre_arch_reset(f->arch, f->stack->sp_lo, fibre_stack_usable(f),
+			       fibre_bootstrap);
+	if (ret) {
+		if (!(f->attr.flags & FIBRE_ATTR_INLINE)) {
+			fibre_stack_put(f->stack);
+			f->stack = NULL;
+		}
 		return ret;
+	}
 	f->fn = fn;
 	f->fn_arg = d;
 	return 0;
@@ -94,10 +338,33 @@ int fibre_recreate(struct fibre *f, void (*fn)(void *), void *d)
 
 void fibre_destroy(struct fibre *f)
 {
-	FCHECK(!f->flags || (f->flags & FIBRE_FLAGS_COMPLETED));
-	if (f->flags & FIBRE_FLAGS_COMPLETED)
-		fibre_arch_destroy(f->arch);
-	free(f);
+	struct fibre_stack *st = f->stack;
+	FCHECK(!(f->flags & FIBRE_FLAGS_STARTED) ||
+	       (f->flags & FIBRE_FLAGS_COMPLETED));
+	FCHECK(!(f->flags & FIBRE_FLAGS_READY));
+	FCHECK(!f->timer.link.next);
+	FCHECK(!f->poll.set);
+	FCHECK(!f->wake_pending);
+	FCHECK(!f->wait.kind);
+	fibre_keys_clear(f);
+	if (f->flags & FIBRE_FLAGS_SHARED) {
+		if (f->shared.arch)
+			fibre_arch_destroy(f->arch);
+		fibre_shared_release(f);
+		free(f->arch);
+		return;
+	}
+	if (st && (st->flags & FIBRE_STACK_PAINTED))
+		fibre_stack_account(f);
+	fibre_arch_destroy(f->arch);
+	if (f->attr.flags & FIBRE_ATTR_INLINE) {
+		/* 'f' goes with it */
+		fibre_stack_put(st);
+		return;
+	}
+	free(f->arch);
+	if (st)
+		fibre_stack_put(st);
 }
 
 void fibre_set_userdata(struct fibre *f, void *d)
@@ -117,6 +384,27 @@ struct fibre *fibre_get_current(void)
 	return s->vtable->get_current(s->vtable_data);
 }
 
+size_t fibre_stack_usage(struct fibre *f)
+{
+	if (f->stack && (f->stack->flags & FIBRE_STACK_PAINTED) &&
+			(f->flags & FIBRE_FLAGS_STARTED))
+		return fibre_stack_peak(f->stack, fibre_stack_top(f));
+	return f->stack_peak;
+}
+
+int fibre_set_priority(struct fibre *f, unsigned int prio)
+{
+	if (prio >= FIBRE_PRIO_LEVELS)
+		return -EINVAL;
+	f->prio = prio;
+	return 0;
+}
+
+unsigned int fibre_get_priority(struct fibre *f)
+{
+	return f->prio;
+}
+
 int fibre_started(struct fibre *f)
 {
 	return (f->flags & FIBRE_FLAGS_STARTED);
@@ -127,10 +415,24 @@ int fibre_completed(struct fibre *f)
 	return (f->flags & FIBRE_FLAGS_COMPLETED);
 }
 
+/* Called whenever the top-most selector changes */
+static inline void fibre_inline_update(void)
+{
+	struct fibre_selector *s = tls_fibre.sstack;
+	fibre_inline_tls.origin = (s && s->vtable == &fibre_origin_vtable) ?
+				  s->vtable_data : NULL;
+}
+
 int fibre_push(struct fibre_selector *s)
 {
+	struct fibre *f;
 	int ret;
 	FCHECK(tls_fibre.inited);
+	/* Its origin would be on the shared stack, which
+	 * fibre_shared_switch() doesn't support */
+	f = tls_fibre.sstack ? fibre_get_current() : NULL;
+	if (f && (f->flags & FIBRE_FLAGS_SHARED))
+		return -EINVAL;
 	s->parent = tls_fibre.sstack;
 	tls_fibre.sstack = s;
 	ret = s->vtable->post_push(s->vtable_data);
@@ -138,6 +440,7 @@ int fibre_push(struct fibre_selector *s)
 		tls_fibre.sstack = s->parent;
 		s->parent = NULL;
 	}
+	fibre_inline_update();
 	return ret;
 }
 
@@ -151,6 +454,7 @@ int fibre_pop(struct fibre_selector **foo)
 		return ret;
 	tls_fibre.sstack = s->parent;
 	s->parent = NULL;
+	fibre_inline_update();
 	if (foo)
 		*foo = s;
 	return 0;
@@ -182,14 +486,47 @@ void fibre_schedule_to(struct fibre *f)
 	FCHECK(tls_fibre.sstack);
 	FCHECK(fibre_can_switch_explicit());
 	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
-	tls_fibre.sstack->vtable->schedule(tls_fibre.sstack->vtable_data, f);
+	tls_fibre.sstack->vtable->schedule(tls_fibre.sstack->vtable_data, f,
+					   NULL);
+	fibre_reap();
 }
 
 void fibre_schedule(void)
 {
 	FCHECK(tls_fibre.sstack);
 	FCHECK(fibre_can_switch_implicit());
-	tls_fibre.sstack->vtable->schedule(tls_fibre.sstack->vtable_data, NULL);
+	tls_fibre.sstack->vtable->schedule(tls_fibre.sstack->vtable_data, NULL,
+					   NULL);
+	fibre_reap();
+}
+
+void *fibre_transfer(struct fibre *f, void *msg)
+{
+	FCHECK(tls_fibre.sstack);
+	FCHECK(f ? fibre_can_switch_explicit() : fibre_can_switch_implicit());
+	FCHECK(!f || !(f->flags & FIBRE_FLAGS_COMPLETED));
+	msg = tls_fibre.sstack->vtable->schedule(tls_fibre.sstack->vtable_data,
+						 f, msg);
+	fibre_reap();
+	return msg;
+}
+
+int fibre_ready(struct fibre *f)
+{
+	struct fibre_selector *s = tls_fibre.sstack;
+	FCHECK(s);
+	if (!s->vtable->ready)
+		return -EOPNOTSUPP;
+	return s->vtable->ready(s->vtable_data, f, 0);
+}
+
+int fibre_ready_next(struct fibre *f)
+{
+	struct fibre_selector *s = tls_fibre.sstack;
+	FCHECK(s);
+	if (!s->vtable->ready)
+		return -EOPNOTSUPP;
+	return s->vtable->ready(s->vtable_data, f, 1);
 }
 
 struct fibre_selector *fibre_selector_alloc(
@@ -202,21 +539,65 @@ struct fibre_selector *fibre_selector_alloc(
 		f->vtable = v;
 		f->vtable_data = vd;
 		f->async_mask = 0;
+		f->async_transparent = 0;
 	}
 	return f;
 }
 
+void *fibre_selector_data(struct fibre_selector *s,
+			  const struct fibre_selector_vtable *v)
+{
+	return (s->vtable == v) ? s->vtable_data : NULL;
+}
+
 void fibre_async_set_mask(uint32_t mask)
 {
 	FCHECK(tls_fibre.sstack);
 	tls_fibre.sstack->async_mask = mask;
 }
 
-int fibre_async_can_suspend(uint32_t method)
+void fibre_async_set_transparent(uint32_t mask)
+{
+	FCHECK(tls_fibre.sstack);
+	tls_fibre.sstack->async_transparent = mask;
+}
+
+/* The selector that handles 'method' for the top-most one, or NULL. That's
+ * the top-most one itself if it has 'method' in its mask, otherwise the first
+ * below it that does, if all those in between are transparent for it. The
+ * fibre that's current in that one (the "proxy") then suspends in place of
+ * whatever's running, whose context is kept in the proxy's 'arch' until the
+ * proxy is resumed (when it was running, 'arch' wasn't in use). So the proxy
+ * can't be an origin. While it's suspended, the stacks of everything in
+ * between are frozen, which is fine as none of them can be on the shared
+ * stack (fibre_push() won't have it). */
+static struct fibre_selector *fibre_async_owner(uint32_t method)
 {
 	struct fibre_selector *s = tls_fibre.sstack;
-	return (!tls_fibre.async_atomic && s && (s->async_mask & method) &&
-				s->vtable->can_switch_implicit(s->vtable_data));
+	if (!s || (s->async_mask & method))
+		return s;
+	while (s->async_transparent & method) {
+		s = s->parent;
+		if (!s)
+			return NULL;
+		if (s->async_mask & method)
+			return s->vtable->get_current(s->vtable_data) ?
+			       s : NULL;
+	}
+	return NULL;
+}
+
+int fibre_async_can_suspend(uint32_t method)
+{
+	struct fibre_selector *s;
+	if (tls_fibre.async_atomic)
+		return 0;
+	s = fibre_async_owner(method);
+	if (!s || !s->vtable->can_switch_implicit(s->vtable_data))
+		return 0;
+	/* There has to be a fibre to suspend (see fibre_async_self()), which
+	 * there isn't for the top-most selector's origin */
+	return fibre_get_current() || s->vtable->get_current(s->vtable_data);
 }
 
 void fibre_async_atomicity_up(void)
@@ -224,52 +605,250 @@ void fibre_async_atomicity_up(void)
 	tls_fibre.async_atomic++;
 }
 
+unsigned int fibre_async_atomicity(void)
+{
+	return tls_fibre.async_atomic;
+}
+
 void fibre_async_atomicity_down(void)
 {
 	FCHECK(tls_fibre.async_atomic);
 	tls_fibre.async_atomic--;
 }
 
-int fibre_async_suspend_poll(void)
+/* The fibre that suspends with 'method', ie. the current one, or if that's
+ * an origin whose selector is transparent for it, the proxy */
+static struct fibre *fibre_async_self(uint32_t method)
+{
+	struct fibre *f = fibre_get_current();
+	struct fibre_selector *s;
+	if (f)
+		return f;
+	s = fibre_async_owner(method);
+	return s->vtable->get_current(s->vtable_data);
+}
+
+static void fibre_async_copy(struct fibre *to, const struct fibre *from)
+{
+	switch (from->async) {
+	case FIBRE_ASYNC_FD_READABLE:
+		to->async_fd_readable = from->async_fd_readable;
+		break;
+	case FIBRE_ASYNC_CHECK_CB:
+		to->async_check_cb = from->async_check_cb;
+		break;
+	case FIBRE_ASYNC_TIMER:
+		to->async_timer = from->async_timer;
+		break;
+	case FIBRE_ASYNC_IO:
+		to->async_io = from->async_io;
+	}
+	to->async_deadline = from->async_deadline;
+	to->async_abort = 0;
+	to->async = from->async;
+}
+
+/* Suspends by way of the proxy's selector (see fibre_async_owner()), which
+ * is made top-most in the meantime */
+static void fibre_async_delegate(struct fibre *f)
+{
+	struct fibre_selector *top = tls_fibre.sstack;
+	struct fibre_selector *s = fibre_async_owner(f->async);
+	struct fibre *p = s->vtable->get_current(s->vtable_data);
+	FCHECK(s && p);
+	if (p != f) {
+		FCHECK(!p->async);
+		fibre_async_copy(p, f);
+		f->async_proxy = p;
+	}
+	tls_fibre.sstack = s;
+	fibre_inline_update();
+	s->vtable->schedule(s->vtable_data, NULL, NULL);
+	fibre_reap();
+	tls_fibre.sstack = top;
+	fibre_inline_update();
+	if (p != f) {
+		f->async_abort = p->async_abort;
+		if (f->async == FIBRE_ASYNC_IO)
+			f->async_io.res = p->async_io.res;
+		f->async_proxy = NULL;
+		p->async = 0;
+	}
+}
+
+/* Suspends the current fibre, which has had its method's details filled in,
+ * and returns zero or the negative errno it was aborted with */
+static int fibre_suspend(struct fibre *f, uint32_t method, uint64_t deadline)
 {
-	struct fibre *f;
-	FCHECK(fibre_async_can_suspend(FIBRE_ASYNC_POLL));
-	f = fibre_get_current();
 	FCHECK(!f->async);
-	f->async = FIBRE_ASYNC_POLL;
+	f->async = method;
+	f->async_deadline = deadline;
 	f->async_abort = 0;
-	fibre_schedule();
+	f->async_proxy = NULL;
+	if (tls_fibre.sstack->async_mask & method)
+		fibre_schedule();
+	else
+		fibre_async_delegate(f);
 	f->async = 0;
-	return f->async_abort ? -EINTR : 0;
+	return f->async_abort;
 }
 
-int fibre_async_suspend_fd_readable(int fd)
+int fibre_async_suspend_poll_timeout(uint64_t deadline)
+{
+	FCHECK(fibre_async_can_suspend(FIBRE_ASYNC_POLL));
+	return fibre_suspend(fibre_async_self(FIBRE_ASYNC_POLL),
+			     FIBRE_ASYNC_POLL, deadline);
+}
+
+int fibre_async_suspend_poll(void)
+{
+	return fibre_async_suspend_poll_timeout(FIBRE_NO_DEADLINE);
+}
+
+int fibre_async_suspend_fd_readable_timeout(int fd, uint64_t deadline)
 {
 	struct fibre *f;
 	FCHECK(fibre_async_can_suspend(FIBRE_ASYNC_FD_READABLE));
-	f = fibre_get_current();
-	FCHECK(!f->async);
-	f->async = FIBRE_ASYNC_FD_READABLE;
+	f = fibre_async_self(FIBRE_ASYNC_FD_READABLE);
 	f->async_fd_readable.fd = fd;
-	f->async_abort = 0;
-	fibre_schedule();
-	f->async = 0;
-	return f->async_abort ? -EINTR : 0;
+	return fibre_suspend(f, FIBRE_ASYNC_FD_READABLE, deadline);
 }
 
-int fibre_async_suspend_use_cb(void *arg, int (*cb)(void *))
+int fibre_async_suspend_fd_readable(int fd)
+{
+	return fibre_async_suspend_fd_readable_timeout(fd, FIBRE_NO_DEADLINE);
+}
+
+int fibre_async_suspend_use_cb_timeout(void *arg, int (*cb)(void *),
+				       uint64_t deadline)
 {
 	struct fibre *f;
 	FCHECK(fibre_async_can_suspend(FIBRE_ASYNC_CHECK_CB));
-	f = fibre_get_current();
-	FCHECK(!f->async);
-	f->async = FIBRE_ASYNC_CHECK_CB;
+	f = fibre_async_self(FIBRE_ASYNC_CHECK_CB);
 	f->async_check_cb.cb_arg = arg;
 	f->async_check_cb.cb = cb;
-	f->async_abort = 0;
-	fibre_schedule();
-	f->async = 0;
-	return f->async_abort ? -EINTR : 0;
+	return fibre_suspend(f, FIBRE_ASYNC_CHECK_CB, deadline);
+}
+
+int fibre_async_suspend_use_cb(void *arg, int (*cb)(void *))
+{
+	return fibre_async_suspend_use_cb_timeout(arg, cb, FIBRE_NO_DEADLINE);
+}
+
+int fibre_async_suspend_wake_timeout(uint64_t deadline)
+{
+	FCHECK(fibre_async_can_suspend(FIBRE_ASYNC_WAKE));
+	return fibre_suspend(fibre_async_self(FIBRE_ASYNC_WAKE),
+			     FIBRE_ASYNC_WAKE, deadline);
+}
+
+int fibre_async_suspend_wake(void)
+{
+	return fibre_async_suspend_wake_timeout(FIBRE_NO_DEADLINE);
+}
+
+uint64_t fibre_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int fibre_sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+	struct fibre *f;
+	if (!fibre_async_can_suspend(FIBRE_ASYNC_TIMER)) {
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		return 0;
+	}
+	f = fibre_async_self(FIBRE_ASYNC_TIMER);
+	f->async_timer.deadline = deadline;
+	return fibre_suspend(f, FIBRE_ASYNC_TIMER, FIBRE_NO_DEADLINE);
+}
+
+int fibre_sleep_for(uint64_t ns)
+{
+	return fibre_sleep_until(fibre_time_ns() + ns);
+}
+
+/* Without FIBRE_ASYNC_IO, the system call */
+static long fibre_io_sys(const struct fibre_io *io)
+{
+	long ret;
+	switch (io->op) {
+	case FIBRE_IO_READ:
+		ret = read(io->fd, io->buf, io->len);
+		break;
+	case FIBRE_IO_WRITE:
+		ret = write(io->fd, io->buf, io->len);
+		break;
+	case FIBRE_IO_ACCEPT:
+		ret = accept4(io->fd, io->buf, io->addrlen, io->flags);
+		break;
+	default:
+		ret = connect(io->fd, io->buf, io->len);
+	}
+	return (ret < 0) ? -errno : ret;
+}
+
+static long fibre_io(const struct fibre_io *io)
+{
+	int retry = (io->op == FIBRE_IO_READ || io->op == FIBRE_IO_ACCEPT);
+	struct fibre *f;
+	long ret;
+	int err;
+	while (1) {
+		if (fibre_async_can_suspend(FIBRE_ASYNC_IO)) {
+			f = fibre_async_self(FIBRE_ASYNC_IO);
+			f->async_io = *io;
+			err = fibre_suspend(f, FIBRE_ASYNC_IO,
+					    FIBRE_NO_DEADLINE);
+			ret = f->async_io.res;
+			if (err && ret == -ECANCELED)
+				return err;
+		} else
+			ret = fibre_io_sys(io);
+		if (ret != -EAGAIN || !retry ||
+		    !fibre_async_can_suspend(FIBRE_ASYNC_FD_READABLE))
+			return ret;
+		err = fibre_async_suspend_fd_readable(io->fd);
+		if (err)
+			return err;
+	}
+}
+
+ssize_t fibre_io_read(int fd, void *buf, size_t len)
+{
+	struct fibre_io io = { .op = FIBRE_IO_READ, .fd = fd, .buf = buf,
+			       .len = len };
+	return fibre_io(&io);
+}
+
+ssize_t fibre_io_write(int fd, const void *buf, size_t len)
+{
+	struct fibre_io io = { .op = FIBRE_IO_WRITE, .fd = fd,
+			       .buf = (void *)buf, .len = len };
+	return fibre_io(&io);
+}
+
+int fibre_io_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+		    int flags)
+{
+	struct fibre_io io = { .op = FIBRE_IO_ACCEPT, .fd = fd, .buf = addr,
+			       .addrlen = addrlen, .flags = flags };
+	return fibre_io(&io);
+}
+
+int fibre_io_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct fibre_io io = { .op = FIBRE_IO_CONNECT, .fd = fd,
+			       .buf = (void *)addr, .len = addrlen };
+	return fibre_io(&io);
 }
 
 uint32_t fibre_async_type(struct fibre *f)
@@ -290,8 +869,38 @@ void fibre_async_get_use_cb(struct fibre *f, void **arg, int (**cb)(void *))
 	*cb = f->async_check_cb.cb;
 }
 
+void fibre_async_get_timer(struct fibre *f, uint64_t *deadline)
+{
+	FCHECK(f->async == FIBRE_ASYNC_TIMER);
+	*deadline = f->async_timer.deadline;
+}
+
+void fibre_async_get_io(struct fibre *f, struct fibre_io **io)
+{
+	FCHECK(f->async == FIBRE_ASYNC_IO);
+	*io = &f->async_io;
+}
+
+uint64_t fibre_async_get_deadline(struct fibre *f)
+{
+	FCHECK(f->async);
+	return f->async_deadline;
+}
+
 void fibre_async_abort(struct fibre *f)
 {
 	FCHECK(f->async);
-	f->async_abort = 1;
+	if (f->async_proxy)
+		f = f->async_proxy;
+	if (!f->async_abort)
+		f->async_abort = -EINTR;
+}
+
+void fibre_async_timeout(struct fibre *f)
+{
+	FCHECK(f->async);
+	if (f->async_proxy)
+		f = f->async_proxy;
+	if (!f->async_abort)
+		f->async_abort = -ETIMEDOUT;
 }
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "private.h"
+
+/* The key registry, shared by every thread. A key is claimed by bumping
+ * 'num' with a compare-and-swap, so it never goes past FIBRE_KEYS_MAX, and
+ * its destructor is filled in after that, which is fine as nothing can have
+ * a value for the key until fibre_key_create() has returned it. */
+
+static struct {
+	unsigned int num;
+	void (*destructor[FIBRE_KEYS_MAX])(void *);
+} keys;
+
+int fibre_key_create(unsigned int *key, void (*destructor)(void *))
+{
+	unsigned int k = __atomic_load_n(&keys.num, __ATOMIC_RELAXED);
+	do {
+		if (k == FIBRE_KEYS_MAX)
+			return -EAGAIN;
+	} while (!__atomic_compare_exchange_n(&keys.num, &k, k + 1, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	__atomic_store_n(&keys.destructor[k], destructor, __ATOMIC_RELEASE);
+	*key = k;
+	return 0;
+}
+
+/* Where 'key's value is, NULL if it's in a spill table the fibre doesn't have
+ * (yet), in which case the value is NULL */
+static inline void **key_slot(struct fibre *f, unsigned int key)
+{
+	if (key < FIBRE_KEYS_INLINE)
+		return &f->keys[key];
+	key -= FIBRE_KEYS_INLINE;
+	return key < f->keys_spill_num ? &f->keys_spill[key] : NULL;
+}
+
+void *fibre_key_get(struct fibre *f, unsigned int key)
+{
+	void **slot;
+	FCHECK(key < __atomic_load_n(&keys.num, __ATOMIC_RELAXED));
+	slot = key_slot(f, key);
+	return slot ? *slot : NULL;
+}
+
+int fibre_key_set(struct fibre *f, unsigned int key, void *val)
+{
+	unsigned int num;
+	void **slot, **spill;
+	FCHECK(key < __atomic_load_n(&keys.num, __ATOMIC_RELAXED));
+	slot = key_slot(f, key);
+	if (slot) {
+		*slot = val;
+		return 0;
+	}
+	if (!val)
+		return 0;
+	/* Room for every key there is so far, not just this one */
+	num = __atomic_load_n(&keys.num, __ATOMIC_RELAXED) - FIBRE_KEYS_INLINE;
+	spill = realloc(f->keys_spill, num * sizeof(*spill));
+	if (!spill)
+		return -ENOMEM;
+	memset(spill + f->keys_spill_num, 0,
+	       (num - f->keys_spill_num) * sizeof(*spill));
+	f->keys_spill = spill;
+	f->keys_spill_num = num;
+	spill[key - FIBRE_KEYS_INLINE] = val;
+	return 0;
+}
+
+void fibre_keys_clear(struct fibre *f)
+{
+	unsigned int num = __atomic_load_n(&keys.num, __ATOMIC_RELAXED);
+	unsigned int round, key;
+	void (*destructor)(void *);
+	void **slot, *val;
+	int again = 1;
+	for (round = 0; again && round < FIBRE_KEYS_ROUNDS; round++) {
+		again = 0;
+		for (key = 0; key < num; key++) {
+			slot = key_slot(f, key);
+			if (!slot || !*slot)
+				continue;
+			val = *slot;
+			*slot = NULL;
+			destructor = __atomic_load_n(&keys.destructor[key],
+						     __ATOMIC_ACQUIRE);
+			if (destructor) {
+				destructor(val);
+				again = 1;
+			}
+		}
+	}
+	/* Whatever the destructors have left is dropped */
+	memset(f->keys, 0, sizeof(f->keys));
+	free(f->keys_spill);
+	f->keys_spill = NULL;
+	f->keys_spill_num = 0;
+}
@@ -0,0 +1,267 @@
+#include <string.h>
+#include "private.h"
+
+/* The poll set. Fibres are grouped by callback, and each group keeps its
+ * fibres' args in one array (with the fibres, and the sequence numbers they
+ * were added with, in parallel arrays), so that checking a group is one call
+ * of its batch form or a tight loop of direct-ish calls to the same function
+ * over consecutive memory. A fibre is removed from a group by moving the
+ * group's last entry into its place, so the arrays aren't in order; instead,
+ * the fibres found ready by one check are sorted by sequence number as they
+ * go on the ready list. A fibre that's removed while on the ready list just
+ * leaves a hole there.
+ *
+ * There are usually only a few distinct callbacks, so the groups are found
+ * by a linear search (starting with the last one found).
+ */
+
+struct group {
+	int (*cb)(void *);
+	unsigned int (*batch)(void *const *args, unsigned int num,
+			      unsigned char *ready);
+	unsigned int num;
+	unsigned int cap;
+	void **args;
+	struct fibre **fibres;
+	uint64_t *seqs;
+	unsigned char *ready;
+};
+
+struct entry {
+	uint64_t seq;
+	struct fibre *f;
+};
+
+struct fibre_pollset {
+	struct group **groups;
+	unsigned int num_groups;
+	unsigned int last;
+	unsigned int count;
+	uint64_t seq;
+	/* The ready list, taken from at 'head' */
+	struct entry *ready;
+	unsigned int ready_head;
+	unsigned int ready_num;
+	unsigned int ready_cap;
+};
+
+int fibre_pollset_create(struct fibre_pollset **foo)
+{
+	struct fibre_pollset *ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return -ENOMEM;
+	*foo = ps;
+	return 0;
+}
+
+void fibre_pollset_destroy(struct fibre_pollset *ps)
+{
+	unsigned int loop;
+	FCHECK(!ps->count);
+	for (loop = 0; loop < ps->num_groups; loop++) {
+		struct group *g = ps->groups[loop];
+		free(g->args);
+		free(g->fibres);
+		free(g->seqs);
+		free(g->ready);
+		free(g);
+	}
+	free(ps->groups);
+	free(ps->ready);
+	free(ps);
+}
+
+static struct group *ps_group(struct fibre_pollset *ps, int (*cb)(void *))
+{
+	struct group **groups, *g;
+	unsigned int loop;
+	if (ps->num_groups && ps->groups[ps->last]->cb == cb)
+		return ps->groups[ps->last];
+	for (loop = 0; loop < ps->num_groups; loop++)
+		if (ps->groups[loop]->cb == cb) {
+			ps->last = loop;
+			return ps->groups[loop];
+		}
+	groups = realloc(ps->groups, (loop + 1) * sizeof(*groups));
+	if (!groups)
+		return NULL;
+	ps->groups = groups;
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return NULL;
+	g->cb = cb;
+	groups[loop] = g;
+	ps->num_groups++;
+	ps->last = loop;
+	return g;
+}
+
+static int group_grow(struct group *g)
+{
+	unsigned int cap = g->cap ? g->cap * 2 : 64;
+	void **args = realloc(g->args, cap * sizeof(*args));
+	struct fibre **fibres;
+	uint64_t *seqs;
+	unsigned char *ready;
+	if (!args)
+		return -ENOMEM;
+	g->args = args;
+	fibres = realloc(g->fibres, cap * sizeof(*fibres));
+	if (!fibres)
+		return -ENOMEM;
+	g->fibres = fibres;
+	seqs = realloc(g->seqs, cap * sizeof(*seqs));
+	if (!seqs)
+		return -ENOMEM;
+	g->seqs = seqs;
+	ready = realloc(g->ready, cap);
+	if (!ready)
+		return -ENOMEM;
+	g->ready = ready;
+	g->cap = cap;
+	return 0;
+}
+
+int fibre_pollset_batch(struct fibre_pollset *ps, int (*cb)(void *),
+			unsigned int (*batch)(void *const *args,
+					      unsigned int num,
+					      unsigned char *ready))
+{
+	struct group *g = ps_group(ps, cb);
+	if (!g)
+		return -ENOMEM;
+	g->batch = batch;
+	return 0;
+}
+
+int fibre_pollset_add(struct fibre_pollset *ps, struct fibre *f)
+{
+	struct group *g;
+	FCHECK(f->async == FIBRE_ASYNC_CHECK_CB);
+	FCHECK(!f->poll.set);
+	g = ps_group(ps, f->async_check_cb.cb);
+	if (!g || (g->num == g->cap && group_grow(g)))
+		return -ENOMEM;
+	g->args[g->num] = f->async_check_cb.cb_arg;
+	g->fibres[g->num] = f;
+	g->seqs[g->num] = ps->seq++;
+	f->poll.set = ps;
+	f->poll.group = g;
+	f->poll.idx = g->num++;
+	ps->count++;
+	return 0;
+}
+
+/* Moves the group's last entry into 'idx' */
+static inline void group_del(struct group *g, unsigned int idx)
+{
+	unsigned int last = --g->num;
+	if (idx == last)
+		return;
+	g->args[idx] = g->args[last];
+	g->fibres[idx] = g->fibres[last];
+	g->seqs[idx] = g->seqs[last];
+	g->fibres[idx]->poll.idx = idx;
+}
+
+void fibre_pollset_remove(struct fibre_pollset *ps, struct fibre *f)
+{
+	FCHECK(f->poll.set == ps);
+	if (f->poll.group)
+		group_del(f->poll.group, f->poll.idx);
+	else
+		ps->ready[f->poll.idx].f = NULL;
+	f->poll.set = NULL;
+	ps->count--;
+}
+
+unsigned int fibre_pollset_count(struct fibre_pollset *ps)
+{
+	return ps->count;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+/* Moves a group's ready entries (by 'ready') to the ready list. Going
+ * backwards, whatever group_del() moves in has already been looked at. */
+static int ps_collect(struct fibre_pollset *ps, struct group *g,
+		      unsigned int num)
+{
+	unsigned int idx = g->num;
+	if (ps->ready_num + num > ps->ready_cap) {
+		unsigned int cap = ps->ready_cap ? ps->ready_cap : 64;
+		struct entry *ready;
+		while (cap < ps->ready_num + num)
+			cap *= 2;
+		ready = realloc(ps->ready, cap * sizeof(*ready));
+		if (!ready)
+			return -ENOMEM;
+		ps->ready = ready;
+		ps->ready_cap = cap;
+	}
+	while (num && idx--) {
+		struct entry *e;
+		if (!g->ready[idx])
+			continue;
+		e = &ps->ready[ps->ready_num++];
+		e->seq = g->seqs[idx];
+		e->f = g->fibres[idx];
+		e->f->poll.group = NULL;
+		group_del(g, idx);
+		num--;
+	}
+	return 0;
+}
+
+/* Only called with the ready list empty */
+static void ps_check(struct fibre_pollset *ps)
+{
+	unsigned int loop, idx, num;
+	for (loop = 0; loop < ps->num_groups; loop++) {
+		struct group *g = ps->groups[loop];
+		if (!g->num)
+			continue;
+		if (g->batch)
+			num = g->batch((void *const *)g->args, g->num,
+				       g->ready);
+		else {
+			int (*cb)(void *) = g->cb;
+			for (idx = 0, num = 0; idx < g->num; idx++) {
+				g->ready[idx] = !!cb(g->args[idx]);
+				num += g->ready[idx];
+			}
+		}
+		/* If there's no room on the ready list, they stay put, and
+		 * get checked again (which they shouldn't be, but that beats
+		 * losing them) */
+		if (num)
+			ps_collect(ps, g, num);
+	}
+	if (ps->ready_num > 1)
+		qsort(ps->ready, ps->ready_num, sizeof(*ps->ready), entry_cmp);
+	for (loop = 0; loop < ps->ready_num; loop++)
+		ps->ready[loop].f->poll.idx = loop;
+}
+
+unsigned int fibre_pollset_check(struct fibre_pollset *ps,
+				 struct fibre **fibres, unsigned int max)
+{
+	unsigned int num = 0;
+	if (ps->ready_head == ps->ready_num) {
+		ps->ready_head = ps->ready_num = 0;
+		ps_check(ps);
+	}
+	while (num < max && ps->ready_head < ps->ready_num) {
+		struct fibre *f = ps->ready[ps->ready_head++].f;
+		if (!f)
+			continue;
+		f->poll.set = NULL;
+		fibres[num++] = f;
+	}
+	ps->count -= num;
+	return num;
+}
@@ -4,6 +4,7 @@
 #define HEADER_SRC_PRIVATE_H
 
 #include <fibre.h>
+#include <fibre_inline.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,29 +19,213 @@
 #define FUNUSED __attribute__((unused))
 #endif
 
+#ifndef FIBRE_STACK_SIZE
+#define FIBRE_STACK_SIZE (64*1024)
+#endif
+
+/* Fibre stacks come from a per-thread pool (stack.c). The descriptor sits at
+ * the top of the stack's own mapping, and the usable stack is the 'size' bytes
+ * immediately below it, starting at 'sp_lo'.
+ *  next: pool free-list linkage (only meaningful while in a pool).
+ *  pool: the pool of the thread that mapped the stack.
+ *  map: the stack's own mapping, or for a FIBRE_STACK_HUGE stack, the arena
+ *       it was carved from.
+ *  cls: the pool's size-class.
+ *  dirty_lo: for a FIBRE_STACK_PAINTED stack, everything from sp_lo up to
+ *            here is known to still be zero.
+ *  flags: FIBRE_STACK_* bitmask.
+ */
+struct fibre_stack {
+	struct fibre_stack *next;
+	struct fibre_stack_pool *pool;
+	void *map;
+	size_t map_size;
+	void *sp_lo;
+	size_t size;
+	unsigned int flags;
+	unsigned int cls;
+	void *dirty_lo;
+};
+#define FIBRE_STACK_GUARD    0x1
+#define FIBRE_STACK_UNPOOLED 0x2
+#define FIBRE_STACK_FOREIGN  0x4
+#define FIBRE_STACK_PAINTED  0x8
+#define FIBRE_STACK_HUGE     0x10
+
+#ifndef FIBRE_STACK_GUARD_PAGES
+#define FIBRE_STACK_GUARD_PAGES 1
+#endif
+
+int fibre_stack_init(void);
+void fibre_stack_finish(void);
+/* 'attr' may be NULL, for the defaults */
+struct fibre_stack *fibre_stack_get(const struct fibre_attr *attr);
+/* Can be called from any thread, not just the one that got the stack */
+void fibre_stack_put(struct fibre_stack *);
+/* Stack painting, for stack usage measurement. The paint is zero, which is
+ * what fresh mappings already hold, so painting only ever has to clean up
+ * what was used since the last time. fibre_stack_peak() returns how much of
+ * the stack below 'top' has been touched since it was painted. */
+void fibre_stack_paint(struct fibre_stack *, void *top);
+size_t fibre_stack_peak(struct fibre_stack *, void *top);
+
+/* Stack usage statistics (stack_stats.c) */
+extern __thread unsigned int fibre_stack_stats_on;
+void fibre_stack_stats_finish(void);
+void fibre_stack_stats_record(void (*fn)(void *), size_t peak);
+/* Returns zero if there's no suggestion (yet) */
+size_t fibre_stack_stats_suggest(void (*fn)(void *));
+
+/* Shared-stack execution (shared.c), for FIBRE_ATTR_SHARED fibres.
+ * fibre_shared_init() sets up the thread's shared stack if it hasn't been
+ * already, fibre_shared_done() is called by a shared fibre as it completes. */
+int fibre_shared_init(void);
+void fibre_shared_finish(void);
+void fibre_shared_done(struct fibre *);
+void fibre_shared_release(struct fibre *);
+
+/* Where every fibre's arch context starts executing */
+void fibre_bootstrap(void);
+
 /* The arch-<whatever> implementations will define this; */
 struct fibre_arch;
 
-/* That platform-specific support will also provide the following hooks; */
+/* That platform-specific support will also provide the following hooks.
+ *
+ * Fibre contexts are constructed in place, in memory of fibre_arch_sizeof()
+ * bytes (aligned to at least 16) provided by the caller, who also owns the
+ * stack memory the arch code builds its initial frame on. fibre_arch_destroy()
+ * releases whatever the context holds internally, but not the memory itself.
+ * fibre_arch_reset() re-initialises an existing (and no longer running)
+ * context, and must not allocate or make syscalls in the common case of the
+ * stack being the one it was last created/reset on.
+ *
+ * Origin contexts (for the selectors) are allocated by fibre_arch_origin() and
+ * released by fibre_arch_origin_free().
+ *
+ * fibre_arch_switch() hands 'msg' to the context being switched to, which gets
+ * it as the return value of the fibre_arch_switch() that it's resuming from (a
+ * context that's starting afresh doesn't get it). It returns whatever is
+ * handed over by the switch that later resumes 'src'. */
+#ifdef FIBRE_ARCH_PREFIX
+/* This arch implementation is being built into a FIBRE_ARCH=multi library
+ * (see arch-multi.c), so its hooks get prefixed names, eg.
+ * fibre_arch_x86_init(), and it provides a struct fibre_arch_ops of them. */
+#define FIBRE_ARCH_CAT2(prefix, hook) fibre_arch_##prefix##_##hook
+#define FIBRE_ARCH_CAT(prefix, hook) FIBRE_ARCH_CAT2(prefix, hook)
+#define fibre_arch_init FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, init)
+#define fibre_arch_finish FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, finish)
+#define fibre_arch_sizeof FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, sizeof)
+#define fibre_arch_origin FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, origin)
+#define fibre_arch_origin_free FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, origin_free)
+#define fibre_arch_create FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, create)
+#define fibre_arch_reset FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, reset)
+#define fibre_arch_destroy FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, destroy)
+#define fibre_arch_switch FIBRE_ARCH_CAT(FIBRE_ARCH_PREFIX, switch)
+#define FIBRE_ARCH_OPS(prefix) \
+	const struct fibre_arch_ops FIBRE_ARCH_CAT(prefix, ops) = { \
+		.name = #prefix, \
+		.init = fibre_arch_init, \
+		.finish = fibre_arch_finish, \
+		.size = fibre_arch_sizeof, \
+		.origin = fibre_arch_origin, \
+		.origin_free = fibre_arch_origin_free, \
+		.create = fibre_arch_create, \
+		.reset = fibre_arch_reset, \
+		.destroy = fibre_arch_destroy, \
+		.swtch = fibre_arch_switch \
+	}
+#endif
+
 int fibre_arch_init(void);
 void fibre_arch_finish(void);
+size_t fibre_arch_sizeof(void);
 int fibre_arch_origin(struct fibre_arch **);
-int fibre_arch_create(struct fibre_arch **, void (*fn)(void));
+void fibre_arch_origin_free(struct fibre_arch *);
+int fibre_arch_create(struct fibre_arch *, void *stack, size_t stack_size,
+		      void (*fn)(void));
+int fibre_arch_reset(struct fibre_arch *, void *stack, size_t stack_size,
+		     void (*fn)(void));
 void fibre_arch_destroy(struct fibre_arch *);
-void fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src);
+void *fibre_arch_switch(struct fibre_arch *dest, struct fibre_arch *src,
+			void *msg);
+
+struct fibre_arch_ops {
+	const char *name;
+	int (*init)(void);
+	void (*finish)(void);
+	size_t (*size)(void);
+	int (*origin)(struct fibre_arch **);
+	void (*origin_free)(struct fibre_arch *);
+	int (*create)(struct fibre_arch *, void *stack, size_t stack_size,
+		      void (*fn)(void));
+	int (*reset)(struct fibre_arch *, void *stack, size_t stack_size,
+		     void (*fn)(void));
+	void (*destroy)(struct fibre_arch *);
+	void *(*swtch)(struct fibre_arch *dest, struct fibre_arch *src,
+		       void *msg);
+};
+
+/* Timer wheel list linkage (timer.c) */
+struct fibre_tlink {
+	struct fibre_tlink *next;
+	struct fibre_tlink *prev;
+};
 
-/* The fibre structure;
- *  arch: the platform-specific meat.
+/* Each fibre is one 64-byte aligned block, with the arch context first and
+ * struct fibre immediately after it, so that the context and the fields at
+ * the start of struct fibre share cache lines. That block is allocated
+ * separately, or with FIBRE_ATTR_INLINE it's carved from the top of the
+ * fibre's own stack (just below the stack descriptor), making the fibre a
+ * single allocation.
+ *
+ * The fibre structure;
+ *  arch: the platform-specific meat (ie. the start of the block).
  *  flags: FIBRE_FLAGS_* bitmask.
+ *  keys: the values for the first FIBRE_KEYS_INLINE keys, and 'keys_spill'
+ *        (NULL until needed) for the 'keys_spill_num' after them (keys.c).
+ *  async*: suspension state, checked on every suspend/resume. 'async_abort'
+ *          is zero, or the negative errno the suspension was aborted with,
+ *          'async_deadline' is for the _timeout suspends, and
+ *          'async_proxy' is the fibre suspended in its place, if any (see
+ *          fibre_async_owner()).
+ *  rq_next: run-queue linkage, for selectors that queue fibres (while
+ *           FIBRE_FLAGS_READY).
+ *  prio: see fibre_set_priority().
+ *  oncpu: for the M:N runtime (sel_mn.c), set while the fibre is running
+ *         on a worker, until it has been switched away from.
+ *  timer: linkage for a struct fibre_timers (timer.c), 'link.next' is NULL
+ *         while it isn't in one.
+ *  poll: where the fibre is in a struct fibre_pollset (pollset.c), 'set' is
+ *        NULL while it isn't in one.
+ *  stack: NULL once the fibre has completed and its stack has been returned
+ *         to the pool (never the case for FIBRE_ATTR_INLINE).
+ *  attr: creation attributes, retained so that fibre_recreate() can get an
+ *        equivalent stack.
+ *  stack_peak: peak stack usage, if measured (see fibre_stack_stats_mode()).
+ *              For FIBRE_ATTR_SHARED fibres, the largest stack image saved.
+ *  shared: for FIBRE_ATTR_SHARED fibres (whose 'stack' is always NULL), the
+ *          saved image of the live part of the stack, while some other fibre
+ *          has the shared stack. 'arch' is zero until the arch context has
+ *          been created, which happens when the fibre first gets the stack.
+ * Fields from 'stack' onwards are cold, ie. not touched by switching (except
+ * 'shared', by switches in and out of shared fibres).
  */
 struct fibre {
 	struct fibre_arch *arch;
 	unsigned int flags;
+	void *keys[FIBRE_KEYS_INLINE];
+	uint32_t async; /* Zero if not suspended, otherwise FIBRE_ASYNC_* */
+	int async_abort;
+	struct fibre *rq_next;
+	unsigned int prio;
+	int oncpu;
+	/* Where fibre_wake_remote() pushes it, set by the epoll selector */
+	struct fibre_wakeq *wakeq;
+	struct fibre_stack *stack;
 	void (*fn)(void *);
 	void *fn_arg;
 	void *userdata;
-	uint32_t async; /* Zero if not suspended, otherwise FIBRE_ASYNC_* */
-	int async_abort;
 	union {
 		struct fibre_async_fd_readable {
 			int fd;
@@ -49,10 +234,78 @@ struct fibre {
 			void *cb_arg;
 			int (*cb)(void *);
 		} async_check_cb;
+		struct fibre_async_timer {
+			uint64_t deadline;
+		} async_timer;
+		struct fibre_io async_io;
 	};
+	uint64_t async_deadline;
+	struct fibre *async_proxy;
+	struct {
+		struct fibre_tlink link;
+		uint64_t expires;
+		unsigned int slot;
+	} timer;
+	struct {
+		struct fibre_pollset *set;
+		void *group;
+		unsigned int idx;
+	} poll;
+	struct fibre *wake_next;
+	int wake_pending;
+	/* While waiting on a struct fibre_mutex etc. (sync.c) */
+	struct {
+		struct fibre *next;
+		unsigned int kind;
+		struct fibre_mutex *mutex;
+		/* For channels, the ops and which of them was done */
+		struct fibre_chan_op *ops;
+		unsigned int num;
+		unsigned int done;
+	} wait;
+	void **keys_spill;
+	unsigned int keys_spill_num;
+	struct fibre_attr attr;
+	size_t stack_peak;
+	struct {
+		void *buf;
+		size_t len;
+		size_t cap;
+		int arch;
+	} shared;
 };
 #define FIBRE_FLAGS_STARTED   0x1
 #define FIBRE_FLAGS_COMPLETED 0x2
+#define FIBRE_FLAGS_SHARED    0x4 /* FIBRE_ATTR_SHARED */
+#define FIBRE_FLAGS_READY     0x8 /* Queued by fibre_ready() */
+
+/* fibre_inline.h relies on these */
+_Static_assert(offsetof(struct fibre, arch) ==
+	       offsetof(struct fibre_inline_fibre, arch), "fibre_inline.h");
+_Static_assert(offsetof(struct fibre, flags) ==
+	       offsetof(struct fibre_inline_fibre, flags), "fibre_inline.h");
+_Static_assert(offsetof(struct fibre, keys) ==
+	       offsetof(struct fibre_inline_fibre, keys), "fibre_inline.h");
+_Static_assert(FIBRE_INLINE_FLAGS_SLOW ==
+	       (FIBRE_FLAGS_COMPLETED | FIBRE_FLAGS_SHARED), "fibre_inline.h");
+
+/* Selectors switch with this rather than calling fibre_arch_switch()
+ * directly, so that shared-stack fibres get their stacks swapped in. 'dest'
+ * and 'src' are the fibres being switched to and from, NULL meaning the
+ * selector's 'origin' context. 'msg' and the return value are as for
+ * fibre_arch_switch(). */
+void *fibre_shared_switch(struct fibre *dest, struct fibre *src,
+			  struct fibre_arch *origin, void *msg);
+
+static inline void *fibre_switch(struct fibre *dest, struct fibre *src,
+				 struct fibre_arch *origin, void *msg)
+{
+	if ((dest && (dest->flags & FIBRE_FLAGS_SHARED)) ||
+			(src && (src->flags & FIBRE_FLAGS_SHARED)))
+		return fibre_shared_switch(dest, src, origin, msg);
+	return fibre_arch_switch(dest ? dest->arch : origin,
+				 src ? src->arch : origin, msg);
+}
 
 struct fibre_selector_vtable {
 	void (*destroy)(void *vtable_data);
@@ -66,16 +319,82 @@ struct fibre_selector_vtable {
 	/* Return non-zero for TRUE */
 	int (*can_switch_explicit)(void *vtable_data);
 	int (*can_switch_implicit)(void *vtable_data);
-	/* For implicit scheduling, f==NULL */
-	void (*schedule)(void *vtable_data, struct fibre *f);
+	/* For implicit scheduling, f==NULL. Hands 'msg' to the fibre switched
+	 * to, and returns the message handed back when the caller is resumed
+	 * (see fibre_transfer()). */
+	void *(*schedule)(void *vtable_data, struct fibre *f, void *msg);
 	/* Should return NULL iff the currently-executing fibre is the
 	 * "origin" that pushed this selector on to the stack. */
 	struct fibre *(*get_current)(void *vtable_data);
+	/* For fibre_ready() and fibre_ready_next() ('next' non-zero), NULL if
+	 * the selector has no run queue */
+	int (*ready)(void *vtable_data, struct fibre *f, int next);
+	/* Optional. Called by each fibre as it starts, for a selector that has
+	 * something to do after every switch, which for a fibre starting
+	 * afresh isn't after a return from fibre_switch(). */
+	void (*started)(void *vtable_data);
 };
 
+/* The calling thread's async atomicity count */
+unsigned int fibre_async_atomicity(void);
+
+/* io_uring (uring.c), for the epoll selector. fibre_uring_queue() queues the
+ * FIBRE_ASYNC_IO operation of a fibre that has suspended, and
+ * fibre_uring_cancel() an attempt to cancel it, to be submitted by the next
+ * fibre_uring_submit(), which can also wait for 'wait' completions.
+ * fibre_uring_reap() takes up to 'max' fibres whose operations have completed
+ * (their results being in 'async_io.res'). fibre_uring_inflight() is how many
+ * operations have been queued but not reaped. fibre_uring_forget_file() stops
+ * operations on 'fd' using its registered file, for fibre_epoll_forget(). */
+struct fibre_uring;
+struct iovec;
+int fibre_uring_create(struct fibre_uring **);
+void fibre_uring_destroy(struct fibre_uring *);
+int fibre_uring_fd(struct fibre_uring *);
+unsigned int fibre_uring_inflight(struct fibre_uring *);
+int fibre_uring_queue(struct fibre_uring *, struct fibre *);
+void fibre_uring_cancel(struct fibre_uring *, struct fibre *);
+int fibre_uring_submit(struct fibre_uring *, unsigned int wait);
+unsigned int fibre_uring_reap(struct fibre_uring *, struct fibre **,
+			      unsigned int max);
+int fibre_uring_register_files(struct fibre_uring *, const int *fds,
+			       unsigned int num);
+void fibre_uring_forget_file(struct fibre_uring *, int fd);
+int fibre_uring_register_buffers(struct fibre_uring *, const struct iovec *,
+				 unsigned int num);
+
+/* The remote wake queue (wakeq.c), for the epoll selector, which
+ * fibre_wake_remote() pushes fibres on to from any thread. Its eventfd,
+ * fibre_wakeq_fd(), becomes readable when the queue goes from empty to
+ * non-empty. fibre_wakeq_take() takes everything on it, in the order it was
+ * pushed, linked through 'wake_next', and is only called after
+ * fibre_wakeq_ack() has read the eventfd (if it was readable). The taker
+ * clears each fibre's 'wake_pending' once it's done with its 'wake_next'. */
+struct fibre_wakeq;
+int fibre_wakeq_create(struct fibre_wakeq **);
+void fibre_wakeq_destroy(struct fibre_wakeq *);
+int fibre_wakeq_fd(struct fibre_wakeq *);
+int fibre_wakeq_empty(struct fibre_wakeq *);
+void fibre_wakeq_ack(struct fibre_wakeq *);
+struct fibre *fibre_wakeq_take(struct fibre_wakeq *);
+
+/* Keys (keys.c). fibre_keys_clear() runs the destructors for a fibre's
+ * values (see fibre_key_create()), leaving them all NULL, and frees its
+ * 'keys_spill'. */
+void fibre_keys_clear(struct fibre *);
+
+/* The origin selector's vtable (sel_origin.c), whose vtable_data is laid out
+ * as a struct fibre_inline_origin. fibre.c keeps fibre_inline_tls.origin
+ * pointing at it while such a selector is top-most. */
+extern const struct fibre_selector_vtable fibre_origin_vtable;
+
 /* When a vtable implementation implements its API constructor, it uses this
  * internal API to allocate a new selector struct and latch its vtable and
  * vtable_data to it. */
 struct fibre_selector *fibre_selector_alloc(
 			 	const struct fibre_selector_vtable *,
 				void *);
+/* A selector's vtable_data, if it has the given vtable, otherwise NULL, for
+ * the APIs of particular selector types */
+void *fibre_selector_data(struct fibre_selector *,
+			  const struct fibre_selector_vtable *);
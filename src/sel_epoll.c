@@ -0,0 +1,607 @@
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include "private.h"
+
+/* The epoll selector. A FIFO run queue (linked through the fibres' 'rq_next')
+ * like the run-queue selector's, plus the dispatcher for fibres that suspend
+ * with FIBRE_ASYNC_FD_READABLE, FIBRE_ASYNC_TIMER, FIBRE_ASYNC_CHECK_CB,
+ * FIBRE_ASYNC_IO or FIBRE_ASYNC_WAKE. Such a fibre gets parked as it switches
+ * away, on its fd's list of waiters, in the timer wheel, in the poll set
+ * (pollset.c), in the io_uring (uring.c), or just counted in 'remote', and
+ * queued again when epoll_wait() says the fd is readable, the wheel says it's
+ * time, its callback returns non-zero, its operation completes, or it turns
+ * up on the wake queue (wakeq.c), all the fibres from one check for events in
+ * one go.
+ * A fibre that suspends with a deadline (the _timeout suspends) is in the
+ * wheel as well, and is taken off its fd or out of the poll set and queued
+ * (timed out) if that expires first.
+ * The io_uring's fd is in the epoll set (as -1), so that its completions
+ * wake epoll_wait(), but when the io_uring is all there is to wait for, it
+ * waits in the io_uring_enter() that submits the SQEs instead. The wake
+ * queue's eventfd is in the epoll set too (as -2), and the queue is taken
+ * every time it checks for events, whether or not that says so. Each fibre it
+ * switches to gets pointed at the queue, for fibre_wake_remote().
+ *
+ * Fds are added to the epoll set edge-triggered, and stay there until
+ * fibre_epoll_forget(), so the usual read-until-EAGAIN-then-wait loop makes
+ * one epoll_ctl() per fd, not per wait. Every edge is remembered in 'edge',
+ * whether or not anyone was waiting, as the next waiter won't get another one
+ * for the same data (which a fibre that was woken may not have read all of),
+ * and that waiter checks with poll() before parking.
+ */
+
+#ifndef FIBRE_EPOLL_EVENTS
+#define FIBRE_EPOLL_EVENTS 64
+#endif
+/* How many fibres it dispatches from the queue before checking for events
+ * without waiting (it waits whenever the queue is empty) */
+#ifndef FIBRE_EPOLL_FAIRNESS
+#define FIBRE_EPOLL_FAIRNESS 61
+#endif
+
+struct reg {
+	/* Linked through 'rq_next' */
+	struct fibre *waiters;
+	unsigned char added;
+	unsigned char edge;
+};
+
+struct vd {
+	struct fibre_arch *origin;
+	struct fibre *current;
+	struct fibre *head;
+	struct fibre *tail;
+	unsigned int countdown;
+	int epfd;
+	/* How many fibres are parked on fds, in the wheel, and waiting to be
+	 * woken */
+	unsigned long waiting;
+	unsigned long sleeping;
+	unsigned long remote;
+	struct fibre_timers *timers;
+	struct fibre_pollset *polls;
+	/* NULL if there's no io_uring */
+	struct fibre_uring *ring;
+	struct fibre_wakeq *wakeq;
+	struct reg *regs;
+	unsigned int num_regs;
+	struct epoll_event events[FIBRE_EPOLL_EVENTS];
+};
+
+static inline void q_push(struct vd *vd, struct fibre *f)
+{
+	f->flags |= FIBRE_FLAGS_READY;
+	f->rq_next = NULL;
+	if (vd->tail)
+		vd->tail->rq_next = f;
+	else
+		vd->head = f;
+	vd->tail = f;
+}
+
+static inline void q_push_head(struct vd *vd, struct fibre *f)
+{
+	f->flags |= FIBRE_FLAGS_READY;
+	f->rq_next = vd->head;
+	if (!vd->head)
+		vd->tail = f;
+	vd->head = f;
+}
+
+static inline struct fibre *q_pop(struct vd *vd)
+{
+	struct fibre *f = vd->head;
+	if (f) {
+		vd->head = f->rq_next;
+		if (!vd->head)
+			vd->tail = NULL;
+		f->flags &= ~FIBRE_FLAGS_READY;
+	}
+	return f;
+}
+
+static int ep_grow(struct vd *vd, int fd)
+{
+	unsigned int num = vd->num_regs ? vd->num_regs * 2 : 64;
+	struct reg *regs;
+	if (num <= (unsigned int)fd)
+		num = fd + 1;
+	regs = realloc(vd->regs, num * sizeof(*regs));
+	if (!regs)
+		return -ENOMEM;
+	memset(regs + vd->num_regs, 0, (num - vd->num_regs) * sizeof(*regs));
+	vd->regs = regs;
+	vd->num_regs = num;
+	return 0;
+}
+
+/* If it can't be waited for, the fibre is queued again straight away, so
+ * whatever it's waiting for gets retried */
+static void ep_wait_fd(struct vd *vd, struct fibre *f)
+{
+	int fd = f->async_fd_readable.fd;
+	struct reg *reg;
+	if (fd < 0 || ((unsigned int)fd >= vd->num_regs && ep_grow(vd, fd)))
+		goto now;
+	reg = &vd->regs[fd];
+	if (!reg->added) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = fd;
+		if (epoll_ctl(vd->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			/* Eg. EPERM for a regular file, which is always
+			 * readable */
+			if (errno != EEXIST)
+				goto now;
+			/* Added, then closed without being forgotten */
+			reg->edge = 1;
+		} else
+			reg->edge = 0;
+		reg->added = 1;
+	}
+	if (reg->edge) {
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		reg->edge = 0;
+		if (poll(&p, 1, 0))
+			goto now;
+	}
+	f->rq_next = reg->waiters;
+	reg->waiters = f;
+	vd->waiting++;
+	return;
+now:
+	q_push(vd, f);
+}
+
+/* A fibre that has just suspended */
+static void ep_park(struct vd *vd, struct fibre *f)
+{
+	uint64_t deadline = f->async_deadline;
+	switch (f->async) {
+	case FIBRE_ASYNC_FD_READABLE:
+		ep_wait_fd(vd, f);
+		break;
+	case FIBRE_ASYNC_TIMER:
+		fibre_timers_add(vd->timers, f, f->async_timer.deadline);
+		vd->sleeping++;
+		break;
+	case FIBRE_ASYNC_CHECK_CB:
+		if (!fibre_pollset_add(vd->polls, f))
+			break;
+		/* Out of memory, so it can check again itself */
+		q_push(vd, f);
+		break;
+	case FIBRE_ASYNC_IO:
+		if (vd->ring && !fibre_uring_queue(vd->ring, f))
+			break;
+		/* As for a non-blocking fd */
+		f->async_io.res = -EAGAIN;
+		q_push(vd, f);
+		break;
+	case FIBRE_ASYNC_WAKE:
+		vd->remote++;
+		break;
+	default:
+		/* Nothing to wait for (FIBRE_ASYNC_POLL), just retry */
+		if (deadline != FIBRE_NO_DEADLINE &&
+		    deadline <= fibre_time_ns())
+			fibre_async_timeout(f);
+		q_push(vd, f);
+	}
+	if (deadline != FIBRE_NO_DEADLINE && !(f->flags & FIBRE_FLAGS_READY)) {
+		fibre_timers_add(vd->timers, f, deadline);
+		vd->sleeping++;
+	}
+}
+
+/* Takes a parked fibre with a deadline out of the wheel */
+static inline void ep_untime(struct vd *vd, struct fibre *f)
+{
+	if (f->timer.link.next) {
+		fibre_timers_cancel(vd->timers, f);
+		vd->sleeping--;
+	}
+}
+
+static inline int ep_held(struct vd *vd)
+{
+	return vd->waiting || vd->sleeping || vd->remote ||
+	       fibre_pollset_count(vd->polls) ||
+	       (vd->ring && fibre_uring_inflight(vd->ring)) ||
+	       !fibre_wakeq_empty(vd->wakeq);
+}
+
+static inline int ep_parked(struct vd *vd, struct fibre *f)
+{
+	return f->async && f != vd->current &&
+	       !(f->flags & FIBRE_FLAGS_READY);
+}
+
+static void ep_unpark(struct vd *vd, struct fibre *f)
+{
+	struct fibre **p;
+	ep_untime(vd, f);
+	if (f->async == FIBRE_ASYNC_TIMER)
+		return;
+	if (f->async == FIBRE_ASYNC_WAKE) {
+		vd->remote--;
+		return;
+	}
+	if (f->async == FIBRE_ASYNC_CHECK_CB) {
+		fibre_pollset_remove(vd->polls, f);
+		return;
+	}
+	p = &vd->regs[f->async_fd_readable.fd].waiters;
+	while (*p != f)
+		p = &(*p)->rq_next;
+	*p = f->rq_next;
+	vd->waiting--;
+}
+
+/* Queues whatever fibre_wake_remote() has woken, as fibre_ready() would. The
+ * fibre that has just switched away is still 'current', and may have been
+ * parked. */
+static void ep_take(struct vd *vd)
+{
+	struct fibre *f = fibre_wakeq_take(vd->wakeq), *f_next;
+	while (f) {
+		f_next = f->wake_next;
+		__atomic_store_n(&f->wake_pending, 0, __ATOMIC_RELEASE);
+		if (f->flags & (FIBRE_FLAGS_COMPLETED | FIBRE_FLAGS_READY))
+			goto next;
+		if (f->async) {
+			if (f->async == FIBRE_ASYNC_IO) {
+				fibre_uring_cancel(vd->ring, f);
+				goto next;
+			}
+			ep_unpark(vd, f);
+		}
+		q_push(vd, f);
+next:
+		f = f_next;
+	}
+}
+
+static void ep_harvest(struct vd *vd, int block)
+{
+	struct fibre *expired[FIBRE_EPOLL_EVENTS];
+	int timeout = block ? -1 : 0, num, loop;
+	unsigned int inflight = vd->ring ? fibre_uring_inflight(vd->ring) : 0;
+	uint64_t now, next;
+	/* Callbacks can only be polled, and wakes can be taken now */
+	if (fibre_pollset_count(vd->polls) || !fibre_wakeq_empty(vd->wakeq))
+		timeout = block = 0;
+	if (vd->sleeping) {
+		now = fibre_time_ns();
+		next = fibre_timers_next(vd->timers);
+		if (next <= now)
+			timeout = 0;
+		else if (block) {
+			next = (next - now + 999999) / 1000000;
+			timeout = (next < INT_MAX) ? next : INT_MAX;
+		}
+	}
+	if (inflight) {
+		if (timeout && !vd->waiting && !vd->sleeping && !vd->remote) {
+			fibre_uring_submit(vd->ring, 1);
+			timeout = 0;
+		} else
+			fibre_uring_submit(vd->ring, 0);
+	}
+	if (vd->waiting || vd->remote || timeout)
+		num = epoll_wait(vd->epfd, vd->events, FIBRE_EPOLL_EVENTS,
+				 timeout);
+	else
+		num = 0;
+	for (loop = 0; loop < num; loop++) {
+		struct reg *reg;
+		struct fibre *f, *f_next;
+		if (vd->events[loop].data.fd == -2) {
+			/* Taken below */
+			fibre_wakeq_ack(vd->wakeq);
+			continue;
+		}
+		if (vd->events[loop].data.fd < 0) {
+			/* The io_uring (which could just be cancellations) */
+			inflight = 1;
+			continue;
+		}
+		reg = &vd->regs[vd->events[loop].data.fd];
+		reg->edge = 1;
+		f = reg->waiters;
+		if (!f)
+			continue;
+		reg->waiters = NULL;
+		do {
+			f_next = f->rq_next;
+			ep_untime(vd, f);
+			q_push(vd, f);
+			vd->waiting--;
+			f = f_next;
+		} while (f);
+	}
+	if (inflight)
+		do {
+			num = fibre_uring_reap(vd->ring, expired,
+					       FIBRE_EPOLL_EVENTS);
+			for (loop = 0; loop < num; loop++)
+				q_push(vd, expired[loop]);
+		} while (num == FIBRE_EPOLL_EVENTS);
+	ep_take(vd);
+	if (fibre_pollset_count(vd->polls))
+		do {
+			num = fibre_pollset_check(vd->polls, expired,
+						  FIBRE_EPOLL_EVENTS);
+			for (loop = 0; loop < num; loop++) {
+				ep_untime(vd, expired[loop]);
+				q_push(vd, expired[loop]);
+			}
+		} while (num == FIBRE_EPOLL_EVENTS);
+	if (!vd->sleeping)
+		return;
+	now = fibre_time_ns();
+	do {
+		num = fibre_timers_expire(vd->timers, now, expired,
+					  FIBRE_EPOLL_EVENTS);
+		vd->sleeping -= num;
+		for (loop = 0; loop < num; loop++) {
+			struct fibre *f = expired[loop];
+			if (f->async != FIBRE_ASYNC_TIMER) {
+				/* A deadline */
+				ep_unpark(vd, f);
+				fibre_async_timeout(f);
+			}
+			q_push(vd, f);
+		}
+	} while (num == FIBRE_EPOLL_EVENTS);
+}
+
+static struct fibre *ep_next(struct vd *vd)
+{
+	if (!ep_held(vd))
+		return q_pop(vd);
+	if (vd->head && !--vd->countdown) {
+		vd->countdown = FIBRE_EPOLL_FAIRNESS;
+		ep_harvest(vd, 0);
+	}
+	while (!vd->head && ep_held(vd))
+		ep_harvest(vd, 1);
+	return q_pop(vd);
+}
+
+static void ep_destroy(void *__vd)
+{
+	struct vd *vd = __vd;
+	FCHECK(!vd->current && !vd->head);
+	FCHECK(!ep_held(vd));
+	if (vd->ring)
+		fibre_uring_destroy(vd->ring);
+	fibre_timers_destroy(vd->timers);
+	fibre_pollset_destroy(vd->polls);
+	fibre_wakeq_destroy(vd->wakeq);
+	close(vd->epfd);
+	free(vd->regs);
+	free(vd);
+}
+
+static int ep_post_push(void *__vd)
+{
+	struct vd *vd = __vd;
+	int ret = fibre_arch_origin(&vd->origin);
+	vd->current = NULL;
+	if (!ret)
+		fibre_async_set_mask(FIBRE_ASYNC_POLL |
+				     FIBRE_ASYNC_FD_READABLE |
+				     FIBRE_ASYNC_TIMER | FIBRE_ASYNC_CHECK_CB |
+				     FIBRE_ASYNC_WAKE |
+				     (vd->ring ? FIBRE_ASYNC_IO : 0));
+	return ret;
+}
+
+static int ep_pre_pop(void *__vd)
+{
+	struct vd *vd = __vd;
+	if (vd->current || vd->head || ep_held(vd))
+		return -EBUSY;
+	fibre_arch_origin_free(vd->origin);
+	return 0;
+}
+
+static int ep_can_switch_explicit(void *vd)
+{
+	return 1;
+}
+
+static int ep_can_switch_implicit(void *vd)
+{
+	return 1;
+}
+
+static void *ep_schedule(void *__vd, struct fibre *f, void *msg)
+{
+	struct vd *vd = __vd;
+	struct fibre *s = vd->current;
+	/* Queued and parked fibres can only be run by way of the queue */
+	FCHECK(!f || !(f->flags & FIBRE_FLAGS_READY));
+	FCHECK(!f || !f->async);
+	if (s && s->async && !(s->flags & FIBRE_FLAGS_READY))
+		ep_park(vd, s);
+	if (!f) {
+		f = ep_next(vd);
+		if (!f && !s)
+			/* The origin, with nothing to run or wait for */
+			return NULL;
+	}
+	if (f == s)
+		return msg;
+	if (f && __atomic_load_n(&f->wakeq, __ATOMIC_RELAXED) != vd->wakeq)
+		__atomic_store_n(&f->wakeq, vd->wakeq, __ATOMIC_RELEASE);
+	vd->current = f;
+	return fibre_switch(f, s, vd->origin, msg);
+}
+
+static struct fibre *ep_get_current(void *__vd)
+{
+	struct vd *vd = __vd;
+	return vd->current;
+}
+
+static int ep_ready(void *__vd, struct fibre *f, int next)
+{
+	struct vd *vd = __vd;
+	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
+	if (f->flags & FIBRE_FLAGS_READY)
+		return 0;
+	if (ep_parked(vd, f)) {
+		if (f->async == FIBRE_ASYNC_IO) {
+			/* It's queued once the operation is done with */
+			fibre_uring_cancel(vd->ring, f);
+			return 0;
+		}
+		ep_unpark(vd, f);
+	}
+	if (next)
+		q_push_head(vd, f);
+	else
+		q_push(vd, f);
+	return 0;
+}
+
+static const struct fibre_selector_vtable ep_vt = {
+	.destroy = ep_destroy,
+	.post_push = ep_post_push,
+	.pre_pop = ep_pre_pop,
+	.can_switch_explicit = ep_can_switch_explicit,
+	.can_switch_implicit = ep_can_switch_implicit,
+	.schedule = ep_schedule,
+	.get_current = ep_get_current,
+	.ready = ep_ready
+};
+
+int fibre_selector_epoll(struct fibre_selector **foo)
+{
+	struct fibre_selector *s;
+	struct vd *vd = malloc(sizeof(*vd));
+	int ret;
+	if (!vd)
+		return -ENOMEM;
+	vd->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (vd->epfd < 0) {
+		ret = -errno;
+		free(vd);
+		return ret;
+	}
+	ret = fibre_timers_create(&vd->timers, fibre_time_ns(), 0);
+	if (ret) {
+		close(vd->epfd);
+		free(vd);
+		return ret;
+	}
+	ret = fibre_pollset_create(&vd->polls);
+	if (ret) {
+		fibre_timers_destroy(vd->timers);
+		close(vd->epfd);
+		free(vd);
+		return ret;
+	}
+	ret = fibre_wakeq_create(&vd->wakeq);
+	if (!ret) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = -2;
+		if (epoll_ctl(vd->epfd, EPOLL_CTL_ADD,
+			      fibre_wakeq_fd(vd->wakeq), &ev)) {
+			ret = -errno;
+			fibre_wakeq_destroy(vd->wakeq);
+		}
+	}
+	if (ret) {
+		fibre_pollset_destroy(vd->polls);
+		fibre_timers_destroy(vd->timers);
+		close(vd->epfd);
+		free(vd);
+		return ret;
+	}
+	vd->current = NULL;
+	vd->head = vd->tail = NULL;
+	vd->countdown = FIBRE_EPOLL_FAIRNESS;
+	vd->waiting = vd->sleeping = vd->remote = 0;
+	vd->regs = NULL;
+	vd->num_regs = 0;
+	if (!fibre_uring_create(&vd->ring)) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = -1;
+		if (epoll_ctl(vd->epfd, EPOLL_CTL_ADD,
+			      fibre_uring_fd(vd->ring), &ev)) {
+			fibre_uring_destroy(vd->ring);
+			vd->ring = NULL;
+		}
+	} else
+		vd->ring = NULL;
+	s = fibre_selector_alloc(&ep_vt, vd);
+	if (!s) {
+		ep_destroy(vd);
+		return -ENOMEM;
+	}
+	*foo = s;
+	return 0;
+}
+
+int fibre_epoll_forget(struct fibre_selector *s, int fd)
+{
+	struct vd *vd = fibre_selector_data(s, &ep_vt);
+	struct reg *reg;
+	if (!vd)
+		return -EINVAL;
+	if (fd < 0)
+		return 0;
+	if ((unsigned int)fd < vd->num_regs && vd->regs[fd].waiters)
+		return -EBUSY;
+	if (vd->ring)
+		fibre_uring_forget_file(vd->ring, fd);
+	if ((unsigned int)fd >= vd->num_regs)
+		return 0;
+	reg = &vd->regs[fd];
+	if (reg->added)
+		/* If it's been closed already, it's gone from the set */
+		epoll_ctl(vd->epfd, EPOLL_CTL_DEL, fd, NULL);
+	reg->added = reg->edge = 0;
+	return 0;
+}
+
+int fibre_epoll_register_files(struct fibre_selector *s, const int *fds,
+			       unsigned int num)
+{
+	struct vd *vd = fibre_selector_data(s, &ep_vt);
+	if (!vd)
+		return -EINVAL;
+	if (!vd->ring)
+		return -EOPNOTSUPP;
+	return fibre_uring_register_files(vd->ring, fds, num);
+}
+
+int fibre_epoll_register_buffers(struct fibre_selector *s,
+				 const struct iovec *iov, unsigned int num)
+{
+	struct vd *vd = fibre_selector_data(s, &ep_vt);
+	if (!vd)
+		return -EINVAL;
+	if (!vd->ring)
+		return -EOPNOTSUPP;
+	return fibre_uring_register_buffers(vd->ring, iov, num);
+}
+
+int fibre_epoll_batch(struct fibre_selector *s, int (*cb)(void *),
+		      unsigned int (*batch)(void *const *args,
+					    unsigned int num,
+					    unsigned char *ready))
+{
+	struct vd *vd = fibre_selector_data(s, &ep_vt);
+	if (!vd)
+		return -EINVAL;
+	return fibre_pollset_batch(vd->polls, cb, batch);
+}
@@ -0,0 +1,623 @@
+#include <pthread.h>
+#include <sched.h>
+#include "private.h"
+
+/* The M:N runtime. Each worker thread pushes one of these selectors (its
+ * vtable_data is the struct worker) and sits in a loop of fibre_schedule(),
+ * going to sleep when there's nothing to run.
+ *
+ * Ready fibres are found, in order, in the worker's own deque (newest first),
+ * the runtime's FIFO, and the other workers' deques (oldest first). Every
+ * FIBRE_MN_FAIRNESS dispatches the FIFO goes first, so that fibres that keep
+ * readying each other can't starve it. The deques are Chase-Lev's, with the
+ * memory ordering of Lê et al. ("Correct and Efficient Work-Stealing for Weak
+ * Memory Models"); a deque's rings are only freed with the runtime, as a thief
+ * can be reading from one after it's been replaced.
+ *
+ * A fibre can be readied, and taken by another worker, before it has finished
+ * switching away from the worker it was running on. So 'oncpu' is set by the
+ * worker that switches to a fibre, and cleared by whatever runs next on that
+ * worker, once it's been switched away from; a worker that wants to switch to
+ * a fibre that's still 'oncpu' waits until it isn't. Whatever runs next
+ * either returns from fibre_switch() in mn_schedule(), or is a fibre that's
+ * just starting, hence the 'started' hook. Only the worker loop waits, as a
+ * fibre that did could be holding up the worker it's waiting for (which could
+ * be waiting for it to switch away); a fibre that finds what it wants to
+ * switch to still 'oncpu' leaves it in 'pending' and switches to the loop.
+ */
+
+#ifndef FIBRE_MN_DEQUE
+#define FIBRE_MN_DEQUE 256
+#endif
+_Static_assert(!(FIBRE_MN_DEQUE & (FIBRE_MN_DEQUE - 1)),
+	       "FIBRE_MN_DEQUE must be a power of two");
+#ifndef FIBRE_MN_FAIRNESS
+#define FIBRE_MN_FAIRNESS 61
+#endif
+/* How many times an idle worker looks for work before going to sleep, and
+ * a worker waiting for a fibre to be switched away from spins before
+ * yielding its CPU */
+#ifndef FIBRE_MN_SPIN
+#define FIBRE_MN_SPIN 100
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+struct ring {
+	long mask;
+	/* The ring this one replaced */
+	struct ring *old;
+	struct fibre *buf[];
+};
+
+struct deque {
+	/* Owner only, except that thieves read 'bottom' and 'ring' */
+	long bottom;
+	struct ring *ring;
+	/* Thieves */
+	long top __attribute__((aligned(64)));
+};
+
+struct worker {
+	struct deque dq;
+	struct fibre_mn *mn;
+	struct fibre_arch *origin;
+	struct fibre *current;
+	/* The fibre just switched away from, whose 'oncpu' is to be cleared */
+	struct fibre *prev;
+	/* For the worker loop to switch to, once it's off the other CPU */
+	struct fibre *pending;
+	void *pending_msg;
+	unsigned long dispatched;
+	unsigned int ticks;
+	uint32_t rng;
+	unsigned int idx;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
+struct fibre_mn {
+	unsigned int num;
+	struct worker *workers;
+	pthread_mutex_t lock;
+	/* Idle workers wait on this, fibre_mn_wait() on 'quiet' */
+	pthread_cond_t work;
+	pthread_cond_t quiet;
+	/* The FIFO (linked through 'rq_next'), under 'lock' */
+	struct fibre *head;
+	struct fibre *tail;
+	/* Written under 'lock', read without */
+	unsigned long queued;
+	unsigned int idle;
+	unsigned int wakeups;
+	int stop;
+	/* Start-up */
+	unsigned int started;
+	int err;
+};
+
+static __thread struct worker *tls_worker;
+
+static int dq_init(struct deque *d)
+{
+	d->ring = malloc(sizeof(*d->ring) +
+			 FIBRE_MN_DEQUE * sizeof(d->ring->buf[0]));
+	if (!d->ring)
+		return -ENOMEM;
+	d->ring->mask = FIBRE_MN_DEQUE - 1;
+	d->ring->old = NULL;
+	d->top = d->bottom = 0;
+	return 0;
+}
+
+static void dq_finish(struct deque *d)
+{
+	struct ring *r = d->ring, *old;
+	while (r) {
+		old = r->old;
+		free(r);
+		r = old;
+	}
+}
+
+static struct ring *dq_grow(struct deque *d, struct ring *r, long t, long b)
+{
+	struct ring *n = malloc(sizeof(*n) +
+				2 * (r->mask + 1) * sizeof(n->buf[0]));
+	if (!n)
+		return NULL;
+	n->mask = 2 * r->mask + 1;
+	n->old = r;
+	for (; t < b; t++)
+		n->buf[t & n->mask] = r->buf[t & r->mask];
+	__atomic_store_n(&d->ring, n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Owner only. Fails (-ENOMEM) if it's full and can't grow. */
+static int dq_push(struct deque *d, struct fibre *f)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct ring *r = d->ring;
+	if (b - t > r->mask && !(r = dq_grow(d, r, t, b)))
+		return -ENOMEM;
+	__atomic_store_n(&r->buf[b & r->mask], f, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Owner only, takes the newest */
+static struct fibre *dq_take(struct deque *d)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	struct ring *r = d->ring;
+	struct fibre *f;
+	/* 'top' only goes up, so this can't be wrong about it being empty,
+	 * and saves the fence */
+	if (b <= t)
+		return NULL;
+	__atomic_store_n(&d->bottom, --b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	f = __atomic_load_n(&r->buf[b & r->mask], __ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last one, which a thief could be after too */
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			f = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return f;
+}
+
+/* Anyone but the owner, takes the oldest. Sets '*lost' if it lost a race for
+ * it, ie. it's worth trying again. */
+static struct fibre *dq_steal(struct deque *d, int *lost)
+{
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	long b;
+	struct ring *r;
+	struct fibre *f;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	r = __atomic_load_n(&d->ring, __ATOMIC_ACQUIRE);
+	f = __atomic_load_n(&r->buf[t & r->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		*lost = 1;
+		return NULL;
+	}
+	return f;
+}
+
+static inline int dq_empty(struct deque *d)
+{
+	return __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST) <=
+	       __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+}
+
+static int mn_has_work(struct fibre_mn *mn)
+{
+	unsigned int loop;
+	if (__atomic_load_n(&mn->queued, __ATOMIC_SEQ_CST))
+		return 1;
+	for (loop = 0; loop < mn->num; loop++)
+		if (!dq_empty(&mn->workers[loop].dq))
+			return 1;
+	return 0;
+}
+
+/* With 'lock' held */
+static inline void mn_wake_locked(struct fibre_mn *mn)
+{
+	if (mn->wakeups < mn->idle) {
+		mn->wakeups++;
+		pthread_cond_signal(&mn->work);
+	}
+}
+
+/* After pushing on to a deque. Pairs with mn_idle() re-checking for work
+ * after bumping 'idle', so that one or the other notices. */
+static void mn_wake(struct fibre_mn *mn)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mn->wakeups, __ATOMIC_RELAXED) >=
+			__atomic_load_n(&mn->idle, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&mn->lock);
+	mn_wake_locked(mn);
+	pthread_mutex_unlock(&mn->lock);
+}
+
+static void mn_enqueue(struct fibre_mn *mn, struct fibre *f)
+{
+	f->rq_next = NULL;
+	pthread_mutex_lock(&mn->lock);
+	if (mn->tail)
+		mn->tail->rq_next = f;
+	else
+		mn->head = f;
+	mn->tail = f;
+	__atomic_store_n(&mn->queued, mn->queued + 1, __ATOMIC_SEQ_CST);
+	mn_wake_locked(mn);
+	pthread_mutex_unlock(&mn->lock);
+}
+
+static struct fibre *mn_dequeue(struct fibre_mn *mn)
+{
+	struct fibre *f;
+	if (!__atomic_load_n(&mn->queued, __ATOMIC_RELAXED))
+		return NULL;
+	pthread_mutex_lock(&mn->lock);
+	f = mn->head;
+	if (f) {
+		mn->head = f->rq_next;
+		if (!mn->head)
+			mn->tail = NULL;
+		__atomic_store_n(&mn->queued, mn->queued - 1,
+				 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mn->lock);
+	return f;
+}
+
+static struct fibre *mn_steal(struct worker *w)
+{
+	struct fibre_mn *mn = w->mn;
+	unsigned int loop, victim;
+	struct fibre *f;
+	int lost;
+	if (mn->num < 2)
+		return NULL;
+	do {
+		lost = 0;
+		/* xorshift32 */
+		w->rng ^= w->rng << 13;
+		w->rng ^= w->rng >> 17;
+		w->rng ^= w->rng << 5;
+		victim = w->rng % mn->num;
+		for (loop = 0; loop < mn->num; loop++) {
+			if (victim != w->idx &&
+			    (f = dq_steal(&mn->workers[victim].dq, &lost)))
+				return f;
+			if (++victim == mn->num)
+				victim = 0;
+		}
+	} while (lost);
+	return NULL;
+}
+
+static struct fibre *mn_find(struct worker *w)
+{
+	struct fibre *f;
+	if (!(++w->ticks % FIBRE_MN_FAIRNESS) && (f = mn_dequeue(w->mn)))
+		return f;
+	if ((f = dq_take(&w->dq)) || (f = mn_dequeue(w->mn)))
+		return f;
+	return mn_steal(w);
+}
+
+/* Not inlined, and opaque to the compiler, so that it can't hang on to the
+ * thread pointer from before a switch that resumed the caller on a different
+ * thread */
+static __attribute__((noinline)) struct worker *mn_this_worker(void)
+{
+	struct worker *w = tls_worker;
+	__asm__ __volatile__("" : "+r" (w) : : "memory");
+	return w;
+}
+
+/* Run by whatever runs next on the worker, after a switch */
+static inline void mn_switched(struct worker *w)
+{
+	struct fibre *prev = w->prev;
+	if (prev) {
+		w->prev = NULL;
+		__atomic_store_n(&prev->oncpu, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void mn_wait_offcpu(struct fibre *f)
+{
+	unsigned int loop = 0;
+	while (__atomic_load_n(&f->oncpu, __ATOMIC_ACQUIRE)) {
+		if (++loop < FIBRE_MN_SPIN)
+			cpu_relax();
+		else
+			sched_yield();
+	}
+}
+
+static void mn_destroy(void *__vd)
+{
+	/* The workers belong to the struct fibre_mn */
+	FUNUSED struct worker *w = __vd;
+	FCHECK(!w->current);
+}
+
+static int mn_post_push(void *__vd)
+{
+	struct worker *w = __vd;
+	int ret = fibre_arch_origin(&w->origin);
+	w->current = NULL;
+	w->prev = NULL;
+	w->pending = NULL;
+	return ret;
+}
+
+static int mn_pre_pop(void *__vd)
+{
+	struct worker *w = __vd;
+	if (w->current || w->pending || !dq_empty(&w->dq))
+		return -EBUSY;
+	fibre_arch_origin_free(w->origin);
+	return 0;
+}
+
+static int mn_can_switch(void *vd)
+{
+	return 1;
+}
+
+static void *mn_schedule(void *__vd, struct fibre *f, void *msg)
+{
+	struct worker *w = __vd;
+	struct fibre *s = w->current;
+	/* The count would stay with this thread, not go with the fibre */
+	FCHECK(!fibre_async_atomicity());
+	FCHECK(!f || !(f->flags & FIBRE_FLAGS_READY));
+	if (!f && w->pending) {
+		/* The worker loop, sent here to do the waiting */
+		FCHECK(!s);
+		f = w->pending;
+		msg = w->pending_msg;
+		w->pending = NULL;
+	} else if (!f) {
+		f = mn_find(w);
+		if (!f && !s)
+			/* The worker loop, with nothing to run */
+			return NULL;
+		if (f)
+			__atomic_and_fetch(&f->flags, ~FIBRE_FLAGS_READY,
+					   __ATOMIC_RELAXED);
+	}
+	if (f == s)
+		return msg;
+	if (f && __atomic_load_n(&f->oncpu, __ATOMIC_ACQUIRE)) {
+		if (s) {
+			w->pending = f;
+			w->pending_msg = msg;
+			f = NULL;
+		} else
+			mn_wait_offcpu(f);
+	}
+	if (f) {
+		__atomic_store_n(&f->oncpu, 1, __ATOMIC_RELAXED);
+		w->dispatched++;
+	}
+	w->current = f;
+	w->prev = s;
+	msg = fibre_switch(f, s, w->origin, msg);
+	mn_switched(mn_this_worker());
+	return msg;
+}
+
+static struct fibre *mn_get_current(void *__vd)
+{
+	struct worker *w = __vd;
+	return w->current;
+}
+
+static int mn_ready(void *__vd, struct fibre *f, int next)
+{
+	struct worker *w = __vd;
+	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
+	if (f->flags & FIBRE_FLAGS_SHARED)
+		return -EINVAL;
+	if (__atomic_fetch_or(&f->flags, FIBRE_FLAGS_READY, __ATOMIC_ACQ_REL) &
+			FIBRE_FLAGS_READY)
+		return 0;
+	/* A fibre readying itself is yielding, so goes to the back of the
+	 * FIFO rather than straight back to itself */
+	if (f == w->current || dq_push(&w->dq, f))
+		mn_enqueue(w->mn, f);
+	else
+		mn_wake(w->mn);
+	return 0;
+}
+
+static void mn_started(void *__vd)
+{
+	mn_switched(__vd);
+}
+
+static const struct fibre_selector_vtable mn_vt = {
+	.destroy = mn_destroy,
+	.post_push = mn_post_push,
+	.pre_pop = mn_pre_pop,
+	.can_switch_explicit = mn_can_switch,
+	.can_switch_implicit = mn_can_switch,
+	.schedule = mn_schedule,
+	.get_current = mn_get_current,
+	.ready = mn_ready,
+	.started = mn_started
+};
+
+static void mn_idle(struct worker *w)
+{
+	struct fibre_mn *mn = w->mn;
+	unsigned int loop;
+	for (loop = 0; loop < FIBRE_MN_SPIN; loop++) {
+		if (mn_has_work(mn))
+			return;
+		cpu_relax();
+	}
+	pthread_mutex_lock(&mn->lock);
+	__atomic_store_n(&mn->idle, mn->idle + 1, __ATOMIC_SEQ_CST);
+	if (!mn_has_work(mn)) {
+		if (mn->idle == mn->num)
+			pthread_cond_broadcast(&mn->quiet);
+		while (!mn->stop && !mn->wakeups)
+			pthread_cond_wait(&mn->work, &mn->lock);
+		if (mn->wakeups)
+			mn->wakeups--;
+	}
+	__atomic_store_n(&mn->idle, mn->idle - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mn->lock);
+}
+
+static void *mn_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct fibre_mn *mn = w->mn;
+	struct fibre_selector *s = NULL;
+	unsigned long dispatched;
+	int ret = fibre_init();
+	if (!ret) {
+		s = fibre_selector_alloc(&mn_vt, w);
+		ret = s ? fibre_push(s) : -ENOMEM;
+		if (ret) {
+			if (s)
+				fibre_selector_free(s);
+			fibre_finish();
+		}
+	}
+	tls_worker = w;
+	pthread_mutex_lock(&mn->lock);
+	if (ret && !mn->err)
+		mn->err = ret;
+	mn->started++;
+	pthread_cond_broadcast(&mn->quiet);
+	pthread_mutex_unlock(&mn->lock);
+	if (ret)
+		return NULL;
+	while (!__atomic_load_n(&mn->stop, __ATOMIC_RELAXED)) {
+		dispatched = w->dispatched;
+		fibre_schedule();
+		if (w->dispatched == dispatched)
+			mn_idle(w);
+	}
+	ret = fibre_pop(NULL);
+	FCHECK(!ret);
+	fibre_selector_free(s);
+	fibre_finish();
+	return NULL;
+}
+
+static void mn_stop(struct fibre_mn *mn, unsigned int num_threads)
+{
+	unsigned int loop;
+	pthread_mutex_lock(&mn->lock);
+	__atomic_store_n(&mn->stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&mn->work);
+	pthread_mutex_unlock(&mn->lock);
+	for (loop = 0; loop < num_threads; loop++)
+		pthread_join(mn->workers[loop].thread, NULL);
+}
+
+static void mn_free(struct fibre_mn *mn)
+{
+	unsigned int loop;
+	for (loop = 0; loop < mn->num; loop++)
+		dq_finish(&mn->workers[loop].dq);
+	pthread_cond_destroy(&mn->quiet);
+	pthread_cond_destroy(&mn->work);
+	pthread_mutex_destroy(&mn->lock);
+	free(mn->workers);
+	free(mn);
+}
+
+int fibre_mn_create(struct fibre_mn **foo, unsigned int num)
+{
+	struct fibre_mn *mn;
+	unsigned int loop;
+	int ret = 0;
+	if (!num)
+		return -EINVAL;
+	mn = calloc(1, sizeof(*mn));
+	if (!mn)
+		return -ENOMEM;
+	mn->workers = aligned_alloc(64, num * sizeof(*mn->workers));
+	if (!mn->workers) {
+		free(mn);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&mn->lock, NULL);
+	pthread_cond_init(&mn->work, NULL);
+	pthread_cond_init(&mn->quiet, NULL);
+	for (loop = 0; loop < num; loop++) {
+		struct worker *w = &mn->workers[loop];
+		w->mn = mn;
+		w->current = w->prev = w->pending = NULL;
+		w->dispatched = 0;
+		w->ticks = 0;
+		w->rng = loop * 2654435761U + 1;
+		w->idx = loop;
+		w->dq.ring = NULL;
+		if (!ret)
+			ret = dq_init(&w->dq);
+	}
+	mn->num = num;
+	if (ret) {
+		mn_free(mn);
+		return ret;
+	}
+	for (loop = 0; loop < num; loop++) {
+		ret = -pthread_create(&mn->workers[loop].thread, NULL,
+				      mn_worker, &mn->workers[loop]);
+		if (ret)
+			break;
+	}
+	pthread_mutex_lock(&mn->lock);
+	while (mn->started < loop)
+		pthread_cond_wait(&mn->quiet, &mn->lock);
+	if (!ret)
+		ret = mn->err;
+	pthread_mutex_unlock(&mn->lock);
+	if (ret) {
+		mn_stop(mn, loop);
+		mn_free(mn);
+		return ret;
+	}
+	*foo = mn;
+	return 0;
+}
+
+int fibre_mn_submit(struct fibre_mn *mn, struct fibre *f)
+{
+	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
+	if (f->flags & FIBRE_FLAGS_SHARED)
+		return -EINVAL;
+	if (!(__atomic_fetch_or(&f->flags, FIBRE_FLAGS_READY,
+				__ATOMIC_ACQ_REL) & FIBRE_FLAGS_READY))
+		mn_enqueue(mn, f);
+	return 0;
+}
+
+void fibre_mn_wait(struct fibre_mn *mn)
+{
+	pthread_mutex_lock(&mn->lock);
+	while (mn->idle < mn->num || mn->queued)
+		pthread_cond_wait(&mn->quiet, &mn->lock);
+	pthread_mutex_unlock(&mn->lock);
+}
+
+void fibre_mn_destroy(struct fibre_mn *mn)
+{
+	FCHECK(!__atomic_load_n(&mn->queued, __ATOMIC_RELAXED));
+	mn_stop(mn, mn->num);
+	mn_free(mn);
+}
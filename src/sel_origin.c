@@ -4,6 +4,10 @@ struct vd {
 	struct fibre_arch *origin;
 	struct fibre *current;
 };
+_Static_assert(offsetof(struct vd, origin) ==
+	       offsetof(struct fibre_inline_origin, origin), "fibre_inline.h");
+_Static_assert(offsetof(struct vd, current) ==
+	       offsetof(struct fibre_inline_origin, current), "fibre_inline.h");
 
 static void so_destroy(void *__vd)
 {
@@ -25,7 +29,7 @@ static int so_pre_pop(void *__vd)
 	struct vd *vd = __vd;
 	if (vd->current)
 		return -EBUSY;
-	fibre_arch_destroy(vd->origin);
+	fibre_arch_origin_free(vd->origin);
 	return 0;
 }
 
@@ -40,23 +44,13 @@ static int so_can_switch_implicit(void *__vd)
 	return !!vd->current;
 }
 
-static void so_schedule(void *__vd, struct fibre *f)
+static void *so_schedule(void *__vd, struct fibre *f, void *msg)
 {
 	struct vd *vd = __vd;
-	struct fibre_arch *s, *d;
+	struct fibre *s = vd->current;
 	FCHECK(vd->current || f);
-	if (vd->current)
-		s = vd->current->arch;
-	else
-		s = vd->origin;
-	if (f) {
-		d = f->arch;
-		vd->current = f;
-	} else {
-		d = vd->origin;
-		vd->current = NULL;
-	}
-	fibre_arch_switch(d, s);
+	vd->current = f;
+	return fibre_switch(f, s, vd->origin, msg);
 }
 
 static struct fibre *so_get_current(void *__vd)
@@ -65,7 +59,7 @@ static struct fibre *so_get_current(void *__vd)
 	return vd->current;
 }
 
-static const struct fibre_selector_vtable so_vt = {
+const struct fibre_selector_vtable fibre_origin_vtable = {
 	.destroy = so_destroy,
 	.post_push = so_post_push,
 	.pre_pop = so_pre_pop,
@@ -81,7 +75,7 @@ int fibre_selector_origin(struct fibre_selector **foo)
 	struct vd *vd = malloc(sizeof(*vd));
 	if (!vd)
 		return -ENOMEM;
-	s = fibre_selector_alloc(&so_vt, vd);
+	s = fibre_selector_alloc(&fibre_origin_vtable, vd);
 	if (!s) {
 		free(vd);
 		return -ENOMEM;
@@ -0,0 +1,191 @@
+#include "private.h"
+
+/* The priority selector. Like the run-queue selector (sel_runq.c), but with a
+ * FIFO per priority level (linked through the fibres' 'rq_next'), and a bitmap
+ * of the non-empty levels, so that finding the highest-priority queued fibre
+ * is a count-trailing-zeros.
+ *
+ * Aging, if enabled, happens every 'aging' dispatches from the queue: the
+ * fibre at the head of each non-empty level below the highest moves up a
+ * level (to the back of that one). So a fibre gets to the head of the queue
+ * within a bounded number of dispatches of getting to the head of its level,
+ * however busy the higher levels are. Its own priority is unaffected, the
+ * next time it's queued it's back at that level.
+ */
+
+_Static_assert(FIBRE_PRIO_LEVELS <= 32, "the bitmap is 32 bits");
+
+struct level {
+	struct fibre *head;
+	struct fibre *tail;
+};
+
+struct vd {
+	struct fibre_arch *origin;
+	struct fibre *current;
+	uint32_t bitmap;
+	unsigned int aging;
+	unsigned int countdown;
+	struct level levels[FIBRE_PRIO_LEVELS];
+};
+
+static inline void level_push(struct vd *vd, unsigned int idx, struct fibre *f)
+{
+	struct level *l = &vd->levels[idx];
+	f->rq_next = NULL;
+	if (l->tail)
+		l->tail->rq_next = f;
+	else {
+		l->head = f;
+		vd->bitmap |= 1U << idx;
+	}
+	l->tail = f;
+}
+
+static inline void level_push_head(struct vd *vd, unsigned int idx,
+				   struct fibre *f)
+{
+	struct level *l = &vd->levels[idx];
+	f->rq_next = l->head;
+	if (!l->head) {
+		l->tail = f;
+		vd->bitmap |= 1U << idx;
+	}
+	l->head = f;
+}
+
+static inline struct fibre *level_pop(struct vd *vd, unsigned int idx)
+{
+	struct level *l = &vd->levels[idx];
+	struct fibre *f = l->head;
+	l->head = f->rq_next;
+	if (!l->head) {
+		l->tail = NULL;
+		vd->bitmap &= ~(1U << idx);
+	}
+	return f;
+}
+
+static void prio_age(struct vd *vd)
+{
+	/* Every non-empty level but the highest, from the top down, so that
+	 * nothing moves more than one level at a time */
+	uint32_t bits = vd->bitmap & (vd->bitmap - 1);
+	while (bits) {
+		unsigned int idx = __builtin_ctz(bits);
+		bits &= bits - 1;
+		level_push(vd, idx - 1, level_pop(vd, idx));
+	}
+}
+
+static inline struct fibre *prio_pop(struct vd *vd)
+{
+	if (!vd->bitmap)
+		return NULL;
+	if (vd->aging && !--vd->countdown) {
+		vd->countdown = vd->aging;
+		prio_age(vd);
+	}
+	return level_pop(vd, __builtin_ctz(vd->bitmap));
+}
+
+static void prio_destroy(void *__vd)
+{
+	FUNUSED struct vd *vd = __vd;
+	FCHECK(!vd->current);
+	FCHECK(!vd->bitmap);
+	free(vd);
+}
+
+static int prio_post_push(void *__vd)
+{
+	struct vd *vd = __vd;
+	int ret = fibre_arch_origin(&vd->origin);
+	vd->current = NULL;
+	return ret;
+}
+
+static int prio_pre_pop(void *__vd)
+{
+	struct vd *vd = __vd;
+	if (vd->current || vd->bitmap)
+		return -EBUSY;
+	fibre_arch_origin_free(vd->origin);
+	return 0;
+}
+
+static int prio_can_switch_explicit(void *vd)
+{
+	return 1;
+}
+
+static int prio_can_switch_implicit(void *vd)
+{
+	return 1;
+}
+
+/* As for the run-queue selector */
+static void *prio_schedule(void *__vd, struct fibre *f, void *msg)
+{
+	struct vd *vd = __vd;
+	struct fibre *s = vd->current;
+	FCHECK(!f || !(f->flags & FIBRE_FLAGS_READY));
+	if (!f) {
+		f = prio_pop(vd);
+		if (!f && !s)
+			return NULL;
+		if (f)
+			f->flags &= ~FIBRE_FLAGS_READY;
+	}
+	if (f == s)
+		return msg;
+	vd->current = f;
+	return fibre_switch(f, s, vd->origin, msg);
+}
+
+static struct fibre *prio_get_current(void *__vd)
+{
+	struct vd *vd = __vd;
+	return vd->current;
+}
+
+static int prio_ready(void *__vd, struct fibre *f, int next)
+{
+	struct vd *vd = __vd;
+	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
+	if (f->flags & FIBRE_FLAGS_READY)
+		return 0;
+	f->flags |= FIBRE_FLAGS_READY;
+	if (next)
+		level_push_head(vd, f->prio, f);
+	else
+		level_push(vd, f->prio, f);
+	return 0;
+}
+
+static const struct fibre_selector_vtable prio_vt = {
+	.destroy = prio_destroy,
+	.post_push = prio_post_push,
+	.pre_pop = prio_pre_pop,
+	.can_switch_explicit = prio_can_switch_explicit,
+	.can_switch_implicit = prio_can_switch_implicit,
+	.schedule = prio_schedule,
+	.get_current = prio_get_current,
+	.ready = prio_ready
+};
+
+int fibre_selector_prio(struct fibre_selector **foo, unsigned int aging)
+{
+	struct fibre_selector *s;
+	struct vd *vd = calloc(1, sizeof(*vd));
+	if (!vd)
+		return -ENOMEM;
+	vd->aging = vd->countdown = aging;
+	s = fibre_selector_alloc(&prio_vt, vd);
+	if (!s) {
+		free(vd);
+		return -ENOMEM;
+	}
+	*foo = s;
+	return 0;
+}
@@ -0,0 +1,185 @@
+#include "private.h"
+
+/* The run-queue selector. Fibres are queued by fibre_ready(), and implicit
+ * scheduling runs the next one in the queue, or returns to the origin if
+ * there are none.
+ *
+ * The queue is a fixed-size ring of fibre pointers, with an overflow list
+ * (linked through the fibres' own 'rq_next') behind it for when the ring is
+ * full. Once anything is in the overflow list, new arrivals go on the end of
+ * that too, so the order stays FIFO, and when the ring runs dry it's refilled
+ * from the overflow list in one batch. In front of it all is the "run next"
+ * slot, for fibre_ready_next().
+ */
+
+#ifndef FIBRE_RUNQ_RING
+#define FIBRE_RUNQ_RING 256
+#endif
+#define RING_MASK (FIBRE_RUNQ_RING - 1)
+_Static_assert(!(FIBRE_RUNQ_RING & RING_MASK),
+	       "FIBRE_RUNQ_RING must be a power of two");
+
+struct vd {
+	struct fibre_arch *origin;
+	struct fibre *current;
+	struct fibre *next;
+	unsigned int head;
+	unsigned int tail;
+	struct fibre *ov_head;
+	struct fibre *ov_tail;
+	struct fibre *ring[FIBRE_RUNQ_RING];
+};
+
+static inline int rq_empty(struct vd *vd)
+{
+	return !vd->next && vd->head == vd->tail && !vd->ov_head;
+}
+
+static inline void rq_push(struct vd *vd, struct fibre *f)
+{
+	if (!vd->ov_head && vd->tail - vd->head < FIBRE_RUNQ_RING) {
+		vd->ring[vd->tail++ & RING_MASK] = f;
+		return;
+	}
+	f->rq_next = NULL;
+	if (vd->ov_tail)
+		vd->ov_tail->rq_next = f;
+	else
+		vd->ov_head = f;
+	vd->ov_tail = f;
+}
+
+static void rq_refill(struct vd *vd)
+{
+	struct fibre *f = vd->ov_head;
+	while (f && vd->tail - vd->head < FIBRE_RUNQ_RING) {
+		vd->ring[vd->tail++ & RING_MASK] = f;
+		f = f->rq_next;
+	}
+	vd->ov_head = f;
+	if (!f)
+		vd->ov_tail = NULL;
+}
+
+static inline struct fibre *rq_pop(struct vd *vd)
+{
+	struct fibre *f = vd->next;
+	if (f) {
+		vd->next = NULL;
+		return f;
+	}
+	if (vd->head == vd->tail) {
+		if (!vd->ov_head)
+			return NULL;
+		rq_refill(vd);
+	}
+	return vd->ring[vd->head++ & RING_MASK];
+}
+
+static void rq_destroy(void *__vd)
+{
+	FUNUSED struct vd *vd = __vd;
+	FCHECK(!vd->current);
+	FCHECK(rq_empty(vd));
+	free(vd);
+}
+
+static int rq_post_push(void *__vd)
+{
+	struct vd *vd = __vd;
+	int ret = fibre_arch_origin(&vd->origin);
+	vd->current = NULL;
+	return ret;
+}
+
+static int rq_pre_pop(void *__vd)
+{
+	struct vd *vd = __vd;
+	if (vd->current || !rq_empty(vd))
+		return -EBUSY;
+	fibre_arch_origin_free(vd->origin);
+	return 0;
+}
+
+static int rq_can_switch_explicit(void *vd)
+{
+	return 1;
+}
+
+static int rq_can_switch_implicit(void *vd)
+{
+	return 1;
+}
+
+static void *rq_schedule(void *__vd, struct fibre *f, void *msg)
+{
+	struct vd *vd = __vd;
+	struct fibre *s = vd->current;
+	/* A queued fibre can only be run by way of the queue */
+	FCHECK(!f || !(f->flags & FIBRE_FLAGS_READY));
+	if (!f) {
+		f = rq_pop(vd);
+		if (!f && !s)
+			/* The origin, with nothing to run */
+			return NULL;
+		if (f)
+			f->flags &= ~FIBRE_FLAGS_READY;
+	}
+	if (f == s)
+		/* The only thing to run is the fibre that readied itself */
+		return msg;
+	vd->current = f;
+	return fibre_switch(f, s, vd->origin, msg);
+}
+
+static struct fibre *rq_get_current(void *__vd)
+{
+	struct vd *vd = __vd;
+	return vd->current;
+}
+
+static int rq_ready(void *__vd, struct fibre *f, int next)
+{
+	struct vd *vd = __vd;
+	FCHECK(!(f->flags & FIBRE_FLAGS_COMPLETED));
+	if (f->flags & FIBRE_FLAGS_READY)
+		return 0;
+	f->flags |= FIBRE_FLAGS_READY;
+	if (next) {
+		if (vd->next)
+			rq_push(vd, vd->next);
+		vd->next = f;
+	} else
+		rq_push(vd, f);
+	return 0;
+}
+
+static const struct fibre_selector_vtable rq_vt = {
+	.destroy = rq_destroy,
+	.post_push = rq_post_push,
+	.pre_pop = rq_pre_pop,
+	.can_switch_explicit = rq_can_switch_explicit,
+	.can_switch_implicit = rq_can_switch_implicit,
+	.schedule = rq_schedule,
+	.get_current = rq_get_current,
+	.ready = rq_ready
+};
+
+int fibre_selector_runq(struct fibre_selector **foo)
+{
+	struct fibre_selector *s;
+	struct vd *vd = malloc(sizeof(*vd));
+	if (!vd)
+		return -ENOMEM;
+	vd->current = NULL;
+	vd->next = NULL;
+	vd->head = vd->tail = 0;
+	vd->ov_head = vd->ov_tail = NULL;
+	s = fibre_selector_alloc(&rq_vt, vd);
+	if (!s) {
+		free(vd);
+		return -ENOMEM;
+	}
+	*foo = s;
+	return 0;
+}
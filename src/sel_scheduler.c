@@ -12,6 +12,7 @@ static void ss_destroy(void *__vd)
 {
 	FUNUSED struct vd *vd = __vd;
 	FCHECK(!vd->current);
+	free(vd);
 }
 
 static int ss_post_push(void *__vd)
@@ -27,6 +28,7 @@ static int ss_pre_pop(void *__vd)
 	struct vd *vd = __vd;
 	if (vd->current)
 		return -EBUSY;
+	fibre_arch_origin_free(vd->origin);
 	return 0;
 }
 
@@ -41,29 +43,19 @@ static int ss_can_switch_implicit(void *__vd)
 	return 1;
 }
 
-static void ss_schedule(void *__vd, struct fibre *f)
+static void *ss_schedule(void *__vd, struct fibre *f, void *msg)
 {
 	struct vd *vd = __vd;
-	struct fibre_arch *s, *d;
+	struct fibre *s = vd->current;
 	FCHECK(vd->allow_explicit || !f);
-	if (vd->current)
-		s = vd->current->arch;
-	else
-		s = vd->origin;
 	if (!f)
 		f = vd->cb(vd->cb_arg);
-	if (f) {
-		d = f->arch;
-		vd->current = f;
-	} else {
-		if (!vd->current)
-			/* We're being asked to switch to the origin, but we're
-			 * already the origin... */
-			return;
-		d = vd->origin;
-		vd->current = NULL;
-	}
-	fibre_arch_switch(d, s);
+	if (!f && !s)
+		/* We're being asked to switch to the origin, but we're
+		 * already the origin... */
+		return NULL;
+	vd->current = f;
+	return fibre_switch(f, s, vd->origin, msg);
 }
 
 static struct fibre *ss_get_current(void *__vd)
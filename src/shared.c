@@ -0,0 +1,202 @@
+#include "private.h"
+
+#include <string.h>
+
+/* Shared-stack execution.
+ *
+ * FIBRE_ATTR_SHARED fibres all run on one stack per thread. Only one of them
+ * (the "owner") has its stack there at any time, the others have the live
+ * part of theirs (from where their stack pointer was when they switched out,
+ * up to the top) saved in a side buffer sized to fit. So an idle shared fibre
+ * costs its actual stack depth rather than a whole stack.
+ *
+ * Saving is lazy. The owner's stack stays where it is when the owner switches
+ * away, and only gets copied out when another shared fibre needs the stack,
+ * so a shared fibre that alternates with the origin or dedicated-stack fibres
+ * costs no copying at all.
+ *
+ * The copying can't be done while running on the shared stack, so a switch
+ * from one shared fibre to another goes via a "copier" context, which has a
+ * (small, dedicated) stack of its own. A switch into a shared fibre from any
+ * other context does the copying there and then.
+ *
+ * The arch code doesn't tell us exactly where a fibre's stack pointer was
+ * when it switched out, so we use the address of a local in
+ * fibre_shared_switch(), less enough slack to cover the frames that the arch
+ * switch puts below it.
+ *
+ * A shared fibre's arch context is only created when the fibre first gets the
+ * shared stack, because building its initial frame would otherwise clobber
+ * the stack of the owner at the time.
+ *
+ * Once it has run, a shared fibre can only be resumed on the same thread.
+ */
+
+#ifndef FIBRE_SHARED_STACK_SIZE
+#define FIBRE_SHARED_STACK_SIZE (256*1024)
+#endif
+
+#ifndef FIBRE_SHARED_SLACK
+#define FIBRE_SHARED_SLACK 512
+#endif
+
+static __thread struct shared_state {
+	struct fibre_stack *stack;
+	char *top;
+	/* The fibre whose stack is on the shared stack (NULL if none), and
+	 * where its stack pointer was when it last switched out */
+	struct fibre *owner;
+	char *sp;
+	/* The copier, and the fibre (and message) it is to switch to */
+	struct fibre_arch *copier;
+	struct fibre_stack *copier_stack;
+	struct fibre *to;
+	void *msg;
+} tls_shared;
+
+static void shared_fatal(const char *what)
+{
+	fprintf(stderr, "Critical: shared-stack %s failed\n", what);
+	abort();
+}
+
+static void shared_save(struct shared_state *sh, struct fibre *f)
+{
+	size_t len = sh->top - sh->sp;
+	if (len > f->shared.cap || len < f->shared.cap / 4) {
+		size_t cap = (len + 255) & ~(size_t)255;
+		void *buf = realloc(f->shared.buf, cap);
+		if (!buf)
+			shared_fatal("save");
+		f->shared.buf = buf;
+		f->shared.cap = cap;
+	}
+	memcpy(f->shared.buf, sh->sp, len);
+	f->shared.len = len;
+	if (len > f->stack_peak)
+		f->stack_peak = len;
+}
+
+/* Give the shared stack to 'f'. Must not be run on the shared stack. */
+static void shared_take(struct shared_state *sh, struct fibre *f)
+{
+	struct fibre_stack *st = sh->stack;
+	int ret;
+	if (sh->owner == f)
+		return;
+	if (sh->owner)
+		shared_save(sh, sh->owner);
+	sh->owner = f;
+	if (f->shared.len) {
+		memcpy(sh->top - f->shared.len, f->shared.buf, f->shared.len);
+		return;
+	}
+	/* Not started yet */
+	if (f->shared.arch)
+		ret = fibre_arch_reset(f->arch, st->sp_lo, st->size,
+				       fibre_bootstrap);
+	else
+		ret = fibre_arch_create(f->arch, st->sp_lo, st->size,
+					fibre_bootstrap);
+	if (ret)
+		shared_fatal("context creation");
+	f->shared.arch = 1;
+}
+
+static void shared_copier(void)
+{
+	struct shared_state *sh = &tls_shared;
+	while (1) {
+		shared_take(sh, sh->to);
+		fibre_arch_switch(sh->to->arch, sh->copier, sh->msg);
+	}
+}
+
+int fibre_shared_init(void)
+{
+	struct shared_state *sh = &tls_shared;
+	struct fibre_attr attr;
+	int ret;
+	if (sh->stack)
+		return 0;
+	fibre_attr_init(&attr);
+	attr.stack_size = FIBRE_SHARED_STACK_SIZE;
+	attr.flags |= FIBRE_ATTR_GUARD;
+	attr.pool = FIBRE_ATTR_POOL_NONE;
+	sh->stack = fibre_stack_get(&attr);
+	if (!sh->stack)
+		return -ENOMEM;
+	sh->copier_stack = fibre_stack_get(NULL);
+	sh->copier = aligned_alloc(64, (fibre_arch_sizeof() + 63) & ~(size_t)63);
+	if (!sh->copier_stack || !sh->copier) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	ret = fibre_arch_create(sh->copier, sh->copier_stack->sp_lo,
+				sh->copier_stack->size, shared_copier);
+	if (ret)
+		goto err;
+	sh->top = (char *)sh->stack->sp_lo + sh->stack->size;
+	sh->owner = NULL;
+	sh->to = NULL;
+	return 0;
+err:
+	free(sh->copier);
+	if (sh->copier_stack)
+		fibre_stack_put(sh->copier_stack);
+	fibre_stack_put(sh->stack);
+	sh->stack = NULL;
+	return ret;
+}
+
+void fibre_shared_finish(void)
+{
+	struct shared_state *sh = &tls_shared;
+	if (!sh->stack)
+		return;
+	fibre_arch_destroy(sh->copier);
+	free(sh->copier);
+	fibre_stack_put(sh->copier_stack);
+	fibre_stack_put(sh->stack);
+	sh->stack = NULL;
+}
+
+void fibre_shared_done(struct fibre *f)
+{
+	/* Nothing on the stack is worth keeping now */
+	FCHECK(tls_shared.owner == f);
+	tls_shared.owner = NULL;
+}
+
+void fibre_shared_release(struct fibre *f)
+{
+	free(f->shared.buf);
+	f->shared.buf = NULL;
+	f->shared.len = f->shared.cap = 0;
+}
+
+void *fibre_shared_switch(struct fibre *dest, struct fibre *src,
+			  struct fibre_arch *origin, void *msg)
+{
+	struct shared_state *sh = &tls_shared;
+	struct fibre_arch *d = dest ? dest->arch : origin;
+	struct fibre_arch *s = src ? src->arch : origin;
+	char mark;
+	if (src && (src->flags & FIBRE_FLAGS_SHARED)) {
+		FCHECK(!sh->owner || sh->owner == src);
+		sh->sp = (char *)((uintptr_t)&mark - FIBRE_SHARED_SLACK);
+		if (sh->sp < (char *)sh->stack->sp_lo)
+			sh->sp = sh->stack->sp_lo;
+		if (dest && (dest->flags & FIBRE_FLAGS_SHARED)) {
+			sh->to = dest;
+			sh->msg = msg;
+			d = sh->copier;
+		}
+	} else {
+		/* A selector pushed from within a shared fibre would have its
+		 * origin on the shared stack, which isn't supported */
+		FCHECK(&mark < (char *)sh->stack->sp_lo || &mark >= sh->top);
+		shared_take(sh, dest);
+	}
+	return fibre_arch_switch(d, s, msg);
+}
@@ -0,0 +1,449 @@
+#include "private.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Per-thread stack pool.
+ *
+ * Stacks are mmap()d, optionally with a PROT_NONE guard page below them, and
+ * the descriptor (struct fibre_stack) lives at the top of the mapping, above
+ * the usable stack. So a stack costs exactly one mapping and no heap
+ * allocation.
+ *
+ * Released stacks go onto a LIFO free-list, so the next fibre_create() (or
+ * fibre_recreate()) gets the stack that was most recently in use and is most
+ * likely to still be cache-warm. Only the owning thread touches that list.
+ * Stacks released on any other thread are pushed (lock-free) onto the owning
+ * pool's "remote" list, which the owner splices back in when its local list
+ * runs dry.
+ *
+ * Pooled stacks are kept per power-of-two size class (and separately for
+ * with/without guard page), so fibres asking for different stack sizes via
+ * fibre_create_ex() don't thrash each other's stacks.
+ *
+ * FIBRE_ATTR_POOL_HUGE stacks are instead carved, a size class at a time, out
+ * of 2MiB arenas backed by huge pages, so that switching between many fibres
+ * doesn't need a TLB entry per stack. An arena is MAP_HUGETLB if the system
+ * has huge pages reserved, otherwise it's aligned and madvise()d for
+ * transparent huge pages, and if neither works it's just ordinary memory.
+ * These stacks can't have guard pages (it would split the huge page), and as
+ * the arena is only unmapped once all its stacks are released, they're never
+ * trimmed from the pool.
+ *
+ * The pool struct itself is reference-counted, with one reference held by the
+ * owning thread and one by each mapping that belongs to it, so that stacks
+ * released remotely after the owner has called fibre_finish() can still be
+ * unmapped safely. When the owner finishes, it latches POOL_DEAD into the
+ * remote list, and remote releasers that see it unmap directly.
+ */
+
+#ifndef FIBRE_STACK_POOL_MAX
+#define FIBRE_STACK_POOL_MAX 64
+#endif
+
+#ifndef FIBRE_STACK_COLOURS
+#define FIBRE_STACK_COLOURS 64
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+#ifndef FIBRE_STACK_ARENA_SIZE
+#define FIBRE_STACK_ARENA_SIZE (2*1024*1024)
+#endif
+
+#define POOL_DEAD ((struct fibre_stack *)1)
+
+/* Keep the stack top (just below the descriptor) 64-byte aligned */
+#define DESC_SIZE ((sizeof(struct fibre_stack) + 63) & ~(size_t)63)
+
+/* Size classes are powers of two, from one 4KiB page up to 2MiB. Like the
+ * fibre_attr stack_size they are measured in stack footprint, which includes
+ * the descriptor but not the guard page. Anything bigger is mapped unpooled. */
+#define CLASS_MIN_SHIFT 12
+#define NUM_CLASSES 10
+
+/* Each class has a free-list per kind of stack; no guard, guard, and huge */
+#define KIND_HUGE 2
+#define NUM_KINDS 3
+
+struct stack_class {
+	struct fibre_stack *free;
+	unsigned int num_free;
+};
+
+struct fibre_stack_pool {
+	/* Owner-only LIFOs, indexed by [class][kind] */
+	struct stack_class classes[NUM_CLASSES][NUM_KINDS];
+	/* Pushed by non-owner threads, all classes mixed */
+	struct fibre_stack *remote;
+	/* Owner reference + one per mapping */
+	unsigned long refs;
+	/* Cache colour for the next mapping */
+	unsigned int colour;
+};
+
+/* The (separately allocated) header of a FIBRE_STACK_HUGE arena, which is
+ * referenced by each of the stacks carved from it. */
+struct stack_arena {
+	void *map;
+	size_t map_size;
+	unsigned long refs;
+};
+
+static __thread struct fibre_stack_pool *tls_pool;
+static size_t pagesize;
+
+static void pool_unref(struct fibre_stack_pool *p)
+{
+	if (!__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		free(p);
+}
+
+/* Returns the smallest class of at least 'size' bytes, or -1 if it's too big
+ * to pool. */
+static int size_to_class(size_t size)
+{
+	int cls = 0;
+	while (((size_t)1 << (cls + CLASS_MIN_SHIFT)) < size)
+		if (++cls == NUM_CLASSES)
+			return -1;
+	return cls;
+}
+
+/* Every mapping has its stack top (and any FIBRE_ATTR_INLINE block below it)
+ * at the same offset within a page, so without some staggering the hottest
+ * part of every fibre's stack would compete for the same few cache sets. */
+static size_t stack_colour(struct fibre_stack_pool *p, size_t msize)
+{
+	size_t colour = (p->colour++ % FIBRE_STACK_COLOURS) * 64;
+	if (colour + DESC_SIZE >= msize / 4)
+		return 0;
+	return colour;
+}
+
+static struct fibre_stack *stack_map(struct fibre_stack_pool *p, size_t msize,
+				     int guard)
+{
+	struct fibre_stack *st;
+	size_t gsize = guard ? pagesize : 0;
+	void *m = mmap(NULL, msize + gsize, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		       -1, 0);
+	if (m == MAP_FAILED)
+		return NULL;
+	if (guard && mprotect(m, gsize, PROT_NONE)) {
+		munmap(m, msize + gsize);
+		return NULL;
+	}
+	st = (struct fibre_stack *)((char *)m + gsize + msize - DESC_SIZE);
+	st->next = NULL;
+	st->pool = p;
+	st->map = m;
+	st->map_size = msize + gsize;
+	st->sp_lo = (char *)m + gsize;
+	st->size = msize - DESC_SIZE - stack_colour(p, msize);
+	st->flags = guard ? FIBRE_STACK_GUARD : 0;
+	st->cls = 0;
+	st->dirty_lo = NULL;
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+	return st;
+}
+
+static void stack_unmap(struct fibre_stack *st)
+{
+	struct fibre_stack_pool *p = st->pool;
+	FUNUSED int ret = 0;
+	if (st->flags & FIBRE_STACK_HUGE) {
+		struct stack_arena *a = st->map;
+		if (!__atomic_sub_fetch(&a->refs, 1, __ATOMIC_ACQ_REL)) {
+			ret = munmap(a->map, a->map_size);
+			free(a);
+		}
+	} else
+		ret = munmap(st->map, st->map_size);
+	FCHECK(!ret);
+	pool_unref(p);
+}
+
+static void *arena_mmap(size_t size)
+{
+	void *m;
+	char *aligned;
+	size_t head;
+#ifdef MAP_HUGETLB
+	/* Not MAP_NORESERVE, we want this to fail (rather than SIGBUS later)
+	 * if there aren't enough huge pages reserved */
+	m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (m != MAP_FAILED)
+		return m;
+#endif
+	/* Transparent huge pages need the arena to be aligned */
+	m = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED)
+		return NULL;
+	aligned = (char *)(((uintptr_t)m + size - 1) & ~(uintptr_t)(size - 1));
+	head = aligned - (char *)m;
+	if (head)
+		munmap(m, head);
+	munmap(aligned + size, size - head);
+#ifdef MADV_HUGEPAGE
+	/* If this fails, it's ordinary memory */
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+/* Carves a new arena into stacks of the given class, and puts them all in the
+ * pool. */
+static int arena_map(struct fibre_stack_pool *p, int cls)
+{
+	struct stack_class *c = &p->classes[cls][KIND_HUGE];
+	size_t size = (size_t)1 << (cls + CLASS_MIN_SHIFT), stride, shift;
+	unsigned int num, loop;
+	struct stack_arena *a;
+	/* Stacks a power-of-two apart would have their tops all competing for
+	 * the same cache sets, so space them out with an odd stride. And as
+	 * the huge page makes each arena physically contiguous, every arena
+	 * would then have the same layout as far as the cache is concerned,
+	 * so each one shifts its stack tops down by a different amount of the
+	 * slack that the stride leaves over the class size. */
+	num = FIBRE_STACK_ARENA_SIZE / (size + size / 16 + 64);
+	if (!num)
+		num = 1;
+	stride = (FIBRE_STACK_ARENA_SIZE / num) & ~(size_t)63;
+	shift = (stride - size) / 64;
+	shift = shift ? (p->colour++ * 17 % shift) * 64 : 0;
+	a = malloc(sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+	a->map = arena_mmap(FIBRE_STACK_ARENA_SIZE);
+	if (!a->map) {
+		free(a);
+		return -ENOMEM;
+	}
+	a->map_size = FIBRE_STACK_ARENA_SIZE;
+	a->refs = num;
+	/* Push them in reverse, so they get handed out in address order */
+	for (loop = num; loop-- > 0; ) {
+		char *lo = (char *)a->map + loop * stride;
+		struct fibre_stack *st = (struct fibre_stack *)
+					(lo + stride - shift - DESC_SIZE);
+		st->pool = p;
+		st->map = a;
+		st->map_size = 0;
+		st->sp_lo = lo;
+		st->size = stride - shift - DESC_SIZE;
+		st->flags = FIBRE_STACK_HUGE;
+		st->cls = cls;
+		st->dirty_lo = NULL;
+		st->next = c->free;
+		c->free = st;
+		c->num_free++;
+	}
+	__atomic_add_fetch(&p->refs, num, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* A caller-provided stack gets its descriptor carved from the top of the
+ * buffer and is never mapped, pooled or unmapped by us. */
+static struct fibre_stack *stack_foreign(void *buf, size_t size)
+{
+	struct fibre_stack *st;
+	uintptr_t top = ((uintptr_t)buf + size) & ~(uintptr_t)63;
+	if (top < (uintptr_t)buf + DESC_SIZE + 1024)
+		return NULL;
+	st = (struct fibre_stack *)(top - DESC_SIZE);
+	st->next = NULL;
+	st->pool = NULL;
+	st->map = NULL;
+	st->map_size = 0;
+	st->sp_lo = buf;
+	st->size = (uintptr_t)st - (uintptr_t)buf;
+	st->flags = FIBRE_STACK_FOREIGN;
+	st->cls = 0;
+	st->dirty_lo = NULL;
+	return st;
+}
+
+static inline int stack_kind(struct fibre_stack *st)
+{
+	if (st->flags & FIBRE_STACK_HUGE)
+		return KIND_HUGE;
+	return !!(st->flags & FIBRE_STACK_GUARD);
+}
+
+static void stack_push(struct fibre_stack_pool *p, struct fibre_stack *st)
+{
+	int kind = stack_kind(st);
+	struct stack_class *c = &p->classes[st->cls][kind];
+	if (kind != KIND_HUGE && c->num_free >= FIBRE_STACK_POOL_MAX) {
+		stack_unmap(st);
+		return;
+	}
+	st->next = c->free;
+	c->free = st;
+	c->num_free++;
+}
+
+static void pool_drain_remote(struct fibre_stack_pool *p)
+{
+	struct fibre_stack *st, *next;
+	st = __atomic_exchange_n(&p->remote, NULL, __ATOMIC_ACQUIRE);
+	for (; st; st = next) {
+		next = st->next;
+		stack_push(p, st);
+	}
+}
+
+int fibre_stack_init(void)
+{
+	struct fibre_stack_pool *p;
+	int cls, kind;
+	FCHECK(!tls_pool);
+	if (!pagesize)
+		pagesize = sysconf(_SC_PAGESIZE);
+	p = malloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+	for (cls = 0; cls < NUM_CLASSES; cls++)
+		for (kind = 0; kind < NUM_KINDS; kind++) {
+			p->classes[cls][kind].free = NULL;
+			p->classes[cls][kind].num_free = 0;
+		}
+	p->remote = NULL;
+	p->refs = 1;
+	p->colour = 0;
+	tls_pool = p;
+	return 0;
+}
+
+void fibre_stack_finish(void)
+{
+	struct fibre_stack_pool *p = tls_pool;
+	struct fibre_stack *st, *next;
+	int cls, kind;
+	FCHECK(p);
+	st = __atomic_exchange_n(&p->remote, POOL_DEAD, __ATOMIC_ACQUIRE);
+	for (; st; st = next) {
+		next = st->next;
+		stack_unmap(st);
+	}
+	for (cls = 0; cls < NUM_CLASSES; cls++)
+		for (kind = 0; kind < NUM_KINDS; kind++)
+			for (st = p->classes[cls][kind].free; st; st = next) {
+				next = st->next;
+				stack_unmap(st);
+			}
+	tls_pool = NULL;
+	pool_unref(p);
+}
+
+struct fibre_stack *fibre_stack_get(const struct fibre_attr *attr)
+{
+	struct fibre_stack_pool *p = tls_pool;
+	struct fibre_stack *st;
+	struct stack_class *c;
+	size_t size = FIBRE_STACK_SIZE;
+	int guard = FIBRE_STACK_GUARD_PAGES, kind, cls;
+	FCHECK(p);
+	if (attr) {
+		if (attr->stack)
+			return stack_foreign(attr->stack, attr->stack_size);
+		if (attr->stack_size)
+			size = attr->stack_size;
+		guard = !!(attr->flags & FIBRE_ATTR_GUARD);
+	}
+	kind = guard;
+	if (attr && attr->pool == FIBRE_ATTR_POOL_HUGE)
+		kind = KIND_HUGE;
+	cls = size_to_class(size);
+	if (cls < 0 || (attr && attr->pool == FIBRE_ATTR_POOL_NONE)) {
+		size = (size + pagesize - 1) & ~(pagesize - 1);
+		st = stack_map(p, size, guard);
+		if (st)
+			st->flags |= FIBRE_STACK_UNPOOLED;
+		return st;
+	}
+	c = &p->classes[cls][kind];
+	if (!c->free && __atomic_load_n(&p->remote, __ATOMIC_RELAXED))
+		pool_drain_remote(p);
+	if (!c->free && kind == KIND_HUGE && arena_map(p, cls))
+		return NULL;
+	st = c->free;
+	if (st) {
+		c->free = st->next;
+		c->num_free--;
+		return st;
+	}
+	st = stack_map(p, (size_t)1 << (cls + CLASS_MIN_SHIFT), guard);
+	if (st)
+		st->cls = cls;
+	return st;
+}
+
+void fibre_stack_put(struct fibre_stack *st)
+{
+	struct fibre_stack_pool *p = st->pool;
+	struct fibre_stack *head;
+	if (st->flags & FIBRE_STACK_FOREIGN)
+		return;
+	if (st->flags & FIBRE_STACK_UNPOOLED) {
+		stack_unmap(st);
+		return;
+	}
+	if (p == tls_pool) {
+		stack_push(p, st);
+		return;
+	}
+	/* Remote free */
+	head = __atomic_load_n(&p->remote, __ATOMIC_RELAXED);
+	do {
+		if (head == POOL_DEAD) {
+			stack_unmap(st);
+			return;
+		}
+		st->next = head;
+	} while (!__atomic_compare_exchange_n(&p->remote, &head, st, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+void fibre_stack_paint(struct fibre_stack *st, void *top)
+{
+	char *lo = st->sp_lo;
+	if (st->flags & FIBRE_STACK_PAINTED) {
+		if ((char *)st->dirty_lo < (char *)top)
+			memset(st->dirty_lo, 0, (char *)top - (char *)st->dirty_lo);
+		st->dirty_lo = top;
+		return;
+	}
+	/* We've no idea what's been touched, so start from scratch. For our own
+	 * mappings, dropping the pages is cheaper than zeroing them and gives
+	 * the memory back too. */
+	if (!(st->flags & (FIBRE_STACK_FOREIGN | FIBRE_STACK_HUGE))) {
+		char *hi = (char *)((uintptr_t)top & ~(uintptr_t)(pagesize - 1));
+		if (hi > lo && !madvise(lo, hi - lo, MADV_DONTNEED))
+			lo = hi;
+	}
+	memset(lo, 0, (char *)top - lo);
+	st->flags |= FIBRE_STACK_PAINTED;
+	st->dirty_lo = top;
+}
+
+size_t fibre_stack_peak(struct fibre_stack *st, void *top)
+{
+	const unsigned long *p = (const unsigned long *)
+		(((uintptr_t)st->sp_lo + sizeof(*p) - 1) & ~(sizeof(*p) - 1));
+	FCHECK(st->flags & FIBRE_STACK_PAINTED);
+	while ((void *)p < top && !*p)
+		p++;
+	if ((void *)p < st->dirty_lo)
+		st->dirty_lo = (void *)p;
+	return (char *)top - (char *)p;
+}
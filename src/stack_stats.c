@@ -0,0 +1,146 @@
+#include "private.h"
+
+/* Per-thread stack usage statistics, keyed by fibre entry function.
+ *
+ * The table is open-addressed (linear probing) and only ever grows, because
+ * the set of distinct entry functions in a program is small and fixed. Nothing
+ * in here runs unless fibre_stack_stats_mode() has turned measurement on.
+ */
+
+#ifndef FIBRE_STACK_STATS_MARGIN
+#define FIBRE_STACK_STATS_MARGIN 4096
+#endif
+
+/* How many measurements of an entry function before adaptive mode trusts
+ * them. */
+#ifndef FIBRE_STACK_STATS_SAMPLES
+#define FIBRE_STACK_STATS_SAMPLES 16
+#endif
+
+__thread unsigned int fibre_stack_stats_on;
+
+static __thread struct stats_state {
+	size_t margin;
+	struct fibre_stack_stat *tab;
+	unsigned int mask;
+	unsigned int used;
+} tls_stats;
+
+static inline unsigned int fn_hash(void (*fn)(void *))
+{
+	uint64_t h = (uintptr_t)fn;
+	h ^= h >> 17;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(h >> 32);
+}
+
+static struct fibre_stack_stat *stats_find(void (*fn)(void *))
+{
+	unsigned int idx;
+	if (!tls_stats.tab)
+		return NULL;
+	for (idx = fn_hash(fn) & tls_stats.mask; tls_stats.tab[idx].fn;
+			idx = (idx + 1) & tls_stats.mask)
+		if (tls_stats.tab[idx].fn == fn)
+			return &tls_stats.tab[idx];
+	return NULL;
+}
+
+static int stats_grow(void)
+{
+	struct fibre_stack_stat *old = tls_stats.tab;
+	unsigned int oldsize = old ? tls_stats.mask + 1 : 0, loop;
+	unsigned int newsize = oldsize ? oldsize * 2 : 64;
+	struct fibre_stack_stat *tab = calloc(newsize, sizeof(*tab));
+	if (!tab)
+		return -ENOMEM;
+	tls_stats.tab = tab;
+	tls_stats.mask = newsize - 1;
+	for (loop = 0; loop < oldsize; loop++) {
+		unsigned int idx;
+		if (!old[loop].fn)
+			continue;
+		for (idx = fn_hash(old[loop].fn) & tls_stats.mask; tab[idx].fn;
+				idx = (idx + 1) & tls_stats.mask)
+			;
+		tab[idx] = old[loop];
+	}
+	free(old);
+	return 0;
+}
+
+void fibre_stack_stats_mode(unsigned int mode, size_t margin)
+{
+	fibre_stack_stats_on = mode;
+	tls_stats.margin = margin ? margin : FIBRE_STACK_STATS_MARGIN;
+}
+
+void fibre_stack_stats_finish(void)
+{
+	free(tls_stats.tab);
+	tls_stats.tab = NULL;
+	tls_stats.used = 0;
+	fibre_stack_stats_on = FIBRE_STACK_STATS_OFF;
+}
+
+void fibre_stack_stats_record(void (*fn)(void *), size_t peak)
+{
+	struct fibre_stack_stat *s = stats_find(fn);
+	if (!s) {
+		unsigned int idx;
+		/* Keep the load factor under 1/2 */
+		if ((!tls_stats.tab || 2 * (tls_stats.used + 1) >
+					tls_stats.mask + 1) && stats_grow())
+			return;
+		for (idx = fn_hash(fn) & tls_stats.mask; tls_stats.tab[idx].fn;
+				idx = (idx + 1) & tls_stats.mask)
+			;
+		s = &tls_stats.tab[idx];
+		s->fn = fn;
+		tls_stats.used++;
+	}
+	s->count++;
+	s->total += peak;
+	if (peak > s->peak)
+		s->peak = peak;
+}
+
+size_t fibre_stack_stats_suggest(void (*fn)(void *))
+{
+	struct fibre_stack_stat *s = stats_find(fn);
+	size_t size;
+	if (!s || s->count < FIBRE_STACK_STATS_SAMPLES)
+		return 0;
+	size = s->peak + tls_stats.margin;
+	/* Anything that needs the default (or more) just gets the default */
+	return size < FIBRE_STACK_SIZE ? size : 0;
+}
+
+int fibre_stack_stats(void (*fn)(void *), struct fibre_stack_stat *out)
+{
+	struct fibre_stack_stat *s = stats_find(fn);
+	if (!s)
+		return -ENOENT;
+	*out = *s;
+	out->suggested = fibre_stack_stats_suggest(fn);
+	return 0;
+}
+
+unsigned int fibre_stack_stats_all(struct fibre_stack_stat *out,
+				   unsigned int max)
+{
+	unsigned int loop, num = 0;
+	if (!tls_stats.tab)
+		return 0;
+	for (loop = 0; loop <= tls_stats.mask; loop++) {
+		if (!tls_stats.tab[loop].fn)
+			continue;
+		if (num < max) {
+			out[num] = tls_stats.tab[loop];
+			out[num].suggested =
+				fibre_stack_stats_suggest(out[num].fn);
+		}
+		num++;
+	}
+	return num;
+}
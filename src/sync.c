@@ -0,0 +1,485 @@
+#include <string.h>
+#include "private.h"
+
+/* The synchronisation primitives. A fibre that has to wait goes on the
+ * primitive's queue (linked through 'wait.next'), with 'wait.kind' saying what
+ * it's waiting for, and suspends until whatever releases the primitive hands
+ * it over, clearing 'wait.kind'. If it's resumed any other way (someone else
+ * calling fibre_ready() on it), it just suspends again. */
+
+#define WAIT_MUTEX 1
+#define WAIT_COND  2
+#define WAIT_SEM   3
+#define WAIT_READ  4
+#define WAIT_WRITE 5
+#define WAIT_CHAN  6
+
+static inline void wq_push(struct fibre_waitq *q, struct fibre *f)
+{
+	f->wait.next = NULL;
+	if (q->tail)
+		q->tail->wait.next = f;
+	else
+		q->head = f;
+	q->tail = f;
+}
+
+static inline struct fibre *wq_pop(struct fibre_waitq *q)
+{
+	struct fibre *f = q->head;
+	if (f) {
+		q->head = f->wait.next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return f;
+}
+
+static inline void wq_init(struct fibre_waitq *q)
+{
+	q->head = q->tail = NULL;
+}
+
+/* It may have been handed over already, if it has switched since queueing */
+static void sync_sleep(struct fibre *f)
+{
+	while (f->wait.kind)
+		fibre_schedule();
+}
+
+static void sync_wait(struct fibre_waitq *q, unsigned int kind)
+{
+	struct fibre *f = fibre_get_current();
+	/* The origin can't wait */
+	FCHECK(f);
+	f->wait.kind = kind;
+	wq_push(q, f);
+	sync_sleep(f);
+}
+
+/* Resumes a waiter that has been handed what it was waiting for */
+static inline void sync_wake(struct fibre *f, unsigned int flags)
+{
+	FUNUSED int ret;
+	f->wait.kind = 0;
+	if (flags & FIBRE_SYNC_SWITCH)
+		ret = fibre_ready_next(f);
+	else
+		ret = fibre_ready(f);
+	FCHECK(!ret);
+}
+
+/* Once the waiters have been woken, a fibre that woke them yields to them
+ * if it's to switch */
+static inline void sync_yield(unsigned int flags)
+{
+	struct fibre *f;
+	if (!(flags & FIBRE_SYNC_SWITCH))
+		return;
+	f = fibre_get_current();
+	if (!f)
+		return;
+	fibre_ready(f);
+	fibre_schedule();
+}
+
+void fibre_mutex_init(struct fibre_mutex *m, unsigned int flags)
+{
+	m->locked = 0;
+	m->flags = flags;
+	wq_init(&m->waiters);
+}
+
+void fibre_mutex_lock(struct fibre_mutex *m)
+{
+	if (!m->locked) {
+		m->locked = 1;
+		return;
+	}
+	sync_wait(&m->waiters, WAIT_MUTEX);
+}
+
+int fibre_mutex_trylock(struct fibre_mutex *m)
+{
+	if (m->locked)
+		return -EBUSY;
+	m->locked = 1;
+	return 0;
+}
+
+void fibre_mutex_unlock(struct fibre_mutex *m)
+{
+	struct fibre *f = wq_pop(&m->waiters);
+	FCHECK(m->locked);
+	if (!f) {
+		m->locked = 0;
+		return;
+	}
+	/* Still locked, by 'f' now */
+	sync_wake(f, m->flags);
+	sync_yield(m->flags);
+}
+
+void fibre_cond_init(struct fibre_cond *c)
+{
+	wq_init(&c->waiters);
+}
+
+void fibre_cond_wait(struct fibre_cond *c, struct fibre_mutex *m)
+{
+	struct fibre *f = fibre_get_current();
+	FCHECK(f);
+	FCHECK(m->locked);
+	f->wait.kind = WAIT_COND;
+	f->wait.mutex = m;
+	wq_push(&c->waiters, f);
+	/* If that switches, 'f' may be signalled before it's back */
+	fibre_mutex_unlock(m);
+	sync_sleep(f);
+}
+
+/* Moves a waiter on to its mutex's queue, or hands it the mutex if it's not
+ * held, and returns non-zero for the latter */
+static int cond_move(struct fibre *f)
+{
+	struct fibre_mutex *m = f->wait.mutex;
+	if (m->locked) {
+		f->wait.kind = WAIT_MUTEX;
+		wq_push(&m->waiters, f);
+		return 0;
+	}
+	m->locked = 1;
+	sync_wake(f, m->flags);
+	return 1;
+}
+
+void fibre_cond_signal(struct fibre_cond *c)
+{
+	struct fibre *f = wq_pop(&c->waiters);
+	if (f && cond_move(f))
+		sync_yield(f->wait.mutex->flags);
+}
+
+void fibre_cond_broadcast(struct fibre_cond *c)
+{
+	struct fibre *f = c->waiters.head, *f_next;
+	unsigned int flags = 0;
+	wq_init(&c->waiters);
+	for (; f; f = f_next) {
+		f_next = f->wait.next;
+		if (cond_move(f))
+			flags = f->wait.mutex->flags;
+	}
+	sync_yield(flags);
+}
+
+void fibre_sem_init(struct fibre_sem *s, unsigned long count,
+		    unsigned int flags)
+{
+	s->count = count;
+	s->flags = flags;
+	wq_init(&s->waiters);
+}
+
+void fibre_sem_wait(struct fibre_sem *s)
+{
+	if (s->count) {
+		s->count--;
+		return;
+	}
+	sync_wait(&s->waiters, WAIT_SEM);
+}
+
+int fibre_sem_trywait(struct fibre_sem *s)
+{
+	if (!s->count)
+		return -EBUSY;
+	s->count--;
+	return 0;
+}
+
+void fibre_sem_post(struct fibre_sem *s)
+{
+	struct fibre *f = wq_pop(&s->waiters);
+	if (!f) {
+		s->count++;
+		return;
+	}
+	sync_wake(f, s->flags);
+	sync_yield(s->flags);
+}
+
+void fibre_rwlock_init(struct fibre_rwlock *l, unsigned int flags)
+{
+	l->state = 0;
+	l->flags = flags;
+	wq_init(&l->waiters);
+}
+
+void fibre_rwlock_rdlock(struct fibre_rwlock *l)
+{
+	if (!fibre_rwlock_tryrdlock(l))
+		return;
+	sync_wait(&l->waiters, WAIT_READ);
+}
+
+void fibre_rwlock_wrlock(struct fibre_rwlock *l)
+{
+	if (!fibre_rwlock_trywrlock(l))
+		return;
+	sync_wait(&l->waiters, WAIT_WRITE);
+}
+
+int fibre_rwlock_tryrdlock(struct fibre_rwlock *l)
+{
+	if (l->state < 0 || l->waiters.head)
+		return -EBUSY;
+	l->state++;
+	return 0;
+}
+
+int fibre_rwlock_trywrlock(struct fibre_rwlock *l)
+{
+	/* Nobody waits while it's unlocked */
+	if (l->state)
+		return -EBUSY;
+	l->state = -1;
+	return 0;
+}
+
+void fibre_rwlock_unlock(struct fibre_rwlock *l)
+{
+	struct fibre *f, *first;
+	FCHECK(l->state);
+	if (l->state > 0 && --l->state)
+		return;
+	l->state = 0;
+	first = wq_pop(&l->waiters);
+	if (!first)
+		return;
+	if (first->wait.kind == WAIT_WRITE)
+		l->state = -1;
+	else {
+		/* And the rest of the readers at the head of the queue, which
+		 * go after 'first' if it's to be switched to */
+		l->state = 1;
+		while ((f = l->waiters.head) && f->wait.kind == WAIT_READ) {
+			wq_pop(&l->waiters);
+			l->state++;
+			sync_wake(f, 0);
+		}
+	}
+	sync_wake(first, l->flags);
+	sync_yield(l->flags);
+}
+
+/* A channel's waiters are queued by their ops rather than by the fibres, as a
+ * select waits on several queues at once. Whatever does the op for a waiter
+ * takes all of that fibre's ops off their queues before resuming it. */
+
+static inline struct fibre_chanq *chan_q(struct fibre_chan_op *op)
+{
+	return op->send ? &op->chan->senders : &op->chan->receivers;
+}
+
+static inline void chanq_push(struct fibre_chanq *q, struct fibre_chan_op *op)
+{
+	op->next = NULL;
+	op->prev = q->tail;
+	if (q->tail)
+		q->tail->next = op;
+	else
+		q->head = op;
+	q->tail = op;
+}
+
+static inline void chanq_remove(struct fibre_chanq *q,
+				struct fibre_chan_op *op)
+{
+	if (op->prev)
+		op->prev->next = op->next;
+	else
+		q->head = op->next;
+	if (op->next)
+		op->next->prev = op->prev;
+	else
+		q->tail = op->prev;
+}
+
+static inline void *chan_slot(struct fibre_chan *c, unsigned long idx)
+{
+	return (char *)c->buf + ((c->head + idx) % c->cap) * c->size;
+}
+
+/* Resumes the fibre waiting with 'op', which has been done */
+static void chan_wake(struct fibre_chan_op *op, int ret, unsigned int flags)
+{
+	struct fibre *f = op->fibre;
+	unsigned int loop;
+	for (loop = 0; loop < f->wait.num; loop++)
+		chanq_remove(chan_q(&f->wait.ops[loop]), &f->wait.ops[loop]);
+	op->ret = ret;
+	f->wait.done = op - f->wait.ops;
+	sync_wake(f, flags);
+}
+
+/* Does 'op' if it can be done without waiting, returning -EBUSY if not */
+static int chan_try(struct fibre_chan_op *op)
+{
+	struct fibre_chan *c = op->chan;
+	struct fibre_chan_op *peer;
+	if (op->send) {
+		if (c->closed)
+			return -EPIPE;
+		peer = c->receivers.head;
+		if (peer) {
+			/* So nothing's buffered */
+			memcpy(peer->msg, op->msg, c->size);
+			goto wake;
+		}
+		if (c->num == c->cap)
+			return -EBUSY;
+		memcpy(chan_slot(c, c->num++), op->msg, c->size);
+		return 0;
+	}
+	peer = c->senders.head;
+	if (c->num) {
+		memcpy(op->msg, chan_slot(c, 0), c->size);
+		c->head = (c->head + 1) % c->cap;
+		c->num--;
+		if (!peer)
+			return 0;
+		/* It was waiting for the room that's just been made */
+		memcpy(chan_slot(c, c->num++), peer->msg, c->size);
+		goto wake;
+	}
+	if (peer) {
+		memcpy(op->msg, peer->msg, c->size);
+		goto wake;
+	}
+	return c->closed ? -EPIPE : -EBUSY;
+wake:
+	chan_wake(peer, 0, c->flags);
+	sync_yield(c->flags);
+	return 0;
+}
+
+static int chan_select(struct fibre_chan_op *ops, unsigned int num, int wait)
+{
+	struct fibre *f;
+	unsigned int loop;
+	int ret;
+	for (loop = 0; loop < num; loop++) {
+		ret = chan_try(&ops[loop]);
+		if (ret != -EBUSY) {
+			ops[loop].ret = ret;
+			return loop;
+		}
+	}
+	if (!wait)
+		return -EBUSY;
+	f = fibre_get_current();
+	/* The origin can't wait */
+	FCHECK(f);
+	/* Nor can a shared-stack fibre, as its ops (and likely its messages)
+	 * are on a stack that's copied out while it's away */
+	if (f->flags & FIBRE_FLAGS_SHARED)
+		return -EINVAL;
+	for (loop = 0; loop < num; loop++) {
+		ops[loop].fibre = f;
+		chanq_push(chan_q(&ops[loop]), &ops[loop]);
+	}
+	f->wait.ops = ops;
+	f->wait.num = num;
+	f->wait.kind = WAIT_CHAN;
+	sync_sleep(f);
+	return f->wait.done;
+}
+
+int fibre_chan_init(struct fibre_chan *c, size_t size, unsigned long cap,
+		    unsigned int flags)
+{
+	c->buf = NULL;
+	if (cap) {
+		if (size > (size_t)-1 / cap)
+			return -EINVAL;
+		c->buf = malloc(size * cap);
+		if (!c->buf)
+			return -ENOMEM;
+	}
+	c->size = size;
+	c->cap = cap;
+	c->num = c->head = 0;
+	c->flags = flags;
+	c->closed = 0;
+	c->senders.head = c->senders.tail = NULL;
+	c->receivers.head = c->receivers.tail = NULL;
+	return 0;
+}
+
+void fibre_chan_destroy(struct fibre_chan *c)
+{
+	FCHECK(!c->senders.head && !c->receivers.head);
+	free(c->buf);
+}
+
+int fibre_chan_send(struct fibre_chan *c, const void *msg)
+{
+	struct fibre_chan_op op = {
+		.chan = c,
+		.send = 1,
+		.msg = (void *)msg
+	};
+	int ret = chan_select(&op, 1, 1);
+	return ret < 0 ? ret : op.ret;
+}
+
+int fibre_chan_recv(struct fibre_chan *c, void *msg)
+{
+	struct fibre_chan_op op = {
+		.chan = c,
+		.msg = msg
+	};
+	int ret = chan_select(&op, 1, 1);
+	return ret < 0 ? ret : op.ret;
+}
+
+int fibre_chan_try_send(struct fibre_chan *c, const void *msg)
+{
+	struct fibre_chan_op op = {
+		.chan = c,
+		.send = 1,
+		.msg = (void *)msg
+	};
+	return chan_try(&op);
+}
+
+int fibre_chan_try_recv(struct fibre_chan *c, void *msg)
+{
+	struct fibre_chan_op op = {
+		.chan = c,
+		.msg = msg
+	};
+	return chan_try(&op);
+}
+
+void fibre_chan_close(struct fibre_chan *c)
+{
+	FCHECK(!c->closed);
+	c->closed = 1;
+	/* Any receivers are waiting on an empty buffer */
+	while (c->receivers.head)
+		chan_wake(c->receivers.head, -EPIPE, 0);
+	while (c->senders.head)
+		chan_wake(c->senders.head, -EPIPE, 0);
+}
+
+int fibre_chan_select(struct fibre_chan_op *ops, unsigned int num)
+{
+	return chan_select(ops, num, 1);
+}
+
+int fibre_chan_try_select(struct fibre_chan_op *ops, unsigned int num)
+{
+	return chan_select(ops, num, 0);
+}
@@ -0,0 +1,260 @@
+#include "private.h"
+
+/* The timer wheel. Time is counted in ticks of 'gran' nanoseconds, and a
+ * fibre's deadline is rounded up to a tick ('timer.expires'), which is as fine
+ * as it gets. There are WHEEL_LEVELS levels of WHEEL_SLOTS slots, each slot
+ * being a list of fibres: a level-0 slot is a tick, and each slot at the level
+ * above covers a whole level's worth of the slots below it. A fibre goes in
+ * the lowest level whose slots (relative to the current tick) reach its
+ * expiry, so inserting is a bit of arithmetic and a list append, and removal
+ * is a list unlink. Each time the tick passes a slot boundary at level n, the
+ * slot at level n+1 that's just begun is "cascaded", ie. its fibres are
+ * re-inserted, landing at lower levels. Fibres whose level-0 slot comes up go
+ * on the 'due' list, which fibre_timers_expire() takes them from in order.
+ *
+ * A bitmap of non-empty slots per level lets fibre_timers_next() find the
+ * next expiry without walking the lists, and the wheel skip straight past
+ * runs of empty slots, so a long gap between calls costs nothing extra. A
+ * deadline further away than the top level reaches is parked in the top
+ * level's furthest slot, and re-inserted when that comes up.
+ */
+
+#ifndef FIBRE_TIMER_GRANULARITY
+#define FIBRE_TIMER_GRANULARITY 1000000 /* 1ms */
+#endif
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+#define WHEEL_MAX (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+/* 'timer.slot' for a fibre on the due list */
+#define SLOT_DUE (WHEEL_LEVELS * WHEEL_SLOTS)
+
+struct fibre_timers {
+	uint64_t gran;
+	/* The next tick to process */
+	uint64_t tick;
+	unsigned long count;
+	uint64_t bitmap[WHEEL_LEVELS];
+	struct fibre_tlink due;
+	struct fibre_tlink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+#define tlink_fibre(l) \
+	((struct fibre *)((char *)(l) - offsetof(struct fibre, timer.link)))
+
+static inline void tlist_init(struct fibre_tlink *h)
+{
+	h->next = h->prev = h;
+}
+
+static inline int tlist_empty(struct fibre_tlink *h)
+{
+	return h->next == h;
+}
+
+static inline void tlist_append(struct fibre_tlink *h, struct fibre_tlink *l)
+{
+	l->prev = h->prev;
+	l->next = h;
+	h->prev->next = l;
+	h->prev = l;
+}
+
+static inline void tlist_del(struct fibre_tlink *l)
+{
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	l->next = NULL;
+}
+
+/* Moves everything from 'from' to the end of 'to' */
+static inline void tlist_splice(struct fibre_tlink *to,
+				struct fibre_tlink *from)
+{
+	if (tlist_empty(from))
+		return;
+	from->next->prev = to->prev;
+	to->prev->next = from->next;
+	from->prev->next = to;
+	to->prev = from->prev;
+	tlist_init(from);
+}
+
+static void wheel_insert(struct fibre_timers *t, struct fibre *f)
+{
+	uint64_t expires = f->timer.expires, delta;
+	unsigned int level = 0, idx;
+	if (expires < t->tick)
+		expires = t->tick;
+	delta = expires - t->tick;
+	if (delta > WHEEL_MAX) {
+		delta = WHEEL_MAX;
+		expires = t->tick + delta;
+	}
+	while (level < WHEEL_LEVELS - 1 &&
+	       (delta >> (WHEEL_BITS * (level + 1))))
+		level++;
+	idx = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	f->timer.slot = level * WHEEL_SLOTS + idx;
+	tlist_append(&t->slots[level][idx], &f->timer.link);
+	t->bitmap[level] |= (uint64_t)1 << idx;
+}
+
+/* The tick has just reached a boundary of the slots at 'level - 1' */
+static void wheel_cascade(struct fibre_timers *t, unsigned int level)
+{
+	unsigned int idx;
+	struct fibre_tlink list;
+	if (level == WHEEL_LEVELS)
+		return;
+	idx = (t->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	if (!idx)
+		wheel_cascade(t, level + 1);
+	if (!(t->bitmap[level] & ((uint64_t)1 << idx)))
+		return;
+	t->bitmap[level] &= ~((uint64_t)1 << idx);
+	tlist_init(&list);
+	tlist_splice(&list, &t->slots[level][idx]);
+	while (!tlist_empty(&list)) {
+		struct fibre_tlink *l = list.next;
+		tlist_del(l);
+		wheel_insert(t, tlink_fibre(l));
+	}
+}
+
+/* How far after 'from' (wrapping) the first set bit is, or -1 */
+static inline int next_bit(uint64_t bits, unsigned int from)
+{
+	if (!bits)
+		return -1;
+	if (from)
+		bits = (bits >> from) | (bits << (64 - from));
+	return __builtin_ctzll(bits);
+}
+
+/* The tick of the next expiry, or rather, for anything above level 0, of the
+ * start of the next non-empty slot (which is where it gets cascaded). Or
+ * UINT64_MAX if the wheel is empty. */
+static uint64_t wheel_next(struct fibre_timers *t)
+{
+	uint64_t best = UINT64_MAX, start;
+	unsigned int level, shift, cur, past;
+	int off;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		cur = (t->tick >> shift) & WHEEL_MASK;
+		/* Unless the tick is on a boundary of this level's slots, the
+		 * current one has been cascaded already, so anything in it is
+		 * a whole turn of the level away */
+		past = !!(t->tick & (((uint64_t)1 << shift) - 1));
+		off = next_bit(t->bitmap[level], (cur + past) & WHEEL_MASK);
+		if (off < 0)
+			continue;
+		start = ((t->tick >> shift) + past + off) << shift;
+		if (start < best)
+			best = start;
+	}
+	return best;
+}
+
+/* Processes every tick up to and including 'target', skipping straight from
+ * one that has something to do to the next */
+static void wheel_advance(struct fibre_timers *t, uint64_t target)
+{
+	while (t->tick <= target) {
+		unsigned int idx = t->tick & WHEEL_MASK;
+		uint64_t bit = (uint64_t)1 << idx, next;
+		struct fibre_tlink *l;
+		if (!idx)
+			wheel_cascade(t, 1);
+		if (t->bitmap[0] & bit) {
+			t->bitmap[0] &= ~bit;
+			for (l = t->slots[0][idx].next; l != &t->slots[0][idx];
+			     l = l->next)
+				tlink_fibre(l)->timer.slot = SLOT_DUE;
+			tlist_splice(&t->due, &t->slots[0][idx]);
+		}
+		t->tick++;
+		next = wheel_next(t);
+		if (next > t->tick)
+			t->tick = (next > target) ? target + 1 : next;
+	}
+}
+
+int fibre_timers_create(struct fibre_timers **foo, uint64_t now,
+			uint64_t granularity)
+{
+	struct fibre_timers *t = malloc(sizeof(*t));
+	unsigned int level, idx;
+	if (!t)
+		return -ENOMEM;
+	t->gran = granularity ? granularity : FIBRE_TIMER_GRANULARITY;
+	t->tick = now / t->gran;
+	t->count = 0;
+	tlist_init(&t->due);
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		t->bitmap[level] = 0;
+		for (idx = 0; idx < WHEEL_SLOTS; idx++)
+			tlist_init(&t->slots[level][idx]);
+	}
+	*foo = t;
+	return 0;
+}
+
+void fibre_timers_destroy(struct fibre_timers *t)
+{
+	FCHECK(!t->count);
+	free(t);
+}
+
+void fibre_timers_add(struct fibre_timers *t, struct fibre *f,
+		      uint64_t deadline)
+{
+	if (f->timer.link.next)
+		fibre_timers_cancel(t, f);
+	f->timer.expires = deadline / t->gran + !!(deadline % t->gran);
+	wheel_insert(t, f);
+	t->count++;
+}
+
+void fibre_timers_cancel(struct fibre_timers *t, struct fibre *f)
+{
+	unsigned int slot = f->timer.slot;
+	if (!f->timer.link.next)
+		return;
+	tlist_del(&f->timer.link);
+	t->count--;
+	if (slot != SLOT_DUE) {
+		unsigned int level = slot / WHEEL_SLOTS;
+		unsigned int idx = slot % WHEEL_SLOTS;
+		if (tlist_empty(&t->slots[level][idx]))
+			t->bitmap[level] &= ~((uint64_t)1 << idx);
+	}
+}
+
+uint64_t fibre_timers_next(struct fibre_timers *t)
+{
+	uint64_t next;
+	if (!tlist_empty(&t->due))
+		return 0;
+	next = wheel_next(t);
+	return (next == UINT64_MAX) ? next : next * t->gran;
+}
+
+unsigned int fibre_timers_expire(struct fibre_timers *t, uint64_t now,
+				 struct fibre **fibres, unsigned int max)
+{
+	uint64_t target = now / t->gran;
+	unsigned int num = 0;
+	if (target >= t->tick)
+		wheel_advance(t, target);
+	while (num < max && !tlist_empty(&t->due)) {
+		struct fibre_tlink *l = t->due.next;
+		tlist_del(l);
+		fibres[num++] = tlink_fibre(l);
+	}
+	t->count -= num;
+	return num;
+}
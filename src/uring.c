@@ -0,0 +1,462 @@
+#include "private.h"
+
+/* io_uring, for the epoll selector's FIBRE_ASYNC_IO, by way of the raw system
+ * calls (so no liburing). Each fibre's operation becomes one SQE, with the
+ * fibre as its user_data, and the SQEs queued by all the fibres that suspend
+ * between two calls to fibre_uring_submit() go in with one io_uring_enter().
+ * Completions are reaped straight from the CQ ring.
+ *
+ * Registered files and buffers are used transparently: an operation on an fd
+ * that's registered uses IOSQE_FIXED_FILE, and a read or write that's
+ * entirely within a registered buffer uses READ_FIXED/WRITE_FIXED. The CQ is
+ * twice the size of the SQ, and beyond that the kernel holds completions back
+ * (IORING_FEAT_NODROP) until they're flushed by an io_uring_enter().
+ *
+ * Built without <linux/io_uring.h>, or with FIBRE_NO_IO_URING,
+ * fibre_uring_create() fails with -ENOSYS, so nothing else gets called.
+ */
+
+#if !defined(FIBRE_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FIBRE_IO_URING
+#endif
+#endif
+
+#ifdef FIBRE_IO_URING
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifndef FIBRE_URING_ENTRIES
+#define FIBRE_URING_ENTRIES 256
+#endif
+
+struct fibre_uring {
+	int fd;
+	/* SQEs queued but not yet submitted, and operations not yet reaped
+	 * (not counting cancellations) */
+	unsigned int pending;
+	unsigned int inflight;
+	unsigned int sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_head_p;
+	unsigned int *sq_tail_p;
+	unsigned int *sq_flags_p;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int cq_mask;
+	unsigned int *cq_head_p;
+	unsigned int *cq_tail_p;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	/* Registered files, indexed by fd (-1 if not registered), and
+	 * buffers */
+	int *files;
+	unsigned int num_files;
+	struct iovec *bufs;
+	unsigned int num_bufs;
+};
+
+static inline int sys_enter(int fd, unsigned int submit, unsigned int wait,
+			    unsigned int flags)
+{
+	long ret = syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL,
+			   0);
+	return (ret < 0) ? -errno : ret;
+}
+
+static inline int sys_register(int fd, unsigned int opcode, const void *arg,
+			       unsigned int num)
+{
+	long ret = syscall(__NR_io_uring_register, fd, opcode, arg, num);
+	return (ret < 0) ? -errno : 0;
+}
+
+static void uring_unmap(struct fibre_uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_map && u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_size);
+	if (u->sq_map)
+		munmap(u->sq_map, u->sq_map_size);
+}
+
+int fibre_uring_create(struct fibre_uring **foo)
+{
+	struct io_uring_params p;
+	struct fibre_uring *u = calloc(1, sizeof(*u));
+	int ret;
+	if (!u)
+		return -ENOMEM;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, FIBRE_URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		ret = -errno;
+		free(u);
+		return ret;
+	}
+	u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_map_size = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_size > u->sq_map_size)
+			u->sq_map_size = u->cq_map_size;
+		u->cq_map_size = u->sq_map_size;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED) {
+		u->sq_map = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_map = u->sq_map;
+	else {
+		u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd,
+				 IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED) {
+			u->cq_map = NULL;
+			goto err;
+		}
+	}
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+	u->sq_head_p = (unsigned int *)((char *)u->sq_map + p.sq_off.head);
+	u->sq_tail_p = (unsigned int *)((char *)u->sq_map + p.sq_off.tail);
+	u->sq_flags_p = (unsigned int *)((char *)u->sq_map + p.sq_off.flags);
+	u->sq_array = (unsigned int *)((char *)u->sq_map + p.sq_off.array);
+	u->sq_mask = *(unsigned int *)((char *)u->sq_map +
+				       p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_tail = *u->sq_tail_p;
+	u->cq_head_p = (unsigned int *)((char *)u->cq_map + p.cq_off.head);
+	u->cq_tail_p = (unsigned int *)((char *)u->cq_map + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)((char *)u->cq_map +
+				       p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+	*foo = u;
+	return 0;
+err:
+	ret = -errno;
+	uring_unmap(u);
+	close(u->fd);
+	free(u);
+	return ret;
+}
+
+void fibre_uring_destroy(struct fibre_uring *u)
+{
+	FCHECK(!u->inflight);
+	uring_unmap(u);
+	close(u->fd);
+	free(u->files);
+	free(u->bufs);
+	free(u);
+}
+
+int fibre_uring_fd(struct fibre_uring *u)
+{
+	return u->fd;
+}
+
+unsigned int fibre_uring_inflight(struct fibre_uring *u)
+{
+	return u->inflight;
+}
+
+/* Returns NULL if the SQ is full even after submitting what's in it. Once
+ * filled in, the SQE is queued by uring_commit(). */
+static struct io_uring_sqe *uring_sqe(struct fibre_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	if (u->sq_tail - __atomic_load_n(u->sq_head_p, __ATOMIC_ACQUIRE) >=
+			u->sq_entries) {
+		fibre_uring_submit(u, 0);
+		if (u->sq_tail - __atomic_load_n(u->sq_head_p,
+						 __ATOMIC_ACQUIRE) >=
+				u->sq_entries)
+			return NULL;
+	}
+	sqe = &u->sqes[u->sq_tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static inline void uring_commit(struct fibre_uring *u)
+{
+	unsigned int idx = u->sq_tail & u->sq_mask;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail_p, ++u->sq_tail, __ATOMIC_RELEASE);
+	u->pending++;
+}
+
+static int uring_buf(struct fibre_uring *u, const void *buf, size_t len)
+{
+	unsigned int loop;
+	for (loop = 0; loop < u->num_bufs; loop++) {
+		const char *base = u->bufs[loop].iov_base;
+		if ((const char *)buf >= base &&
+		    (const char *)buf + len <= base + u->bufs[loop].iov_len)
+			return loop;
+	}
+	return -1;
+}
+
+int fibre_uring_queue(struct fibre_uring *u, struct fibre *f)
+{
+	struct fibre_io *io = &f->async_io;
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	int idx;
+	if (!sqe)
+		return -EBUSY;
+	sqe->user_data = (uintptr_t)f;
+	sqe->fd = io->fd;
+	if (io->fd >= 0 && (unsigned int)io->fd < u->num_files &&
+	    u->files[io->fd] >= 0) {
+		sqe->fd = u->files[io->fd];
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	switch (io->op) {
+	case FIBRE_IO_READ:
+	case FIBRE_IO_WRITE:
+		sqe->opcode = (io->op == FIBRE_IO_READ) ? IORING_OP_READ :
+			      IORING_OP_WRITE;
+		idx = uring_buf(u, io->buf, io->len);
+		if (idx >= 0) {
+			sqe->opcode = (io->op == FIBRE_IO_READ) ?
+				      IORING_OP_READ_FIXED :
+				      IORING_OP_WRITE_FIXED;
+			sqe->buf_index = idx;
+		}
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->len = io->len;
+		/* The current file position, if it has one */
+		sqe->off = -1;
+		break;
+	case FIBRE_IO_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->addr2 = (uintptr_t)io->addrlen;
+		sqe->accept_flags = io->flags;
+		break;
+	case FIBRE_IO_CONNECT:
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->addr = (uintptr_t)io->buf;
+		sqe->off = io->len;
+		break;
+	default:
+		FCHECK(0);
+	}
+	uring_commit(u);
+	u->inflight++;
+	return 0;
+}
+
+void fibre_uring_cancel(struct fibre_uring *u, struct fibre *f)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	/* If there's no room, the operation just runs its course */
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)f;
+	sqe->user_data = 0;
+	uring_commit(u);
+}
+
+int fibre_uring_submit(struct fibre_uring *u, unsigned int wait)
+{
+	int ret;
+	if (!u->pending && !wait)
+		return 0;
+	ret = sys_enter(u->fd, u->pending, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0);
+	if (ret > 0)
+		u->pending -= ret;
+	return (ret < 0) ? ret : 0;
+}
+
+unsigned int fibre_uring_reap(struct fibre_uring *u, struct fibre **fibres,
+			      unsigned int max)
+{
+	unsigned int head = *u->cq_head_p, tail, num = 0;
+	tail = __atomic_load_n(u->cq_tail_p, __ATOMIC_ACQUIRE);
+	if (head == tail &&
+	    (__atomic_load_n(u->sq_flags_p, __ATOMIC_RELAXED) &
+	     IORING_SQ_CQ_OVERFLOW)) {
+		/* Get the kernel to flush what it's held back */
+		sys_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+		tail = __atomic_load_n(u->cq_tail_p, __ATOMIC_ACQUIRE);
+	}
+	while (head != tail && num < max) {
+		struct io_uring_cqe *cqe = &u->cqes[head++ & u->cq_mask];
+		struct fibre *f = (struct fibre *)(uintptr_t)cqe->user_data;
+		/* Cancellations have no fibre */
+		if (!f)
+			continue;
+		f->async_io.res = cqe->res;
+		fibres[num++] = f;
+	}
+	__atomic_store_n(u->cq_head_p, head, __ATOMIC_RELEASE);
+	u->inflight -= num;
+	return num;
+}
+
+int fibre_uring_register_files(struct fibre_uring *u, const int *fds,
+			       unsigned int num)
+{
+	unsigned int loop, max = 0;
+	int *files = NULL, ret;
+	if (u->inflight)
+		return -EBUSY;
+	for (loop = 0; loop < num; loop++) {
+		if (fds[loop] < 0)
+			return -EBADF;
+		if ((unsigned int)fds[loop] >= max)
+			max = fds[loop] + 1;
+	}
+	if (num) {
+		files = malloc(max * sizeof(*files));
+		if (!files)
+			return -ENOMEM;
+		memset(files, 0xff, max * sizeof(*files));
+		for (loop = 0; loop < num; loop++)
+			files[fds[loop]] = loop;
+	}
+	if (u->num_files)
+		sys_register(u->fd, IORING_UNREGISTER_FILES, NULL, 0);
+	free(u->files);
+	u->files = NULL;
+	u->num_files = 0;
+	if (!num)
+		return 0;
+	ret = sys_register(u->fd, IORING_REGISTER_FILES, fds, num);
+	if (ret) {
+		free(files);
+		return ret;
+	}
+	u->files = files;
+	u->num_files = max;
+	return 0;
+}
+
+void fibre_uring_forget_file(struct fibre_uring *u, int fd)
+{
+	struct io_uring_files_update up = { 0 };
+	int none = -1;
+	if (fd < 0 || (unsigned int)fd >= u->num_files || u->files[fd] < 0)
+		return;
+	/* Also let the kernel drop its reference to the file, if it can;
+	 * either way, operations on the fd no longer use the slot */
+	up.offset = u->files[fd];
+	up.fds = (uintptr_t)&none;
+	sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+	u->files[fd] = -1;
+}
+
+int fibre_uring_register_buffers(struct fibre_uring *u,
+				 const struct iovec *iov, unsigned int num)
+{
+	struct iovec *bufs = NULL;
+	int ret;
+	if (u->inflight)
+		return -EBUSY;
+	if (num) {
+		bufs = malloc(num * sizeof(*bufs));
+		if (!bufs)
+			return -ENOMEM;
+		memcpy(bufs, iov, num * sizeof(*bufs));
+	}
+	if (u->num_bufs)
+		sys_register(u->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	free(u->bufs);
+	u->bufs = NULL;
+	u->num_bufs = 0;
+	if (!num)
+		return 0;
+	ret = sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, num);
+	if (ret) {
+		free(bufs);
+		return ret;
+	}
+	u->bufs = bufs;
+	u->num_bufs = num;
+	return 0;
+}
+
+#else
+
+/* Only fibre_uring_create() ever gets called */
+
+int fibre_uring_create(struct fibre_uring **foo)
+{
+	return -ENOSYS;
+}
+
+void fibre_uring_destroy(struct fibre_uring *u)
+{
+}
+
+int fibre_uring_fd(struct fibre_uring *u)
+{
+	return -1;
+}
+
+unsigned int fibre_uring_inflight(struct fibre_uring *u)
+{
+	return 0;
+}
+
+int fibre_uring_queue(struct fibre_uring *u, struct fibre *f)
+{
+	return -ENOSYS;
+}
+
+void fibre_uring_cancel(struct fibre_uring *u, struct fibre *f)
+{
+}
+
+int fibre_uring_submit(struct fibre_uring *u, unsigned int wait)
+{
+	return -ENOSYS;
+}
+
+unsigned int fibre_uring_reap(struct fibre_uring *u, struct fibre **fibres,
+			      unsigned int max)
+{
+	return 0;
+}
+
+int fibre_uring_register_files(struct fibre_uring *u, const int *fds,
+			       unsigned int num)
+{
+	return -ENOSYS;
+}
+
+void fibre_uring_forget_file(struct fibre_uring *u, int fd)
+{
+}
+
+int fibre_uring_register_buffers(struct fibre_uring *u,
+				 const struct iovec *iov, unsigned int num)
+{
+	return -ENOSYS;
+}
+
+#endif
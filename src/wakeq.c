@@ -0,0 +1,103 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "private.h"
+
+/* The remote wake queue, for fibre_wake_remote(). Any thread pushes a fibre
+ * on to 'head' with a compare-and-swap (linked through 'wake_next'), and the
+ * selector's thread takes the whole lot with one exchange, and reverses it so
+ * that the fibres come out in the order they were woken. Nothing is ever
+ * popped singly, so there's no ABA problem. A fibre is only pushed if it
+ * isn't already on the queue ('wake_pending'), so waking it twice before the
+ * selector gets to it is the same as waking it once.
+ *
+ * The push that finds the queue empty also writes to the eventfd, so a
+ * selector that's waiting for events (with the eventfd among them) wakes up,
+ * and is only woken once however many pushes follow before it takes them.
+ * The selector has to read the eventfd (fibre_wakeq_ack()) *before* taking,
+ * or a push in between would find the queue empty, write the eventfd, and
+ * have that write read away.
+ */
+
+struct fibre_wakeq {
+	struct fibre *head;
+	int fd;
+};
+
+int fibre_wakeq_create(struct fibre_wakeq **foo)
+{
+	struct fibre_wakeq *q = malloc(sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	q->head = NULL;
+	q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->fd < 0) {
+		int ret = -errno;
+		free(q);
+		return ret;
+	}
+	*foo = q;
+	return 0;
+}
+
+void fibre_wakeq_destroy(struct fibre_wakeq *q)
+{
+	FCHECK(!q->head);
+	close(q->fd);
+	free(q);
+}
+
+int fibre_wakeq_fd(struct fibre_wakeq *q)
+{
+	return q->fd;
+}
+
+void fibre_wakeq_ack(struct fibre_wakeq *q)
+{
+	uint64_t val;
+	if (read(q->fd, &val, sizeof(val)) < 0)
+		/* There's been no write since the last one */
+		FCHECK(errno == EAGAIN);
+}
+
+int fibre_wakeq_empty(struct fibre_wakeq *q)
+{
+	return !__atomic_load_n(&q->head, __ATOMIC_RELAXED);
+}
+
+struct fibre *fibre_wakeq_take(struct fibre_wakeq *q)
+{
+	struct fibre *f, *next, *list = NULL;
+	if (!__atomic_load_n(&q->head, __ATOMIC_RELAXED))
+		return NULL;
+	f = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+	while (f) {
+		next = f->wake_next;
+		f->wake_next = list;
+		list = f;
+		f = next;
+	}
+	return list;
+}
+
+int fibre_wake_remote(struct fibre *f)
+{
+	struct fibre_wakeq *q = __atomic_load_n(&f->wakeq, __ATOMIC_ACQUIRE);
+	struct fibre *head;
+	if (!q)
+		return -EOPNOTSUPP;
+	if (__atomic_exchange_n(&f->wake_pending, 1, __ATOMIC_ACQUIRE))
+		return 0;
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	do
+		f->wake_next = head;
+	while (!__atomic_compare_exchange_n(&q->head, &head, f, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED));
+	if (!head) {
+		uint64_t one = 1;
+		FUNUSED ssize_t ret = write(q->fd, &one, sizeof(one));
+		/* It could only fail if the count would overflow */
+		FCHECK(ret == sizeof(one));
+	}
+	return 0;
+}
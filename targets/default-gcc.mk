@@ -5,12 +5,14 @@ AR := ar
 ARFLAGS := rcs
 
 ifndef FIBRE_ARCH
-$(error FIBRE_ARCH needs to be defined; e.g. ucontext, setjmp, x86)
+$(error FIBRE_ARCH needs to be defined; e.g. ucontext, ucfast, setjmp, x86, multi)
 endif
 
 #FIBRE_ARCH := ucontext
+#FIBRE_ARCH := ucfast
 #FIBRE_ARCH := setjmp
 #FIBRE_ARCH := x86
+#FIBRE_ARCH := multi
 
 # Slurp in the standard routines for parsing Makefile content and
 # generating dependencies
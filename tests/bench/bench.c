@@ -35,13 +35,24 @@
  */
 
 #include <fibre.h>
+#include <fibre_inline.h>
 #include "bench.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <assert.h>
 
 //#define TRACE_ME
@@ -87,7 +98,18 @@ struct ctx_fibre_counter {
 	struct fibre *next;
 };
 
-static void fn_fibre_blind(void *__foo)
+/* Each with and without fibre_schedule_to_inline() (-d) */
+static inline __attribute__((always_inline)) void switch_to(struct fibre *f,
+							     int direct)
+{
+	if (direct)
+		fibre_schedule_to_inline(f);
+	else
+		fibre_schedule_to(f);
+}
+
+static inline __attribute__((always_inline)) void fibre_blind(void *__foo,
+								int direct)
 {
 	struct ctx_fibre_blind *ctx = (struct ctx_fibre_blind *)__foo;
 	struct fibre *next = ctx->next;
@@ -95,11 +117,12 @@ static void fn_fibre_blind(void *__foo)
 #ifdef TRACE_ME
 		printf("fn_fibre_blind(%u)\n", ctx->whoami);
 #endif
-		fibre_schedule_to(next);
+		switch_to(next, direct);
 	}
 }
 
-static void fn_fibre_counter(void *__foo)
+static inline __attribute__((always_inline)) void fibre_counter(void *__foo,
+								  int direct)
 {
 	struct ctx_fibre_counter *ctx = (struct ctx_fibre_counter *)__foo;
 	struct fibre *next = ctx->next;
@@ -108,19 +131,49 @@ static void fn_fibre_counter(void *__foo)
 #ifdef TRACE_ME
 		printf("fn_fibre_counter(), countdown=%u\n", countdown);
 #endif
-		fibre_schedule_to(next);
+		switch_to(next, direct);
 	} while (--countdown);
 }
 
+static void fn_fibre_blind(void *foo)
+{
+	fibre_blind(foo, 0);
+}
+
+static void fn_fibre_counter(void *foo)
+{
+	fibre_counter(foo, 0);
+}
+
+static void fn_fibre_blind_direct(void *foo)
+{
+	fibre_blind(foo, 1);
+}
+
+static void fn_fibre_counter_direct(void *foo)
+{
+	fibre_counter(foo, 1);
+}
+
+/* If set (-b, or for each in turn with -a), setup_fibre() asks for it */
+static const char *backend;
+
 /* Globals. Initialised in setup_fibre(), used in start_fibre() */
 static struct ctx_fibre_blind *ctxf_b;
 static struct ctx_fibre_counter *ctxf_c;
 
-static void setup_fibre(unsigned long num_fibres, unsigned long num_loops)
+static void setup_fibre(unsigned long num_fibres, unsigned long num_loops,
+			unsigned int attr_flags, unsigned int attr_pool,
+			int direct)
 {
+	void (*fn_blind)(void *) = direct ? fn_fibre_blind_direct :
+					    fn_fibre_blind;
+	void (*fn_counter)(void *) = direct ? fn_fibre_counter_direct :
+					      fn_fibre_counter;
 	int ret;
 	unsigned long loop;
 	struct fibre_selector *se;
+	struct fibre_attr attr;
 
 	assert(num_fibres >= 2);
 
@@ -128,19 +181,26 @@ static void setup_fibre(unsigned long num_fibres, unsigned long num_loops)
 	ctxf_c = MALLOC(struct ctx_fibre_counter);
 	assert(ctxf_b && ctxf_c);
 
+	if (backend) {
+		ret = fibre_backend_select(backend);
+		assert(!ret);
+	}
 	ret = fibre_init();
 	assert(!ret);
+	fibre_attr_init(&attr);
+	attr.flags |= attr_flags;
+	attr.pool = attr_pool;
 
 	/* Allocate the fibres */
 	for (loop = 0; loop < num_fibres - 1; loop++) {
 		struct ctx_fibre_blind *bb = &ctxf_b[loop];
-		ret = fibre_create(&bb->me, fn_fibre_blind, bb);
+		ret = fibre_create_ex(&bb->me, &attr, fn_blind, bb);
 		assert(!ret);
 #ifdef TRACE_ME
 		bb->whoami = loop;
 #endif
 	}
-	ret = fibre_create(&ctxf_c->me, fn_fibre_counter, ctxf_c);
+	ret = fibre_create_ex(&ctxf_c->me, &attr, fn_counter, ctxf_c);
 	assert(!ret);
 
 	/* Configure the fibres (the skipping) */
@@ -241,9 +301,461 @@ static void start_straw(void)
 	}
 }
 
-/********/
-/* Main */
-/********/
+/******************/
+/* Mode "handoff" */
+/******************/
+
+/* A producer fibre handing items one at a time to a consumer fibre, either by
+ * leaving each item in a shared structure and switching with
+ * fibre_schedule_to(), or by passing it with fibre_transfer(). */
+
+struct ctx_handoff {
+	struct fibre *producer;
+	struct fibre *consumer;
+	unsigned long loops;
+	unsigned long item;
+	unsigned long sum;
+};
+
+static void fn_shm_producer(void *__foo)
+{
+	struct ctx_handoff *ctx = (struct ctx_handoff *)__foo;
+	unsigned long loop;
+	for (loop = 1; loop <= ctx->loops; loop++) {
+		ctx->item = loop;
+		fibre_schedule_to(ctx->consumer);
+	}
+}
+
+static void fn_shm_consumer(void *__foo)
+{
+	struct ctx_handoff *ctx = (struct ctx_handoff *)__foo;
+	while (1) {
+		fibre_schedule_to(ctx->producer);
+		ctx->sum += ctx->item;
+	}
+}
+
+static void fn_xfer_producer(void *__foo)
+{
+	struct ctx_handoff *ctx = (struct ctx_handoff *)__foo;
+	unsigned long loop;
+	for (loop = 1; loop <= ctx->loops; loop++)
+		fibre_transfer(ctx->consumer, (void *)loop);
+}
+
+static void fn_xfer_consumer(void *__foo)
+{
+	struct ctx_handoff *ctx = (struct ctx_handoff *)__foo;
+	void *item = fibre_transfer(ctx->producer, NULL);
+	while (1) {
+		ctx->sum += (unsigned long)item;
+		item = fibre_transfer(ctx->producer, NULL);
+	}
+}
+
+static void setup_handoff(struct ctx_handoff *ctx, unsigned long num_loops,
+			  void (*producer)(void *), void (*consumer)(void *))
+{
+	int ret;
+	ctx->loops = num_loops;
+	ctx->sum = 0;
+	ret = fibre_create(&ctx->producer, producer, ctx);
+	assert(!ret);
+	ret = fibre_create(&ctx->consumer, consumer, ctx);
+	assert(!ret);
+}
+
+/* As with start_fibre(), the consumer is left hanging at the end */
+static void start_handoff(struct ctx_handoff *ctx)
+{
+	fibre_schedule_to(ctx->consumer);
+	assert(fibre_completed(ctx->producer));
+	assert(ctx->sum == ctx->loops * (ctx->loops + 1) / 2);
+}
+
+/************************/
+/* Mode "M:N scaling" */
+/************************/
+
+/* Pairs of fibres in the M:N runtime, passing a baton back and forth, with a
+ * little work (MN_WORK rounds of an LCG) for each pass. A fibre that finds the
+ * baton isn't there parks itself, and the other readies it when it passes the
+ * baton over, so this is the wake-up path: the woken fibre goes on the
+ * waker's own deque, and idle workers steal. */
+
+#define MN_WORK 200
+
+struct ctx_mn {
+	pthread_mutex_t lock;
+	/* Whose turn it is, 0 or 1 */
+	unsigned int turn;
+	struct fibre *parked;
+	struct fibre *f[2];
+	unsigned long loops;
+	unsigned long work;
+};
+
+static void mn_pass(struct ctx_mn *ctx, unsigned int me)
+{
+	struct fibre *f = NULL;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->turn = !me;
+	if (ctx->parked) {
+		f = ctx->parked;
+		ctx->parked = NULL;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (f)
+		fibre_ready(f);
+}
+
+static void mn_await(struct ctx_mn *ctx, unsigned int me)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->turn == me) {
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	ctx->parked = ctx->f[me];
+	pthread_mutex_unlock(&ctx->lock);
+	fibre_schedule();
+}
+
+static void fn_mn(unsigned int me, struct ctx_mn *ctx)
+{
+	unsigned long loop, work = 0;
+	unsigned int round;
+	for (loop = 0; loop < ctx->loops; loop++) {
+		mn_await(ctx, me);
+		for (round = 0; round < MN_WORK; round++)
+			work = work * 6364136223846793005UL + 1442695040888963407UL;
+		mn_pass(ctx, me);
+	}
+	ctx->work += work;
+}
+
+static void fn_mn_0(void *__foo)
+{
+	fn_mn(0, (struct ctx_mn *)__foo);
+}
+
+static void fn_mn_1(void *__foo)
+{
+	fn_mn(1, (struct ctx_mn *)__foo);
+}
+
+/****************/
+/* Mode "epoll" */
+/****************/
+
+/* Pairs of fibres passing a counter back and forth over socketpairs, waiting
+ * for each message with fibre_async_suspend_fd_readable(). Run by the epoll
+ * selector, and by the sort of dispatcher an application would otherwise
+ * write for itself: an origin selector, with an EPOLLONESHOT registration
+ * that gets re-armed with epoll_ctl() for each suspension, and a switch back
+ * to the dispatcher between every two fibres. And with fibre_io_read() and
+ * fibre_io_write() in place of the system calls, by way of the epoll
+ * selector's io_uring, on blocking fds (so that the operations wait in the
+ * kernel), with and without the fds registered. */
+
+struct ctx_ep {
+	int fd[2];
+	struct fibre *f[2];
+	unsigned long loops;
+};
+
+static void ep_recv(int fd, unsigned long *val)
+{
+	while (read(fd, val, sizeof(*val)) != sizeof(*val))
+		fibre_async_suspend_fd_readable(fd);
+}
+
+static void ep_send(int fd, unsigned long val)
+{
+	ssize_t res = write(fd, &val, sizeof(val));
+	assert(res == sizeof(val));
+}
+
+static void fn_ep_client(void *__foo)
+{
+	struct ctx_ep *ctx = __foo;
+	unsigned long loop, val = 0;
+	for (loop = 0; loop < ctx->loops; loop++) {
+		ep_send(ctx->fd[0], val);
+		ep_recv(ctx->fd[0], &val);
+	}
+}
+
+static void fn_ep_server(void *__foo)
+{
+	struct ctx_ep *ctx = __foo;
+	unsigned long loop, val;
+	for (loop = 0; loop < ctx->loops; loop++) {
+		ep_recv(ctx->fd[1], &val);
+		ep_send(ctx->fd[1], val + 1);
+	}
+}
+
+static void fn_io_client(void *__foo)
+{
+	struct ctx_ep *ctx = __foo;
+	unsigned long loop, val = 0;
+	ssize_t res;
+	for (loop = 0; loop < ctx->loops; loop++) {
+		res = fibre_io_write(ctx->fd[0], &val, sizeof(val));
+		res |= fibre_io_read(ctx->fd[0], &val, sizeof(val));
+		assert(res == sizeof(val));
+	}
+}
+
+static void fn_io_server(void *__foo)
+{
+	struct ctx_ep *ctx = __foo;
+	unsigned long loop, val;
+	ssize_t res;
+	for (loop = 0; loop < ctx->loops; loop++) {
+		res = fibre_io_read(ctx->fd[1], &val, sizeof(val));
+		val++;
+		res |= fibre_io_write(ctx->fd[1], &val, sizeof(val));
+		assert(res == sizeof(val));
+	}
+}
+
+/******************/
+/* Mode "pollset" */
+/******************/
+
+/* Lots of fibres suspended with fibre_async_suspend_use_cb(), spread over a
+ * few callbacks, none of them ready, so what's measured is the cost of one
+ * pass over them all. Checked the way a dispatcher would without the poll
+ * set, walking the fibres and making each one's indirect call, then by
+ * fibre_pollset_check(), with its callbacks grouped, and with batch forms. */
+
+struct ctx_poll {
+	int flag;
+	struct fibre *f;
+};
+
+#define POLL_CB(n) \
+static int poll_cb_##n(void *arg) \
+{ \
+	return ((struct ctx_poll *)arg)->flag; \
+} \
+static unsigned int poll_batch_##n(void *const *args, unsigned int num, \
+				   unsigned char *ready) \
+{ \
+	unsigned int loop, res = 0; \
+	for (loop = 0; loop < num; loop++) { \
+		ready[loop] = ((struct ctx_poll *)args[loop])->flag; \
+		res += ready[loop]; \
+	} \
+	return res; \
+}
+POLL_CB(0)
+POLL_CB(1)
+POLL_CB(2)
+POLL_CB(3)
+
+static int (*const poll_cbs[4])(void *) = {
+	poll_cb_0, poll_cb_1, poll_cb_2, poll_cb_3
+};
+static unsigned int (*const poll_batches[4])(void *const *, unsigned int,
+					     unsigned char *) = {
+	poll_batch_0, poll_batch_1, poll_batch_2, poll_batch_3
+};
+
+static void fn_poll(void *__foo)
+{
+	struct ctx_poll *ctx = __foo;
+	int res = fibre_async_suspend_use_cb(ctx, poll_cbs[rand() % 4]);
+	assert(!res);
+}
+
+/*****************/
+/* Mode "remote" */
+/*****************/
+
+/* Another thread waking fibres that run under the epoll selector. Each pass,
+ * it bumps every fibre's 'want' and wakes it, then waits (yielding) until
+ * they've all seen it, so with one fibre each pass is a round trip, and with
+ * lots of them it's how fast wakes can be handed over. Done with
+ * fibre_wake_remote(), and the way it'd be done without: a list under a
+ * mutex, and a write to an eventfd for every wake, that a dispatcher fibre
+ * waits on before taking the list and fibre_ready()ing what's on it. */
+
+struct ctx_remote {
+	struct fibre *f;
+	unsigned long want;
+	struct ctx_remote *next;
+};
+
+static struct {
+	struct ctx_remote *ctx;
+	unsigned long num;
+	unsigned long passes;
+	unsigned long seen;
+	/* Non-zero for the mutex and eventfd */
+	int locked;
+	pthread_mutex_t lock;
+	struct ctx_remote *head;
+	int efd;
+	int stop;
+} remote;
+
+static void fn_remote(void *__foo)
+{
+	struct ctx_remote *ctx = __foo;
+	unsigned long pass;
+	for (pass = 1; pass <= remote.passes; pass++) {
+		while (__atomic_load_n(&ctx->want, __ATOMIC_ACQUIRE) < pass)
+			if (remote.locked)
+				/* Until the dispatcher readies it */
+				fibre_schedule();
+			else
+				fibre_async_suspend_wake();
+		__atomic_add_fetch(&remote.seen, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void fn_remote_dispatch(void *__foo)
+{
+	struct ctx_remote *ctx, *next;
+	uint64_t val;
+	while (!__atomic_load_n(&remote.stop, __ATOMIC_ACQUIRE)) {
+		if (read(remote.efd, &val, sizeof(val)) != sizeof(val)) {
+			fibre_async_suspend_fd_readable(remote.efd);
+			continue;
+		}
+		pthread_mutex_lock(&remote.lock);
+		ctx = remote.head;
+		remote.head = NULL;
+		pthread_mutex_unlock(&remote.lock);
+		for (; ctx; ctx = next) {
+			next = ctx->next;
+			fibre_ready(ctx->f);
+		}
+	}
+}
+
+static void remote_kick(void)
+{
+	uint64_t one = 1;
+	ssize_t res = write(remote.efd, &one, sizeof(one));
+	assert(res == sizeof(one));
+}
+
+static void *remote_thread(void *arg)
+{
+	unsigned long pass, loop;
+	struct ctx_remote *ctx;
+	int res;
+	for (pass = 1; pass <= remote.passes; pass++) {
+		for (loop = 0; loop < remote.num; loop++) {
+			ctx = &remote.ctx[loop];
+			__atomic_store_n(&ctx->want, pass, __ATOMIC_RELEASE);
+			if (!remote.locked) {
+				res = fibre_wake_remote(ctx->f);
+				assert(!res);
+				continue;
+			}
+			pthread_mutex_lock(&remote.lock);
+			ctx->next = remote.head;
+			remote.head = ctx;
+			pthread_mutex_unlock(&remote.lock);
+			remote_kick();
+		}
+		while (__atomic_load_n(&remote.seen, __ATOMIC_ACQUIRE) <
+		       pass * remote.num)
+			sched_yield();
+	}
+	if (remote.locked) {
+		__atomic_store_n(&remote.stop, 1, __ATOMIC_RELEASE);
+		remote_kick();
+	}
+	return NULL;
+}
+
+/* Readied after the others, so they've all suspended (and been pointed at
+ * the selector's wake queue) by the time the thread starts */
+static void fn_remote_start(void *__foo)
+{
+	int res = pthread_create((pthread_t *)__foo, NULL, remote_thread,
+				 NULL);
+	assert(!res);
+}
+
+/****************/
+/* Mode "locks" */
+/****************/
+
+/* The fibre synchronisation primitives against pthread ones: lock and
+ * unlock with nobody else about, then contenders (fibres, or threads) that
+ * each take a mutex and yield while holding it, so every acquisition but
+ * the first has to wait for the holder to hand over, and a pair ping-ponging
+ * between two semaphores. */
+
+static struct {
+	unsigned long loops;
+	unsigned long count;
+	pthread_mutex_t pmutex;
+	struct fibre_mutex fmutex;
+	sem_t psem[2];
+	struct fibre_sem fsem[2];
+} locks;
+
+static void *fn_locks_pthread(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < locks.loops; loop++) {
+		pthread_mutex_lock(&locks.pmutex);
+		locks.count++;
+		sched_yield();
+		pthread_mutex_unlock(&locks.pmutex);
+	}
+	return NULL;
+}
+
+static void fn_locks_fibre(void *arg)
+{
+	struct fibre *me = fibre_get_current();
+	unsigned long loop;
+	for (loop = 0; loop < locks.loops; loop++) {
+		fibre_mutex_lock_inline(&locks.fmutex);
+		locks.count++;
+		fibre_ready(me);
+		fibre_schedule();
+		fibre_mutex_unlock_inline(&locks.fmutex);
+	}
+}
+
+static void *fn_sem_pthread(void *arg)
+{
+	long me = (long)arg;
+	unsigned long loop;
+	for (loop = 0; loop < locks.loops; loop++) {
+		if (!me)
+			sem_post(&locks.psem[1]);
+		sem_wait(&locks.psem[me]);
+		if (me)
+			sem_post(&locks.psem[0]);
+	}
+	return NULL;
+}
+
+static void fn_sem_fibre(void *arg)
+{
+	long me = (long)arg;
+	unsigned long loop;
+	for (loop = 0; loop < locks.loops; loop++) {
+		if (!me)
+			fibre_sem_post(&locks.fsem[1]);
+		fibre_sem_wait(&locks.fsem[me]);
+		if (me)
+			fibre_sem_post(&locks.fsem[0]);
+	}
+}
+
 
 /* Annoying. I want a printf that puts commas between thousands, millions, etc.
  * Seeing as I'm doing this, do the right-aligning stuff too. */
@@ -283,6 +795,907 @@ static void my_str_printf(const char *prefix, const char *arg)
 	printf("%s: %s\n", prefix, arg);
 }
 
+static unsigned long usecs(const struct rusage *before,
+			    const struct rusage *after)
+{
+	return (unsigned long)(after->ru_utime.tv_sec -
+			       before->ru_utime.tv_sec) * 1000000 +
+		after->ru_utime.tv_usec - before->ru_utime.tv_usec +
+		(unsigned long)(after->ru_stime.tv_sec -
+				before->ru_stime.tv_sec) * 1000000 +
+		after->ru_stime.tv_usec - before->ru_stime.tv_usec;
+}
+
+/* Runs one fibre configuration in a child process (the fibres can't be torn
+ * down), and returns its switches per second. */
+static unsigned long sweep_one(unsigned long num_fibres,
+			       unsigned long num_loops,
+			       unsigned int attr_flags, unsigned int attr_pool,
+			       int direct)
+{
+	struct rusage before, after;
+	unsigned long persec;
+	int fds[2], status;
+	pid_t pid;
+	int res = pipe(fds);
+	assert(!res);
+	pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		setup_fibre(num_fibres, num_loops, attr_flags, attr_pool,
+			    direct);
+		res = getrusage(RUSAGE_SELF, &before);
+		assert(!res);
+		start_fibre();
+		res = getrusage(RUSAGE_SELF, &after);
+		assert(!res);
+		persec = (double)num_fibres * num_loops /
+			 (usecs(&before, &after) + 1) * 1000000;
+		res = write(fds[1], &persec, sizeof(persec));
+		_exit(res != sizeof(persec));
+	}
+	close(fds[1]);
+	if (read(fds[0], &persec, sizeof(persec)) != sizeof(persec))
+		persec = 0;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return persec;
+}
+
+static void sweep(unsigned long max_fibres, unsigned long num_loops,
+		  unsigned int attr_flags, int direct)
+{
+	unsigned long num_fibres, loops;
+	printf("%12s %12s %16s %16s\n", "fibres", "loops",
+	       "switches/sec", "huge/sec");
+	for (num_fibres = 10; num_fibres <= max_fibres; num_fibres *= 4) {
+		/* Keep the total number of switches about the same */
+		loops = num_loops * DEFAULT_FIBRES / num_fibres;
+		if (!loops)
+			loops = 1;
+		printf("%12lu %12lu %16lu %16lu\n", num_fibres, loops,
+		       sweep_one(num_fibres, loops, attr_flags,
+				 FIBRE_ATTR_POOL_DEFAULT, direct),
+		       sweep_one(num_fibres, loops, attr_flags,
+				 FIBRE_ATTR_POOL_HUGE, direct));
+		fflush(stdout);
+	}
+}
+
+/* Each handoff is two switches */
+static void handoff(unsigned long num_loops)
+{
+	struct ctx_handoff shm, xfer;
+	struct fibre_selector *se;
+	struct rusage before, middle, after;
+	int res;
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_origin(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	setup_handoff(&shm, num_loops, fn_shm_producer, fn_shm_consumer);
+	setup_handoff(&xfer, num_loops, fn_xfer_producer, fn_xfer_consumer);
+	res = getrusage(RUSAGE_SELF, &before);
+	assert(!res);
+	start_handoff(&shm);
+	res = getrusage(RUSAGE_SELF, &middle);
+	assert(!res);
+	start_handoff(&xfer);
+	res = getrusage(RUSAGE_SELF, &after);
+	assert(!res);
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Number of handoffs", num_loops);
+	my_ul_printf("shared-memory handoffs per sec",
+		     (double)num_loops / (usecs(&before, &middle) + 1) * 1000000);
+	my_ul_printf("fibre_transfer() handoffs per sec",
+		     (double)num_loops / (usecs(&middle, &after) + 1) * 1000000);
+}
+
+/* Runs the ring in each backend the library has, in child processes */
+static void all_backends(unsigned long num_fibres, unsigned long num_loops,
+			 unsigned int attr_flags, unsigned int attr_pool,
+			 int direct)
+{
+	const char *names[16];
+	unsigned int loop, num = fibre_backend_list(names, 16);
+	if (num > 16)
+		num = 16;
+	printf("%12s %16s\n", "backend", "switches/sec");
+	for (loop = 0; loop < num; loop++) {
+		backend = names[loop];
+		printf("%12s %16lu\n", backend,
+		       sweep_one(num_fibres, num_loops, attr_flags, attr_pool,
+				 direct));
+		fflush(stdout);
+	}
+	backend = NULL;
+}
+
+static double wall(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 'num_loops' passes in all, spread over the pairs, for 1, 2, 4, ... up to
+ * 'max_workers' workers. Wall-clock time, as it's spread over threads. */
+static void mn_scaling(unsigned int max_workers, unsigned long num_fibres,
+		       unsigned long num_loops)
+{
+	unsigned long num_pairs = num_fibres / 2 ? num_fibres / 2 : 1;
+	struct ctx_mn *ctx = MALLOCn(struct ctx_mn, num_pairs);
+	unsigned int workers, loop;
+	struct fibre_mn *mn;
+	double start, base = 0, persec;
+	int res;
+	assert(ctx);
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	for (loop = 0; loop < num_pairs; loop++) {
+		pthread_mutex_init(&ctx[loop].lock, NULL);
+		res = fibre_create(&ctx[loop].f[0], fn_mn_0, &ctx[loop]);
+		assert(!res);
+		res = fibre_create(&ctx[loop].f[1], fn_mn_1, &ctx[loop]);
+		assert(!res);
+	}
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Number of pairs", num_pairs);
+	my_ul_printf("Passes per pair", num_loops / num_pairs);
+	printf("%12s %16s %12s\n", "workers", "passes/sec", "speedup");
+	for (workers = 1; ; workers *= 2) {
+		if (workers > max_workers)
+			workers = max_workers;
+		res = fibre_mn_create(&mn, workers);
+		assert(!res);
+		start = wall();
+		for (loop = 0; loop < num_pairs; loop++) {
+			ctx[loop].turn = 0;
+			ctx[loop].parked = NULL;
+			ctx[loop].loops = num_loops / num_pairs;
+			if (workers > 1) {
+				res = fibre_recreate(ctx[loop].f[0], fn_mn_0,
+						     &ctx[loop]);
+				res |= fibre_recreate(ctx[loop].f[1], fn_mn_1,
+						      &ctx[loop]);
+				assert(!res);
+			}
+			res = fibre_mn_submit(mn, ctx[loop].f[0]);
+			res |= fibre_mn_submit(mn, ctx[loop].f[1]);
+			assert(!res);
+		}
+		fibre_mn_wait(mn);
+		persec = (double)(num_loops / num_pairs) * num_pairs /
+			 (wall() - start);
+		fibre_mn_destroy(mn);
+		if (!base)
+			base = persec;
+		printf("%12u %16lu %12.2f\n", workers, (unsigned long)persec,
+		       persec / base);
+		fflush(stdout);
+		if (workers == max_workers)
+			break;
+	}
+	for (loop = 0; loop < num_pairs; loop++) {
+		assert(fibre_completed(ctx[loop].f[0]));
+		fibre_destroy(ctx[loop].f[0]);
+		fibre_destroy(ctx[loop].f[1]);
+	}
+	FREE(struct ctx_mn, ctx);
+	fibre_finish();
+}
+
+/* Runs 'f' until it completes or suspends, and if it has suspended, re-arms
+ * its fd */
+static int ep_by_hand_run(int epfd, struct fibre *f)
+{
+	struct epoll_event ev;
+	int fd;
+	fibre_schedule_to(f);
+	if (fibre_completed(f))
+		return 1;
+	fibre_async_get_fd_readable(f, &fd);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = f;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) && errno == ENOENT)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	return 0;
+}
+
+static void ep_by_hand(struct ctx_ep *ctx, unsigned long num_pairs)
+{
+	struct epoll_event evs[64];
+	struct fibre_selector *se;
+	unsigned long left = num_pairs * 2, loop;
+	int epfd = epoll_create1(0), num, res;
+	assert(epfd >= 0);
+	res = fibre_selector_origin(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	fibre_async_set_mask(FIBRE_ASYNC_FD_READABLE);
+	for (loop = 0; loop < num_pairs; loop++) {
+		left -= ep_by_hand_run(epfd, ctx[loop].f[1]);
+		left -= ep_by_hand_run(epfd, ctx[loop].f[0]);
+	}
+	while (left) {
+		num = epoll_wait(epfd, evs, 64, -1);
+		for (res = 0; res < num; res++)
+			left -= ep_by_hand_run(epfd, evs[res].data.ptr);
+	}
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	close(epfd);
+}
+
+/* Returns zero if there's no io_uring, for 'registered' modes */
+static int ep_selector(struct ctx_ep *ctx, unsigned long num_pairs,
+		       int registered)
+{
+	struct fibre_selector *se;
+	unsigned long loop;
+	int *fds = MALLOCn(int, num_pairs * 2);
+	int res = fibre_selector_epoll(&se);
+	assert(!res && fds);
+	res = fibre_push(se);
+	assert(!res);
+	for (loop = 0; loop < num_pairs; loop++) {
+		fds[loop * 2] = ctx[loop].fd[0];
+		fds[loop * 2 + 1] = ctx[loop].fd[1];
+	}
+	if (registered &&
+	    fibre_epoll_register_files(se, fds, num_pairs * 2)) {
+		FREE(int, fds);
+		fibre_pop(NULL);
+		fibre_selector_free(se);
+		return 0;
+	}
+	FREE(int, fds);
+	for (loop = 0; loop < num_pairs; loop++) {
+		fibre_ready(ctx[loop].f[1]);
+		fibre_ready(ctx[loop].f[0]);
+	}
+	fibre_schedule();
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	return 1;
+}
+
+/* 'num_loops' round trips in all, spread over the pairs */
+static void ep_compare(unsigned long num_fibres, unsigned long num_loops)
+{
+	unsigned long num_pairs = num_fibres / 2 ? num_fibres / 2 : 1;
+	struct ctx_ep *ctx = MALLOCn(struct ctx_ep, num_pairs);
+	static const char *names[] = {
+		"by-hand round trips per sec",
+		"epoll selector round trips per sec",
+		"io_uring round trips per sec",
+		"registered files round trips per sec"
+	};
+	unsigned long loop;
+	unsigned int mode;
+	double start, persec[4];
+	int res;
+	assert(ctx);
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	for (loop = 0; loop < num_pairs; loop++) {
+		res = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+				 ctx[loop].fd);
+		assert(!res);
+		ctx[loop].loops = num_loops / num_pairs;
+		res = fibre_create(&ctx[loop].f[0], fn_ep_client, &ctx[loop]);
+		res |= fibre_create(&ctx[loop].f[1], fn_ep_server, &ctx[loop]);
+		assert(!res);
+	}
+	for (mode = 0; mode < 4; mode++) {
+		for (loop = 0; mode && loop < num_pairs; loop++) {
+			res = fibre_recreate(ctx[loop].f[0], mode > 1 ?
+					     fn_io_client : fn_ep_client,
+					     &ctx[loop]);
+			res |= fibre_recreate(ctx[loop].f[1], mode > 1 ?
+					      fn_io_server : fn_ep_server,
+					      &ctx[loop]);
+			assert(!res);
+			if (mode == 2) {
+				fcntl(ctx[loop].fd[0], F_SETFL, 0);
+				fcntl(ctx[loop].fd[1], F_SETFL, 0);
+			}
+		}
+		start = wall();
+		if (!mode)
+			ep_by_hand(ctx, num_pairs);
+		else if (!ep_selector(ctx, num_pairs, mode == 3)) {
+			persec[mode] = 0;
+			continue;
+		}
+		persec[mode] = (double)(num_loops / num_pairs) * num_pairs /
+			       (wall() - start);
+	}
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Number of pairs", num_pairs);
+	my_ul_printf("Round trips per pair", num_loops / num_pairs);
+	for (mode = 0; mode < 4; mode++)
+		if (persec[mode])
+			my_ul_printf(names[mode], persec[mode]);
+		else
+			my_str_printf(names[mode], "no io_uring");
+	for (loop = 0; loop < num_pairs; loop++) {
+		assert(fibre_completed(ctx[loop].f[0]));
+		fibre_destroy(ctx[loop].f[0]);
+		fibre_destroy(ctx[loop].f[1]);
+		close(ctx[loop].fd[0]);
+		close(ctx[loop].fd[1]);
+	}
+	FREE(struct ctx_ep, ctx);
+	fibre_finish();
+}
+
+/* Walks the fibres, as a dispatcher without the poll set would */
+static unsigned long poll_naive(struct ctx_poll *ctx, unsigned long num)
+{
+	unsigned long loop, ready = 0;
+	int (*cb)(void *);
+	void *arg;
+	for (loop = 0; loop < num; loop++) {
+		fibre_async_get_use_cb(ctx[loop].f, &arg, &cb);
+		ready += !!cb(arg);
+	}
+	return ready;
+}
+
+/* 'num_loops' * DEFAULT_FIBRES callbacks in all, as -w does */
+static void poll_compare(unsigned long num_fibres, unsigned long num_loops)
+{
+	struct ctx_poll *ctx = MALLOCn(struct ctx_poll, num_fibres);
+	static const char *names[] = {
+		"walked nsecs per pass",
+		"poll set nsecs per pass",
+		"batched nsecs per pass"
+	};
+	unsigned long passes = num_loops * DEFAULT_FIBRES / num_fibres;
+	unsigned long loop, pass;
+	struct fibre_selector *se;
+	struct fibre_pollset *ps;
+	struct fibre *out[64];
+	struct fibre_attr attr;
+	unsigned int mode;
+	double start, nsecs[3];
+	int res;
+	assert(ctx);
+	if (!passes)
+		passes = 1;
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_origin(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	fibre_async_set_mask(FIBRE_ASYNC_CHECK_CB);
+	res = fibre_pollset_create(&ps);
+	assert(!res);
+	/* So that there can be lots of them */
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED;
+	for (loop = 0; loop < num_fibres; loop++) {
+		ctx[loop].flag = 0;
+		res = fibre_create_ex(&ctx[loop].f, &attr, fn_poll,
+				      &ctx[loop]);
+		assert(!res);
+		fibre_schedule_to(ctx[loop].f);
+		res = fibre_pollset_add(ps, ctx[loop].f);
+		assert(!res);
+	}
+	for (mode = 0; mode < 3; mode++) {
+		if (mode == 2)
+			for (loop = 0; loop < 4; loop++) {
+				res = fibre_pollset_batch(ps, poll_cbs[loop],
+							  poll_batches[loop]);
+				assert(!res);
+			}
+		start = wall();
+		for (pass = 0; pass < passes; pass++)
+			if (mode ? fibre_pollset_check(ps, out, 64) :
+				   poll_naive(ctx, num_fibres))
+				abort();
+		nsecs[mode] = (wall() - start) * 1e9 / passes;
+	}
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Number of fibres", num_fibres);
+	my_ul_printf("Number of passes", passes);
+	for (mode = 0; mode < 3; mode++)
+		my_ul_printf(names[mode], nsecs[mode]);
+	/* Ready them all, to let them finish */
+	for (loop = 0; loop < num_fibres; loop++)
+		ctx[loop].flag = 1;
+	while ((res = fibre_pollset_check(ps, out, 64)))
+		while (res--)
+			fibre_schedule_to(out[res]);
+	assert(!fibre_pollset_count(ps));
+	fibre_pollset_destroy(ps);
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	for (loop = 0; loop < num_fibres; loop++) {
+		assert(fibre_completed(ctx[loop].f));
+		fibre_destroy(ctx[loop].f);
+	}
+	FREE(struct ctx_poll, ctx);
+	fibre_finish();
+}
+
+/* Returns the seconds taken */
+static double remote_run(int locked, unsigned long num, unsigned long passes)
+{
+	struct fibre *start, *dispatch = NULL;
+	unsigned long loop;
+	pthread_t t;
+	double secs;
+	int res;
+	remote.num = num;
+	remote.passes = passes;
+	remote.seen = 0;
+	remote.locked = locked;
+	remote.head = NULL;
+	remote.stop = 0;
+	if (locked) {
+		res = fibre_create(&dispatch, fn_remote_dispatch, NULL);
+		assert(!res);
+		fibre_ready(dispatch);
+	}
+	for (loop = 0; loop < num; loop++) {
+		remote.ctx[loop].want = 0;
+		res = fibre_create(&remote.ctx[loop].f, fn_remote,
+				   &remote.ctx[loop]);
+		assert(!res);
+		fibre_ready(remote.ctx[loop].f);
+	}
+	res = fibre_create(&start, fn_remote_start, &t);
+	assert(!res);
+	fibre_ready(start);
+	secs = wall();
+	fibre_schedule();
+	secs = wall() - secs;
+	res = pthread_join(t, NULL);
+	assert(!res);
+	for (loop = 0; loop < num; loop++) {
+		assert(fibre_completed(remote.ctx[loop].f));
+		fibre_destroy(remote.ctx[loop].f);
+	}
+	fibre_destroy(start);
+	if (dispatch)
+		fibre_destroy(dispatch);
+	return secs;
+}
+
+/* 'num_loops' wakes in all, the round trips of one fibre, then passes over
+ * 'num_fibres' */
+static void remote_compare(unsigned long num_fibres, unsigned long num_loops)
+{
+	static const char *names[] = {
+		"fibre_wake_remote() round trip nsecs",
+		"mutex+eventfd round trip nsecs",
+		"fibre_wake_remote() wakes per sec",
+		"mutex+eventfd wakes per sec"
+	};
+	unsigned long passes = num_loops / num_fibres;
+	struct fibre_selector *se;
+	double res_mode[4];
+	unsigned int mode;
+	int res;
+	if (!passes)
+		passes = 1;
+	remote.ctx = MALLOCn(struct ctx_remote, num_fibres);
+	assert(remote.ctx);
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_epoll(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	pthread_mutex_init(&remote.lock, NULL);
+	remote.efd = eventfd(0, EFD_NONBLOCK);
+	assert(remote.efd >= 0);
+	for (mode = 0; mode < 4; mode++) {
+		if (mode < 2)
+			res_mode[mode] = remote_run(mode, 1, num_loops) * 1e9 /
+					 num_loops;
+		else
+			res_mode[mode] = passes * num_fibres /
+					 remote_run(mode - 2, num_fibres,
+						    passes);
+	}
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Round trips", num_loops);
+	my_ul_printf("Number of fibres", num_fibres);
+	my_ul_printf("Wakes per fibre", passes);
+	for (mode = 0; mode < 4; mode++)
+		my_ul_printf(names[mode], res_mode[mode]);
+	res = fibre_epoll_forget(se, remote.efd);
+	assert(!res);
+	close(remote.efd);
+	pthread_mutex_destroy(&remote.lock);
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	FREE(struct ctx_remote, remote.ctx);
+	fibre_finish();
+}
+
+/***************/
+/* Mode "chan" */
+/***************/
+
+/* A producer passing messages to a consumer: through a hand-rolled queue,
+ * switching to the consumer with fibre_schedule_to() for each one (and back
+ * again), and then through channels, unbuffered and buffered, with and
+ * without FIBRE_SYNC_SWITCH. */
+
+#define CHAN_BUF 64
+
+static struct {
+	unsigned long loops;
+	unsigned long sum;
+	struct fibre *producer;
+	struct fibre *consumer;
+	unsigned long ring[CHAN_BUF];
+	unsigned long head;
+	unsigned long num;
+	struct fibre_chan c;
+} chan;
+
+static void fn_ring_producer(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < chan.loops; loop++) {
+		chan.ring[(chan.head + chan.num++) % CHAN_BUF] = loop;
+		fibre_schedule_to(chan.consumer);
+	}
+	/* To finish */
+	fibre_ready(chan.consumer);
+}
+
+static void fn_ring_consumer(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < chan.loops; loop++) {
+		chan.sum += chan.ring[chan.head];
+		chan.head = (chan.head + 1) % CHAN_BUF;
+		chan.num--;
+		fibre_schedule_to(chan.producer);
+	}
+}
+
+static void fn_chan_producer(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < chan.loops; loop++)
+		fibre_chan_send(&chan.c, &loop);
+	fibre_chan_close(&chan.c);
+}
+
+static void fn_chan_consumer(void *arg)
+{
+	unsigned long msg;
+	while (!fibre_chan_recv(&chan.c, &msg))
+		chan.sum += msg;
+}
+
+static void chan_compare(unsigned long num_loops)
+{
+	static const char *names[] = {
+		"queue and switch msgs per sec",
+		"unbuffered msgs per sec",
+		"unbuffered (switch) msgs per sec",
+		"buffered msgs per sec",
+		"buffered (switch) msgs per sec"
+	};
+	struct fibre_selector *se;
+	double start, res_mode[5];
+	unsigned int mode;
+	int res;
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_runq(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	chan.loops = num_loops;
+	for (mode = 0; mode < 5; mode++) {
+		if (mode) {
+			res = fibre_chan_init(&chan.c, sizeof(unsigned long),
+					      mode < 3 ? 0 : CHAN_BUF,
+					      (mode & 1) ? 0 :
+					      FIBRE_SYNC_SWITCH);
+			assert(!res);
+		}
+		chan.head = chan.num = chan.sum = 0;
+		res = fibre_create(&chan.producer, mode ? fn_chan_producer :
+				   fn_ring_producer, NULL);
+		res |= fibre_create(&chan.consumer, mode ? fn_chan_consumer :
+				    fn_ring_consumer, NULL);
+		assert(!res);
+		/* The queue's consumer is only ever switched to */
+		fibre_ready(chan.producer);
+		if (mode)
+			fibre_ready(chan.consumer);
+		start = wall();
+		fibre_schedule();
+		res_mode[mode] = num_loops / (wall() - start);
+		assert(chan.sum == num_loops * (num_loops - 1) / 2);
+		assert(fibre_completed(chan.producer) &&
+		       fibre_completed(chan.consumer));
+		fibre_destroy(chan.producer);
+		fibre_destroy(chan.consumer);
+		if (mode)
+			fibre_chan_destroy(&chan.c);
+	}
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Messages", num_loops);
+	my_ul_printf("Buffered", CHAN_BUF);
+	for (mode = 0; mode < 5; mode++)
+		my_ul_printf(names[mode], res_mode[mode]);
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	fibre_finish();
+}
+
+/***************/
+/* Mode "keys" */
+/***************/
+
+/* Looking up per-fibre state from inside the fibre: by way of the userdata
+ * pointer to a side structure (as a library has to, if it shares userdata
+ * with others), and by keys, kept in the fibre and spilled, inline and not.
+ * The compiler is kept from seeing that it's the same fibre each time. */
+
+#define KEYS_SPILLED (FIBRE_KEYS_INLINE + 1)
+
+static struct {
+	unsigned long loops;
+	double rate[5];
+} keys;
+
+struct keys_side {
+	unsigned long val;
+};
+
+#define KEYS_LOOP(idx, expr) \
+	do { \
+		start = wall(); \
+		for (loop = 0, sum = 0; loop < keys.loops; loop++) { \
+			__asm__ __volatile__("" : "+r" (me)); \
+			sum += (expr); \
+		} \
+		keys.rate[idx] = keys.loops / (wall() - start); \
+		assert(sum == keys.loops); \
+	} while (0)
+
+static void fn_keys(void *arg)
+{
+	struct fibre *me = fibre_get_current();
+	unsigned int *key = arg, k;
+	struct keys_side side = { 1 };
+	unsigned long loop, sum;
+	double start;
+	int res;
+	fibre_set_userdata(me, &side);
+	for (k = 0; k <= KEYS_SPILLED; k++) {
+		res = fibre_key_set(me, key[k], (void *)1);
+		assert(!res);
+	}
+	KEYS_LOOP(0, ((struct keys_side *)fibre_get_userdata(me))->val);
+	KEYS_LOOP(1, (uintptr_t)fibre_key_get_inline(me, key[0]));
+	KEYS_LOOP(2, (uintptr_t)fibre_key_get(me, key[0]));
+	KEYS_LOOP(3, (uintptr_t)fibre_key_get_inline(me, key[KEYS_SPILLED]));
+	KEYS_LOOP(4, fibre_key_set_inline(me, key[0], (void *)1) +
+		     (uintptr_t)fibre_key_get_inline(me, key[0]));
+}
+
+static void keys_compare(unsigned long num_loops)
+{
+	static const char *names[] = {
+		"userdata and side struct per sec",
+		"inline key gets per sec",
+		"key gets per sec",
+		"spilled key gets per sec",
+		"inline key sets and gets per sec"
+	};
+	unsigned int key[KEYS_SPILLED + 1];
+	struct fibre_selector *se;
+	struct fibre *f;
+	unsigned int mode;
+	int res;
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_runq(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	for (mode = 0; mode <= KEYS_SPILLED; mode++) {
+		res = fibre_key_create(&key[mode], NULL);
+		assert(!res && key[mode] == mode);
+	}
+	keys.loops = num_loops;
+	res = fibre_create(&f, fn_keys, key);
+	assert(!res);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Lookups", num_loops);
+	for (mode = 0; mode < 5; mode++)
+		my_ul_printf(names[mode], keys.rate[mode]);
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	fibre_finish();
+}
+
+/* Returns the seconds taken */
+static double locks_threads(void *(*fn)(void *), unsigned long num)
+{
+	pthread_t *t = MALLOCn(pthread_t, num);
+	unsigned long loop;
+	double start;
+	int res;
+	assert(t);
+	start = wall();
+	for (loop = 0; loop < num; loop++) {
+		res = pthread_create(&t[loop], NULL, fn, (void *)loop);
+		assert(!res);
+	}
+	for (loop = 0; loop < num; loop++) {
+		res = pthread_join(t[loop], NULL);
+		assert(!res);
+	}
+	start = wall() - start;
+	FREE(pthread_t, t);
+	return start;
+}
+
+static double locks_fibres(void (*fn)(void *), unsigned long num)
+{
+	struct fibre **f = MALLOCn(struct fibre *, num);
+	unsigned long loop;
+	double start;
+	int res;
+	assert(f);
+	for (loop = 0; loop < num; loop++) {
+		res = fibre_create(&f[loop], fn, (void *)loop);
+		assert(!res);
+		fibre_ready(f[loop]);
+	}
+	start = wall();
+	fibre_schedule();
+	start = wall() - start;
+	for (loop = 0; loop < num; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+	FREE(struct fibre *, f);
+	return start;
+}
+
+/* 'num_loops' lock/unlocks and round trips, shared by the contenders */
+static void locks_compare(unsigned long num_fibres, unsigned long num_loops)
+{
+	static const char *names[] = {
+		"uncontended pthread locks per sec",
+		"uncontended fibre locks per sec",
+		"contended pthread locks per sec",
+		"contended fibre locks per sec",
+		"contended fibre (switch) locks per sec",
+		"sem_t round trips per sec",
+		"fibre_sem round trips per sec",
+		"fibre_sem (switch) round trips per sec"
+	};
+	struct fibre_selector *se;
+	unsigned long loop;
+	double start, res_mode[8];
+	unsigned int mode;
+	int res;
+	if (backend) {
+		res = fibre_backend_select(backend);
+		assert(!res);
+	}
+	res = fibre_init();
+	assert(!res);
+	res = fibre_selector_runq(&se);
+	assert(!res);
+	res = fibre_push(se);
+	assert(!res);
+	pthread_mutex_init(&locks.pmutex, NULL);
+	fibre_mutex_init(&locks.fmutex, 0);
+
+	start = wall();
+	for (loop = 0; loop < num_loops; loop++) {
+		pthread_mutex_lock(&locks.pmutex);
+		pthread_mutex_unlock(&locks.pmutex);
+	}
+	res_mode[0] = num_loops / (wall() - start);
+	start = wall();
+	for (loop = 0; loop < num_loops; loop++) {
+		fibre_mutex_lock_inline(&locks.fmutex);
+		/* So that the compiler can't see through it */
+		__asm__ __volatile__("" : : "r" (&locks.fmutex) : "memory");
+		fibre_mutex_unlock_inline(&locks.fmutex);
+	}
+	res_mode[1] = num_loops / (wall() - start);
+
+	locks.loops = num_loops / num_fibres ? num_loops / num_fibres : 1;
+	locks.count = 0;
+	res_mode[2] = locks.loops * num_fibres /
+		      locks_threads(fn_locks_pthread, num_fibres);
+	for (mode = 3; mode < 5; mode++) {
+		fibre_mutex_init(&locks.fmutex,
+				 mode == 4 ? FIBRE_SYNC_SWITCH : 0);
+		res_mode[mode] = locks.loops * num_fibres /
+				 locks_fibres(fn_locks_fibre, num_fibres);
+	}
+	assert(locks.count == locks.loops * num_fibres * 3);
+
+	locks.loops = num_loops;
+	sem_init(&locks.psem[0], 0, 0);
+	sem_init(&locks.psem[1], 0, 0);
+	res_mode[5] = num_loops / locks_threads(fn_sem_pthread, 2);
+	for (mode = 6; mode < 8; mode++) {
+		fibre_sem_init(&locks.fsem[0], 0,
+			       mode == 7 ? FIBRE_SYNC_SWITCH : 0);
+		fibre_sem_init(&locks.fsem[1], 0,
+			       mode == 7 ? FIBRE_SYNC_SWITCH : 0);
+		res_mode[mode] = num_loops / locks_fibres(fn_sem_fibre, 2);
+	}
+	sem_destroy(&locks.psem[0]);
+	sem_destroy(&locks.psem[1]);
+	pthread_mutex_destroy(&locks.pmutex);
+
+	my_str_printf("Backend", fibre_backend_name());
+	my_ul_printf("Number of contenders", num_fibres);
+	my_ul_printf("Locks per contender", num_loops / num_fibres);
+	my_ul_printf("Round trips", num_loops);
+	for (mode = 0; mode < 8; mode++)
+		my_ul_printf(names[mode], res_mode[mode]);
+	res = fibre_pop(NULL);
+	assert(!res);
+	fibre_selector_free(se);
+	fibre_finish();
+}
+
 #define ARG_INC() ({++argv; --argc; (argc ? *argv : NULL);})
 #define NEED_ARG(__p) \
 do { \
@@ -301,16 +1714,55 @@ static void usage(int ecode)
 	fprintf(stderr, "  -l/--loops <num>   = number of loops, def=%d\n",
 			DEFAULT_LOOPS);
 	fprintf(stderr, "  -s/--straw         = run strawman comparison\n");
+	fprintf(stderr, "  -i/--inline        = single-allocation fibres\n");
+	fprintf(stderr, "  -S/--shared        = fibres on the shared stack\n");
+	fprintf(stderr, "  -H/--huge          = stacks from huge-page arenas\n");
+	fprintf(stderr, "  -w/--sweep         = compare with/without -H, for\n"
+			"                       10 fibres up to -f (loops scaled)\n");
+	fprintf(stderr, "  -d/--direct        = use fibre_schedule_to_inline(), and\n"
+			"                       compare with fibre_schedule_to()\n");
+	fprintf(stderr, "  -t/--transfer      = producer/consumer handoff, shared\n"
+			"                       memory vs fibre_transfer()\n");
+	fprintf(stderr, "  -b/--backend <b>   = use context-switching backend <b>\n");
+	fprintf(stderr, "  -a/--all-backends  = compare all the backends the\n"
+			"                       library has\n");
+	fprintf(stderr, "  -m/--mn <num>      = M:N runtime scaling, -f/2 pairs\n"
+			"                       making -l passes in all, on 1,\n"
+			"                       2, 4, ... up to <num> workers\n");
+	fprintf(stderr, "  -e/--epoll         = -f/2 pairs of fibres making -l\n"
+			"                       round trips over socketpairs,\n"
+			"                       epoll selector vs a dispatcher\n"
+			"                       written by hand, and io_uring\n");
+	fprintf(stderr, "  -p/--pollset       = -f fibres suspended on callbacks,\n"
+			"                       cost of a pass over them, walked\n"
+			"                       vs the poll set\n");
+	fprintf(stderr, "  -r/--remote        = another thread waking fibres, -l\n"
+			"                       round trips with one, and -l\n"
+			"                       wakes over -f, fibre_wake_remote()\n"
+			"                       vs a mutex and eventfd\n");
+	fprintf(stderr, "  -k/--locks         = fibre mutex and semaphore vs pthread\n"
+			"                       ones, uncontended, -f contenders\n"
+			"                       for a mutex (-l locks in all), and\n"
+			"                       -l semaphore round trips\n");
+	fprintf(stderr, "  -c/--chan          = -l messages from one fibre to another,\n"
+			"                       by a queue and fibre_schedule_to(),\n"
+			"                       then by channels\n");
+	fprintf(stderr, "  -K/--keys          = -l lookups of per-fibre state, by\n"
+			"                       userdata and by fibre_key_get()\n");
 	fprintf(stderr, "  -h/-?/--help       = display this message\n");
 	exit(ecode);
 }
 int main(int argc, char *argv[])
 {
 	struct rusage before, after;
-	int res, is_straw = 0;
+	int res, is_straw = 0, is_sweep = 0, is_direct = 0, is_handoff = 0;
+	int is_all = 0, is_epoll = 0, is_pollset = 0, is_remote = 0;
+	int is_locks = 0, is_chan = 0, is_keys = 0;
+	unsigned int mn_workers = 0;
+	unsigned int attr_flags = 0, attr_pool = FIBRE_ATTR_POOL_DEFAULT;
 	unsigned long num_fibres = DEFAULT_FIBRES;
 	unsigned long num_loops = DEFAULT_LOOPS;
-	unsigned long num_switch, utime, stime;
+	unsigned long num_switch, utime, stime, slow = 0;
 	double persec;
 	const char *s;
 
@@ -330,6 +1782,68 @@ int main(int argc, char *argv[])
 			is_straw = 1;
 			continue;
 		}
+		if (!strcmp(s, "-i") || !strcmp(s, "--inline")) {
+			attr_flags |= FIBRE_ATTR_INLINE;
+			continue;
+		}
+		if (!strcmp(s, "-S") || !strcmp(s, "--shared")) {
+			attr_flags |= FIBRE_ATTR_SHARED;
+			continue;
+		}
+		if (!strcmp(s, "-H") || !strcmp(s, "--huge")) {
+			attr_pool = FIBRE_ATTR_POOL_HUGE;
+			continue;
+		}
+		if (!strcmp(s, "-d") || !strcmp(s, "--direct")) {
+			is_direct = 1;
+			continue;
+		}
+		if (!strcmp(s, "-b") || !strcmp(s, "--backend")) {
+			NEED_ARG(s);
+			backend = s;
+			continue;
+		}
+		if (!strcmp(s, "-a") || !strcmp(s, "--all-backends")) {
+			is_all = 1;
+			continue;
+		}
+		if (!strcmp(s, "-t") || !strcmp(s, "--transfer")) {
+			is_handoff = 1;
+			continue;
+		}
+		if (!strcmp(s, "-m") || !strcmp(s, "--mn")) {
+			NEED_ARG(s);
+			mn_workers = atoi(s);
+			continue;
+		}
+		if (!strcmp(s, "-e") || !strcmp(s, "--epoll")) {
+			is_epoll = 1;
+			continue;
+		}
+		if (!strcmp(s, "-p") || !strcmp(s, "--pollset")) {
+			is_pollset = 1;
+			continue;
+		}
+		if (!strcmp(s, "-r") || !strcmp(s, "--remote")) {
+			is_remote = 1;
+			continue;
+		}
+		if (!strcmp(s, "-c") || !strcmp(s, "--chan")) {
+			is_chan = 1;
+			continue;
+		}
+		if (!strcmp(s, "-K") || !strcmp(s, "--keys")) {
+			is_keys = 1;
+			continue;
+		}
+		if (!strcmp(s, "-k") || !strcmp(s, "--locks")) {
+			is_locks = 1;
+			continue;
+		}
+		if (!strcmp(s, "-w") || !strcmp(s, "--sweep")) {
+			is_sweep = 1;
+			continue;
+		}
 		if (strcmp(s, "-h") && strcmp(s, "-?") && strcmp(s, "--help")) {
 			fprintf(stderr, "Unrecognised option: %s\n", s);
 			usage(-1);
@@ -337,10 +1851,56 @@ int main(int argc, char *argv[])
 		usage(0);
 	}
 
+	if (is_all) {
+		all_backends(num_fibres, num_loops, attr_flags, attr_pool,
+			     is_direct);
+		return 0;
+	}
+	if (mn_workers) {
+		mn_scaling(mn_workers, num_fibres, num_loops);
+		return 0;
+	}
+	if (is_epoll) {
+		ep_compare(num_fibres, num_loops);
+		return 0;
+	}
+	if (is_pollset) {
+		poll_compare(num_fibres, num_loops);
+		return 0;
+	}
+	if (is_remote) {
+		remote_compare(num_fibres, num_loops);
+		return 0;
+	}
+	if (is_keys) {
+		keys_compare(num_loops);
+		return 0;
+	}
+	if (is_chan) {
+		chan_compare(num_loops);
+		return 0;
+	}
+	if (is_locks) {
+		locks_compare(num_fibres, num_loops);
+		return 0;
+	}
+	if (is_handoff) {
+		handoff(num_loops);
+		return 0;
+	}
+	if (is_sweep) {
+		sweep(num_fibres, num_loops, attr_flags, is_direct);
+		return 0;
+	}
+	/* The same with the out-of-line call, for comparison. It runs in a
+	 * child process, so has to be done before we set up our own fibres. */
+	if (is_direct && !is_straw)
+		slow = sweep_one(num_fibres, num_loops, attr_flags, attr_pool, 0);
 	if (is_straw)
 		setup_straw(num_fibres, num_loops);
 	else
-		setup_fibre(num_fibres, num_loops);
+		setup_fibre(num_fibres, num_loops, attr_flags, attr_pool,
+			    is_direct);
 
 	printf("Starting...\n");
 	res = getrusage(RUSAGE_SELF, &before);
@@ -358,6 +1918,22 @@ int main(int argc, char *argv[])
 	num_switch = num_loops * num_fibres;
 	printf("Config:\n");
 	my_str_printf("Run-time model", is_straw ? "straw-man" : "fibres");
+	if (!is_straw)
+		my_str_printf("Fibre allocation",
+			      (attr_flags & FIBRE_ATTR_SHARED) ?
+			      "shared stack" :
+			      (attr_flags & FIBRE_ATTR_INLINE) ?
+			      "single (inline)" : "separate");
+	if (!is_straw)
+		my_str_printf("Stack pool",
+			      attr_pool == FIBRE_ATTR_POOL_HUGE ?
+			      "huge-page arenas" : "default");
+	if (!is_straw)
+		my_str_printf("Backend", fibre_backend_name());
+	if (!is_straw)
+		my_str_printf("Switch call", is_direct ?
+			      "fibre_schedule_to_inline()" :
+			      "fibre_schedule_to()");
 	my_ul_printf("Number of contexts", num_fibres);
 	my_ul_printf("Number of loops", num_loops);
 	printf("Measurements:\n");
@@ -371,12 +1947,21 @@ int main(int argc, char *argv[])
 		before.ru_stime.tv_usec;
 	my_ul_printf("Number of usecs in user", utime);
 	my_ul_printf("Number of usecs in system", stime);
+	my_ul_printf("Peak resident set (KiB)", after.ru_maxrss);
 	printf("Results:\n");
 	my_ul_printf("Number of context switches", num_switch);
 	/* Calculate switches-per-second, using usertime + systime */
 	persec = (double)num_switch / (utime + stime) * 1000000;
 	/* I know, this rounds down, it's not an oversight. */
 	my_ul_printf("context switches per sec", (unsigned long)persec);
+	if (is_direct && !is_straw) {
+		my_ul_printf("... with fibre_schedule_to()", slow);
+		if (slow) {
+			my_padding("Inline fast-path gain (%)");
+			printf("Inline fast-path gain (%%): %.1f\n",
+			       (persec / slow - 1) * 100);
+		}
+	}
 
 	return 0;	
 }
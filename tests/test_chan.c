@@ -0,0 +1,320 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises channels: a three-stage pipeline shut down by closing, buffered
+ * and not, with and without FIBRE_SYNC_SWITCH, a send to a waiting receiver,
+ * the _try versions, closing with fibres waiting, select, and shared-stack
+ * fibres, which mustn't wait. */
+
+#define NUM_MSGS 1000
+
+static struct fibre_chan c1, c2, c3;
+static unsigned long sum;
+
+static void fn_source(void *arg)
+{
+	unsigned long loop;
+	int ret;
+	for (loop = 1; loop <= NUM_MSGS; loop++) {
+		ret = fibre_chan_send(&c1, &loop);
+		assert(!ret);
+	}
+	fibre_chan_close(&c1);
+}
+
+static void fn_double(void *arg)
+{
+	unsigned long msg;
+	int ret;
+	while (!fibre_chan_recv(&c1, &msg)) {
+		msg *= 2;
+		ret = fibre_chan_send(&c2, &msg);
+		assert(!ret);
+	}
+	fibre_chan_close(&c2);
+}
+
+static void fn_sink(void *arg)
+{
+	unsigned long msg;
+	int ret;
+	while (!(ret = fibre_chan_recv(&c2, &msg)))
+		sum += msg;
+	assert(ret == -EPIPE);
+}
+
+static void run(void (**fns)(void *), unsigned int num)
+{
+	struct fibre *f[4];
+	unsigned int loop;
+	int ret;
+	for (loop = 0; loop < num; loop++) {
+		ret = fibre_create(&f[loop], fns[loop], NULL);
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	fibre_schedule();
+	for (loop = 0; loop < num; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+}
+
+static void test_pipeline(unsigned long cap, unsigned int flags)
+{
+	void (*fns[])(void *) = { fn_sink, fn_double, fn_source };
+	int ret = fibre_chan_init(&c1, sizeof(unsigned long), cap, flags);
+	ret |= fibre_chan_init(&c2, sizeof(unsigned long), cap, flags);
+	assert(!ret);
+	sum = 0;
+	run(fns, 3);
+	assert(sum == (unsigned long)NUM_MSGS * (NUM_MSGS + 1));
+	fibre_chan_destroy(&c1);
+	fibre_chan_destroy(&c2);
+}
+
+static unsigned long got;
+
+static void fn_receiver(void *arg)
+{
+	unsigned long msg = 0;
+	int ret = fibre_chan_recv(&c1, &msg);
+	assert(!ret);
+	got = msg;
+}
+
+static void fn_sender(void *arg)
+{
+	unsigned long msg = 42;
+	int ret;
+	assert(c1.receivers.head);
+	ret = fibre_chan_send(&c1, &msg);
+	assert(!ret);
+	/* The receiver has it, and has run if it's switched to */
+	assert(!c1.receivers.head && !c1.num);
+	assert(got == ((c1.flags & FIBRE_SYNC_SWITCH) ? 42 : 0));
+}
+
+static void test_handoff(unsigned long cap, unsigned int flags)
+{
+	void (*fns[])(void *) = { fn_receiver, fn_sender };
+	int ret = fibre_chan_init(&c1, sizeof(unsigned long), cap, flags);
+	assert(!ret);
+	got = 0;
+	run(fns, 2);
+	assert(got == 42);
+	fibre_chan_destroy(&c1);
+}
+
+static void test_try(void)
+{
+	int msg = 1, out, ret;
+	ret = fibre_chan_init(&c1, sizeof(int), 0, 0);
+	assert(!ret);
+	assert(fibre_chan_try_send(&c1, &msg) == -EBUSY);
+	assert(fibre_chan_try_recv(&c1, &msg) == -EBUSY);
+	fibre_chan_close(&c1);
+	assert(fibre_chan_try_recv(&c1, &msg) == -EPIPE);
+	assert(fibre_chan_send(&c1, &msg) == -EPIPE);
+	fibre_chan_destroy(&c1);
+
+	/* Wrapping around the buffer */
+	ret = fibre_chan_init(&c1, sizeof(int), 3, 0);
+	assert(!ret);
+	for (msg = 0; msg < 6; msg++) {
+		ret = fibre_chan_try_send(&c1, &msg);
+		assert(!ret);
+		if (msg & 1)
+			continue;
+		ret = fibre_chan_try_recv(&c1, &out);
+		assert(!ret && out == msg / 2);
+	}
+	assert(c1.num == 3 && fibre_chan_try_send(&c1, &msg) == -EBUSY);
+	fibre_chan_close(&c1);
+	assert(fibre_chan_try_send(&c1, &msg) == -EPIPE);
+	/* What's buffered is still received */
+	for (msg = 3; msg < 6; msg++) {
+		ret = fibre_chan_recv(&c1, &out);
+		assert(!ret && out == msg);
+	}
+	assert(fibre_chan_recv(&c1, &msg) == -EPIPE);
+	fibre_chan_destroy(&c1);
+}
+
+static int closed;
+
+static void fn_closed(void *arg)
+{
+	unsigned long msg = 0;
+	int ret;
+	if (arg)
+		ret = fibre_chan_send(&c1, &msg);
+	else
+		ret = fibre_chan_recv(&c2, &msg);
+	assert(ret == -EPIPE);
+	closed++;
+}
+
+static void test_close(void)
+{
+	struct fibre *f[4];
+	unsigned int loop;
+	int ret = fibre_chan_init(&c1, sizeof(unsigned long), 1, 0);
+	ret |= fibre_chan_init(&c2, sizeof(unsigned long), 0, 0);
+	assert(!ret);
+	ret = fibre_chan_try_send(&c1, &c1);
+	assert(!ret);
+	/* Two senders on a full channel, two receivers on an empty one */
+	closed = 0;
+	for (loop = 0; loop < 4; loop++) {
+		ret = fibre_create(&f[loop], fn_closed,
+				   (void *)(long)(loop & 1));
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	fibre_schedule();
+	assert(!closed && c1.senders.head && c2.receivers.head);
+	fibre_chan_close(&c1);
+	fibre_chan_close(&c2);
+	fibre_schedule();
+	assert(closed == 4);
+	for (loop = 0; loop < 4; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+	fibre_chan_destroy(&c1);
+	fibre_chan_destroy(&c2);
+}
+
+static int selected[4];
+
+static void fn_select(void *arg)
+{
+	unsigned long in1, in2, out = 7;
+	struct fibre_chan_op ops[] = {
+		{ .chan = &c1, .msg = &in1 },
+		{ .chan = &c2, .msg = &in2 },
+		{ .chan = &c3, .send = 1, .msg = &out }
+	};
+	int ret, loop;
+	assert(fibre_chan_try_select(ops, 3) == -EBUSY);
+	for (loop = 0; loop < 4; loop++) {
+		ret = fibre_chan_select(ops, 3);
+		assert(ret >= 0 && ret < 3);
+		/* Off every queue */
+		assert(!c1.receivers.head && !c2.receivers.head &&
+		       !c3.senders.head);
+		selected[loop] = ret;
+		if (ret == 1)
+			assert(!ops[1].ret && in2 == 5);
+		else if (ret == 0)
+			assert(ops[0].ret == -EPIPE);
+		else
+			assert(!ops[2].ret);
+	}
+}
+
+static void fn_select_peer(void *arg)
+{
+	unsigned long msg = 5;
+	int ret = fibre_chan_send(&c2, &msg);
+	assert(!ret);
+	ret = fibre_chan_recv(&c3, &msg);
+	assert(!ret && msg == 7);
+	fibre_chan_close(&c1);
+	/* Buffered, as the select has been resumed already */
+	ret = fibre_chan_send(&c2, &msg);
+	assert(!ret && c2.num == 1);
+}
+
+static void test_select(unsigned int flags)
+{
+	void (*fns[])(void *) = { fn_select, fn_select_peer };
+	int ret = fibre_chan_init(&c1, sizeof(unsigned long), 0, flags);
+	ret |= fibre_chan_init(&c2, sizeof(unsigned long), 1, flags);
+	ret |= fibre_chan_init(&c3, sizeof(unsigned long), 0, flags);
+	assert(!ret);
+	run(fns, 2);
+	assert(selected[0] == 1 && selected[1] == 2);
+	/* Both can be done by then, so it's the first */
+	assert(selected[2] == 0 && selected[3] == 0);
+	fibre_chan_destroy(&c1);
+	fibre_chan_destroy(&c2);
+	fibre_chan_destroy(&c3);
+}
+
+static void fn_shared(void *arg)
+{
+	unsigned long msg = 0;
+	struct fibre_chan_op op = { .chan = &c1, .msg = &msg };
+	int ret;
+	assert(fibre_chan_recv(&c1, &msg) == -EINVAL);
+	assert(fibre_chan_select(&op, 1) == -EINVAL);
+	assert(!c1.receivers.head);
+	/* Let the sender wait, then there's no need to */
+	fibre_ready(fibre_get_current());
+	fibre_schedule();
+	assert(c1.senders.head);
+	ret = fibre_chan_recv(&c1, &msg);
+	assert(!ret && msg == 42);
+}
+
+static void fn_shared_peer(void *arg)
+{
+	unsigned long msg = 42;
+	int ret = fibre_chan_send(&c1, &msg);
+	assert(!ret);
+}
+
+static void test_shared(void)
+{
+	struct fibre_attr attr;
+	struct fibre *f[2];
+	int ret = fibre_chan_init(&c1, sizeof(unsigned long), 0, 0);
+	assert(!ret);
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED;
+	ret = fibre_create_ex(&f[0], &attr, fn_shared, NULL);
+	ret |= fibre_create(&f[1], fn_shared_peer, NULL);
+	assert(!ret);
+	fibre_ready(f[0]);
+	fibre_ready(f[1]);
+	fibre_schedule();
+	assert(fibre_completed(f[0]) && fibre_completed(f[1]));
+	fibre_destroy(f[0]);
+	fibre_destroy(f[1]);
+	fibre_chan_destroy(&c1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	test_pipeline(0, 0);
+	test_pipeline(0, FIBRE_SYNC_SWITCH);
+	test_pipeline(4, 0);
+	test_pipeline(4, FIBRE_SYNC_SWITCH);
+	test_handoff(0, 0);
+	test_handoff(0, FIBRE_SYNC_SWITCH);
+	test_handoff(4, FIBRE_SYNC_SWITCH);
+	test_try();
+	test_close();
+	test_select(0);
+	test_select(FIBRE_SYNC_SWITCH);
+	test_shared();
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
@@ -0,0 +1,420 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <assert.h>
+
+/* Exercises the epoll selector: pairs of fibres echoing over socketpairs,
+ * several fibres waiting on one fd, an edge that arrives while nobody's
+ * waiting, waiting again after reading only some of what an edge brought,
+ * sleeping alongside, abort of fibres waiting on an fd and on a
+ * timer, suspensions with deadlines, an fd epoll can't watch, and
+ * forgetting (and reusing) fds. */
+
+#define NUM_PAIRS 20
+#define NUM_ROUNDS 200
+#define NUM_READERS 5
+
+static struct fibre_selector *se;
+
+static void nonblock(int fd)
+{
+	int ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	assert(!ret);
+}
+
+static void read_wait(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+	while ((ret = read(fd, buf, len)) < 0) {
+		assert(errno == EAGAIN);
+		ret = fibre_async_suspend_fd_readable(fd);
+		assert(!ret);
+	}
+	assert((size_t)ret == len);
+}
+
+static int socks[NUM_PAIRS][2];
+
+static void fn_client(void *arg)
+{
+	int fd = socks[(unsigned long)arg][0];
+	unsigned int loop, val;
+	ssize_t ret;
+	for (loop = 0; loop < NUM_ROUNDS; loop++) {
+		ret = write(fd, &loop, sizeof(loop));
+		assert(ret == sizeof(loop));
+		read_wait(fd, &val, sizeof(val));
+		assert(val == loop + 1);
+	}
+}
+
+static void fn_server(void *arg)
+{
+	int fd = socks[(unsigned long)arg][1];
+	unsigned int loop, val;
+	ssize_t ret;
+	for (loop = 0; loop < NUM_ROUNDS; loop++) {
+		read_wait(fd, &val, sizeof(val));
+		assert(val == loop);
+		val++;
+		ret = write(fd, &val, sizeof(val));
+		assert(ret == sizeof(val));
+	}
+}
+
+static void test_echo(void)
+{
+	struct fibre *f[NUM_PAIRS][2];
+	unsigned long loop;
+	int ret;
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, socks[loop]);
+		assert(!ret);
+		nonblock(socks[loop][0]);
+		nonblock(socks[loop][1]);
+		ret = fibre_create(&f[loop][1], fn_server, (void *)loop);
+		ret |= fibre_create(&f[loop][0], fn_client, (void *)loop);
+		assert(!ret);
+		fibre_ready(f[loop][1]);
+		fibre_ready(f[loop][0]);
+	}
+	/* Back when they've all finished */
+	fibre_schedule();
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		assert(fibre_completed(f[loop][0]));
+		assert(fibre_completed(f[loop][1]));
+		fibre_destroy(f[loop][0]);
+		fibre_destroy(f[loop][1]);
+		ret = fibre_epoll_forget(se, socks[loop][0]);
+		ret |= fibre_epoll_forget(se, socks[loop][1]);
+		assert(!ret);
+		close(socks[loop][0]);
+		close(socks[loop][1]);
+	}
+}
+
+static int pfd[2];
+static unsigned long readers;
+
+static void fn_reader(void *arg)
+{
+	char c;
+	int ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	readers++;
+	read_wait(pfd[0], &c, 1);
+}
+
+static void fn_writer(void *arg)
+{
+	ssize_t ret;
+	/* Everyone's waiting by now */
+	assert(!readers);
+	ret = write(pfd[1], "hello", NUM_READERS);
+	assert(ret == NUM_READERS);
+}
+
+/* Reads one byte, then waits again without reading, after the next byte
+ * has arrived, so there'll be no edge for it */
+static void fn_late(void *arg)
+{
+	char c;
+	int ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	read_wait(pfd[0], &c, 1);
+	assert(c == 'a');
+	ret = fibre_sleep_for(5000000);
+	assert(!ret);
+	ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	read_wait(pfd[0], &c, 1);
+	assert(c == 'b');
+}
+
+static void fn_early(void *arg)
+{
+	ssize_t ret = write(pfd[1], "a", 1);
+	assert(ret == 1);
+	fibre_sleep_for(2000000);
+	ret = write(pfd[1], "b", 1);
+	assert(ret == 1);
+}
+
+/* Reads one byte of the two that were written together, then waits again,
+ * when there'll be no edge for the other one */
+static void fn_partial(void *arg)
+{
+	char c;
+	int ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	ret = read(pfd[0], &c, 1);
+	assert(ret == 1 && c == 'a');
+	ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	ret = read(pfd[0], &c, 1);
+	assert(ret == 1 && c == 'b');
+}
+
+static void fn_both(void *arg)
+{
+	ssize_t ret = write(pfd[1], "ab", 2);
+	assert(ret == 2);
+}
+
+static void test_shared(void)
+{
+	struct fibre *f[NUM_READERS + 1];
+	unsigned long loop;
+	int ret = pipe(pfd);
+	assert(!ret);
+	nonblock(pfd[0]);
+	for (loop = 0; loop <= NUM_READERS; loop++) {
+		ret = fibre_create(&f[loop], loop < NUM_READERS ? fn_reader :
+				   fn_writer, NULL);
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	fibre_schedule();
+	assert(readers == NUM_READERS);
+	ret = fibre_recreate(f[0], fn_late, NULL);
+	ret |= fibre_recreate(f[1], fn_early, NULL);
+	assert(!ret);
+	fibre_ready(f[0]);
+	fibre_ready(f[1]);
+	fibre_schedule();
+	ret = fibre_recreate(f[0], fn_partial, NULL);
+	ret |= fibre_recreate(f[1], fn_both, NULL);
+	assert(!ret);
+	fibre_ready(f[0]);
+	fibre_ready(f[1]);
+	fibre_schedule();
+	for (loop = 0; loop <= NUM_READERS; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+}
+
+static struct fibre *victims[2];
+static uint64_t woken[2];
+
+static void fn_victim(void *arg)
+{
+	int ret;
+	if (arg)
+		ret = fibre_sleep_for(10000000000ULL);
+	else
+		ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(ret == -EINTR);
+	woken[arg ? 1 : 0] = fibre_time_ns();
+}
+
+static void fn_aborter(void *arg)
+{
+	unsigned int loop;
+	int ret = fibre_sleep_for(1000000);
+	assert(!ret);
+	for (loop = 0; loop < 2; loop++) {
+		fibre_async_abort(victims[loop]);
+		ret = fibre_ready(victims[loop]);
+		assert(!ret);
+	}
+}
+
+static void test_abort(void)
+{
+	struct fibre *f;
+	uint64_t start = fibre_time_ns();
+	unsigned long loop;
+	int ret = fibre_create(&f, fn_aborter, NULL);
+	assert(!ret);
+	for (loop = 0; loop < 2; loop++) {
+		ret = fibre_create(&victims[loop], fn_victim, (void *)loop);
+		assert(!ret);
+		fibre_ready(victims[loop]);
+	}
+	fibre_ready(f);
+	fibre_schedule();
+	for (loop = 0; loop < 2; loop++) {
+		assert(fibre_completed(victims[loop]));
+		assert(woken[loop] - start < 1000000000);
+		fibre_destroy(victims[loop]);
+	}
+	fibre_destroy(f);
+}
+
+static int never(void *arg)
+{
+	return 0;
+}
+
+/* Each way of suspending with a deadline, timing out or not */
+static void fn_timeout(void *arg)
+{
+	unsigned long kind = (unsigned long)arg;
+	uint64_t start = fibre_time_ns(), deadline = start + 3000000;
+	int ret;
+	switch (kind) {
+	case 0:
+		ret = fibre_async_suspend_fd_readable_timeout(pfd[0], deadline);
+		break;
+	case 1:
+		ret = fibre_async_suspend_use_cb_timeout(NULL, never, deadline);
+		break;
+	case 2:
+		/* Retried until it times out */
+		while (!(ret = fibre_async_suspend_poll_timeout(deadline)))
+			;
+		break;
+	case 3:
+		/* Readable in time (see fn_timeout_writer) */
+		ret = fibre_async_suspend_fd_readable_timeout(
+						pfd[0], start + 1000000000);
+		assert(!ret);
+		return;
+	default:
+		/* Aborted first */
+		ret = fibre_async_suspend_use_cb_timeout(NULL, never,
+							 start + 1000000000);
+		assert(ret == -EINTR);
+		return;
+	}
+	assert(ret == -ETIMEDOUT);
+	assert(fibre_time_ns() >= deadline);
+	assert(fibre_time_ns() - start < 1000000000);
+}
+
+static void fn_timeout_writer(void *arg)
+{
+	ssize_t ret;
+	int err = fibre_sleep_for(10000000);
+	assert(!err);
+	ret = write(pfd[1], "x", 1);
+	assert(ret == 1);
+	fibre_async_abort(victims[0]);
+	err = fibre_ready(victims[0]);
+	assert(!err);
+}
+
+static void test_timeout(void)
+{
+	struct fibre *f[6];
+	unsigned long loop;
+	char c;
+	int ret;
+	for (loop = 0; loop < 6; loop++) {
+		ret = fibre_create(&f[loop], loop < 5 ? fn_timeout :
+				   fn_timeout_writer, (void *)loop);
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	victims[0] = f[4];
+	fibre_schedule();
+	for (loop = 0; loop < 6; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+	ret = read(pfd[0], &c, 1);
+	assert(ret == 1);
+}
+
+static void fn_can_suspend(void *arg)
+{
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_FD_READABLE));
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_CHECK_CB));
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_POLL));
+}
+
+static void fn_devnull(void *arg)
+{
+	int fd = open("/dev/null", O_RDONLY);
+	int ret;
+	assert(fd >= 0);
+	/* Not pollable, so straight back */
+	ret = fibre_async_suspend_fd_readable(fd);
+	assert(!ret);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *other;
+	struct fibre *f;
+	uint64_t start;
+	int ret, fd;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	/* The origin has no fibre to suspend, so it sleeps the thread */
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_FD_READABLE));
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_CHECK_CB));
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_POLL));
+	start = fibre_time_ns();
+	ret = fibre_sleep_for(2000000);
+	assert(!ret);
+	assert(fibre_time_ns() - start >= 2000000);
+	ret = fibre_create(&f, fn_can_suspend, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+
+	/* With nothing to do, the origin just carries on */
+	fibre_schedule();
+
+	test_echo();
+	test_shared();
+	test_abort();
+	test_timeout();
+	ret = fibre_create(&f, fn_devnull, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+
+	/* A new fd with the old number gets added afresh */
+	fd = pfd[0];
+	ret = fibre_epoll_forget(se, fd);
+	assert(!ret);
+	close(pfd[0]);
+	close(pfd[1]);
+	ret = pipe(pfd);
+	assert(!ret);
+	assert(pfd[0] == fd);
+	nonblock(pfd[0]);
+	ret = fibre_recreate(f, fn_early, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	ret = fibre_create(&victims[0], fn_late, NULL);
+	assert(!ret);
+	fibre_ready(victims[0]);
+	fibre_schedule();
+	assert(fibre_completed(f) && fibre_completed(victims[0]));
+	fibre_destroy(f);
+	fibre_destroy(victims[0]);
+	ret = fibre_epoll_forget(se, pfd[0]);
+	assert(!ret);
+	close(pfd[0]);
+	close(pfd[1]);
+
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	ret = fibre_selector_runq(&other);
+	assert(!ret);
+	ret = fibre_epoll_forget(other, 0);
+	assert(ret == -EINVAL);
+	fibre_selector_free(other);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
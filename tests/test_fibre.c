@@ -1,6 +1,8 @@
 #include <fibre.h>
+#include <fibre_inline.h>
 
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 
 #undef DO_TRACE
@@ -42,6 +44,122 @@ static void f2(void *__foo)
 	TRACE(("f2 ending\n"));
 }
 
+/* The same ping-pong with fibre_schedule_to_inline() on one side, mixed with
+ * the out-of-line version on the other */
+#define INLINE_TARGET 100000
+
+static void fn_inline(void *__foo)
+{
+	struct testfoo *foo = (struct testfoo *)__foo;
+	while ((++foo->c) < foo->tgt)
+		fibre_schedule_to_inline(foo->f1);
+}
+
+static void test_schedule_inline(void)
+{
+	struct testfoo foo = {
+		.tgt = INLINE_TARGET,
+		.c = 0
+	};
+	struct fibre_selector *se;
+	int ret;
+
+	ret = fibre_selector_origin(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	ret = fibre_create(&foo.f1, f1, &foo);
+	assert(!ret);
+	ret = fibre_create(&foo.f2, fn_inline, &foo);
+	assert(!ret);
+	fibre_schedule_to_inline(foo.f1);
+	/* Whichever completed first, the other is one switch from done */
+	if (!fibre_completed(foo.f1))
+		fibre_schedule_to_inline(foo.f1);
+	if (!fibre_completed(foo.f2))
+		fibre_schedule_to_inline(foo.f2);
+	assert(foo.c >= INLINE_TARGET);
+	fibre_destroy(foo.f1);
+	fibre_destroy(foo.f2);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+}
+
+/* Producer/consumer with fibre_transfer(), the consumer replying to each item
+ * with twice its value, and handing the total to the origin at the end. */
+#define TRANSFER_ITEMS 1000
+
+static struct fibre *producer, *consumer;
+
+static void fn_producer(void *arg)
+{
+	unsigned long loop;
+	void *ack;
+	for (loop = 1; loop <= TRANSFER_ITEMS; loop++) {
+		ack = fibre_transfer(consumer, (void *)loop);
+		assert(ack == (void *)(2 * loop));
+	}
+}
+
+static void fn_consumer(void *arg)
+{
+	unsigned long sum = 0;
+	void *msg = fibre_transfer(producer, NULL);
+	while (msg) {
+		sum += (unsigned long)msg;
+		msg = fibre_transfer_inline(producer,
+					    (void *)(2 * (unsigned long)msg));
+	}
+	/* The producer has completed, and we've been resumed by the origin */
+	fibre_transfer(NULL, (void *)sum);
+}
+
+static struct fibre *cb_none(void *arg)
+{
+	return NULL;
+}
+
+static void test_transfer(int use_scheduler, unsigned int prod_flags,
+			  unsigned int cons_flags)
+{
+	struct fibre_selector *se;
+	struct fibre_attr attr;
+	void *msg;
+	int ret;
+
+	if (use_scheduler)
+		ret = fibre_selector_scheduler(&se, cb_none, NULL, 1);
+	else
+		ret = fibre_selector_origin(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+
+	fibre_attr_init(&attr);
+	attr.flags |= prod_flags;
+	ret = fibre_create_ex(&producer, &attr, fn_producer, NULL);
+	assert(!ret);
+	fibre_attr_init(&attr);
+	attr.flags |= cons_flags;
+	ret = fibre_create_ex(&consumer, &attr, fn_consumer, NULL);
+	assert(!ret);
+
+	/* Back when the producer completes */
+	msg = fibre_transfer(consumer, (void *)1);
+	assert(!msg && fibre_completed(producer));
+	msg = fibre_transfer(consumer, NULL);
+	assert(msg == (void *)(TRANSFER_ITEMS * (TRANSFER_ITEMS + 1UL) / 2));
+	fibre_schedule_to(consumer);
+	assert(fibre_completed(consumer));
+
+	fibre_destroy(producer);
+	fibre_destroy(consumer);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+}
+
 int main(int argc, char *argv[])
 {
 	struct testfoo foo = {
@@ -54,6 +172,13 @@ int main(int argc, char *argv[])
 	ret = fibre_init();
 	assert(!ret);
 
+	/* Whichever backend we got, it's now the only one we can have */
+	assert(fibre_backend_name());
+	ret = fibre_backend_select(fibre_backend_name());
+	assert(!ret);
+	ret = fibre_backend_select("no-such-backend");
+	assert(ret == -ENOENT);
+
 	ret = fibre_selector_origin(&se);
 	assert(!ret && se);
 
@@ -85,5 +210,11 @@ int main(int argc, char *argv[])
 	fibre_destroy(foo.f1);
 	fibre_destroy(foo.f2);
 	fibre_selector_free(se);
+
+	test_schedule_inline();
+	test_transfer(0, 0, 0);
+	test_transfer(1, 0, 0);
+	test_transfer(0, FIBRE_ATTR_SHARED, FIBRE_ATTR_SHARED);
+	test_transfer(0, 0, FIBRE_ATTR_SHARED);
 	return 0;
 }
@@ -0,0 +1,329 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+/* Exercises FIBRE_ASYNC_IO in the epoll selector: pairs of fibres echoing
+ * over socketpairs, blocking and non-blocking, with and without registered
+ * files and buffers, accept and connect over loopback TCP, abort, and a
+ * registered fd that's forgotten, closed and its number reused. Then the
+ * same echoing without FIBRE_ASYNC_IO, which falls back to waiting for
+ * readability, and without a selector that can suspend at all. (Without
+ * io_uring in the kernel, the io_uring runs are the fallback too.) */
+
+#define NUM_PAIRS 20
+#define NUM_ROUNDS 200
+
+static struct fibre_selector *se;
+static int socks[NUM_PAIRS][2];
+/* Where the fibres read and write, which can be a registered buffer */
+static char bufs[NUM_PAIRS][2][64];
+
+static void fn_client(void *arg)
+{
+	unsigned long me = (unsigned long)arg;
+	char *buf = bufs[me][0];
+	unsigned int loop;
+	ssize_t ret;
+	for (loop = 0; loop < NUM_ROUNDS; loop++) {
+		ret = snprintf(buf, 64, "ping %u", loop);
+		ret = fibre_io_write(socks[me][0], buf, ret + 1);
+		assert(ret > 0);
+		ret = fibre_io_read(socks[me][0], buf, 64);
+		assert(ret > 0);
+		assert(!strcmp(buf, "pong"));
+	}
+}
+
+static void fn_server(void *arg)
+{
+	unsigned long me = (unsigned long)arg;
+	char *buf = bufs[me][1], expect[64];
+	unsigned int loop;
+	ssize_t ret;
+	for (loop = 0; loop < NUM_ROUNDS; loop++) {
+		ret = fibre_io_read(socks[me][1], buf, 64);
+		assert(ret > 0);
+		snprintf(expect, 64, "ping %u", loop);
+		assert(!strcmp(buf, expect));
+		ret = fibre_io_write(socks[me][1], "pong", 5);
+		assert(ret == 5);
+	}
+}
+
+static void echo(int nonblock, int registered)
+{
+	struct fibre *f[NUM_PAIRS][2];
+	int fds[NUM_PAIRS * 2];
+	struct iovec iov;
+	unsigned long loop;
+	int ret;
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		ret = socketpair(AF_UNIX, SOCK_STREAM |
+				 (nonblock ? SOCK_NONBLOCK : 0), 0,
+				 socks[loop]);
+		assert(!ret);
+		fds[loop * 2] = socks[loop][0];
+		fds[loop * 2 + 1] = socks[loop][1];
+		ret = fibre_create(&f[loop][1], fn_server, (void *)loop);
+		ret |= fibre_create(&f[loop][0], fn_client, (void *)loop);
+		assert(!ret);
+		fibre_ready(f[loop][1]);
+		fibre_ready(f[loop][0]);
+	}
+	if (registered) {
+		ret = fibre_epoll_register_files(se, fds, NUM_PAIRS * 2);
+		assert(!ret);
+		iov.iov_base = bufs;
+		iov.iov_len = sizeof(bufs);
+		ret = fibre_epoll_register_buffers(se, &iov, 1);
+		assert(!ret);
+	}
+	fibre_schedule();
+	if (registered) {
+		ret = fibre_epoll_register_files(se, NULL, 0);
+		ret |= fibre_epoll_register_buffers(se, NULL, 0);
+		assert(!ret);
+	}
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		assert(fibre_completed(f[loop][0]));
+		assert(fibre_completed(f[loop][1]));
+		fibre_destroy(f[loop][0]);
+		fibre_destroy(f[loop][1]);
+		ret = fibre_epoll_forget(se, socks[loop][0]);
+		ret |= fibre_epoll_forget(se, socks[loop][1]);
+		assert(!ret);
+		close(socks[loop][0]);
+		close(socks[loop][1]);
+	}
+}
+
+static int lfd;
+static struct sockaddr_in addr;
+
+static void fn_accept(void *arg)
+{
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	char buf[8];
+	int fd = fibre_io_accept(lfd, (struct sockaddr *)&peer, &len,
+				 SOCK_NONBLOCK);
+	ssize_t ret;
+	assert(fd >= 0);
+	assert(len == sizeof(peer));
+	assert(peer.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+	ret = fibre_io_read(fd, buf, sizeof(buf));
+	assert(ret == 6 && !strcmp(buf, "hello"));
+	close(fd);
+}
+
+static void fn_connect(void *arg)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0), ret;
+	assert(fd >= 0);
+	ret = fibre_io_connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(!ret);
+	ret = fibre_io_write(fd, "hello", 6);
+	assert(ret == 6);
+	close(fd);
+}
+
+static void test_tcp(void)
+{
+	socklen_t len = sizeof(addr);
+	struct fibre *f[2];
+	int ret;
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	assert(lfd >= 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ret = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+	ret |= listen(lfd, 1);
+	ret |= getsockname(lfd, (struct sockaddr *)&addr, &len);
+	assert(!ret);
+	/* The accept goes first, so has to wait */
+	ret = fibre_create(&f[0], fn_accept, NULL);
+	ret |= fibre_create(&f[1], fn_connect, NULL);
+	assert(!ret);
+	fibre_ready(f[0]);
+	fibre_ready(f[1]);
+	fibre_schedule();
+	assert(fibre_completed(f[0]) && fibre_completed(f[1]));
+	fibre_destroy(f[0]);
+	fibre_destroy(f[1]);
+	fibre_epoll_forget(se, lfd);
+	close(lfd);
+}
+
+static struct fibre *victim;
+
+static void fn_victim(void *arg)
+{
+	char buf[8];
+	ssize_t ret = fibre_io_read(socks[0][0], buf, sizeof(buf));
+	assert(ret == -EINTR);
+}
+
+static void fn_aborter(void *arg)
+{
+	int ret = fibre_sleep_for(1000000);
+	assert(!ret);
+	fibre_async_abort(victim);
+	ret = fibre_ready(victim);
+	assert(!ret);
+}
+
+/* Blocking, the read is cancelled, non-blocking, it's the wait for
+ * readability that's aborted */
+static void test_abort(int nonblock)
+{
+	struct fibre *f;
+	int ret = socketpair(AF_UNIX, SOCK_STREAM |
+			     (nonblock ? SOCK_NONBLOCK : 0), 0, socks[0]);
+	assert(!ret);
+	ret = fibre_create(&victim, fn_victim, NULL);
+	ret |= fibre_create(&f, fn_aborter, NULL);
+	assert(!ret);
+	fibre_ready(victim);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(victim) && fibre_completed(f));
+	fibre_destroy(victim);
+	fibre_destroy(f);
+	fibre_epoll_forget(se, socks[0][0]);
+	close(socks[0][0]);
+	close(socks[0][1]);
+}
+
+static int uring;
+
+static int stale[2];
+
+static void fn_stale(void *arg)
+{
+	char buf[8];
+	assert(fibre_io_read(stale[0], buf, sizeof(buf)) == 4);
+	assert(!strcmp(buf, "new"));
+}
+
+/* Operations on a new fd with a forgotten registered fd's number go to the
+ * new file, not the old one (which would read end-of-file) */
+static void test_stale(void)
+{
+	struct fibre *f;
+	int ret = pipe(stale), fd = stale[0];
+	assert(!ret);
+	ret = fibre_epoll_register_files(se, stale, 1);
+	assert(!ret);
+	ret = fibre_epoll_forget(se, fd);
+	assert(!ret);
+	close(stale[0]);
+	close(stale[1]);
+	ret = pipe(stale);
+	assert(!ret);
+	assert(stale[0] == fd);
+	assert(write(stale[1], "new", 4) == 4);
+	ret = fibre_create(&f, fn_stale, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+	ret = fibre_epoll_register_files(se, NULL, 0);
+	assert(!ret);
+	close(stale[0]);
+	close(stale[1]);
+}
+
+static void fn_probe(void *arg)
+{
+	uring = fibre_async_can_suspend(FIBRE_ASYNC_IO);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *other;
+	struct fibre *f;
+	int ret, fds[2];
+	char buf[8];
+
+	ret = fibre_init();
+	assert(!ret);
+
+	/* Nothing can suspend, so just the system calls */
+	ret = fibre_selector_origin(&other);
+	assert(!ret);
+	ret = fibre_push(other);
+	assert(!ret);
+	ret = pipe(fds);
+	assert(!ret);
+	assert(fibre_io_write(fds[1], "abc", 4) == 4);
+	assert(fibre_io_read(fds[0], buf, sizeof(buf)) == 4);
+	assert(!strcmp(buf, "abc"));
+	assert(fibre_io_read(-1, buf, sizeof(buf)) == -EBADF);
+	close(fds[0]);
+	close(fds[1]);
+	ret = fibre_epoll_register_files(other, fds, 2);
+	assert(ret == -EINVAL);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(other);
+
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	/* The origin has no fibre to suspend, so again the system calls */
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_IO));
+	ret = pipe(fds);
+	assert(!ret);
+	assert(fibre_io_write(fds[1], "abc", 4) == 4);
+	assert(fibre_io_read(fds[0], buf, sizeof(buf)) == 4);
+	assert(!strcmp(buf, "abc"));
+	ret = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	assert(!ret);
+	assert(fibre_io_read(fds[0], buf, sizeof(buf)) == -EAGAIN);
+	close(fds[0]);
+	close(fds[1]);
+	ret = fibre_create(&f, fn_probe, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+	printf("io_uring %s\n", uring ? "available" : "not available");
+	/* Blocking fds can only be used with io_uring */
+	if (uring) {
+		echo(0, 0);
+		echo(0, 1);
+		test_abort(0);
+		test_stale();
+	} else {
+		ret = fibre_epoll_register_files(se, fds, 2);
+		assert(ret == -EOPNOTSUPP);
+	}
+	echo(1, 0);
+	test_tcp();
+	test_abort(1);
+
+	/* Readiness only */
+	fibre_async_set_mask(FIBRE_ASYNC_FD_READABLE | FIBRE_ASYNC_TIMER);
+	echo(1, 0);
+	test_tcp();
+	test_abort(1);
+
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include <fibre.h>
+#include <fibre_inline.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises fibre-local keys: values kept in the fibre and spilled, separate
+ * for each fibre and NULL to begin with, destructors called when a fibre
+ * completes (on it), and again if they set values, or when one is destroyed
+ * or recreated with values set, and running out of keys. */
+
+#define NUM_KEYS (FIBRE_KEYS_INLINE + 3)
+#define NUM_FIBRES 4
+
+static unsigned int key[NUM_KEYS], rekey;
+static int destructed[NUM_KEYS], redestructed, on_caller;
+static struct fibre *fibres[NUM_FIBRES], *refibre;
+
+static void destructor(void *val)
+{
+	long idx = (long)val >> 8;
+	struct fibre *f = fibres[(long)val & 0xff];
+	/* On the fibre that had it, if it's completing */
+	assert(fibre_get_current() == (on_caller ? NULL : f));
+	assert(!fibre_key_get(f, key[idx]));
+	destructed[idx]++;
+}
+
+/* Sets another value, for the next round */
+static void redestructor(void *val)
+{
+	int ret;
+	if (++redestructed < FIBRE_KEYS_ROUNDS) {
+		ret = fibre_key_set(refibre, rekey, val);
+		assert(!ret);
+	}
+}
+
+static void fn_keys(void *arg)
+{
+	struct fibre *me = fibre_get_current();
+	long idx = (long)arg, loop;
+	int ret;
+	assert(me == fibres[idx]);
+	for (loop = 0; loop < NUM_KEYS; loop++) {
+		assert(!fibre_key_get(me, key[loop]));
+		assert(!fibre_key_get_inline(me, key[loop]));
+		/* Every other one is left for the destructor */
+		if (loop & 1)
+			ret = fibre_key_set_inline(me, key[loop],
+						   (void *)(loop << 8 | idx));
+		else
+			ret = fibre_key_set(me, key[loop],
+					    (void *)(loop << 8 | idx));
+		assert(!ret);
+	}
+	/* Let the others set theirs */
+	fibre_ready(me);
+	fibre_schedule();
+	for (loop = 0; loop < NUM_KEYS; loop++) {
+		assert(fibre_key_get(me, key[loop]) ==
+		       (void *)(loop << 8 | idx));
+		assert(fibre_key_get_inline(me, key[loop]) ==
+		       (void *)(loop << 8 | idx));
+		if (!(loop & 1)) {
+			ret = fibre_key_set(me, key[loop], NULL);
+			assert(!ret);
+		}
+	}
+}
+
+static void fn_rekey(void *arg)
+{
+	int ret = fibre_key_set(fibre_get_current(), rekey, arg);
+	assert(!ret);
+}
+
+static void fn_nothing(void *arg)
+{
+}
+
+static void test_keys(void)
+{
+	unsigned int loop;
+	int ret;
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		ret = fibre_create(&fibres[loop], fn_keys, (void *)(long)loop);
+		assert(!ret);
+		fibre_ready(fibres[loop]);
+	}
+	fibre_schedule();
+	for (loop = 0; loop < NUM_KEYS; loop++)
+		assert(destructed[loop] == ((loop & 1) ? NUM_FIBRES : 0));
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		assert(fibre_completed(fibres[loop]));
+		assert(!fibre_key_get(fibres[loop], key[NUM_KEYS - 1]));
+	}
+
+	/* Values set once they've completed, kept in the fibre and not, go
+	 * when they're recreated or destroyed */
+	on_caller = 1;
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		ret = fibre_key_set(fibres[loop], key[1],
+				    (void *)(1L << 8 | loop));
+		ret |= fibre_key_set(fibres[loop], key[FIBRE_KEYS_INLINE + 1],
+				     (void *)((FIBRE_KEYS_INLINE + 1L) << 8 |
+					      loop));
+		assert(!ret);
+	}
+	ret = fibre_recreate(fibres[0], fn_nothing, NULL);
+	assert(!ret);
+	assert(destructed[1] == NUM_FIBRES + 1);
+	assert(!fibre_key_get(fibres[0], key[FIBRE_KEYS_INLINE + 1]));
+	for (loop = 0; loop < NUM_FIBRES; loop++)
+		fibre_destroy(fibres[loop]);
+	assert(destructed[1] == NUM_FIBRES * 2);
+	assert(destructed[FIBRE_KEYS_INLINE + 1] == NUM_FIBRES * 2);
+	on_caller = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	struct fibre *f;
+	unsigned int loop, extra;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	for (loop = 0; loop < NUM_KEYS; loop++) {
+		ret = fibre_key_create(&key[loop],
+				       (loop & 1) ? destructor : NULL);
+		assert(!ret);
+		assert(!loop || key[loop] != key[loop - 1]);
+	}
+	ret = fibre_key_create(&rekey, redestructor);
+	assert(!ret);
+
+	test_keys();
+
+	/* Destructors that keep setting values */
+	ret = fibre_create(&f, fn_rekey, (void *)1);
+	assert(!ret);
+	refibre = f;
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	assert(redestructed == FIBRE_KEYS_ROUNDS);
+	assert(!fibre_key_get(f, rekey));
+	fibre_destroy(f);
+
+	/* One that never ran */
+	redestructed = 0;
+	ret = fibre_create(&f, fn_nothing, NULL);
+	assert(!ret);
+	refibre = f;
+	assert(!fibre_key_get(f, rekey));
+	ret = fibre_key_set(f, rekey, (void *)1);
+	assert(!ret);
+	fibre_destroy(f);
+	assert(redestructed == FIBRE_KEYS_ROUNDS);
+
+	for (extra = 0; !fibre_key_create(&loop, NULL); extra++)
+		assert(loop == NUM_KEYS + 1 + extra);
+	assert(NUM_KEYS + 1 + extra == FIBRE_KEYS_MAX);
+	assert(fibre_key_create(&loop, NULL) == -EAGAIN);
+
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
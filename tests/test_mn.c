@@ -0,0 +1,185 @@
+#include <fibre.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises the M:N runtime: fibres that yield, and pairs of fibres that
+ * wake each other (so that a fibre can be readied, and picked up by another
+ * worker, before it has switched away), all of which can migrate between the
+ * workers. Then the runtime is reused with the same fibres, recreated. */
+
+#define NUM_WORKERS 4
+#define NUM_YIELDERS 200
+#define NUM_YIELDS 100
+#define NUM_PAIRS 50
+#define NUM_PINGS 1000
+
+static unsigned long yields, pings, migrations;
+
+static void fn_yield(void *arg)
+{
+	pthread_t me = pthread_self();
+	unsigned long loop;
+	for (loop = 0; loop < NUM_YIELDS; loop++) {
+		__atomic_add_fetch(&yields, 1, __ATOMIC_RELAXED);
+		fibre_ready(fibre_get_current());
+		fibre_schedule();
+		if (!pthread_equal(me, pthread_self())) {
+			__atomic_add_fetch(&migrations, 1, __ATOMIC_RELAXED);
+			me = pthread_self();
+		}
+	}
+}
+
+/* A one-waiter semaphore */
+struct baton {
+	pthread_mutex_t lock;
+	unsigned int count;
+	struct fibre *waiter;
+};
+
+static void baton_take(struct baton *b)
+{
+	struct fibre *f = fibre_get_current();
+	pthread_mutex_lock(&b->lock);
+	if (b->count) {
+		b->count--;
+		pthread_mutex_unlock(&b->lock);
+		return;
+	}
+	b->waiter = f;
+	pthread_mutex_unlock(&b->lock);
+	fibre_schedule();
+	/* Possibly on a different thread, but still us */
+	assert(fibre_get_current() == f);
+}
+
+static void baton_give(struct baton *b)
+{
+	struct fibre *f;
+	pthread_mutex_lock(&b->lock);
+	f = b->waiter;
+	b->waiter = NULL;
+	if (!f)
+		b->count++;
+	pthread_mutex_unlock(&b->lock);
+	if (f)
+		fibre_ready(f);
+}
+
+struct pair {
+	struct baton ping;
+	struct baton pong;
+	struct fibre *f[2];
+};
+
+static struct pair pairs[NUM_PAIRS];
+
+static void fn_ping(void *arg)
+{
+	struct pair *p = arg;
+	unsigned long loop;
+	for (loop = 0; loop < NUM_PINGS; loop++) {
+		baton_give(&p->ping);
+		baton_take(&p->pong);
+	}
+}
+
+static void fn_pong(void *arg)
+{
+	struct pair *p = arg;
+	unsigned long loop;
+	for (loop = 0; loop < NUM_PINGS; loop++) {
+		baton_take(&p->ping);
+		__atomic_add_fetch(&pings, 1, __ATOMIC_RELAXED);
+		baton_give(&p->pong);
+	}
+}
+
+static struct fibre *yielders[NUM_YIELDERS];
+
+static void run(struct fibre_mn *mn, int recreate)
+{
+	unsigned long loop;
+	int ret;
+	yields = pings = 0;
+	for (loop = 0; loop < NUM_YIELDERS; loop++) {
+		if (recreate)
+			ret = fibre_recreate(yielders[loop], fn_yield, NULL);
+		else
+			ret = fibre_create(&yielders[loop], fn_yield, NULL);
+		assert(!ret);
+		ret = fibre_mn_submit(mn, yielders[loop]);
+		assert(!ret);
+	}
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		struct pair *p = &pairs[loop];
+		if (recreate) {
+			ret = fibre_recreate(p->f[0], fn_ping, p);
+			ret |= fibre_recreate(p->f[1], fn_pong, p);
+		} else {
+			pthread_mutex_init(&p->ping.lock, NULL);
+			pthread_mutex_init(&p->pong.lock, NULL);
+			ret = fibre_create(&p->f[0], fn_ping, p);
+			ret |= fibre_create(&p->f[1], fn_pong, p);
+		}
+		assert(!ret);
+		ret = fibre_mn_submit(mn, p->f[1]);
+		ret |= fibre_mn_submit(mn, p->f[0]);
+		assert(!ret);
+	}
+	fibre_mn_wait(mn);
+	assert(yields == NUM_YIELDERS * NUM_YIELDS);
+	assert(pings == NUM_PAIRS * NUM_PINGS);
+	for (loop = 0; loop < NUM_YIELDERS; loop++)
+		assert(fibre_completed(yielders[loop]));
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		assert(fibre_completed(pairs[loop].f[0]));
+		assert(fibre_completed(pairs[loop].f[1]));
+		assert(!pairs[loop].ping.count && !pairs[loop].pong.count);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_attr attr;
+	struct fibre_mn *mn;
+	struct fibre *f;
+	unsigned long loop;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_mn_create(&mn, 0);
+	assert(ret == -EINVAL);
+	ret = fibre_mn_create(&mn, NUM_WORKERS);
+	assert(!ret);
+
+	/* Can't migrate */
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED;
+	ret = fibre_create_ex(&f, &attr, fn_yield, NULL);
+	assert(!ret);
+	ret = fibre_mn_submit(mn, f);
+	assert(ret == -EINVAL);
+	fibre_destroy(f);
+
+	/* Nothing to do */
+	fibre_mn_wait(mn);
+
+	run(mn, 0);
+	run(mn, 1);
+	printf("%lu migrations\n", migrations);
+
+	fibre_mn_destroy(mn);
+	for (loop = 0; loop < NUM_YIELDERS; loop++)
+		fibre_destroy(yielders[loop]);
+	for (loop = 0; loop < NUM_PAIRS; loop++) {
+		fibre_destroy(pairs[loop].f[0]);
+		fibre_destroy(pairs[loop].f[1]);
+	}
+	fibre_finish();
+	return 0;
+}
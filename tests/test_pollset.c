@@ -0,0 +1,294 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises the poll set, first by hand (fibres spread over callbacks, one of
+ * them with a batch form, made ready at random and checked with random
+ * limits, in order, removal from a group and from what's left over from a
+ * check, and no callback being called again once it has said yes), then by
+ * way of the epoll selector, with fibres waiting for a counter alongside one
+ * that sleeps to count, and abort. */
+
+#define NUM_WAITERS 3000
+#define NUM_TICKS 50
+
+struct waiter {
+	unsigned long idx;
+	int flag;
+	int fired;
+	int done;
+	int (*cb)(void *);
+};
+
+static struct waiter waiters[NUM_WAITERS];
+static struct fibre *fibres[NUM_WAITERS];
+static unsigned long batches;
+
+static uint64_t rng = 88172645463325252ULL;
+static uint64_t rand64(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static int check(struct waiter *w)
+{
+	assert(!w->fired);
+	if (!w->flag)
+		return 0;
+	w->fired = 1;
+	return 1;
+}
+
+static int cb_a(void *arg)
+{
+	return check(arg);
+}
+
+static int cb_b(void *arg)
+{
+	return check(arg);
+}
+
+/* Only ever called in its batch form */
+static int cb_c(void *arg)
+{
+	assert(0);
+	return 0;
+}
+
+static unsigned int batch_c(void *const *args, unsigned int num,
+			    unsigned char *ready)
+{
+	unsigned int loop, res = 0;
+	batches++;
+	for (loop = 0; loop < num; loop++) {
+		ready[loop] = check(args[loop]);
+		res += ready[loop];
+	}
+	return res;
+}
+
+static void fn_waiter(void *arg)
+{
+	struct waiter *w = arg;
+	int ret = fibre_async_suspend_use_cb(w, w->cb);
+	assert(!ret);
+	w->done = 1;
+}
+
+static struct fibre_pollset *ps;
+
+static struct fibre *sched_cb(void *arg)
+{
+	struct fibre *f = fibre_get_current();
+	int ret;
+	if (f && fibre_async_type(f) == FIBRE_ASYNC_CHECK_CB) {
+		ret = fibre_pollset_add(ps, f);
+		assert(!ret);
+	}
+	return NULL;
+}
+
+/* Resumes a fibre that has been removed, or taken out by a check */
+static void finish(unsigned long idx)
+{
+	fibre_schedule_to(fibres[idx]);
+	assert(fibre_completed(fibres[idx]));
+	assert(waiters[idx].done);
+}
+
+static void test_set(void)
+{
+	int (*cbs[3])(void *) = { cb_a, cb_b, cb_c };
+	struct fibre_selector *se;
+	struct fibre *out[64];
+	struct waiter *w;
+	unsigned long loop, left = NUM_WAITERS, idx, last;
+	unsigned int num, max;
+	int ret;
+
+	ret = fibre_pollset_create(&ps);
+	assert(!ret);
+	ret = fibre_pollset_batch(ps, cb_c, batch_c);
+	assert(!ret);
+	ret = fibre_selector_scheduler(&se, sched_cb, NULL, 1);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	fibre_async_set_mask(FIBRE_ASYNC_CHECK_CB);
+	for (loop = 0; loop < NUM_WAITERS; loop++) {
+		waiters[loop].idx = loop;
+		waiters[loop].cb = cbs[rand64() % 3];
+		ret = fibre_create(&fibres[loop], fn_waiter, &waiters[loop]);
+		assert(!ret);
+		fibre_set_userdata(fibres[loop], &waiters[loop]);
+		fibre_schedule_to(fibres[loop]);
+	}
+	assert(fibre_pollset_count(ps) == NUM_WAITERS);
+	/* Nothing's ready */
+	assert(!fibre_pollset_check(ps, out, 64));
+	assert(batches == 1);
+
+	while (left) {
+		/* Make some ready, take some out */
+		for (loop = 0; loop < NUM_WAITERS / 20; loop++) {
+			idx = rand64() % NUM_WAITERS;
+			if (!waiters[idx].fired && !waiters[idx].done)
+				waiters[idx].flag = 1;
+		}
+		for (loop = 0; loop < 5; loop++) {
+			idx = rand64() % NUM_WAITERS;
+			if (waiters[idx].flag || waiters[idx].done)
+				continue;
+			fibre_pollset_remove(ps, fibres[idx]);
+			finish(idx);
+			left--;
+		}
+		/* Up to the first one taken out, something that's been found
+		 * ready, but not yet taken out, gets removed */
+		last = 0;
+		max = 1 + rand64() % 64;
+		while ((num = fibre_pollset_check(ps, out, max))) {
+			for (loop = 0; loop < num; loop++) {
+				w = fibre_get_userdata(out[loop]);
+				assert(w->fired);
+				assert(!last || w->idx > last);
+				last = w->idx;
+				finish(w->idx);
+			}
+			left -= num;
+			for (idx = last + 1; idx < NUM_WAITERS; idx++)
+				if (waiters[idx].fired && !waiters[idx].done)
+					break;
+			if (idx < NUM_WAITERS && rand64() % 4 == 0) {
+				fibre_pollset_remove(ps, fibres[idx]);
+				finish(idx);
+				left--;
+			}
+		}
+		assert(fibre_pollset_count(ps) == left);
+	}
+	for (loop = 0; loop < NUM_WAITERS; loop++)
+		fibre_destroy(fibres[loop]);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_pollset_destroy(ps);
+}
+
+static unsigned long ticks, order[NUM_TICKS * 4], ordered;
+static struct fibre *victim;
+
+static int cb_tick(void *arg)
+{
+	return ticks >= (unsigned long)arg;
+}
+
+static unsigned int batch_tick(void *const *args, unsigned int num,
+			       unsigned char *ready)
+{
+	unsigned int loop, res = 0;
+	batches++;
+	for (loop = 0; loop < num; loop++) {
+		ready[loop] = ticks >= (unsigned long)args[loop];
+		res += ready[loop];
+	}
+	return res;
+}
+
+static void fn_tick_waiter(void *arg)
+{
+	unsigned long me = (unsigned long)arg;
+	int ret;
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_CHECK_CB));
+	ret = fibre_async_suspend_use_cb((void *)(me / 4), cb_tick);
+	assert(!ret);
+	assert(ticks >= me / 4);
+	order[ordered++] = me;
+}
+
+static void fn_ticker(void *arg)
+{
+	int ret;
+	while (ticks < NUM_TICKS) {
+		ret = fibre_sleep_for(100000);
+		assert(!ret);
+		ticks++;
+	}
+	fibre_async_abort(victim);
+	ret = fibre_ready(victim);
+	assert(!ret);
+}
+
+static void fn_victim(void *arg)
+{
+	int ret = fibre_async_suspend_use_cb((void *)-1UL, cb_tick);
+	assert(ret == -EINTR);
+}
+
+static void test_epoll(int batch)
+{
+	struct fibre_selector *se;
+	struct fibre *f[NUM_TICKS * 4], *ticker;
+	unsigned long loop;
+	int ret;
+
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	if (batch) {
+		ret = fibre_epoll_batch(se, cb_tick, batch_tick);
+		assert(!ret);
+	}
+	ret = fibre_push(se);
+	assert(!ret);
+	/* The origin has no fibre to suspend */
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_CHECK_CB));
+	ticks = ordered = batches = 0;
+	/* Four fibres for each tick, suspended in order */
+	for (loop = 0; loop < NUM_TICKS * 4; loop++) {
+		ret = fibre_create(&f[loop], fn_tick_waiter, (void *)loop);
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	ret = fibre_create(&victim, fn_victim, NULL);
+	ret |= fibre_create(&ticker, fn_ticker, NULL);
+	assert(!ret);
+	fibre_ready(victim);
+	fibre_ready(ticker);
+	fibre_schedule();
+	assert(ordered == NUM_TICKS * 4);
+	for (loop = 0; loop < NUM_TICKS * 4; loop++) {
+		assert(order[loop] == loop);
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+	assert(fibre_completed(victim) && fibre_completed(ticker));
+	assert(!batch == !batches);
+	fibre_destroy(victim);
+	fibre_destroy(ticker);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	int ret = fibre_init();
+	assert(!ret);
+	test_set();
+	test_epoll(0);
+	test_epoll(1);
+	ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_epoll_batch(se, cb_tick, batch_tick);
+	assert(ret == -EINVAL);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+
+/* Exercises async proxying: a "library" fibre running under the epoll
+ * selector pushes a run-queue selector that's transparent for some methods,
+ * and its fibres (one of them a level further down) sleep, wait on an fd, get
+ * aborted and time out by way of the epoll selector, while a fibre of the
+ * epoll selector's keeps going in between. So does the library fibre itself,
+ * as the run-queue selector's origin. Then the things that can't be proxied:
+ * methods the selector isn't transparent for, and a proxy on the shared
+ * stack. */
+
+static struct fibre *lib, *g_read, *g_abort;
+static int pfd[2], done;
+static unsigned long ticks;
+
+static int never(void *arg)
+{
+	return 0;
+}
+
+static void fn_sleep(void *arg)
+{
+	unsigned long before = ticks;
+	int ret;
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	ret = fibre_sleep_for(3000000);
+	assert(!ret);
+	/* The epoll selector's fibre ran meanwhile */
+	assert(ticks > before);
+}
+
+static void fn_read(void *arg)
+{
+	char c;
+	int ret = fibre_async_suspend_fd_readable(pfd[0]);
+	assert(!ret);
+	ret = read(pfd[0], &c, 1);
+	assert(ret == 1 && c == 'x');
+}
+
+static void fn_nested(void *arg)
+{
+	struct fibre_selector *se;
+	struct fibre *f;
+	int ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	/* Not until it says so */
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	fibre_async_set_transparent(FIBRE_ASYNC_TIMER);
+	ret = fibre_create(&f, fn_sleep, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+}
+
+static void fn_abort(void *arg)
+{
+	int ret = fibre_async_suspend_use_cb(NULL, never);
+	assert(ret == -EINTR);
+}
+
+static void fn_timeout(void *arg)
+{
+	uint64_t deadline = fibre_time_ns() + 2000000;
+	int ret = fibre_async_suspend_fd_readable_timeout(pfd[0], deadline);
+	assert(ret == -ETIMEDOUT);
+	assert(fibre_time_ns() >= deadline);
+}
+
+static void fn_lib(void *arg)
+{
+	void (*fns[])(void *) = { fn_sleep, fn_read, fn_nested, fn_abort,
+				  fn_timeout };
+	struct fibre *f[5];
+	struct fibre_selector *se;
+	unsigned long loop, before;
+	int ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	fibre_async_set_transparent(FIBRE_ASYNC_TIMER |
+				    FIBRE_ASYNC_FD_READABLE |
+				    FIBRE_ASYNC_CHECK_CB);
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_TIMER));
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_IO));
+	for (loop = 0; loop < 5; loop++) {
+		ret = fibre_create(&f[loop], fns[loop], NULL);
+		assert(!ret);
+		fibre_ready(f[loop]);
+	}
+	g_read = f[1];
+	g_abort = f[3];
+	fibre_schedule();
+	for (loop = 0; loop < 5; loop++) {
+		assert(fibre_completed(f[loop]));
+		fibre_destroy(f[loop]);
+	}
+	/* As the origin */
+	before = ticks;
+	ret = fibre_sleep_for(3000000);
+	assert(!ret);
+	assert(ticks > before);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	done = 1;
+}
+
+static void fn_ticker(void *arg)
+{
+	int written = 0, aborted = 0;
+	ssize_t ret;
+	while (!done) {
+		ret = fibre_sleep_for(500000);
+		assert(!ret);
+		ticks++;
+		if (!written && fibre_async_type(g_read)) {
+			ret = write(pfd[1], "x", 1);
+			assert(ret == 1);
+			written = 1;
+		}
+		if (!aborted && fibre_async_type(g_abort)) {
+			fibre_async_abort(g_abort);
+			ret = fibre_ready(lib);
+			assert(!ret);
+			aborted = 1;
+		}
+	}
+	assert(written && aborted);
+}
+
+/* Can't be a proxy, as it can't push a selector at all */
+static void fn_shared(void *arg)
+{
+	struct fibre_selector *se;
+	int ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(ret == -EINVAL);
+	fibre_selector_free(se);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	struct fibre_attr attr;
+	struct fibre *ticker, *f;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = pipe(pfd);
+	assert(!ret);
+	ret = fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	assert(!ret);
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	/* Just the epoll selector's fd readability, not its io_uring */
+	fibre_async_set_mask(FIBRE_ASYNC_FD_READABLE | FIBRE_ASYNC_TIMER |
+			     FIBRE_ASYNC_CHECK_CB);
+
+	ret = fibre_create(&lib, fn_lib, NULL);
+	ret |= fibre_create(&ticker, fn_ticker, NULL);
+	assert(!ret);
+	fibre_ready(lib);
+	fibre_ready(ticker);
+	fibre_schedule();
+	assert(fibre_completed(lib) && fibre_completed(ticker));
+	fibre_destroy(lib);
+	fibre_destroy(ticker);
+
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED;
+	ret = fibre_create_ex(&f, &attr, fn_shared, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+
+	fibre_epoll_forget(se, pfd[0]);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	close(pfd[0]);
+	close(pfd[1]);
+	fibre_finish();
+	return 0;
+}
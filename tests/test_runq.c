@@ -0,0 +1,234 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises the run-queue selector: round-robin yielding between more fibres
+ * than fit in the queue's ring, the "run next" slot, completion falling back
+ * to the origin once nothing is queued, and fibre_transfer() through it. Then
+ * the priority selector's ordering, and its aging. */
+
+#define NUM_FIBRES 1000
+#define NUM_ROUNDS 20
+
+static struct fibre *fibres[NUM_FIBRES];
+static unsigned long log_pos;
+static unsigned long expect;
+
+static void fn_yield(void *arg)
+{
+	unsigned long me = (unsigned long)arg, round;
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		/* Strict round-robin */
+		assert(log_pos++ == round * NUM_FIBRES + me);
+		fibre_ready(fibre_get_current());
+		fibre_schedule();
+	}
+}
+
+static struct fibre *waker, *wakee;
+
+static void fn_wakee(void *arg)
+{
+	/* Runs ahead of everything else that was queued */
+	assert(expect == 1);
+	expect = 2;
+}
+
+static void fn_waker(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < 10; loop++)
+		fibre_ready(fibres[loop]);
+	fibre_ready(fibre_get_current());
+	fibre_ready_next(wakee);
+	expect = 1;
+	fibre_schedule();
+	/* The others went first (in order), then back here */
+	assert(expect == 12);
+}
+
+static void fn_after(void *arg)
+{
+	unsigned long me = (unsigned long)arg;
+	assert(expect == 2 + me);
+	expect++;
+}
+
+static void fn_echo(void *arg)
+{
+	void *msg = NULL;
+	while ((msg = fibre_transfer(NULL, msg)))
+		msg = (void *)((unsigned long)msg + 1);
+}
+
+#define BULK_FIBRES 2
+#define BULK_ROUNDS 50
+
+static unsigned long prio_log[64];
+
+static void fn_log(void *arg)
+{
+	prio_log[log_pos++] = (unsigned long)arg;
+}
+
+/* High priority, and always ready */
+static void fn_bulk(void *arg)
+{
+	unsigned long round;
+	for (round = 0; round < BULK_ROUNDS; round++) {
+		log_pos++;
+		fibre_ready(fibre_get_current());
+		fibre_schedule();
+	}
+}
+
+static void fn_starved(void *arg)
+{
+	expect = log_pos;
+}
+
+static void test_prio(void)
+{
+	static const unsigned int prios[] = { 20, 2, 16, 2, 31, 0 };
+	static const unsigned long order[] = { 5, 1, 3, 2, 0, 4 };
+	struct fibre *pf[BULK_FIBRES + 1];
+	struct fibre_selector *se;
+	unsigned long loop;
+	int ret;
+
+	/* Without aging, strictly by priority, then FIFO */
+	ret = fibre_selector_prio(&se, 0);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	log_pos = 0;
+	for (loop = 0; loop < 6; loop++) {
+		ret = fibre_create(&pf[0], fn_log, (void *)loop);
+		assert(!ret);
+		assert(fibre_get_priority(pf[0]) == FIBRE_PRIO_DEFAULT);
+		ret = fibre_set_priority(pf[0], prios[loop]);
+		assert(!ret);
+		ret = fibre_ready(pf[0]);
+		assert(!ret);
+		fibres[loop] = pf[0];
+	}
+	ret = fibre_set_priority(pf[0], FIBRE_PRIO_LEVELS);
+	assert(ret == -EINVAL);
+	fibre_schedule();
+	assert(log_pos == 6);
+	for (loop = 0; loop < 6; loop++) {
+		assert(prio_log[loop] == order[loop]);
+		fibre_destroy(fibres[loop]);
+	}
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+
+	/* With aging, a low-priority fibre gets a look in before the
+	 * high-priority ones are done */
+	ret = fibre_selector_prio(&se, 2);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	log_pos = 0;
+	expect = ~0UL;
+	for (loop = 0; loop < BULK_FIBRES; loop++) {
+		ret = fibre_create(&pf[loop], fn_bulk, NULL);
+		assert(!ret);
+		fibre_set_priority(pf[loop], 0);
+		fibre_ready(pf[loop]);
+	}
+	ret = fibre_create(&pf[loop], fn_starved, NULL);
+	assert(!ret);
+	fibre_set_priority(pf[loop], 3);
+	fibre_ready(pf[loop]);
+	fibre_schedule();
+	assert(log_pos == BULK_FIBRES * BULK_ROUNDS);
+	assert(expect < 20);
+	for (loop = 0; loop <= BULK_FIBRES; loop++)
+		fibre_destroy(pf[loop]);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	struct fibre *f;
+	unsigned long loop;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_origin(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	ret = fibre_ready(NULL);
+	assert(ret == -EOPNOTSUPP);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+
+	ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+
+	/* With nothing queued, the origin just carries on */
+	fibre_schedule();
+
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		ret = fibre_create(&fibres[loop], fn_yield, (void *)loop);
+		assert(!ret);
+		ret = fibre_ready(fibres[loop]);
+		assert(!ret);
+		/* Already queued */
+		ret = fibre_ready(fibres[loop]);
+		assert(!ret);
+	}
+	ret = fibre_pop(NULL);
+	assert(ret == -EBUSY);
+	/* Back when they've all completed */
+	fibre_schedule();
+	assert(log_pos == NUM_ROUNDS * NUM_FIBRES);
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		assert(fibre_completed(fibres[loop]));
+		ret = fibre_recreate(fibres[loop], fn_after, (void *)loop);
+		assert(!ret);
+	}
+
+	ret = fibre_create(&waker, fn_waker, NULL);
+	assert(!ret);
+	ret = fibre_create(&wakee, fn_wakee, NULL);
+	assert(!ret);
+	fibre_schedule_to(waker);
+	assert(fibre_completed(waker) && fibre_completed(wakee));
+	for (loop = 0; loop < 10; loop++)
+		assert(fibre_completed(fibres[loop]));
+	fibre_destroy(waker);
+	fibre_destroy(wakee);
+
+	/* Implicit transfers from the fibre come back to the origin */
+	ret = fibre_create(&f, fn_echo, NULL);
+	assert(!ret);
+	fibre_schedule_to(f);
+	for (loop = 1; loop < 100; loop++)
+		assert(fibre_transfer(f, (void *)loop) == (void *)(loop + 1));
+	fibre_transfer(f, NULL);
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+
+	for (loop = 0; loop < NUM_FIBRES; loop++)
+		fibre_destroy(fibres[loop]);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+
+	test_prio();
+	fibre_finish();
+	return 0;
+}
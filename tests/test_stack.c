@@ -0,0 +1,354 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* Exercises the stack pool: stacks being returned at completion and reused by
+ * fibre_recreate(), stacks being released from threads other than the one
+ * that allocated them (both before and after that thread has finished),
+ * per-fibre stack attributes, and fibres on the shared stack. */
+
+#define NUM_FIBRES 64
+#define NUM_ROUNDS 100
+
+static unsigned int counter;
+
+static void fn(void *arg)
+{
+	volatile char buf[1024];
+	buf[0] = buf[sizeof(buf) - 1] = 1;
+	counter += (unsigned long)arg + buf[0];
+}
+
+static void fn_deep(void *arg)
+{
+	volatile char buf[200 * 1024];
+	buf[0] = buf[sizeof(buf) - 1] = 1;
+	counter += (unsigned long)arg + buf[0];
+}
+
+/* Relies on the ABI's stack alignment (vararg floating point spills) */
+static void fn_aligned(void *arg)
+{
+	char buf[32];
+#ifdef __x86_64__
+	assert(!((uintptr_t)__builtin_frame_address(0) & 15));
+#endif
+	snprintf(buf, sizeof(buf), "%.1f", 1.5 * (unsigned long)arg);
+	assert(!strcmp(buf, "1.5"));
+}
+
+static struct fibre *fibres[NUM_FIBRES];
+
+static char user_stack[16 * 1024] __attribute__((aligned(64)));
+
+static void test_attrs(void)
+{
+	struct fibre_attr attr;
+	struct fibre *f;
+	int ret;
+
+	counter = 0;
+
+	/* Small, pooled, no guard */
+	fibre_attr_init(&attr);
+	attr.stack_size = 8 * 1024;
+	attr.flags &= ~FIBRE_ATTR_GUARD;
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	assert(fibre_completed(f));
+	ret = fibre_recreate(f, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* Big, guarded */
+	fibre_attr_init(&attr);
+	attr.stack_size = 256 * 1024;
+	attr.flags |= FIBRE_ATTR_GUARD;
+	ret = fibre_create_ex(&f, &attr, fn_deep, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* Odd-sized, unpooled */
+	fibre_attr_init(&attr);
+	attr.stack_size = 40 * 1024 + 123;
+	attr.pool = FIBRE_ATTR_POOL_NONE;
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* Caller-provided, including across a recreate */
+	fibre_attr_init(&attr);
+	attr.stack = user_stack;
+	attr.stack_size = sizeof(user_stack);
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	ret = fibre_recreate(f, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* Caller-provided, and not 16-byte aligned */
+	attr.stack = user_stack + 8;
+	attr.stack_size = sizeof(user_stack) - 8;
+	ret = fibre_create_ex(&f, &attr, fn_aligned, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	assert(fibre_completed(f));
+	ret = fibre_recreate(f, fn_aligned, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* Caller-provided, but too small to be usable */
+	attr.stack_size = 64;
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(ret == -EINVAL);
+
+	/* Single-allocation, including across a recreate */
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_INLINE;
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(!ret);
+	fibre_set_userdata(f, &attr);
+	fibre_schedule_to(f);
+	ret = fibre_recreate(f, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	assert(fibre_get_userdata(f) == &attr);
+	fibre_destroy(f);
+
+	/* Single-allocation, on a caller-provided stack */
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_INLINE;
+	attr.stack = user_stack;
+	attr.stack_size = sizeof(user_stack);
+	ret = fibre_create_ex(&f, &attr, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	/* From a huge-page arena, including across a recreate */
+	fibre_attr_init(&attr);
+	attr.stack_size = 256 * 1024;
+	attr.pool = FIBRE_ATTR_POOL_HUGE;
+	ret = fibre_create_ex(&f, &attr, fn_deep, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	ret = fibre_recreate(f, fn_deep, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	fibre_destroy(f);
+
+	assert(counter == 22);
+}
+
+static void test_stats(void)
+{
+	struct fibre_stack_stat stat;
+	struct fibre_attr attr;
+	struct fibre *f;
+	unsigned int loop;
+	int ret;
+
+	fibre_stack_stats_mode(FIBRE_STACK_STATS_MEASURE, 0);
+	fibre_attr_init(&attr);
+	attr.stack_size = 256 * 1024;
+	ret = fibre_create_ex(&f, &attr, fn_deep, (void *)1);
+	assert(!ret);
+	assert(!fibre_stack_usage(f));
+	fibre_schedule_to(f);
+	assert(fibre_stack_usage(f) >= 200 * 1024);
+	assert(fibre_stack_usage(f) < 256 * 1024);
+	ret = fibre_recreate(f, fn, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	assert(fibre_stack_usage(f) >= 1024);
+	assert(fibre_stack_usage(f) < 16 * 1024);
+	fibre_destroy(f);
+
+	/* Inline fibres are measured when destroyed */
+	attr.flags |= FIBRE_ATTR_INLINE;
+	ret = fibre_create_ex(&f, &attr, fn_deep, (void *)1);
+	assert(!ret);
+	fibre_schedule_to(f);
+	assert(fibre_stack_usage(f) >= 200 * 1024);
+	fibre_destroy(f);
+
+	ret = fibre_stack_stats(fn_deep, &stat);
+	assert(!ret && stat.count == 2 && stat.peak >= 200 * 1024);
+	assert(!stat.suggested);
+
+	/* Adaptive mode only kicks in after enough samples */
+	fibre_stack_stats_mode(FIBRE_STACK_STATS_ADAPTIVE, 0);
+	for (loop = 0; loop < 32; loop++) {
+		ret = fibre_create(&f, fn, (void *)1);
+		assert(!ret);
+		fibre_schedule_to(f);
+		fibre_destroy(f);
+	}
+	ret = fibre_stack_stats(fn, &stat);
+	assert(!ret && stat.count == 33);
+	assert(stat.suggested && stat.suggested < 16 * 1024);
+	assert(fibre_stack_stats_all(&stat, 1) == 2);
+	fibre_stack_stats_mode(FIBRE_STACK_STATS_OFF, 0);
+}
+
+/* A ring of fibres, most of them on the shared stack, each passing control to
+ * the next and checking that its stack survived the others running. */
+#define RING 8
+#define RING_ROUNDS 50
+
+static struct fibre *ring[RING];
+
+static int is_shared(unsigned long idx)
+{
+	return idx % 3 != 2;
+}
+
+static void fn_ring(void *arg)
+{
+	unsigned long me = (unsigned long)arg, loop, round;
+	volatile unsigned long buf[512 + 64 * RING];
+	for (round = 0; round < RING_ROUNDS; round++) {
+		for (loop = 0; loop < 512 + 64 * me; loop++)
+			buf[loop] = me * round + loop;
+		if (me + 1 < RING)
+			fibre_schedule_to(ring[me + 1]);
+		else
+			fibre_schedule();
+		for (loop = 0; loop < 512 + 64 * me; loop++)
+			assert(buf[loop] == me * round + loop);
+	}
+	counter++;
+}
+
+static void fn_push(void *arg)
+{
+	assert(fibre_push(arg) == -EINVAL);
+	counter++;
+}
+
+static void test_shared(void)
+{
+	struct fibre_selector *other;
+	struct fibre_attr attr;
+	unsigned long loop, round;
+	int ret;
+
+	counter = 0;
+	for (loop = 0; loop < RING; loop++) {
+		fibre_attr_init(&attr);
+		if (is_shared(loop))
+			attr.flags |= FIBRE_ATTR_SHARED;
+		ret = fibre_create_ex(&ring[loop], &attr, fn_ring,
+				      (void *)loop);
+		assert(!ret);
+	}
+	/* Twice, the second time round as recreated fibres */
+	for (round = 0; round < 2; round++) {
+		for (loop = 0; loop < RING_ROUNDS; loop++)
+			fibre_schedule_to(ring[0]);
+		for (loop = 0; loop < RING; loop++) {
+			fibre_schedule_to(ring[loop]);
+			assert(fibre_completed(ring[loop]));
+			if (is_shared(loop))
+				assert(fibre_stack_usage(ring[loop]) >=
+				       (512 + 64 * loop) * sizeof(long));
+			ret = fibre_recreate(ring[loop], fn_ring, (void *)loop);
+			assert(!ret);
+		}
+	}
+	for (loop = 0; loop < RING; loop++)
+		fibre_destroy(ring[loop]);
+	assert(counter == 2 * RING);
+
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED | FIBRE_ATTR_INLINE;
+	ret = fibre_create_ex(&ring[0], &attr, fn_ring, NULL);
+	assert(ret == -EINVAL);
+
+	/* A shared fibre can't push a selector */
+	ret = fibre_selector_runq(&other);
+	assert(!ret);
+	fibre_attr_init(&attr);
+	attr.flags |= FIBRE_ATTR_SHARED;
+	ret = fibre_create_ex(&ring[0], &attr, fn_push, other);
+	assert(!ret);
+	fibre_schedule_to(ring[0]);
+	assert(fibre_completed(ring[0]) && counter == 2 * RING + 1);
+	fibre_destroy(ring[0]);
+	fibre_selector_free(other);
+}
+
+static void *remote_destroy(void *arg)
+{
+	unsigned int loop;
+	for (loop = 0; loop < NUM_FIBRES; loop++)
+		fibre_destroy(fibres[loop]);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	pthread_t t;
+	unsigned int loop, round;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_origin(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		ret = fibre_create(&fibres[loop], fn, (void *)1);
+		assert(!ret);
+	}
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		for (loop = 0; loop < NUM_FIBRES; loop++) {
+			fibre_schedule_to(fibres[loop]);
+			assert(fibre_completed(fibres[loop]));
+			ret = fibre_recreate(fibres[loop], fn, (void *)1);
+			assert(!ret);
+		}
+	}
+	assert(counter == 2 * NUM_FIBRES * NUM_ROUNDS);
+
+	test_attrs();
+	test_stats();
+	test_shared();
+
+	/* Never-run fibres, destroyed by another thread while we're alive */
+	ret = pthread_create(&t, NULL, remote_destroy, NULL);
+	assert(!ret);
+	ret = pthread_join(t, NULL);
+	assert(!ret);
+
+	/* Never-run fibres (which still hold their stacks), destroyed by
+	 * another thread after we've finished. These pick up the stacks the
+	 * other thread released above. */
+	for (loop = 0; loop < NUM_FIBRES; loop++) {
+		ret = fibre_create(&fibres[loop], fn, (void *)0);
+		assert(!ret);
+	}
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	ret = pthread_create(&t, NULL, remote_destroy, NULL);
+	assert(!ret);
+	ret = pthread_join(t, NULL);
+	assert(!ret);
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include <fibre.h>
+#include <fibre_inline.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Exercises the mutex (with and without FIBRE_SYNC_SWITCH, and under the
+ * epoll selector as well as the run-queue one), by fibres that yield while
+ * holding it, the condition variable with a bounded buffer and a broadcast,
+ * the semaphore as a limit on how many fibres are in at once, and the
+ * reader-writer lock, readers together, writers alone and in order. */
+
+#define NUM_FIBRES 8
+#define NUM_ITERS 200
+
+static struct fibre *fibres[NUM_FIBRES];
+static int inside;
+static unsigned long count;
+
+static void yield(void)
+{
+	fibre_ready(fibre_get_current());
+	fibre_schedule();
+}
+
+static void run(void (*fn)(void *), unsigned int num)
+{
+	unsigned int loop;
+	int ret;
+	for (loop = 0; loop < num; loop++) {
+		ret = fibre_create(&fibres[loop], fn, (void *)(long)loop);
+		assert(!ret);
+		fibre_ready(fibres[loop]);
+	}
+	fibre_schedule();
+	for (loop = 0; loop < num; loop++) {
+		assert(fibre_completed(fibres[loop]));
+		fibre_destroy(fibres[loop]);
+	}
+}
+
+static struct fibre_mutex mutex;
+static struct fibre *holder;
+
+static void fn_mutex(void *arg)
+{
+	struct fibre *me = fibre_get_current();
+	unsigned long loop;
+	int contended;
+	for (loop = 0; loop < NUM_ITERS; loop++) {
+		if (loop & 1)
+			fibre_mutex_lock_inline(&mutex);
+		else
+			fibre_mutex_lock(&mutex);
+		assert(!inside);
+		inside = 1;
+		holder = me;
+		count++;
+		/* So that the others queue up */
+		yield();
+		assert(fibre_mutex_trylock(&mutex) == -EBUSY);
+		assert(holder == me);
+		inside = 0;
+		contended = !!mutex.waiters.head;
+		if (loop & 1)
+			fibre_mutex_unlock_inline(&mutex);
+		else
+			fibre_mutex_unlock(&mutex);
+		/* Handed over, and switched to the new holder or not */
+		if (contended && (mutex.flags & FIBRE_SYNC_SWITCH))
+			assert(holder != me);
+		else
+			assert(holder == me);
+	}
+}
+
+static void test_mutex(unsigned int flags)
+{
+	int ret;
+	fibre_mutex_init(&mutex, flags);
+	/* Uncontended, from the origin */
+	fibre_mutex_lock(&mutex);
+	ret = fibre_mutex_trylock(&mutex);
+	assert(ret == -EBUSY);
+	fibre_mutex_unlock(&mutex);
+	ret = fibre_mutex_trylock(&mutex);
+	assert(!ret);
+	fibre_mutex_unlock(&mutex);
+
+	count = 0;
+	run(fn_mutex, NUM_FIBRES);
+	assert(count == NUM_FIBRES * NUM_ITERS);
+	assert(!mutex.locked);
+}
+
+#define BUF_SIZE 4
+#define NUM_ITEMS 1000
+
+static struct fibre_cond not_full, not_empty, finished;
+static unsigned long buf[BUF_SIZE], buf_num, buf_head, sum;
+static unsigned int produced, consumed, waiting;
+
+static void fn_producer(void *arg)
+{
+	fibre_mutex_lock(&mutex);
+	while (produced < NUM_ITEMS) {
+		if (buf_num == BUF_SIZE) {
+			fibre_cond_wait(&not_full, &mutex);
+			continue;
+		}
+		buf[(buf_head + buf_num++) % BUF_SIZE] = ++produced;
+		fibre_cond_signal(&not_empty);
+		if (produced % 7 == 0) {
+			fibre_mutex_unlock(&mutex);
+			yield();
+			fibre_mutex_lock(&mutex);
+		}
+	}
+	fibre_mutex_unlock(&mutex);
+}
+
+static void fn_consumer(void *arg)
+{
+	fibre_mutex_lock(&mutex);
+	while (consumed < NUM_ITEMS) {
+		if (!buf_num) {
+			fibre_cond_wait(&not_empty, &mutex);
+			continue;
+		}
+		sum += buf[buf_head];
+		buf_head = (buf_head + 1) % BUF_SIZE;
+		buf_num--;
+		consumed++;
+		fibre_cond_signal(&not_full);
+	}
+	/* The rest are waiting on an empty buffer */
+	fibre_cond_broadcast(&not_empty);
+	fibre_mutex_unlock(&mutex);
+}
+
+static void fn_broadcast(void *arg)
+{
+	fibre_mutex_lock(&mutex);
+	if (++waiting < NUM_FIBRES) {
+		fibre_cond_wait(&finished, &mutex);
+		/* One at a time */
+		assert(!inside);
+		inside = 1;
+		yield();
+		inside = 0;
+	} else
+		fibre_cond_broadcast(&finished);
+	fibre_mutex_unlock(&mutex);
+}
+
+static void test_cond(unsigned int flags)
+{
+	unsigned int loop;
+	int ret;
+	fibre_mutex_init(&mutex, flags);
+	fibre_cond_init(&not_full);
+	fibre_cond_init(&not_empty);
+	fibre_cond_init(&finished);
+	produced = consumed = waiting = 0;
+	buf_num = buf_head = sum = 0;
+	for (loop = 0; loop < 5; loop++) {
+		ret = fibre_create(&fibres[loop],
+				   loop < 2 ? fn_producer : fn_consumer, NULL);
+		assert(!ret);
+		fibre_ready(fibres[loop]);
+	}
+	fibre_schedule();
+	for (loop = 0; loop < 5; loop++) {
+		assert(fibre_completed(fibres[loop]));
+		fibre_destroy(fibres[loop]);
+	}
+	assert(consumed == NUM_ITEMS);
+	assert(sum == (unsigned long)NUM_ITEMS * (NUM_ITEMS + 1) / 2);
+	run(fn_broadcast, NUM_FIBRES);
+	assert(!mutex.locked);
+}
+
+#define SEM_LIMIT 3
+
+static struct fibre_sem sem;
+static int most;
+
+static void fn_sem(void *arg)
+{
+	unsigned long loop;
+	for (loop = 0; loop < NUM_ITERS; loop++) {
+		fibre_sem_wait(&sem);
+		inside++;
+		assert(inside <= SEM_LIMIT);
+		if (inside > most)
+			most = inside;
+		yield();
+		inside--;
+		fibre_sem_post(&sem);
+	}
+}
+
+static void test_sem(unsigned int flags)
+{
+	unsigned int loop;
+	int ret;
+	fibre_sem_init(&sem, 0, flags);
+	ret = fibre_sem_trywait(&sem);
+	assert(ret == -EBUSY);
+	for (loop = 0; loop < SEM_LIMIT; loop++)
+		fibre_sem_post(&sem);
+	ret = fibre_sem_trywait(&sem);
+	assert(!ret);
+	fibre_sem_post(&sem);
+	most = 0;
+	run(fn_sem, NUM_FIBRES);
+	assert(most == SEM_LIMIT);
+	assert(sem.count == SEM_LIMIT);
+}
+
+static struct fibre_rwlock rwlock;
+static int readers, writers, most_readers;
+static unsigned int order[4], ordered;
+
+static void fn_rwlock(void *arg)
+{
+	long me = (long)arg;
+	unsigned long loop;
+	for (loop = 0; loop < NUM_ITERS; loop++) {
+		if (me % 3 == 0) {
+			fibre_rwlock_wrlock(&rwlock);
+			assert(!readers && !writers);
+			writers++;
+			yield();
+			assert(!readers && writers == 1);
+			writers--;
+		} else {
+			fibre_rwlock_rdlock(&rwlock);
+			assert(!writers);
+			readers++;
+			if (readers > most_readers)
+				most_readers = readers;
+			yield();
+			assert(!writers);
+			readers--;
+		}
+		fibre_rwlock_unlock(&rwlock);
+	}
+}
+
+/* A reader, then a writer, then a reader and a writer that come after */
+static void fn_rw_order(void *arg)
+{
+	long me = (long)arg;
+	if (me & 1)
+		fibre_rwlock_wrlock(&rwlock);
+	else {
+		if (me)
+			assert(fibre_rwlock_tryrdlock(&rwlock) == -EBUSY);
+		fibre_rwlock_rdlock(&rwlock);
+	}
+	order[ordered++] = me;
+	yield();
+	fibre_rwlock_unlock(&rwlock);
+}
+
+static void test_rwlock(unsigned int flags)
+{
+	int ret;
+	fibre_rwlock_init(&rwlock, flags);
+	ret = fibre_rwlock_tryrdlock(&rwlock);
+	ret |= fibre_rwlock_tryrdlock(&rwlock);
+	assert(!ret);
+	ret = fibre_rwlock_trywrlock(&rwlock);
+	assert(ret == -EBUSY);
+	fibre_rwlock_unlock(&rwlock);
+	fibre_rwlock_unlock(&rwlock);
+	ret = fibre_rwlock_trywrlock(&rwlock);
+	assert(!ret);
+	ret = fibre_rwlock_tryrdlock(&rwlock);
+	assert(ret == -EBUSY);
+	fibre_rwlock_unlock(&rwlock);
+
+	most_readers = 0;
+	run(fn_rwlock, NUM_FIBRES);
+	assert(most_readers > 1);
+	assert(!rwlock.state);
+
+	ordered = 0;
+	run(fn_rw_order, 4);
+	assert(order[0] == 0 && order[1] == 1 && order[2] == 2 &&
+	       order[3] == 3);
+}
+
+static void test_all(unsigned int flags)
+{
+	test_mutex(flags);
+	test_cond(flags);
+	test_sem(flags);
+	test_rwlock(flags);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_runq(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	test_all(0);
+	test_all(FIBRE_SYNC_SWITCH);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	test_mutex(0);
+	test_mutex(FIBRE_SYNC_SWITCH);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}
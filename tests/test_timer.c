@@ -0,0 +1,216 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+/* Exercises the timer wheel, first with made-up times (deadlines spread over
+ * all its levels and beyond, cancellation, jumps in time big and small, and
+ * fibre_timers_next() always making progress), then for real, with fibres
+ * that fibre_sleep_for() and a dispatcher that waits on the wheel. */
+
+#define GRAN 1000ULL
+#define NUM_TIMERS 2000
+#define NUM_SLEEPERS 20
+#define START 5000000123ULL
+
+static struct fibre *fibres[NUM_TIMERS];
+static uint64_t deadlines[NUM_TIMERS];
+static int armed[NUM_TIMERS];
+
+static uint64_t rng = 88172645463325252ULL;
+static uint64_t rand64(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static void fn_nothing(void *arg)
+{
+}
+
+/* Checks what comes out at 'now', given that the last check was at 'prev' */
+static unsigned int check_expire(struct fibre_timers *t, uint64_t prev,
+				 uint64_t now, unsigned int max)
+{
+	struct fibre *out[64];
+	uint64_t last = 0, rounded;
+	unsigned int num, loop, total = 0, idx;
+	do {
+		num = fibre_timers_expire(t, now, out, max);
+		for (loop = 0; loop < num; loop++) {
+			idx = (unsigned long)fibre_get_userdata(out[loop]);
+			assert(armed[idx]);
+			armed[idx] = 0;
+			rounded = (deadlines[idx] + GRAN - 1) / GRAN * GRAN;
+			/* Not early, not late, in order (those that were
+			 * already due when added count as due at the start) */
+			assert(rounded <= now);
+			assert(rounded > prev - prev % GRAN || !prev);
+			if (rounded < START - START % GRAN)
+				rounded = START - START % GRAN;
+			assert(rounded >= last);
+			last = rounded;
+		}
+		total += num;
+	} while (num == max);
+	return total;
+}
+
+static void test_wheel(void)
+{
+	struct fibre_timers *t;
+	uint64_t start = START, now, prev, next, min;
+	unsigned long loop, left = 0;
+	int ret;
+
+	ret = fibre_timers_create(&t, start, GRAN);
+	assert(!ret);
+	assert(fibre_timers_next(t) == UINT64_MAX);
+	for (loop = 0; loop < NUM_TIMERS; loop++) {
+		ret = fibre_create(&fibres[loop], fn_nothing, NULL);
+		assert(!ret);
+		fibre_set_userdata(fibres[loop], (void *)loop);
+		/* Anything from the past up to beyond the top level */
+		deadlines[loop] = start - 10 * GRAN +
+				  (rand64() >> (rand64() % 64)) %
+				  (GRAN << 40);
+		fibre_timers_add(t, fibres[loop], deadlines[loop]);
+		armed[loop] = 1;
+		left++;
+	}
+	/* Move some, cancel some */
+	for (loop = 0; loop < NUM_TIMERS; loop += 7) {
+		deadlines[loop] = start + rand64() % (GRAN << 20);
+		fibre_timers_add(t, fibres[loop], deadlines[loop]);
+	}
+	for (loop = 3; loop < NUM_TIMERS; loop += 11) {
+		fibre_timers_cancel(t, fibres[loop]);
+		fibre_timers_cancel(t, fibres[loop]);
+		armed[loop] = 0;
+		left--;
+	}
+
+	/* Jump from expiry to expiry, which can be early, but always moves
+	 * things along */
+	prev = 0;
+	now = start;
+	while (left > NUM_TIMERS / 2) {
+		left -= check_expire(t, prev, now, 1 + rand64() % 64);
+		next = fibre_timers_next(t);
+		for (loop = 0, min = UINT64_MAX; loop < NUM_TIMERS; loop++)
+			if (armed[loop] && deadlines[loop] < min)
+				min = deadlines[loop];
+		/* Rounded up to the granularity */
+		if (min != UINT64_MAX)
+			min = (min + GRAN - 1) / GRAN * GRAN;
+		assert(next <= min);
+		assert(next > now || next == 0);
+		prev = now;
+		now = next;
+	}
+	/* Then random steps, with checks in between */
+	while (left) {
+		prev = now;
+		now += rand64() % (GRAN << (rand64() % 40));
+		left -= check_expire(t, prev, now, 64);
+	}
+	assert(fibre_timers_next(t) == UINT64_MAX);
+	fibre_timers_destroy(t);
+	for (loop = 0; loop < NUM_TIMERS; loop++)
+		fibre_destroy(fibres[loop]);
+}
+
+static struct fibre_timers *timers;
+static uint64_t woken[NUM_SLEEPERS];
+
+static void fn_sleeper(void *arg)
+{
+	unsigned long me = (unsigned long)arg;
+	uint64_t ns = (1 + me % 7) * 3000000;
+	uint64_t deadline = fibre_time_ns() + ns;
+	int ret = fibre_sleep_for(ns);
+	assert(!ret);
+	woken[me] = fibre_time_ns();
+	assert(woken[me] >= deadline);
+}
+
+static struct fibre *sched_cb(void *arg)
+{
+	struct fibre *f = fibre_get_current();
+	uint64_t deadline;
+	if (f && fibre_async_type(f) == FIBRE_ASYNC_TIMER) {
+		fibre_async_get_timer(f, &deadline);
+		fibre_timers_add(timers, f, deadline);
+	}
+	return NULL;
+}
+
+static void test_sleep(void)
+{
+	struct fibre *sleepers[NUM_SLEEPERS], *out[NUM_SLEEPERS];
+	struct fibre_selector *se;
+	struct timespec ts;
+	uint64_t before, next;
+	unsigned long loop, left = NUM_SLEEPERS, num;
+	int ret;
+
+	/* Nothing to suspend, so the thread sleeps */
+	before = fibre_time_ns();
+	ret = fibre_sleep_for(2000000);
+	assert(!ret);
+	assert(fibre_time_ns() - before >= 2000000);
+
+	ret = fibre_timers_create(&timers, fibre_time_ns(), 0);
+	assert(!ret);
+	ret = fibre_selector_scheduler(&se, sched_cb, NULL, 1);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	fibre_async_set_mask(FIBRE_ASYNC_TIMER);
+	for (loop = 0; loop < NUM_SLEEPERS; loop++) {
+		ret = fibre_create(&sleepers[loop], fn_sleeper, (void *)loop);
+		assert(!ret);
+		fibre_schedule_to(sleepers[loop]);
+		assert(fibre_async_type(sleepers[loop]) == FIBRE_ASYNC_TIMER);
+	}
+	while (left) {
+		num = fibre_timers_expire(timers, fibre_time_ns(), out,
+					  NUM_SLEEPERS);
+		for (loop = 0; loop < num; loop++) {
+			fibre_schedule_to(out[loop]);
+			assert(fibre_completed(out[loop]));
+		}
+		left -= num;
+		if (num)
+			continue;
+		next = fibre_timers_next(timers);
+		assert(next != UINT64_MAX);
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	/* Shorter sleeps woke first */
+	for (loop = 0; loop < NUM_SLEEPERS; loop++)
+		if (loop % 7)
+			assert(woken[loop] > woken[loop - 1]);
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_timers_destroy(timers);
+	for (loop = 0; loop < NUM_SLEEPERS; loop++)
+		fibre_destroy(sleepers[loop]);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = fibre_init();
+	assert(!ret);
+	test_wheel();
+	test_sleep();
+	fibre_finish();
+	return 0;
+}
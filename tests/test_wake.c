@@ -0,0 +1,227 @@
+#include <fibre.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* Exercises remote wakes under the epoll selector: ping-pong with another
+ * thread, a burst of (repeated) wakes from another thread for fibres that
+ * wait for their flags, with fibres of its own sleeping in between, then a
+ * fibre waking itself, a wake for a fibre that has completed, abort, timeout,
+ * and a fibre that no epoll selector has run. */
+
+#define NUM_ROUNDS 2000
+#define NUM_WAITERS 500
+
+static struct fibre *pinger;
+static unsigned long ping, pong;
+
+static void fn_ping(void *arg)
+{
+	unsigned long loop;
+	int ret;
+	assert(fibre_async_can_suspend(FIBRE_ASYNC_WAKE));
+	for (loop = 1; loop <= NUM_ROUNDS; loop++) {
+		__atomic_store_n(&ping, loop, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&pong, __ATOMIC_ACQUIRE) != loop) {
+			ret = fibre_async_suspend_wake();
+			assert(!ret);
+		}
+	}
+}
+
+static void *thread_pong(void *arg)
+{
+	unsigned long loop;
+	int ret;
+	for (loop = 1; loop <= NUM_ROUNDS; loop++) {
+		while (__atomic_load_n(&ping, __ATOMIC_ACQUIRE) != loop)
+			sched_yield();
+		__atomic_store_n(&pong, loop, __ATOMIC_RELEASE);
+		ret = fibre_wake_remote(pinger);
+		assert(!ret);
+	}
+	return NULL;
+}
+
+static struct fibre *waiters[NUM_WAITERS];
+static int flags[NUM_WAITERS], suspended, done;
+
+static void fn_waiter(void *arg)
+{
+	int *flag = arg, ret;
+	__atomic_add_fetch(&suspended, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE)) {
+		ret = fibre_async_suspend_wake();
+		assert(!ret);
+	}
+	done++;
+}
+
+static void *thread_waker(void *arg)
+{
+	unsigned long loop, idx;
+	int ret;
+	/* They'll all have run to where they wait, or be on their way */
+	while (__atomic_load_n(&suspended, __ATOMIC_ACQUIRE) < NUM_WAITERS)
+		sched_yield();
+	for (loop = 0; loop < NUM_WAITERS; loop++) {
+		/* In an order that isn't theirs, and some twice */
+		idx = (loop * 7) % NUM_WAITERS;
+		__atomic_store_n(&flags[idx], 1, __ATOMIC_RELEASE);
+		ret = fibre_wake_remote(waiters[idx]);
+		ret |= fibre_wake_remote(waiters[idx]);
+		assert(!ret);
+		if (!(loop % 50))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void fn_sleeper(void *arg)
+{
+	int ret;
+	while (done < NUM_WAITERS) {
+		ret = fibre_sleep_for(100000);
+		assert(!ret);
+	}
+}
+
+static void fn_self(void *arg)
+{
+	int ret = fibre_wake_remote(fibre_get_current());
+	assert(!ret);
+	/* Already woken */
+	ret = fibre_async_suspend_wake();
+	assert(!ret);
+}
+
+static struct fibre *victim;
+
+static void fn_abort(void *arg)
+{
+	int ret = fibre_async_suspend_wake();
+	assert(ret == -EINTR);
+}
+
+static void fn_aborter(void *arg)
+{
+	int ret;
+	assert(fibre_async_type(victim) == FIBRE_ASYNC_WAKE);
+	fibre_async_abort(victim);
+	ret = fibre_ready(victim);
+	assert(!ret);
+}
+
+static void fn_timeout(void *arg)
+{
+	uint64_t deadline = fibre_time_ns() + 2000000;
+	int ret = fibre_async_suspend_wake_timeout(deadline);
+	assert(ret == -ETIMEDOUT);
+	assert(fibre_time_ns() >= deadline);
+}
+
+static void fn_nothing(void *arg)
+{
+}
+
+/* With 'thread' running alongside, if there is one */
+static void run(void (*fn)(void *), void *(*thread)(void *),
+		struct fibre **foo)
+{
+	struct fibre *f;
+	pthread_t t;
+	int ret = fibre_create(&f, fn, NULL);
+	assert(!ret);
+	if (foo)
+		*foo = f;
+	fibre_ready(f);
+	if (thread) {
+		ret = pthread_create(&t, NULL, thread, NULL);
+		assert(!ret);
+	}
+	fibre_schedule();
+	if (thread) {
+		ret = pthread_join(t, NULL);
+		assert(!ret);
+	}
+	assert(fibre_completed(f));
+	fibre_destroy(f);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fibre_selector *se;
+	struct fibre *f, *sleeper;
+	unsigned long loop;
+	pthread_t t;
+	int ret;
+
+	ret = fibre_init();
+	assert(!ret);
+	ret = fibre_selector_epoll(&se);
+	assert(!ret);
+	ret = fibre_push(se);
+	assert(!ret);
+	/* The origin has no fibre to suspend */
+	assert(!fibre_async_can_suspend(FIBRE_ASYNC_WAKE));
+
+	run(fn_ping, thread_pong, &pinger);
+
+	for (loop = 0; loop < NUM_WAITERS; loop++) {
+		ret = fibre_create(&waiters[loop], fn_waiter, &flags[loop]);
+		assert(!ret);
+		fibre_ready(waiters[loop]);
+	}
+	ret = fibre_create(&sleeper, fn_sleeper, NULL);
+	assert(!ret);
+	fibre_ready(sleeper);
+	ret = pthread_create(&t, NULL, thread_waker, NULL);
+	assert(!ret);
+	fibre_schedule();
+	ret = pthread_join(t, NULL);
+	assert(!ret);
+	assert(done == NUM_WAITERS);
+	for (loop = 0; loop < NUM_WAITERS; loop++) {
+		assert(fibre_completed(waiters[loop]));
+		fibre_destroy(waiters[loop]);
+	}
+	assert(fibre_completed(sleeper));
+	fibre_destroy(sleeper);
+
+	run(fn_self, NULL, NULL);
+
+	/* The wake is taken, and ignored, before it can be destroyed */
+	ret = fibre_create(&f, fn_nothing, NULL);
+	assert(!ret);
+	fibre_ready(f);
+	fibre_schedule();
+	assert(fibre_completed(f));
+	ret = fibre_wake_remote(f);
+	assert(!ret);
+	fibre_schedule();
+	fibre_destroy(f);
+
+	ret = fibre_create(&victim, fn_abort, NULL);
+	assert(!ret);
+	fibre_ready(victim);
+	run(fn_aborter, NULL, NULL);
+	assert(fibre_completed(victim));
+	fibre_destroy(victim);
+
+	run(fn_timeout, NULL, NULL);
+
+	ret = fibre_create(&f, fn_nothing, NULL);
+	assert(!ret);
+	ret = fibre_wake_remote(f);
+	assert(ret == -EOPNOTSUPP);
+	fibre_destroy(f);
+
+	ret = fibre_pop(NULL);
+	assert(!ret);
+	fibre_selector_free(se);
+	fibre_finish();
+	return 0;
+}